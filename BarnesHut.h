@@ -1,22 +1,33 @@
 #pragma once
 
-#include <SFML/Graphics.hpp>
+#include "ParticleStore.h"
+#include "Morton.h"
+#include "DirectKernel.h"
+#include "Threading.h"
+#include "Profiler.h"
+
+#include <SFML/System/Vector2.hpp>
 #include <vector>
-#include <memory>
 #include <array>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <limits>
 
-// Forward declaration
-class Particle;
-
-// Barnes-Hut Octree Node for 2D simulation (Quadtree)
-class QuadTreeNode {
-public:
+// Barnes-Hut Quadtree node. Nodes live in one flat array owned by QuadTree;
+// the four children of a node are stored consecutively starting at
+// firstChild, and leaves refer to a range of the tree's particle index buffer
+// instead of owning their particles.
+struct QuadTreeNode {
+    static constexpr uint32_t NO_CHILD = std::numeric_limits<uint32_t>::max();
+    
     // Boundaries of this node
     struct Boundary {
-        sf::Vector2f center;
-        float halfSize;
+        ForceVector2 center;
+        ForceReal halfSize;
         
-        bool contains(const sf::Vector2f& point) const {
+        bool contains(const ForceVector2& point) const {
             return (point.x >= center.x - halfSize && point.x <= center.x + halfSize &&
                     point.y >= center.y - halfSize && point.y <= center.y + halfSize);
         }
@@ -29,202 +40,724 @@ public:
         }
     };
     
+    Boundary boundary;
+    
+    // Center of mass and total mass for this node, in the pair precision the
+    // walk reads them in (summed in Real, see QuadTree::updateCenterOfMass)
+    ForceVector2 centerOfMass;
+    ForceReal totalMass = 0;
+    
+    uint32_t firstChild = NO_CHILD;  // Children are firstChild .. firstChild + 3
+    uint32_t begin = 0;              // Particle range in QuadTree::indices
+    uint32_t count = 0;
+    
+    bool isLeaf() const { return firstChild == NO_CHILD; }
+    
+    // Distance from the centre of mass to the farthest corner of the cell,
+    // which bounds how far any of its bodies can be from it
+    ForceReal reach() const {
+        const ForceReal rx = std::abs(centerOfMass.x - boundary.center.x) + boundary.halfSize;
+        const ForceReal ry = std::abs(centerOfMass.y - boundary.center.y) + boundary.halfSize;
+        return std::sqrt(rx * rx + ry * ry);
+    }
+};
+
+// Point masses a single target interacts with: accepted cells as their
+// centre of mass, opened leaves as their bodies. Evaluated in one pass by the
+// SIMD kernel. Kept per thread and reused, so the walk does not allocate.
+struct InteractionList {
+    ForceArray x, y, m;  // Only the first count entries are live
+    size_t count = 0;
+    
+    void clear() { count = 0; }
+    
+    void reserve(size_t extra) {
+        if (count + extra > m.size()) {
+            const size_t capacity = std::max(2 * m.size(), count + extra + 256);
+            x.resize(capacity);
+            y.resize(capacity);
+            m.resize(capacity);
+        }
+    }
+    
+    void add(const ForceVector2& position, ForceReal mass) {
+        reserve(1);
+        x[count] = position.x;
+        y[count] = position.y;
+        m[count] = mass;
+        ++count;
+    }
+    
+    void append(const ForceReal* xs, const ForceReal* ys, const ForceReal* ms, size_t n) {
+        reserve(n);
+        std::copy(xs, xs + n, x.data() + count);
+        std::copy(ys, ys + n, y.data() + count);
+        std::copy(ms, ms + n, m.data() + count);
+        count += n;
+    }
+    
+    SourceSpan span() const { return SourceSpan{x.data(), y.data(), m.data(), count}; }
+};
+
+// Timing and memory figures of the last tree build, shown in the HUD
+struct TreeStats {
+    double buildMs = 0.0;
+    size_t nodeCount = 0;
+    size_t groupCount = 0;  // Cells walked once on behalf of all their bodies
+    size_t bytesPerNode = sizeof(QuadTreeNode);
+    size_t arenaBytes = 0;  // Capacity held by the node, subtree and sort buffers
+    uint32_t refitsSinceBuild = 0;  // Evaluations that refit the tree instead of rebuilding it
+};
+
+// Linear quadtree built into buffers that are reused across frames, so a
+// rebuild does not touch the heap once the buffers have grown to size.
+//
+// Bodies are sorted by Morton key first, which makes every cell a contiguous
+// run of the sorted order: the children of a cell are found by binary search
+// on the next key digit rather than by moving particles around. The top few
+// levels are expanded serially until there are enough independent subtrees
+// to keep every thread busy; those are built in parallel, spliced after the
+// top levels, and their centres of mass are summed before the top levels.
+//
+// Forces are evaluated per group: a leaf, or a cell of at most groupCapacity
+// bodies. One walk per group opens a cell unless it passes theta against the
+// nearest point of the group's bounding box, so the interaction list it
+// produces is valid for every body in the group and the SIMD kernel runs it
+// for all of them at once.
+//
+// Between full builds the tree can be refit instead: the topology and the
+// sorted order are kept, and only masses, centres of mass and cell bounds
+// are recomputed from the moved bodies (see refit()).
+class QuadTree {
+public:
+    static constexpr uint32_t DEFAULT_LEAF_CAPACITY = 16;    // Best of leaf_sweep.cpp at 16k-64k bodies
+    static constexpr uint32_t DEFAULT_GROUP_CAPACITY = 128;  // Likewise
+    static constexpr int MAX_DEPTH = MortonSorter::BITS;     // Deepest level the keys resolve
+    static constexpr int NUM_CHILDREN = 4;                   // Quadtree has 4 children
+    static constexpr uint32_t DEFAULT_REBUILD_INTERVAL = 16;  // Refits between full builds
+    static constexpr float DEFAULT_REFIT_GROWTH = 1.5f;       // Leaf area growth that forces a build
+    
 private:
-    static constexpr int MAX_PARTICLES = 1;  // Maximum particles per leaf node
-    static constexpr int NUM_CHILDREN = 4;   // Quadtree has 4 children
+    static constexpr size_t SUBTREE_TASKS = 64;  // Parallel subtrees to aim for
     
-    Boundary boundary;
-    std::vector<const Particle*> particles;
-    std::array<std::unique_ptr<QuadTreeNode>, NUM_CHILDREN> children;
-    
-    // Center of mass and total mass for this node
-    sf::Vector2f centerOfMass;
-    float totalMass = 0.0f;
-    
-    bool isLeaf = true;
-    
-    void subdivide() {
-        float newHalfSize = boundary.halfSize * 0.5f;
-        
-        // Create four children (NE, NW, SE, SW)
-        children[0] = std::make_unique<QuadTreeNode>(
-            Boundary{boundary.center + sf::Vector2f(newHalfSize, -newHalfSize), newHalfSize});
-        children[1] = std::make_unique<QuadTreeNode>(
-            Boundary{boundary.center + sf::Vector2f(-newHalfSize, -newHalfSize), newHalfSize});
-        children[2] = std::make_unique<QuadTreeNode>(
-            Boundary{boundary.center + sf::Vector2f(newHalfSize, newHalfSize), newHalfSize});
-        children[3] = std::make_unique<QuadTreeNode>(
-            Boundary{boundary.center + sf::Vector2f(-newHalfSize, newHalfSize), newHalfSize});
-        
-        isLeaf = false;
-        
-        // Redistribute existing particles
-        for (const auto* p : particles) {
-            for (auto& child : children) {
-                if (child->insert(p)) {
-                    break;
-                }
+    uint32_t leafCapacity = DEFAULT_LEAF_CAPACITY;  // Maximum particles per leaf node
+    uint32_t groupCapacity = DEFAULT_GROUP_CAPACITY;
+    uint32_t rebuildInterval = DEFAULT_REBUILD_INTERVAL;  // 0 rebuilds on every update
+    float refitGrowth = DEFAULT_REFIT_GROWTH;
+    uint32_t refitsSinceBuild = 0;
+    bool valid = false;     // Whether the tree may be refit
+    double builtArea = 0.0;  // Total leaf area right after the last build
+    
+    std::vector<QuadTreeNode> nodes;
+    MortonSorter sorter;
+    const uint32_t* indices = nullptr;  // Particle indices in Morton order
+    ForceArray sortedX, sortedY, sortedM;  // Bodies gathered into Morton order
+    std::vector<uint32_t> ranks;                  // Inverse of indices
+    std::vector<uint32_t> groups;                 // Node index of each walk group
+    
+    std::vector<uint32_t> frontier, nextFrontier;
+    std::vector<std::vector<QuadTreeNode>> subtrees;
+    std::vector<size_t> subtreeOffsets;
+    
+    // A cell whose bodies all share one key (coincident or closer than the
+    // key resolution) stays a leaf whatever its size
+    bool splittable(const QuadTreeNode& node, int depth) const {
+        if (node.count <= leafCapacity || depth >= MAX_DEPTH) return false;
+        const uint64_t* keys = sorter.keys().data();
+        return keys[node.begin] != keys[node.begin + node.count - 1];
+    }
+    
+    // Appends the four children of node (which sits at depth) to out and
+    // returns the index of the first. The node is taken by value because it
+    // may live in out. Children follow the Morton digit order:
+    // bit 0 is the +x half, bit 1 the +y half.
+    uint32_t appendChildren(std::vector<QuadTreeNode>& out, QuadTreeNode node, int depth) const {
+        static const ForceVector2 directions[NUM_CHILDREN] = {
+            ForceVector2(-1, -1), ForceVector2(1, -1), ForceVector2(-1, 1), ForceVector2(1, 1)
+        };
+        const uint64_t* keys = sorter.keys().data();
+        const ForceReal newHalfSize = node.boundary.halfSize * ForceReal(0.5);
+        const uint32_t firstChild = static_cast<uint32_t>(out.size());
+        const uint32_t end = node.begin + node.count;
+        
+        uint32_t cursor = node.begin;
+        for (int q = 0; q < NUM_CHILDREN; ++q) {
+            uint32_t stop = end;
+            if (q < NUM_CHILDREN - 1) {
+                stop = static_cast<uint32_t>(std::partition_point(keys + cursor, keys + end,
+                    [&](uint64_t key) { return MortonSorter::digit(key, depth) <= uint32_t(q); }) - keys);
             }
+            
+            QuadTreeNode child;
+            child.boundary = QuadTreeNode::Boundary{node.boundary.center + directions[q] * newHalfSize, newHalfSize};
+            child.begin = cursor;
+            child.count = stop - cursor;
+            out.push_back(child);
+            cursor = stop;
         }
-        particles.clear();
+        return firstChild;
     }
     
-    void updateCenterOfMass() {
-        if (isLeaf) {
-            if (particles.empty()) {
-                totalMass = 0.0f;
-                centerOfMass = boundary.center;
+    void subdivide(std::vector<QuadTreeNode>& out, uint32_t nodeIndex, int depth) const {
+        const QuadTreeNode node = out[nodeIndex];
+        if (!splittable(node, depth)) {
+            return;
+        }
+        
+        const uint32_t firstChild = appendChildren(out, node, depth);
+        out[nodeIndex].firstChild = firstChild;
+        for (int q = 0; q < NUM_CHILDREN; ++q) {
+            subdivide(out, firstChild + q, depth + 1);
+        }
+    }
+    
+    void collectGroups() {
+        groups.clear();
+        uint32_t stack[MAX_DEPTH * (NUM_CHILDREN - 1) + NUM_CHILDREN + 1];
+        int top = 0;
+        stack[top++] = 0;
+        while (top > 0) {
+            const uint32_t index = stack[--top];
+            const QuadTreeNode& node = nodes[index];
+            if (node.count == 0) continue;
+            if (node.isLeaf() || node.count <= groupCapacity) {
+                groups.push_back(index);
             } else {
-                totalMass = 0.0f;
-                centerOfMass = sf::Vector2f(0, 0);
-                for (const auto* p : particles) {
-                    totalMass += p->mass;
-                    centerOfMass += p->position * p->mass;
-                }
-                centerOfMass /= totalMass;
-            }
-        } else {
-            totalMass = 0.0f;
-            centerOfMass = sf::Vector2f(0, 0);
-            for (const auto& child : children) {
-                if (child && child->totalMass > 0) {
-                    totalMass += child->totalMass;
-                    centerOfMass += child->centerOfMass * child->totalMass;
+                for (int q = NUM_CHILDREN - 1; q >= 0; --q) {
+                    stack[top++] = node.firstChild + q;
                 }
             }
-            if (totalMass > 0) {
-                centerOfMass /= totalMass;
+        }
+    }
+    
+    // Copies the bodies into the sorted arrays, in the order of indices and
+    // in the pair precision
+    void gather(const BodySpan& ps) {
+        const size_t n = ps.count;
+        sortedX.resize(n);
+        sortedY.resize(n);
+        sortedM.resize(n);
+        parallelFor(n, PARALLEL_GRAIN, [&](size_t begin, size_t end) {
+            for (size_t k = begin; k < end; ++k) {
+                const uint32_t p = indices[k];
+                sortedX[k] = ForceReal(ps.x[p]);
+                sortedY[k] = ForceReal(ps.y[p]);
+                sortedM[k] = ForceReal(ps.m[p]);
+            }
+        });
+    }
+    
+    // Grows a cell's square to also cover the box [lo, hi]
+    static void growToCover(QuadTreeNode::Boundary& boundary, ForceVector2 lo, ForceVector2 hi) {
+        const ForceReal h = boundary.halfSize;
+        lo.x = std::min(lo.x, boundary.center.x - h);
+        lo.y = std::min(lo.y, boundary.center.y - h);
+        hi.x = std::max(hi.x, boundary.center.x + h);
+        hi.y = std::max(hi.y, boundary.center.y + h);
+        boundary.center = (lo + hi) * ForceReal(0.5);
+        boundary.halfSize = std::max(hi.x - lo.x, hi.y - lo.y) * ForceReal(0.5);
+    }
+    
+    double leafArea() const {
+        double area = 0.0;
+        for (const QuadTreeNode& node : nodes) {
+            if (node.isLeaf() && node.count > 0) {
+                area += double(node.boundary.halfSize) * node.boundary.halfSize;
             }
         }
+        return area;
     }
     
-public:
-    explicit QuadTreeNode(const Boundary& b) : boundary(b) {}
+    // Stores the mass and centre of mass summed in mass and moment
+    static void setCenterOfMass(QuadTreeNode& node, Real mass, const Vector2r& moment) {
+        node.totalMass = ForceReal(mass);
+        node.centerOfMass = mass > 0 ? ForceVector2(moment / mass) : node.boundary.center;
+    }
     
-    bool insert(const Particle* particle) {
-        if (!boundary.contains(particle->position)) {
-            return false;
+    // Children always come after their parent, so a reverse sweep sees every
+    // child before the node that aggregates it. Sums run in Real, so mixed
+    // builds add up the moments of large cells in double.
+    void updateCenterOfMass(std::vector<QuadTreeNode>& out, size_t count) const {
+        for (size_t n = count; n-- > 0;) {
+            QuadTreeNode& node = out[n];
+            Real mass = 0;
+            Vector2r moment(0, 0);
+            
+            if (node.isLeaf()) {
+                for (uint32_t k = node.begin; k < node.begin + node.count; ++k) {
+                    mass += sortedM[k];
+                    moment += Vector2r(sortedX[k], sortedY[k]) * Real(sortedM[k]);
+                }
+            } else {
+                for (int q = 0; q < NUM_CHILDREN; ++q) {
+                    const QuadTreeNode& child = out[node.firstChild + q];
+                    mass += child.totalMass;
+                    moment += Vector2r(child.centerOfMass) * Real(child.totalMass);
+                }
+            }
+            setCenterOfMass(node, mass, moment);
         }
+    }
+    
+public:
+    // Fills list with the cells and leaf bodies every point of the box
+    // [lo, hi] interacts with. A single point is the box lo == hi. The tree
+    // must not be empty.
+    void buildInteractionList(const ForceVector2& lo, const ForceVector2& hi, InteractionList& list,
+                              float theta, const Softening& softening) const {
+        const ForceReal eps2 = ForceReal(softening.offset2());
+        const ForceReal theta2 = ForceReal(theta) * ForceReal(theta);
+        const ForceReal support = ForceReal(softening.support());
+        list.clear();
         
-        if (isLeaf) {
-            if (particles.size() < MAX_PARTICLES) {
-                particles.push_back(particle);
-                return true;
-            } else {
-                subdivide();
-                return insert(particle);
+        // Explicit traversal stack: each level pushes at most 4 children
+        uint32_t stack[MAX_DEPTH * (NUM_CHILDREN - 1) + NUM_CHILDREN + 1];
+        int top = 0;
+        stack[top++] = 0;
+        
+        while (top > 0) {
+            const QuadTreeNode& node = nodes[stack[--top]];
+            if (node.totalMass == 0) {
+                continue;
+            }
+            
+            // Check if we can use the node as a single body (s / d < theta,
+            // compared squared), with d measured to the nearest point of the box.
+            // Under a compact kernel a cell that could hold bodies within the
+            // support of the box is always opened, since the softened force of
+            // its bodies is not that of their centre of mass.
+            const ForceVector2& c = node.centerOfMass;
+            ForceReal dx = std::max(ForceReal(0), std::max(lo.x - c.x, c.x - hi.x));
+            ForceReal dy = std::max(ForceReal(0), std::max(lo.y - c.y, c.y - hi.y));
+            ForceReal r2 = dx * dx + dy * dy + eps2;
+            ForceReal s = node.boundary.halfSize * 2;  // Size of the node
+            bool accept = s * s < theta2 * r2;
+            if (accept && support > 0) {
+                const ForceReal opening = support + node.reach();
+                accept = opening * opening < r2;
             }
-        } else {
-            for (auto& child : children) {
-                if (child->insert(particle)) {
-                    return true;
+            if (accept) {
+                list.add(node.centerOfMass, node.totalMass);
+            } else if (node.isLeaf()) {
+                list.append(sortedX.data() + node.begin, sortedY.data() + node.begin,
+                            sortedM.data() + node.begin, node.count);
+            } else {
+                // Recurse into children
+                for (int q = NUM_CHILDREN - 1; q >= 0; --q) {
+                    stack[top++] = node.firstChild + q;
                 }
             }
         }
-        return false;
     }
     
-    void computeForce(const Particle& particle, sf::Vector2f& force, float theta, float G, float softening) const {
-        if (totalMass == 0 || (&particle == particles.front() && particles.size() == 1)) {
-            return;
-        }
+    // Square root cell around all bodies, with a margin
+    static QuadTreeNode::Boundary rootBounds(const BodySpan& ps) {
+        const BodyBounds box = bodyBounds(ps);
+        const Vector2r min(box.minX, box.minY);
+        const Vector2r max(box.maxX, box.maxY);
+        
+        Vector2r center = (min + max) * Real(0.5);
+        Real size = std::max(max.x - min.x, max.y - min.y) * Real(0.6);
+        return QuadTreeNode::Boundary{ForceVector2(center), ForceReal(size)};
+    }
+    
+    void build(const BodySpan& ps, const QuadTreeNode::Boundary& bounds) {
+        PROFILE_SCOPE(ProfilePhase::TreeBuild);
+        const uint32_t n = static_cast<uint32_t>(ps.count);
+        sorter.sort(ps, bounds.center.x - bounds.halfSize, bounds.center.y - bounds.halfSize,
+                    bounds.halfSize * 2);
+        indices = sorter.order().data();
+        gather(ps);
         
-        sf::Vector2f r = centerOfMass - particle.position;
-        float distance = std::sqrt(r.x * r.x + r.y * r.y + softening * softening);
+        nodes.clear();
+        QuadTreeNode root;
+        root.boundary = bounds;
+        root.begin = 0;
+        root.count = n;
+        nodes.push_back(root);
         
-        if (isLeaf) {
-            // Direct calculation for leaf nodes
-            for (const auto* p : particles) {
-                if (p != &particle) {
-                    sf::Vector2f r_ij = p->position - particle.position;
-                    float r2 = r_ij.x * r_ij.x + r_ij.y * r_ij.y + softening * softening;
-                    float r3 = r2 * std::sqrt(r2);
-                    force += r_ij * (G * particle.mass * p->mass / r3);
+        // Expand the top levels breadth-first until the frontier of cells
+        // that still need splitting is wide enough to share out
+        int depth = 0;
+        frontier.assign(1, 0);
+        while (!frontier.empty() && frontier.size() < SUBTREE_TASKS && splittable(nodes[frontier[0]], depth)) {
+            nextFrontier.clear();
+            for (uint32_t index : frontier) {
+                const uint32_t firstChild = appendChildren(nodes, nodes[index], depth);
+                nodes[index].firstChild = firstChild;
+                for (int q = 0; q < NUM_CHILDREN; ++q) {
+                    if (splittable(nodes[firstChild + q], depth + 1)) {
+                        nextFrontier.push_back(firstChild + q);
+                    }
                 }
             }
-        } else {
-            // Check if we can use the node as a single body
-            float s = boundary.halfSize * 2.0f;  // Size of the node
-            if (s / distance < theta) {
-                // Use center of mass approximation
-                float r2 = r.x * r.x + r.y * r.y + softening * softening;
-                float r3 = r2 * std::sqrt(r2);
-                force += r * (G * particle.mass * totalMass / r3);
-            } else {
-                // Recurse into children
-                for (const auto& child : children) {
-                    if (child) {
-                        child->computeForce(particle, force, theta, G, softening);
+            frontier.swap(nextFrontier);
+            ++depth;
+        }
+        const size_t topCount = nodes.size();
+        
+        // Build each frontier cell's subtree into its own buffer. Slot 0 holds
+        // the cell itself, its descendants follow with buffer-local indices.
+        const size_t tasks = frontier.size();
+        if (subtrees.size() < tasks) {
+            subtrees.resize(tasks);
+        }
+        
+        parallelFor(tasks, 1, [&](size_t begin, size_t end) {
+            for (size_t t = begin; t < end; ++t) {
+                std::vector<QuadTreeNode>& local = subtrees[t];
+                local.clear();
+                local.push_back(nodes[frontier[t]]);
+                subdivide(local, 0, depth);
+            }
+        });
+        {
+            // Masses in a pass of their own, so profiles tell them apart
+            PROFILE_SCOPE(ProfilePhase::CenterOfMass);
+            parallelFor(tasks, 1, [&](size_t begin, size_t end) {
+                for (size_t t = begin; t < end; ++t) {
+                    updateCenterOfMass(subtrees[t], subtrees[t].size());
+                }
+            });
+        }
+        
+        // Splice the subtrees after the top levels
+        subtreeOffsets.resize(tasks + 1);
+        subtreeOffsets[0] = topCount;
+        for (size_t t = 0; t < tasks; ++t) {
+            subtreeOffsets[t + 1] = subtreeOffsets[t] + subtrees[t].size() - 1;
+        }
+        // resize() past the capacity allocates exactly the new size, so grow
+        // with headroom or every tree a node larger than the last reallocates
+        if (subtreeOffsets[tasks] > nodes.capacity()) {
+            nodes.reserve(subtreeOffsets[tasks] + subtreeOffsets[tasks] / 2);
+        }
+        nodes.resize(subtreeOffsets[tasks]);
+        
+        parallelFor(tasks, 1, [&](size_t begin, size_t end) {
+            for (size_t t = begin; t < end; ++t) {
+                const std::vector<QuadTreeNode>& local = subtrees[t];
+                const uint32_t shift = static_cast<uint32_t>(subtreeOffsets[t] - 1);
+                for (size_t k = 0; k < local.size(); ++k) {
+                    QuadTreeNode node = local[k];
+                    if (!node.isLeaf()) {
+                        node.firstChild += shift;
                     }
+                    nodes[k == 0 ? frontier[t] : shift + k] = node;
+                }
+            }
+        });
+        
+        {
+            PROFILE_SCOPE(ProfilePhase::CenterOfMass);
+            updateCenterOfMass(nodes, topCount);
+        }
+        
+        ranks.resize(n);
+        parallelFor(n, PARALLEL_GRAIN, [&](size_t begin, size_t end) {
+            for (size_t k = begin; k < end; ++k) {
+                ranks[indices[k]] = uint32_t(k);
+            }
+        });
+        collectGroups();
+        
+        builtArea = leafArea();
+        refitsSinceBuild = 0;
+        valid = true;
+    }
+    
+    // Refits the tree to the bodies' current positions without changing its
+    // topology. Every cell keeps its range of the sorted order, since moving
+    // a body to another leaf would shift the ranges of all cells between the
+    // two; instead a cell's square grows to cover any of its bodies that have
+    // drifted out, which keeps the opening test conservative. The cost is
+    // more cells opened per walk, so this returns false, leaving the tree
+    // unusable, when the body count changed or the total leaf area has grown
+    // past refitGrowth times its size after the build.
+    bool refit(const BodySpan& ps) {
+        if (!valid || ps.count != sortedM.size()) return false;
+        PROFILE_SCOPE(ProfilePhase::CenterOfMass);
+        gather(ps);
+        
+        // Leaves first, all at once
+        parallelFor(nodes.size(), 64, [&](size_t begin, size_t end) {
+            for (size_t n = begin; n < end; ++n) {
+                QuadTreeNode& node = nodes[n];
+                if (!node.isLeaf() || node.count == 0) continue;
+                
+                ForceVector2 lo(sortedX[node.begin], sortedY[node.begin]);
+                ForceVector2 hi = lo;
+                Real mass = 0;
+                Vector2r moment(0, 0);
+                for (uint32_t k = node.begin; k < node.begin + node.count; ++k) {
+                    lo.x = std::min(lo.x, sortedX[k]);
+                    lo.y = std::min(lo.y, sortedY[k]);
+                    hi.x = std::max(hi.x, sortedX[k]);
+                    hi.y = std::max(hi.y, sortedY[k]);
+                    mass += sortedM[k];
+                    moment += Vector2r(sortedX[k], sortedY[k]) * Real(sortedM[k]);
                 }
+                setCenterOfMass(node, mass, moment);
+                growToCover(node.boundary, lo, hi);
+            }
+        });
+        
+        // Then the cells above them, children before parents
+        for (size_t n = nodes.size(); n-- > 0;) {
+            QuadTreeNode& node = nodes[n];
+            if (node.isLeaf()) continue;
+            
+            Real mass = 0;
+            Vector2r moment(0, 0);
+            for (int q = 0; q < NUM_CHILDREN; ++q) {
+                const QuadTreeNode& child = nodes[node.firstChild + q];
+                if (child.count == 0) continue;
+                mass += child.totalMass;
+                moment += Vector2r(child.centerOfMass) * Real(child.totalMass);
+                const ForceReal h = child.boundary.halfSize;
+                growToCover(node.boundary, child.boundary.center - ForceVector2(h, h),
+                            child.boundary.center + ForceVector2(h, h));
             }
+            setCenterOfMass(node, mass, moment);
+        }
+        
+        if (leafArea() > refitGrowth * builtArea) {
+            valid = false;
+            return false;
         }
+        ++refitsSinceBuild;
+        return true;
     }
     
-    void build(const std::vector<Particle>& particles) {
-        for (const auto& p : particles) {
-            insert(&p);
+    // Refits the tree when rebuildInterval allows it and the refit holds up,
+    // rebuilds it around the bodies otherwise. Returns whether it refit.
+    bool update(const BodySpan& ps) {
+        if (rebuildInterval > 0 && refitsSinceBuild < rebuildInterval && refit(ps)) {
+            return true;
         }
-        updateCenterOfMass();
+        build(ps, rootBounds(ps));
+        return false;
     }
     
-    // Visualization helper
-    void draw(sf::RenderWindow& window, int depth = 0) const {
-        sf::RectangleShape rect(sf::Vector2f(boundary.halfSize * 2, boundary.halfSize * 2));
-        rect.setPosition(boundary.center - sf::Vector2f(boundary.halfSize, boundary.halfSize));
-        rect.setFillColor(sf::Color::Transparent);
-        rect.setOutlineColor(sf::Color(100, 100, 100, 50));
-        rect.setOutlineThickness(1.0f);
-        window.draw(rect);
+    // Makes the next update() rebuild, e.g. after the bodies were reordered
+    void invalidate() { valid = false; }
+    
+    // Acceleration of the bodies in group g, in sorted order, written to
+    // ax/ay (which must hold the group's count), and their potential G*phi to
+    // potential when it is given. The potential comes from the same list.
+    void computeGroupAccelerations(size_t g, InteractionList& list, Real* ax, Real* ay,
+                                   float theta, Real G, const Softening& softening,
+                                   Real* potential = nullptr) const {
+        const QuadTreeNode& group = nodes[groups[g]];
+        const ForceReal* gx = sortedX.data() + group.begin;
+        const ForceReal* gy = sortedY.data() + group.begin;
         
-        if (!isLeaf) {
-            for (const auto& child : children) {
-                if (child) {
-                    child->draw(window, depth + 1);
-                }
+        ForceVector2 lo(gx[0], gy[0]);
+        ForceVector2 hi = lo;
+        for (uint32_t k = 1; k < group.count; ++k) {
+            lo.x = std::min(lo.x, gx[k]);
+            lo.y = std::min(lo.y, gy[k]);
+            hi.x = std::max(hi.x, gx[k]);
+            hi.y = std::max(hi.y, gy[k]);
+        }
+        buildInteractionList(lo, hi, list, theta, softening);
+        
+        std::fill(ax, ax + group.count, Real(0));
+        std::fill(ay, ay + group.count, Real(0));
+        if (potential) std::fill(potential, potential + group.count, Real(0));
+        accumulateAccelerations(list.span(), gx, gy, group.count, softening, ax, ay, potential);
+        for (uint32_t k = 0; k < group.count; ++k) {
+            ax[k] *= G;
+            ay[k] *= G;
+        }
+        if (potential) {
+            for (uint32_t k = 0; k < group.count; ++k) {
+                potential[k] *= G;
             }
         }
     }
+    
+    // Acceleration at a single point, and its potential G*phi added to
+    // potential when it is given. A body at the point itself adds nothing
+    // (zero separation).
+    void computeAcceleration(const ForceVector2& position, InteractionList& list, Vector2r& acceleration,
+                             float theta, Real G, const Softening& softening, Real* potential = nullptr) const {
+        if (nodes.empty()) return;
+        
+        buildInteractionList(position, position, list, theta, softening);
+        
+        Real ax = 0;
+        Real ay = 0;
+        Real phi = 0;
+        accumulateAccelerations(list.span(), &position.x, &position.y, 1, softening, &ax, &ay,
+                                potential ? &phi : nullptr);
+        acceleration += Vector2r(ax, ay) * G;
+        if (potential) *potential += G * phi;
+    }
+    
+    const std::vector<QuadTreeNode>& getNodes() const { return nodes; }
+    
+    // Bodies in Morton order, as leaves index them
+    SourceSpan sortedBodies() const {
+        return SourceSpan{sortedX.data(), sortedY.data(), sortedM.data(), sortedM.size()};
+    }
+    
+    size_t groupCount() const { return groups.size(); }
+    const QuadTreeNode& groupNode(size_t g) const { return nodes[groups[g]]; }
+    
+    // Body stored at sorted position k, and the sorted position of body i
+    uint32_t bodyAt(size_t k) const { return indices[k]; }
+    uint32_t rankOf(size_t i) const { return ranks[i]; }
+    ForceVector2 sortedPosition(size_t k) const { return ForceVector2(sortedX[k], sortedY[k]); }
+    
+    void setLeafCapacity(uint32_t capacity) { leafCapacity = std::max<uint32_t>(1, capacity); }
+    uint32_t getLeafCapacity() const { return leafCapacity; }
+    
+    void setGroupCapacity(uint32_t capacity) { groupCapacity = std::max<uint32_t>(1, capacity); }
+    
+    void setRefitPolicy(uint32_t interval, float growth) {
+        rebuildInterval = interval;
+        refitGrowth = std::max(1.0f, growth);
+    }
+    
+    uint32_t getRefitsSinceBuild() const { return refitsSinceBuild; }
+    
+    size_t nodeCount() const { return nodes.size(); }
+    
+    size_t arenaBytes() const {
+        size_t bytes = nodes.capacity() * sizeof(QuadTreeNode) + sorter.bytes() +
+                       (sortedX.capacity() + sortedY.capacity() + sortedM.capacity()) * sizeof(ForceReal) +
+                       (ranks.capacity() + groups.capacity()) * sizeof(uint32_t);
+        for (const auto& subtree : subtrees) {
+            bytes += subtree.capacity() * sizeof(QuadTreeNode);
+        }
+        return bytes;
+    }
 };
 
 // Barnes-Hut Force Calculator
 class BarnesHutForceCalculator {
 private:
+    static constexpr size_t WALK_CHUNKS_PER_THREAD = 8;  // Leaves some to steal
+    
     float theta = 0.5f;  // Opening angle parameter (lower = more accurate)
+    QuadTree tree;       // Reused across calls
+    TreeStats stats;
+    
+    // Per-thread walk buffers
+    struct WalkScratch {
+        InteractionList list;
+        RealArray ax, ay, phi;
+    };
+    std::vector<WalkScratch> scratch;
+    std::vector<uint8_t> wanted;  // Requested targets, by sorted position
+    std::vector<float> groupCost;  // Interactions evaluated per group in the last walk
+    std::vector<size_t> walkRanges;
     
 public:
     void setTheta(float t) { theta = t; }
+    void setLeafCapacity(uint32_t capacity) { tree.setLeafCapacity(capacity); }
+    void setGroupCapacity(uint32_t capacity) { tree.setGroupCapacity(capacity); }
+    void setRefitPolicy(uint32_t interval, float growth) { tree.setRefitPolicy(interval, growth); }
+    void invalidate() { tree.invalidate(); }
+    
+    const QuadTree& getTree() const { return tree; }
+    const TreeStats& getStats() const { return stats; }
     
-    std::vector<sf::Vector2f> computeForces(const std::vector<Particle>& particles, 
-                                           float G, float softening) {
-        if (particles.empty()) return {};
+    // Builds (or refits) the tree from all bodies and evaluates it for the
+    // targets only
+    void computeAccelerations(const BodySpan& particles, const TargetSpan& targets,
+                              const AccelerationSpan& out, Real G, const Softening& softening) {
+        if (particles.count == 0) return;
         
-        // Find bounds
-        sf::Vector2f min = particles[0].position;
-        sf::Vector2f max = particles[0].position;
+        auto buildStart = std::chrono::steady_clock::now();
         
-        for (const auto& p : particles) {
-            min.x = std::min(min.x, p.position.x);
-            min.y = std::min(min.y, p.position.y);
-            max.x = std::max(max.x, p.position.x);
-            max.y = std::max(max.y, p.position.y);
-        }
+        tree.update(particles);
         
-        // Create root node
-        sf::Vector2f center = (min + max) * 0.5f;
-        float size = std::max(max.x - min.x, max.y - min.y) * 0.6f;
+        stats.buildMs = std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - buildStart).count();
+        stats.nodeCount = tree.nodeCount();
+        stats.arenaBytes = tree.arenaBytes();
+        stats.refitsSinceBuild = tree.getRefitsSinceBuild();
         
-        QuadTreeNode root(QuadTreeNode::Boundary{center, size});
-        root.build(particles);
+        stats.groupCount = tree.groupCount();
         
-        // Compute forces
-        std::vector<sf::Vector2f> forces(particles.size(), sf::Vector2f(0, 0));
+        // Mark the requested targets when only some are wanted
+        const bool all = targets.all();
+        if (!all) {
+            wanted.assign(particles.count, 0);
+            for (size_t k = 0; k < targets.count; ++k) {
+                wanted[tree.rankOf(targets(k))] = 1;
+            }
+        }
+        if (scratch.size() < size_t(maxThreads())) {
+            scratch.resize(maxThreads());
+        }
         
-        #pragma omp parallel for
-        for (size_t i = 0; i < particles.size(); ++i) {
-            root.computeForce(particles[i], forces[i], theta, G, softening);
+        PROFILE_SCOPE(ProfilePhase::ForceWalk);
+        
+        // Groups are split between threads by the interactions each cost in
+        // the last walk, which tracks where the clusters are; a rebuild that
+        // changes the group count starts over from the body counts
+        if (groupCost.size() != tree.groupCount()) {
+            groupCost.resize(tree.groupCount());
+            for (size_t g = 0; g < groupCost.size(); ++g) {
+                groupCost[g] = float(tree.groupNode(g).count);
+            }
         }
+        balanceRanges(tree.groupCount(), WALK_CHUNKS_PER_THREAD * size_t(maxThreads()),
+                      [&](size_t g) { return groupCost[g]; }, walkRanges);
         
-        return forces;
+        parallelForRanges(walkRanges, [&](size_t first, size_t last) {
+            WalkScratch& local = scratch[threadIndex()];
+            
+            for (size_t g = first; g < last; ++g) {
+                const QuadTreeNode& group = tree.groupNode(g);
+                
+                uint32_t wantedCount = group.count;
+                if (!all) {
+                    wantedCount = 0;
+                    for (uint32_t k = group.begin; k < group.begin + group.count; ++k) {
+                        wantedCount += wanted[k];
+                    }
+                }
+                if (wantedCount == 0) continue;
+                
+                // A group walk costs every member a full list, so a group
+                // with few requested members walks for those members only
+                if (wantedCount * 4 < group.count) {
+                    float cost = 0.0f;
+                    for (uint32_t k = group.begin; k < group.begin + group.count; ++k) {
+                        if (!wanted[k]) continue;
+                        Vector2r acceleration(0, 0);
+                        Real phi = 0;
+                        tree.computeAcceleration(tree.sortedPosition(k), local.list, acceleration,
+                                                 theta, G, softening, out.potential ? &phi : nullptr);
+                        const uint32_t i = tree.bodyAt(k);
+                        out.ax[i] = acceleration.x;
+                        out.ay[i] = acceleration.y;
+                        if (out.potential) out.potential[i] = phi;
+                        cost += float(local.list.count);
+                    }
+                    groupCost[g] = cost;
+                    continue;
+                }
+                
+                local.ax.resize(std::max<size_t>(local.ax.size(), group.count));
+                local.ay.resize(local.ax.size());
+                if (out.potential) local.phi.resize(local.ax.size());
+                tree.computeGroupAccelerations(g, local.list, local.ax.data(), local.ay.data(),
+                                               theta, G, softening, out.potential ? local.phi.data() : nullptr);
+                groupCost[g] = float(local.list.count) * group.count;
+                for (uint32_t m = 0; m < group.count; ++m) {
+                    if (all || wanted[group.begin + m]) {
+                        const uint32_t i = tree.bodyAt(group.begin + m);
+                        out.ax[i] = local.ax[m];
+                        out.ay[i] = local.ay[m];
+                        if (out.potential) out.potential[i] = local.phi[m];
+                    }
+                }
+            }
+        });
     }
-};g
+};
@@ -0,0 +1,99 @@
+#pragma once
+
+#include "ParticleStore.h"
+#include "ForceSolver.h"
+#include "Morton.h"
+#include "CommandLine.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <random>
+#include <vector>
+
+// Fixtures and error measurement shared by the benchmark tools, so that an
+// "rms error" means the same thing in each of them
+
+// Keeps the store in Morton order, as the simulation does
+inline void sortBodiesMorton(ParticleStore& particles) {
+    MortonSorter sorter;
+    sorter.sort(particles.bodies());
+    particles.permute(sorter.order());
+}
+
+// Half the bodies in a uniform square, half in a Gaussian cluster, so both
+// shallow and deep parts of the tree are exercised
+inline void makeMixedBodies(ParticleStore& particles, size_t count) {
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<float> uniform(0.0f, 1000.0f);
+    std::normal_distribution<float> cluster(500.0f, 40.0f);
+    
+    particles.clear();
+    particles.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        sf::Vector2f pos = (i % 2) ? sf::Vector2f(uniform(rng), uniform(rng))
+                                   : sf::Vector2f(cluster(rng), cluster(rng));
+        particles.add(Vector2r(pos), Vector2r(0, 0), 1);
+    }
+    sortBodiesMorton(particles);
+}
+
+// Fastest of the repetitions, after one warm-up run
+template <typename Run>
+double bestOf(int repetitions, Run&& run) {
+    run();
+    double best = std::numeric_limits<double>::max();
+    for (int r = 0; r < repetitions; ++r) {
+        const auto start = std::chrono::steady_clock::now();
+        run();
+        best = std::min(best, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+    }
+    return best;
+}
+
+struct ForceError {
+    double rms = 0.0;
+    double worst = 0.0;
+};
+
+// Direct-summation accelerations of an evenly spaced sample of bodies
+struct ForceReference {
+    static constexpr size_t DEFAULT_SAMPLE_SIZE = 1024;
+    
+    std::vector<uint32_t> sample;
+    RealArray ax, ay;
+    
+    void compute(const BodySpan& bodies, Real G, const Softening& softening,
+                 size_t sampleSize = DEFAULT_SAMPLE_SIZE) {
+        const size_t count = bodies.count;
+        const size_t sampleCount = std::min(count, sampleSize);
+        sample.resize(sampleCount);
+        for (size_t k = 0; k < sampleCount; ++k) {
+            sample[k] = uint32_t(k * count / sampleCount);
+        }
+        ax.assign(count, 0);
+        ay.assign(count, 0);
+        DirectForceSolver direct;
+        direct.computeAccelerations(bodies, TargetSpan{sample.data(), sample.size()},
+                                    AccelerationSpan{ax.data(), ay.data(), count}, G, softening);
+    }
+    
+    // Relative error |a - a_ref| / |a_ref| of each sampled body: its rms and
+    // its worst value. Bodies with no reference force are left out of both.
+    ForceError error(const Real* px, const Real* py) const {
+        ForceError e;
+        double sum = 0.0;
+        size_t counted = 0;
+        for (uint32_t i : sample) {
+            const double ref = std::hypot(ax[i], ay[i]);
+            if (ref == 0.0) continue;
+            const double rel = std::hypot(px[i] - ax[i], py[i] - ay[i]) / ref;
+            sum += rel * rel;
+            e.worst = std::max(e.worst, rel);
+            ++counted;
+        }
+        e.rms = counted > 0 ? std::sqrt(sum / counted) : 0.0;
+        return e;
+    }
+};
@@ -0,0 +1,338 @@
+#pragma once
+
+#include "ParticleStore.h"
+#include "Morton.h"
+#include "Threading.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Merging of bodies that touch, run after each step when the "collisions"
+// setting is on. A body of mass m is a disk of radius radiusScale * sqrt(m),
+// the same surface density for every body in the plane, and two bodies
+// closer than the sum of their radii merge. Tracers have no radius, so they
+// are swept up by the bodies they hit but never merge with each other.
+//
+// The broad phase is a uniform grid of cells whose width is twice the
+// largest radius among the bodies that are not large, so small touching
+// bodies share a cell or sit in neighbouring ones. It is rebuilt on every
+// call in O(N): the bodies are sorted by cell with the parallel Morton
+// radix sort, and an open-addressing hash of the occupied cells maps a cell
+// to its run of the sorted order. Every body with a radius then tests the
+// bodies of its own and the eight neighbouring cells, in parallel; tracers
+// are only ever tested from the bodies that can hit them. Large bodies,
+// more than LARGE_FACTOR times the mean radius, would make every cell huge:
+// they are left out of the cell size and look up the cells their own reach
+// covers instead.
+//
+// Touching bodies form groups, a chain of contacts being one group, and each
+// group becomes its heaviest member (a fixed member first): the masses,
+// momenta and mass-weighted accelerations are summed and the position moves
+// to the centre of mass. The other members leave the store by swap-and-pop.
+// Contacts are resolved in sorted order, so the result does not depend on
+// the thread count.
+class CollisionStage {
+private:
+    static constexpr uint64_t EMPTY = ~0ull;
+    static constexpr uint32_t MAX_CELL = (1u << MortonSorter::BITS) - 1;
+    static constexpr double LARGE_FACTOR = 4.0;  // Radius over the mean that makes a body large
+    
+    struct CellRun {
+        uint32_t begin = 0, end = 0;  // Range of the sorted order
+    };
+    
+    struct Sum {
+        double m = 0, mx = 0, my = 0, mvx = 0, mvy = 0, max = 0, may = 0;
+    };
+    
+    using Contact = std::pair<uint32_t, uint32_t>;  // Store slots, first < second
+    
+    // Sum and count of the radii that are not zero
+    struct RadiusStats {
+        double sum = 0.0;
+        size_t count = 0;
+        
+        void add(double r) {
+            if (r > 0.0) {
+                sum += r;
+                ++count;
+            }
+        }
+        static RadiusStats combine(const RadiusStats& a, const RadiusStats& b) {
+            return RadiusStats{a.sum + b.sum, a.count + b.count};
+        }
+    };
+    
+    MortonSorter sorter;
+    std::unique_ptr<std::atomic<uint64_t>[]> cellKeys;  // Hash table of occupied cells
+    std::vector<CellRun> cellRuns;
+    size_t tableCapacity = 0;
+    std::vector<std::vector<Contact>> threadContacts;
+    std::vector<Contact> contacts;
+    std::vector<uint32_t> large;  // Slots of the large bodies
+    std::vector<uint32_t> parent;  // Union-find over store slots
+    uint64_t merged = 0;
+    
+    static size_t slotOf(uint64_t key, size_t mask) {
+        return size_t((key * 0x9E3779B97F4A7C15ull) >> 17) & mask;
+    }
+    
+    void insertCell(uint64_t key, CellRun run) {
+        const size_t mask = tableCapacity - 1;
+        for (size_t s = slotOf(key, mask);; s = (s + 1) & mask) {
+            uint64_t expected = EMPTY;
+            if (cellKeys[s].compare_exchange_strong(expected, key, std::memory_order_relaxed)) {
+                cellRuns[s] = run;
+                return;
+            }
+        }
+    }
+    
+    CellRun findCell(uint64_t key) const {
+        const size_t mask = tableCapacity - 1;
+        for (size_t s = slotOf(key, mask);; s = (s + 1) & mask) {
+            const uint64_t stored = cellKeys[s].load(std::memory_order_relaxed);
+            if (stored == key) return cellRuns[s];
+            if (stored == EMPTY) return CellRun{};
+        }
+    }
+    
+    uint32_t find(uint32_t i) {
+        while (parent[i] != i) {
+            parent[i] = parent[parent[i]];
+            i = parent[i];
+        }
+        return i;
+    }
+    
+    // Whether a should absorb b: fixed bodies first, then the heavier one,
+    // then the one added first
+    static bool absorbs(const ParticleStore& particles, uint32_t a, uint32_t b) {
+        const ParticleInfo& ia = particles.info[a];
+        const ParticleInfo& ib = particles.info[b];
+        if (ia.fixed != ib.fixed) return ia.fixed;
+        if (particles.m[a] != particles.m[b]) return particles.m[a] > particles.m[b];
+        return ia.id < ib.id;
+    }
+    
+    // Fills contacts with every touching pair, sorted
+    void findContacts(const ParticleStore& particles, Real radiusScale) {
+        contacts.clear();
+        const size_t n = particles.size();
+        const BodySpan bodies = particles.bodies();
+        auto radius = [&](size_t i) { return double(radiusScale) * std::sqrt(double(particles.m[i])); };
+        auto touching = [&](uint32_t i, uint32_t j, double reach) {
+            const double dx = double(bodies.x[j]) - double(bodies.x[i]);
+            const double dy = double(bodies.y[j]) - double(bodies.y[i]);
+            return dx * dx + dy * dy < reach * reach;
+        };
+        
+        // Bodies far above the mean radius are large and left out of the
+        // grid's cell size; the largest of the rest sets it
+        const RadiusStats all = parallelReduce(n, PARALLEL_GRAIN, RadiusStats{}, [&](size_t begin, size_t end) {
+            RadiusStats local;
+            for (size_t i = begin; i < end; ++i) {
+                local.add(radius(i));
+            }
+            return local;
+        }, RadiusStats::combine);
+        if (all.count == 0) return;
+        const double largeRadius = LARGE_FACTOR * all.sum / all.count;
+        const double maxSmallRadius = parallelReduce(n, PARALLEL_GRAIN, 0.0, [&](size_t begin, size_t end) {
+            double r = 0.0;
+            for (size_t i = begin; i < end; ++i) {
+                const double ri = radius(i);
+                if (ri <= largeRadius) r = std::max(r, ri);
+            }
+            return r;
+        }, [](double a, double b) { return std::max(a, b); });
+        
+        large.clear();
+        for (size_t i = 0; i < n; ++i) {
+            if (radius(i) > largeRadius) large.push_back(uint32_t(i));
+        }
+        
+        // Cells of at least two small radii, widened until the grid spans
+        // the bodies; the margin keeps rounding from splitting a contact by
+        // two cells
+        const BodyBounds box = bodyBounds(bodies);
+        const double extent = std::max(double(box.maxX - box.minX), double(box.maxY - box.minY));
+        const double cell = std::max(2.0 * maxSmallRadius * (1.0 + 1e-6), extent / MAX_CELL);
+        const Real gridSize = Real(cell * double(1u << MortonSorter::BITS));
+        const double scale = double(1u << MortonSorter::BITS) / double(gridSize);
+        sorter.sort(bodies, box.minX, box.minY, gridSize);
+        const std::vector<uint64_t>& keys = sorter.keys();
+        const std::vector<uint32_t>& order = sorter.order();
+        
+        // One table slot per body at most half fills it
+        size_t capacity = 16;
+        while (capacity < 2 * n) capacity <<= 1;
+        if (capacity != tableCapacity) {
+            cellKeys.reset(new std::atomic<uint64_t>[capacity]);
+            cellRuns.resize(capacity);
+            tableCapacity = capacity;
+        }
+        parallelFor(capacity, PARALLEL_GRAIN, [&](size_t begin, size_t end) {
+            for (size_t s = begin; s < end; ++s) {
+                cellKeys[s].store(EMPTY, std::memory_order_relaxed);
+            }
+        });
+        parallelFor(n, PARALLEL_GRAIN, [&](size_t begin, size_t end) {
+            for (size_t k = begin; k < end; ++k) {
+                if (k > 0 && keys[k] == keys[k - 1]) continue;
+                size_t last = k + 1;
+                while (last < n && keys[last] == keys[k]) ++last;
+                insertCell(keys[k], CellRun{uint32_t(k), uint32_t(last)});
+            }
+        });
+        
+        if (threadContacts.size() < size_t(maxThreads())) {
+            threadContacts.resize(maxThreads());
+        }
+        for (auto& local : threadContacts) {
+            local.clear();
+        }
+        
+        // Visits the bodies of cells [x0, x1] x [y0, y1], clamped to the grid
+        auto forCells = [&](int64_t x0, int64_t x1, int64_t y0, int64_t y1, auto&& visit) {
+            for (int64_t cy = std::max<int64_t>(y0, 0); cy <= std::min<int64_t>(y1, MAX_CELL); ++cy) {
+                for (int64_t cx = std::max<int64_t>(x0, 0); cx <= std::min<int64_t>(x1, MAX_CELL); ++cx) {
+                    const CellRun run = findCell(MortonSorter::encode(uint32_t(cx), uint32_t(cy)));
+                    for (uint32_t q = run.begin; q < run.end; ++q) {
+                        visit(order[q]);
+                    }
+                }
+            }
+        };
+        
+        // Small bodies against their own and the eight neighbouring cells. A
+        // pair of small bodies is taken from its lower slot, large bodies
+        // find their own contacts below.
+        parallelFor(n, PARALLEL_GRAIN, [&](size_t begin, size_t end) {
+            std::vector<Contact>& local = threadContacts[threadIndex()];
+            for (size_t k = begin; k < end; ++k) {
+                const uint32_t i = order[k];
+                const double ri = radius(i);
+                if (ri == 0.0 || ri > largeRadius) continue;
+                const int64_t cx = MortonSorter::cellX(keys[k]);
+                const int64_t cy = MortonSorter::cellY(keys[k]);
+                forCells(cx - 1, cx + 1, cy - 1, cy + 1, [&](uint32_t j) {
+                    const double rj = radius(j);
+                    if (j == i || rj > largeRadius || (rj > 0.0 && j < i)) return;
+                    if (touching(i, j, ri + rj)) local.emplace_back(std::min(i, j), std::max(i, j));
+                });
+            }
+        });
+        
+        // Large bodies against every small body within reach, through the
+        // cells their reach covers (or all bodies when that is more cells
+        // than bodies), and against each other directly
+        parallelFor(large.size(), 1, [&](size_t begin, size_t end) {
+            std::vector<Contact>& local = threadContacts[threadIndex()];
+            for (size_t l = begin; l < end; ++l) {
+                const uint32_t i = large[l];
+                const double ri = radius(i);
+                auto visit = [&](uint32_t j) {
+                    const double rj = radius(j);
+                    if (rj > largeRadius) return;
+                    if (touching(i, j, ri + rj)) local.emplace_back(std::min(i, j), std::max(i, j));
+                };
+                const double reach = ri + maxSmallRadius;
+                const int64_t x0 = int64_t(std::floor((double(bodies.x[i]) - reach - box.minX) * scale)) - 1;
+                const int64_t x1 = int64_t(std::floor((double(bodies.x[i]) + reach - box.minX) * scale)) + 1;
+                const int64_t y0 = int64_t(std::floor((double(bodies.y[i]) - reach - box.minY) * scale)) - 1;
+                const int64_t y1 = int64_t(std::floor((double(bodies.y[i]) + reach - box.minY) * scale)) + 1;
+                if (double(x1 - x0 + 1) * double(y1 - y0 + 1) > double(n)) {
+                    for (uint32_t j = 0; j < n; ++j) {
+                        visit(j);
+                    }
+                } else {
+                    forCells(x0, x1, y0, y1, visit);
+                }
+                for (size_t other = l + 1; other < large.size(); ++other) {
+                    const uint32_t j = large[other];
+                    if (touching(i, j, ri + radius(j))) local.emplace_back(std::min(i, j), std::max(i, j));
+                }
+            }
+        });
+        
+        for (const auto& local : threadContacts) {
+            contacts.insert(contacts.end(), local.begin(), local.end());
+        }
+        std::sort(contacts.begin(), contacts.end());
+    }
+    
+public:
+    // Merges every group of touching bodies and returns how many bodies
+    // left the store. The caller re-adopts the store when any did.
+    size_t resolve(ParticleStore& particles, Real radiusScale) {
+        if (particles.size() < 2) return 0;
+        findContacts(particles, radiusScale);
+        if (contacts.empty()) return 0;
+        
+        parent.resize(particles.size());
+        for (const Contact& c : contacts) {
+            parent[c.first] = c.first;
+            parent[c.second] = c.second;
+        }
+        for (const Contact& c : contacts) {
+            const uint32_t a = find(c.first);
+            const uint32_t b = find(c.second);
+            if (a == b) continue;
+            if (absorbs(particles, a, b)) {
+                parent[b] = a;
+            } else {
+                parent[a] = b;
+            }
+        }
+        
+        std::vector<uint32_t> members;
+        members.reserve(2 * contacts.size());
+        for (const Contact& c : contacts) {
+            members.push_back(c.first);
+            members.push_back(c.second);
+        }
+        std::sort(members.begin(), members.end());
+        members.erase(std::unique(members.begin(), members.end()), members.end());
+        
+        std::unordered_map<uint32_t, Sum> groups;
+        std::vector<uint32_t> removed;
+        for (uint32_t i : members) {
+            const uint32_t root = find(i);
+            Sum& sum = groups[root];
+            const double m = particles.m[i];
+            sum.m += m;
+            sum.mx += m * particles.x[i];
+            sum.my += m * particles.y[i];
+            sum.mvx += m * particles.vx[i];
+            sum.mvy += m * particles.vy[i];
+            sum.max += m * particles.ax[i];
+            sum.may += m * particles.ay[i];
+            if (root != i) removed.push_back(i);
+        }
+        
+        for (const auto& [root, sum] : groups) {
+            particles.m[root] = Real(sum.m);
+            if (particles.info[root].fixed || !(sum.m > 0.0)) continue;
+            particles.x[root] = Real(sum.mx / sum.m);
+            particles.y[root] = Real(sum.my / sum.m);
+            particles.vx[root] = Real(sum.mvx / sum.m);
+            particles.vy[root] = Real(sum.mvy / sum.m);
+            particles.ax[root] = Real(sum.max / sum.m);
+            particles.ay[root] = Real(sum.may / sum.m);
+        }
+        
+        particles.removeSwapAndPop(removed);
+        merged += removed.size();
+        return removed.size();
+    }
+    
+    // Bodies absorbed since construction
+    uint64_t mergeCount() const { return merged; }
+};
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Parsing of command-line values shared by the batch and benchmark tools.
+// Each parser accepts the whole text or nothing, so a typo is reported
+// instead of being read as its longest valid prefix.
+
+// Items of a comma-separated list, empty ones dropped
+inline std::vector<std::string> splitList(const std::string& list) {
+    std::vector<std::string> items;
+    std::stringstream stream(list);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        if (!item.empty()) items.push_back(item);
+    }
+    return items;
+}
+
+// A whole positive number and nothing else
+inline bool parsePositive(const char* text, long& value) {
+    char* end = nullptr;
+    const long parsed = std::strtol(text, &end, 10);
+    if (end == text || *end != '\0' || parsed <= 0) return false;
+    value = parsed;
+    return true;
+}
+
+// A positive real number and nothing else
+inline bool parsePositive(const char* text, double& value) {
+    char* end = nullptr;
+    const double parsed = std::strtod(text, &end);
+    if (end == text || *end != '\0' || !(parsed > 0.0) || !std::isfinite(parsed)) return false;
+    value = parsed;
+    return true;
+}
+
+// A whole number, zero included, and nothing else
+inline bool parseWhole(const char* text, uint64_t& value) {
+    while (*text == ' ') ++text;
+    if (*text == '-') return false;  // strtoull would wrap it around
+    char* end = nullptr;
+    const unsigned long long parsed = std::strtoull(text, &end, 10);
+    if (end == text || *end != '\0') return false;
+    value = parsed;
+    return true;
+}
+
+// A count of at least one: "1000", "10k" or "1M"
+inline bool parseCount(const char* text, uint64_t& count) {
+    char* end = nullptr;
+    double value = std::strtod(text, &end);
+    if (end == text) return false;
+    if (*end == 'k' || *end == 'K') {
+        value *= 1e3;
+        ++end;
+    } else if (*end == 'm' || *end == 'M') {
+        value *= 1e6;
+        ++end;
+    }
+    if (*end != '\0' || !(value >= 1.0) || !(value < 1.8e19)) return false;
+    count = static_cast<uint64_t>(value);
+    return true;
+}
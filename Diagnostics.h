@@ -0,0 +1,98 @@
+#pragma once
+
+#include "ParticleStore.h"
+#include "Threading.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+// Conserved quantities of a run, measured by SimulationCore every
+// diagnostics_interval steps and whenever a front end asks for them.
+//
+//   K  = sum 1/2 m v^2                kinetic energy
+//   W  = 1/2 sum m phi                potential energy, phi = -G sum m p(s)
+//   P  = sum m v                      linear momentum
+//   L  = sum m (x vy - y vx)          angular momentum about the origin
+//
+// phi comes from the force solver as a byproduct of the evaluation that also
+// gives the accelerations (AccelerationSpan::potential), on the same tree
+// and interaction lists, so W costs O(N log N) like the forces rather than a
+// separate O(N^2) pass. A symplectic step already ends on such an evaluation
+// at its final positions; other integrators pay one extra evaluation per
+// measurement.
+//
+// Fixed bodies do not move, so they are left out of K, P and L. Each pair is
+// counted once in W: half of each body's phi, or all of it when only fixed
+// bodies attract, where phi is an external potential and the sources
+// themselves get none. Massless tracers add nothing to any of the sums.
+struct Diagnostics {
+    uint64_t step = 0;
+    double time = 0.0;
+    double kinetic = 0.0;
+    double potential = std::numeric_limits<double>::quiet_NaN();  // NaN when the solver gives no phi
+    double momentumX = 0.0;
+    double momentumY = 0.0;
+    double angularMomentum = 0.0;
+    double energyDrift = std::numeric_limits<double>::quiet_NaN();  // (E - E0) / |E0|, E0 at the first measurement
+    
+    bool hasPotential() const { return !std::isnan(potential); }
+    double energy() const { return kinetic + potential; }
+    
+    // 2K / |W|, 1 for a system in virial equilibrium
+    double virialRatio() const {
+        return potential < 0.0 ? 2.0 * kinetic / -potential : std::numeric_limits<double>::quiet_NaN();
+    }
+};
+
+// The sums behind one measurement, in double whatever the state precision
+struct DiagnosticSums {
+    double kinetic = 0.0;
+    double potential = 0.0;
+    double momentumX = 0.0;
+    double momentumY = 0.0;
+    double angularMomentum = 0.0;
+    
+    void add(const DiagnosticSums& other) {
+        kinetic += other.kinetic;
+        potential += other.potential;
+        momentumX += other.momentumX;
+        momentumY += other.momentumY;
+        angularMomentum += other.angularMomentum;
+    }
+};
+
+// Sums the quantities of every body in parallel. potential holds each body's
+// phi (nullptr to leave W out) and weight the share of it that counts. Each
+// chunk keeps its own partial sum and the partials are added in chunk order,
+// so the result does not depend on the thread count.
+inline DiagnosticSums sumDiagnostics(const ParticleStore& particles, const Real* potential, double weight,
+                                     std::vector<DiagnosticSums>& partials) {
+    const size_t n = particles.size();
+    const size_t chunks = (n + PARALLEL_GRAIN - 1) / PARALLEL_GRAIN;
+    partials.assign(chunks, DiagnosticSums{});
+    parallelFor(chunks, 1, [&](size_t first, size_t last) {
+        for (size_t c = first; c < last; ++c) {
+            DiagnosticSums& sums = partials[c];
+            const size_t end = std::min(n, (c + 1) * PARALLEL_GRAIN);
+            for (size_t i = c * PARALLEL_GRAIN; i < end; ++i) {
+                const double m = particles.m[i];
+                if (potential) sums.potential += weight * m * double(potential[i]);
+                if (particles.info[i].fixed) continue;
+                const double vx = particles.vx[i];
+                const double vy = particles.vy[i];
+                sums.kinetic += 0.5 * m * (vx * vx + vy * vy);
+                sums.momentumX += m * vx;
+                sums.momentumY += m * vy;
+                sums.angularMomentum += m * (double(particles.x[i]) * vy - double(particles.y[i]) * vx);
+            }
+        }
+    });
+    DiagnosticSums total;
+    for (const DiagnosticSums& sums : partials) {
+        total.add(sums);
+    }
+    return total;
+}
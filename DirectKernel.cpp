@@ -0,0 +1,748 @@
+#include "DirectKernel.h"
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define ASTRO_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(__aarch64__) || defined(_M_ARM64) || defined(__ARM_NEON)
+#define ASTRO_NEON 1
+#include <arm_neon.h>
+#endif
+
+// Lets the x86 kernels use AVX2/AVX-512 without compiling the whole binary
+// for them, so a portable build still gets the fast path
+#if defined(__GNUC__) || defined(__clang__)
+#define ASTRO_TARGET(isa) __attribute__((target(isa)))
+#else
+#define ASTRO_TARGET(isa)
+#endif
+
+namespace {
+
+// 3 arrays * 4 bytes * 2048 sources = 24 KB, which fits in a 32 KB L1 next to
+// the target block (48 KB in double builds, which still fits most L2 slices
+// with room to spare)
+constexpr size_t SOURCE_TILE = 2048;
+constexpr size_t TARGET_BLOCK = 64;
+
+// Accumulates the unscaled acceleration (without G) from sources [jBegin, jEnd)
+// onto count targets, all in the pair precision. Every kernel below is a
+// template over the softening kernel (Interaction.h), and each SIMD level
+// has a factorLanes(), the lane-wise kernelFactor().
+//
+// The Potential instances also subtract sum m_j p(s) from phi, the unscaled
+// potential, with potentialLanes() as the lane-wise kernelPotential(). The
+// self pair is left out by its s not exceeding the offset eps^2, which also
+// drops any pair closer than the rounding of s can tell apart from it.
+using TileFunction = void (*)(const SourceSpan& sources, size_t jBegin, size_t jEnd,
+                              const ForceReal* xi, const ForceReal* yi, size_t count,
+                              const KernelTerms<ForceReal>& terms, ForceReal* ax, ForceReal* ay, ForceReal* phi);
+
+template <typename Kernel, bool Potential>
+void tileScalar(const SourceSpan& s, size_t jBegin, size_t jEnd,
+                const ForceReal* xi, const ForceReal* yi, size_t count, const KernelTerms<ForceReal>& terms,
+                ForceReal* ax, ForceReal* ay, ForceReal* phi) {
+    for (size_t k = 0; k < count; ++k) {
+        ForceReal sx = 0;
+        ForceReal sy = 0;
+        ForceReal sp = 0;
+        for (size_t j = jBegin; j < jEnd; ++j) {
+            ForceReal dx = s.x[j] - xi[k];
+            ForceReal dy = s.y[j] - yi[k];
+            ForceReal r2 = dx * dx + dy * dy + terms.eps2;
+            ForceReal a = r2 > 0 ? s.m[j] * kernelFactor<Kernel>(r2, 1 / (r2 * std::sqrt(r2)), terms) : 0;
+            sx += dx * a;
+            sy += dy * a;
+            if constexpr (Potential) {
+                if (r2 > terms.eps2) sp += s.m[j] * kernelPotential<Kernel>(r2, 1 / std::sqrt(r2), terms);
+            }
+        }
+        ax[k] += sx;
+        ay[k] += sy;
+        if constexpr (Potential) phi[k] -= sp;
+    }
+}
+
+#ifdef ASTRO_PRECISION_DOUBLE
+#if ASTRO_X86
+template <typename Kernel>
+ASTRO_TARGET("avx2,fma")
+inline __m256d factorLanes(__m256d s, __m256d inv3, const KernelTerms<double>& terms) {
+    if constexpr (Kernel::COMPACT) {
+        static_assert(Kernel::DEGREE == 2, "the lane-wise inner form is quadratic");
+        const __m256d q = _mm256_mul_pd(s, _mm256_set1_pd(terms.invH2));
+        __m256d inner = _mm256_fmadd_pd(_mm256_set1_pd(Kernel::C2), q, _mm256_set1_pd(Kernel::C1));
+        inner = _mm256_mul_pd(_mm256_fmadd_pd(inner, q, _mm256_set1_pd(Kernel::C0)), _mm256_set1_pd(terms.invH3));
+        return _mm256_blendv_pd(inv3, inner, _mm256_cmp_pd(s, _mm256_set1_pd(terms.h2), _CMP_LT_OQ));
+    } else {
+        (void)s, (void)terms;
+        return inv3;
+    }
+}
+
+template <typename Kernel>
+ASTRO_TARGET("avx2,fma")
+inline __m256d potentialLanes(__m256d s, __m256d inv1, const KernelTerms<double>& terms) {
+    if constexpr (Kernel::COMPACT) {
+        const __m256d q = _mm256_mul_pd(s, _mm256_set1_pd(terms.invH2));
+        __m256d inner = _mm256_fmadd_pd(_mm256_set1_pd(Kernel::P3), q, _mm256_set1_pd(Kernel::P2));
+        inner = _mm256_fmadd_pd(inner, q, _mm256_set1_pd(Kernel::P1));
+        inner = _mm256_mul_pd(_mm256_fmadd_pd(inner, q, _mm256_set1_pd(Kernel::P0)), _mm256_set1_pd(terms.invH));
+        return _mm256_blendv_pd(inv1, inner, _mm256_cmp_pd(s, _mm256_set1_pd(terms.h2), _CMP_LT_OQ));
+    } else {
+        (void)s, (void)terms;
+        return inv1;
+    }
+}
+
+template <typename Kernel>
+ASTRO_TARGET("avx512f")
+inline __m512d factorLanes(__m512d s, __m512d inv3, const KernelTerms<double>& terms) {
+    if constexpr (Kernel::COMPACT) {
+        static_assert(Kernel::DEGREE == 2, "the lane-wise inner form is quadratic");
+        const __m512d q = _mm512_mul_pd(s, _mm512_set1_pd(terms.invH2));
+        __m512d inner = _mm512_fmadd_pd(_mm512_set1_pd(Kernel::C2), q, _mm512_set1_pd(Kernel::C1));
+        inner = _mm512_mul_pd(_mm512_fmadd_pd(inner, q, _mm512_set1_pd(Kernel::C0)), _mm512_set1_pd(terms.invH3));
+        return _mm512_mask_blend_pd(_mm512_cmp_pd_mask(s, _mm512_set1_pd(terms.h2), _CMP_LT_OQ), inv3, inner);
+    } else {
+        (void)s, (void)terms;
+        return inv3;
+    }
+}
+
+template <typename Kernel>
+ASTRO_TARGET("avx512f")
+inline __m512d potentialLanes(__m512d s, __m512d inv1, const KernelTerms<double>& terms) {
+    if constexpr (Kernel::COMPACT) {
+        const __m512d q = _mm512_mul_pd(s, _mm512_set1_pd(terms.invH2));
+        __m512d inner = _mm512_fmadd_pd(_mm512_set1_pd(Kernel::P3), q, _mm512_set1_pd(Kernel::P2));
+        inner = _mm512_fmadd_pd(inner, q, _mm512_set1_pd(Kernel::P1));
+        inner = _mm512_mul_pd(_mm512_fmadd_pd(inner, q, _mm512_set1_pd(Kernel::P0)), _mm512_set1_pd(terms.invH));
+        return _mm512_mask_blend_pd(_mm512_cmp_pd_mask(s, _mm512_set1_pd(terms.h2), _CMP_LT_OQ), inv1, inner);
+    } else {
+        (void)s, (void)terms;
+        return inv1;
+    }
+}
+
+// Double builds take the exact square root and divide: there is no double
+// reciprocal square-root estimate worth refining on AVX2
+template <typename Kernel, bool Potential>
+ASTRO_TARGET("avx2,fma")
+void tileAvx2(const SourceSpan& s, size_t jBegin, size_t jEnd,
+              const double* xi, const double* yi, size_t count, const KernelTerms<double>& terms,
+              double* ax, double* ay, double* phi) {
+    const __m256d vEps2 = _mm256_set1_pd(terms.eps2);
+    const __m256d vOne = _mm256_set1_pd(1.0);
+    const __m256d vZero = _mm256_setzero_pd();
+    const size_t vecEnd = jBegin + (jEnd - jBegin) / 4 * 4;
+    
+    for (size_t k = 0; k < count; ++k) {
+        const __m256d vxi = _mm256_set1_pd(xi[k]);
+        const __m256d vyi = _mm256_set1_pd(yi[k]);
+        __m256d sx = _mm256_setzero_pd();
+        __m256d sy = _mm256_setzero_pd();
+        __m256d sp = _mm256_setzero_pd();
+        
+        for (size_t j = jBegin; j < vecEnd; j += 4) {
+            __m256d dx = _mm256_sub_pd(_mm256_loadu_pd(s.x + j), vxi);
+            __m256d dy = _mm256_sub_pd(_mm256_loadu_pd(s.y + j), vyi);
+            __m256d r2 = _mm256_fmadd_pd(dx, dx, _mm256_fmadd_pd(dy, dy, vEps2));
+            
+            __m256d inv3 = _mm256_div_pd(vOne, _mm256_mul_pd(r2, _mm256_sqrt_pd(r2)));
+            if constexpr (Potential) {
+                __m256d p = _mm256_mul_pd(_mm256_loadu_pd(s.m + j),
+                                          potentialLanes<Kernel>(r2, _mm256_mul_pd(inv3, r2), terms));
+                sp = _mm256_add_pd(sp, _mm256_and_pd(p, _mm256_cmp_pd(r2, vEps2, _CMP_GT_OQ)));
+            }
+            inv3 = factorLanes<Kernel>(r2, inv3, terms);
+            
+            __m256d a = _mm256_mul_pd(_mm256_loadu_pd(s.m + j), inv3);
+            a = _mm256_and_pd(a, _mm256_cmp_pd(r2, vZero, _CMP_GT_OQ));
+            sx = _mm256_fmadd_pd(dx, a, sx);
+            sy = _mm256_fmadd_pd(dy, a, sy);
+        }
+        
+        alignas(32) double lanesX[4];
+        alignas(32) double lanesY[4];
+        _mm256_store_pd(lanesX, sx);
+        _mm256_store_pd(lanesY, sy);
+        ax[k] += (lanesX[0] + lanesX[1]) + (lanesX[2] + lanesX[3]);
+        ay[k] += (lanesY[0] + lanesY[1]) + (lanesY[2] + lanesY[3]);
+        if constexpr (Potential) {
+            alignas(32) double lanesP[4];
+            _mm256_store_pd(lanesP, sp);
+            phi[k] -= (lanesP[0] + lanesP[1]) + (lanesP[2] + lanesP[3]);
+        }
+    }
+    
+    if (vecEnd < jEnd) {
+        tileScalar<Kernel, Potential>(s, vecEnd, jEnd, xi, yi, count, terms, ax, ay, phi);
+    }
+}
+
+template <typename Kernel, bool Potential>
+ASTRO_TARGET("avx512f")
+void tileAvx512(const SourceSpan& s, size_t jBegin, size_t jEnd,
+                const double* xi, const double* yi, size_t count, const KernelTerms<double>& terms,
+                double* ax, double* ay, double* phi) {
+    const __m512d vEps2 = _mm512_set1_pd(terms.eps2);
+    const __m512d vHalf = _mm512_set1_pd(0.5);
+    const __m512d vThreeHalves = _mm512_set1_pd(1.5);
+    const __m512d vZero = _mm512_setzero_pd();
+    
+    for (size_t k = 0; k < count; ++k) {
+        const __m512d vxi = _mm512_set1_pd(xi[k]);
+        const __m512d vyi = _mm512_set1_pd(yi[k]);
+        __m512d sx = _mm512_setzero_pd();
+        __m512d sy = _mm512_setzero_pd();
+        __m512d sp = _mm512_setzero_pd();
+        
+        for (size_t j = jBegin; j < jEnd; j += 8) {
+            const size_t remaining = jEnd - j;
+            const __mmask8 lanes = remaining >= 8 ? __mmask8(0xFF) : __mmask8((1u << remaining) - 1u);
+            
+            __m512d dx = _mm512_sub_pd(_mm512_maskz_loadu_pd(lanes, s.x + j), vxi);
+            __m512d dy = _mm512_sub_pd(_mm512_maskz_loadu_pd(lanes, s.y + j), vyi);
+            __m512d r2 = _mm512_fmadd_pd(dx, dx, _mm512_fmadd_pd(dy, dy, vEps2));
+            
+            // 1/sqrt(r2) from the 14-bit estimate and two Newton steps
+            __m512d inv = _mm512_maskz_rsqrt14_pd(lanes, r2);
+            inv = _mm512_mul_pd(inv, _mm512_fnmadd_pd(_mm512_mul_pd(vHalf, r2), _mm512_mul_pd(inv, inv), vThreeHalves));
+            inv = _mm512_mul_pd(inv, _mm512_fnmadd_pd(_mm512_mul_pd(vHalf, r2), _mm512_mul_pd(inv, inv), vThreeHalves));
+            __m512d inv3 = _mm512_mul_pd(inv, _mm512_mul_pd(inv, inv));
+            inv3 = factorLanes<Kernel>(r2, inv3, terms);
+            if constexpr (Potential) {
+                const __mmask8 apart = _mm512_mask_cmp_pd_mask(lanes, r2, vEps2, _CMP_GT_OQ);
+                sp = _mm512_mask3_fmadd_pd(_mm512_maskz_loadu_pd(lanes, s.m + j),
+                                           potentialLanes<Kernel>(r2, inv, terms), sp, apart);
+            }
+            
+            const __mmask8 valid = _mm512_mask_cmp_pd_mask(lanes, r2, vZero, _CMP_GT_OQ);
+            __m512d a = _mm512_maskz_mul_pd(valid, _mm512_maskz_loadu_pd(lanes, s.m + j), inv3);
+            sx = _mm512_fmadd_pd(dx, a, sx);
+            sy = _mm512_fmadd_pd(dy, a, sy);
+        }
+        
+        alignas(64) double lanesX[8];
+        alignas(64) double lanesY[8];
+        alignas(64) double lanesP[8];
+        _mm512_store_pd(lanesX, sx);
+        _mm512_store_pd(lanesY, sy);
+        _mm512_store_pd(lanesP, sp);
+        double tx = 0.0;
+        double ty = 0.0;
+        double tp = 0.0;
+        for (int l = 0; l < 8; ++l) {
+            tx += lanesX[l];
+            ty += lanesY[l];
+            tp += lanesP[l];
+        }
+        ax[k] += tx;
+        ay[k] += ty;
+        if constexpr (Potential) phi[k] -= tp;
+    }
+}
+#endif
+
+#if ASTRO_NEON
+template <typename Kernel>
+inline float64x2_t factorLanes(float64x2_t s, float64x2_t inv3, const KernelTerms<double>& terms) {
+    if constexpr (Kernel::COMPACT) {
+        static_assert(Kernel::DEGREE == 2, "the lane-wise inner form is quadratic");
+        const float64x2_t q = vmulq_f64(s, vdupq_n_f64(terms.invH2));
+        float64x2_t inner = vfmaq_f64(vdupq_n_f64(Kernel::C1), q, vdupq_n_f64(Kernel::C2));
+        inner = vmulq_f64(vfmaq_f64(vdupq_n_f64(Kernel::C0), q, inner), vdupq_n_f64(terms.invH3));
+        return vbslq_f64(vcltq_f64(s, vdupq_n_f64(terms.h2)), inner, inv3);
+    } else {
+        (void)s, (void)terms;
+        return inv3;
+    }
+}
+
+template <typename Kernel>
+inline float64x2_t potentialLanes(float64x2_t s, float64x2_t inv1, const KernelTerms<double>& terms) {
+    if constexpr (Kernel::COMPACT) {
+        const float64x2_t q = vmulq_f64(s, vdupq_n_f64(terms.invH2));
+        float64x2_t inner = vfmaq_f64(vdupq_n_f64(Kernel::P2), q, vdupq_n_f64(Kernel::P3));
+        inner = vfmaq_f64(vdupq_n_f64(Kernel::P1), q, inner);
+        inner = vmulq_f64(vfmaq_f64(vdupq_n_f64(Kernel::P0), q, inner), vdupq_n_f64(terms.invH));
+        return vbslq_f64(vcltq_f64(s, vdupq_n_f64(terms.h2)), inner, inv1);
+    } else {
+        (void)s, (void)terms;
+        return inv1;
+    }
+}
+
+template <typename Kernel, bool Potential>
+void tileNeon(const SourceSpan& s, size_t jBegin, size_t jEnd,
+              const double* xi, const double* yi, size_t count, const KernelTerms<double>& terms,
+              double* ax, double* ay, double* phi) {
+    const float64x2_t vEps2 = vdupq_n_f64(terms.eps2);
+    const float64x2_t vZero = vdupq_n_f64(0.0);
+    const size_t vecEnd = jBegin + (jEnd - jBegin) / 2 * 2;
+    
+    for (size_t k = 0; k < count; ++k) {
+        const float64x2_t vxi = vdupq_n_f64(xi[k]);
+        const float64x2_t vyi = vdupq_n_f64(yi[k]);
+        float64x2_t sx = vdupq_n_f64(0.0);
+        float64x2_t sy = vdupq_n_f64(0.0);
+        float64x2_t sp = vdupq_n_f64(0.0);
+        
+        for (size_t j = jBegin; j < vecEnd; j += 2) {
+            float64x2_t dx = vsubq_f64(vld1q_f64(s.x + j), vxi);
+            float64x2_t dy = vsubq_f64(vld1q_f64(s.y + j), vyi);
+            float64x2_t r2 = vfmaq_f64(vfmaq_f64(vEps2, dy, dy), dx, dx);
+            
+            float64x2_t inv3 = vdivq_f64(vdupq_n_f64(1.0), vmulq_f64(r2, vsqrtq_f64(r2)));
+            if constexpr (Potential) {
+                float64x2_t p = vmulq_f64(vld1q_f64(s.m + j), potentialLanes<Kernel>(r2, vmulq_f64(inv3, r2), terms));
+                sp = vaddq_f64(sp, vbslq_f64(vcgtq_f64(r2, vEps2), p, vZero));
+            }
+            inv3 = factorLanes<Kernel>(r2, inv3, terms);
+            
+            float64x2_t a = vmulq_f64(vld1q_f64(s.m + j), inv3);
+            a = vbslq_f64(vcgtq_f64(r2, vZero), a, vZero);
+            sx = vfmaq_f64(sx, dx, a);
+            sy = vfmaq_f64(sy, dy, a);
+        }
+        
+        ax[k] += vaddvq_f64(sx);
+        ay[k] += vaddvq_f64(sy);
+        if constexpr (Potential) phi[k] -= vaddvq_f64(sp);
+    }
+    
+    if (vecEnd < jEnd) {
+        tileScalar<Kernel, Potential>(s, vecEnd, jEnd, xi, yi, count, terms, ax, ay, phi);
+    }
+}
+#endif
+
+#else
+#if ASTRO_X86
+template <typename Kernel>
+ASTRO_TARGET("avx2,fma")
+inline __m256 factorLanes(__m256 s, __m256 inv3, const KernelTerms<float>& terms) {
+    if constexpr (Kernel::COMPACT) {
+        static_assert(Kernel::DEGREE == 2, "the lane-wise inner form is quadratic");
+        const __m256 q = _mm256_mul_ps(s, _mm256_set1_ps(terms.invH2));
+        __m256 inner = _mm256_fmadd_ps(_mm256_set1_ps(float(Kernel::C2)), q, _mm256_set1_ps(float(Kernel::C1)));
+        inner = _mm256_mul_ps(_mm256_fmadd_ps(inner, q, _mm256_set1_ps(float(Kernel::C0))), _mm256_set1_ps(terms.invH3));
+        return _mm256_blendv_ps(inv3, inner, _mm256_cmp_ps(s, _mm256_set1_ps(terms.h2), _CMP_LT_OQ));
+    } else {
+        (void)s, (void)terms;
+        return inv3;
+    }
+}
+
+template <typename Kernel>
+ASTRO_TARGET("avx2,fma")
+inline __m256 potentialLanes(__m256 s, __m256 inv1, const KernelTerms<float>& terms) {
+    if constexpr (Kernel::COMPACT) {
+        const __m256 q = _mm256_mul_ps(s, _mm256_set1_ps(terms.invH2));
+        __m256 inner = _mm256_fmadd_ps(_mm256_set1_ps(float(Kernel::P3)), q, _mm256_set1_ps(float(Kernel::P2)));
+        inner = _mm256_fmadd_ps(inner, q, _mm256_set1_ps(float(Kernel::P1)));
+        inner = _mm256_mul_ps(_mm256_fmadd_ps(inner, q, _mm256_set1_ps(float(Kernel::P0))), _mm256_set1_ps(terms.invH));
+        return _mm256_blendv_ps(inv1, inner, _mm256_cmp_ps(s, _mm256_set1_ps(terms.h2), _CMP_LT_OQ));
+    } else {
+        (void)s, (void)terms;
+        return inv1;
+    }
+}
+
+template <typename Kernel>
+ASTRO_TARGET("avx512f")
+inline __m512 factorLanes(__m512 s, __m512 inv3, const KernelTerms<float>& terms) {
+    if constexpr (Kernel::COMPACT) {
+        static_assert(Kernel::DEGREE == 2, "the lane-wise inner form is quadratic");
+        const __m512 q = _mm512_mul_ps(s, _mm512_set1_ps(terms.invH2));
+        __m512 inner = _mm512_fmadd_ps(_mm512_set1_ps(float(Kernel::C2)), q, _mm512_set1_ps(float(Kernel::C1)));
+        inner = _mm512_mul_ps(_mm512_fmadd_ps(inner, q, _mm512_set1_ps(float(Kernel::C0))), _mm512_set1_ps(terms.invH3));
+        return _mm512_mask_blend_ps(_mm512_cmp_ps_mask(s, _mm512_set1_ps(terms.h2), _CMP_LT_OQ), inv3, inner);
+    } else {
+        (void)s, (void)terms;
+        return inv3;
+    }
+}
+
+template <typename Kernel>
+ASTRO_TARGET("avx512f")
+inline __m512 potentialLanes(__m512 s, __m512 inv1, const KernelTerms<float>& terms) {
+    if constexpr (Kernel::COMPACT) {
+        const __m512 q = _mm512_mul_ps(s, _mm512_set1_ps(terms.invH2));
+        __m512 inner = _mm512_fmadd_ps(_mm512_set1_ps(float(Kernel::P3)), q, _mm512_set1_ps(float(Kernel::P2)));
+        inner = _mm512_fmadd_ps(inner, q, _mm512_set1_ps(float(Kernel::P1)));
+        inner = _mm512_mul_ps(_mm512_fmadd_ps(inner, q, _mm512_set1_ps(float(Kernel::P0))), _mm512_set1_ps(terms.invH));
+        return _mm512_mask_blend_ps(_mm512_cmp_ps_mask(s, _mm512_set1_ps(terms.h2), _CMP_LT_OQ), inv1, inner);
+    } else {
+        (void)s, (void)terms;
+        return inv1;
+    }
+}
+
+template <typename Kernel, bool Potential>
+ASTRO_TARGET("avx2,fma")
+void tileAvx2(const SourceSpan& s, size_t jBegin, size_t jEnd,
+              const float* xi, const float* yi, size_t count, const KernelTerms<float>& terms,
+              float* ax, float* ay, float* phi) {
+    const __m256 vEps2 = _mm256_set1_ps(terms.eps2);
+    const __m256 vHalf = _mm256_set1_ps(0.5f);
+    const __m256 vThreeHalves = _mm256_set1_ps(1.5f);
+    const __m256 vZero = _mm256_setzero_ps();
+    const size_t vecEnd = jBegin + (jEnd - jBegin) / 8 * 8;
+    
+    for (size_t k = 0; k < count; ++k) {
+        const __m256 vxi = _mm256_set1_ps(xi[k]);
+        const __m256 vyi = _mm256_set1_ps(yi[k]);
+        __m256 sx = _mm256_setzero_ps();
+        __m256 sy = _mm256_setzero_ps();
+        __m256 sp = _mm256_setzero_ps();
+        
+        for (size_t j = jBegin; j < vecEnd; j += 8) {
+            __m256 dx = _mm256_sub_ps(_mm256_loadu_ps(s.x + j), vxi);
+            __m256 dy = _mm256_sub_ps(_mm256_loadu_ps(s.y + j), vyi);
+            __m256 r2 = _mm256_fmadd_ps(dx, dx, _mm256_fmadd_ps(dy, dy, vEps2));
+            
+            // 1/sqrt(r2) to ~23 bits: estimate, then one Newton step
+            __m256 inv = _mm256_rsqrt_ps(r2);
+            __m256 inv2 = _mm256_mul_ps(inv, inv);
+            inv = _mm256_mul_ps(inv, _mm256_fnmadd_ps(_mm256_mul_ps(vHalf, r2), inv2, vThreeHalves));
+            __m256 inv3 = _mm256_mul_ps(inv, _mm256_mul_ps(inv, inv));
+            inv3 = factorLanes<Kernel>(r2, inv3, terms);
+            if constexpr (Potential) {
+                __m256 p = _mm256_mul_ps(_mm256_loadu_ps(s.m + j), potentialLanes<Kernel>(r2, inv, terms));
+                sp = _mm256_add_ps(sp, _mm256_and_ps(p, _mm256_cmp_ps(r2, vEps2, _CMP_GT_OQ)));
+            }
+            
+            __m256 a = _mm256_mul_ps(_mm256_loadu_ps(s.m + j), inv3);
+            a = _mm256_and_ps(a, _mm256_cmp_ps(r2, vZero, _CMP_GT_OQ));
+            sx = _mm256_fmadd_ps(dx, a, sx);
+            sy = _mm256_fmadd_ps(dy, a, sy);
+        }
+        
+        alignas(32) float lanesX[8];
+        alignas(32) float lanesY[8];
+        alignas(32) float lanesP[8];
+        _mm256_store_ps(lanesX, sx);
+        _mm256_store_ps(lanesY, sy);
+        _mm256_store_ps(lanesP, sp);
+        float tx = 0.0f;
+        float ty = 0.0f;
+        float tp = 0.0f;
+        for (int l = 0; l < 8; ++l) {
+            tx += lanesX[l];
+            ty += lanesY[l];
+            tp += lanesP[l];
+        }
+        ax[k] += tx;
+        ay[k] += ty;
+        if constexpr (Potential) phi[k] -= tp;
+    }
+    
+    if (vecEnd < jEnd) {
+        tileScalar<Kernel, Potential>(s, vecEnd, jEnd, xi, yi, count, terms, ax, ay, phi);
+    }
+}
+
+template <typename Kernel, bool Potential>
+ASTRO_TARGET("avx512f")
+void tileAvx512(const SourceSpan& s, size_t jBegin, size_t jEnd,
+                const float* xi, const float* yi, size_t count, const KernelTerms<float>& terms,
+                float* ax, float* ay, float* phi) {
+    const __m512 vEps2 = _mm512_set1_ps(terms.eps2);
+    const __m512 vHalf = _mm512_set1_ps(0.5f);
+    const __m512 vThreeHalves = _mm512_set1_ps(1.5f);
+    const __m512 vZero = _mm512_setzero_ps();
+    
+    for (size_t k = 0; k < count; ++k) {
+        const __m512 vxi = _mm512_set1_ps(xi[k]);
+        const __m512 vyi = _mm512_set1_ps(yi[k]);
+        __m512 sx = _mm512_setzero_ps();
+        __m512 sy = _mm512_setzero_ps();
+        __m512 sp = _mm512_setzero_ps();
+        
+        for (size_t j = jBegin; j < jEnd; j += 16) {
+            // The tail is handled with a lane mask instead of a scalar loop
+            const size_t remaining = jEnd - j;
+            const __mmask16 lanes = remaining >= 16 ? __mmask16(0xFFFF)
+                                                    : __mmask16((1u << remaining) - 1u);
+            
+            __m512 dx = _mm512_sub_ps(_mm512_maskz_loadu_ps(lanes, s.x + j), vxi);
+            __m512 dy = _mm512_sub_ps(_mm512_maskz_loadu_ps(lanes, s.y + j), vyi);
+            __m512 r2 = _mm512_fmadd_ps(dx, dx, _mm512_fmadd_ps(dy, dy, vEps2));
+            
+            __m512 inv = _mm512_maskz_rsqrt14_ps(lanes, r2);
+            __m512 inv2 = _mm512_mul_ps(inv, inv);
+            inv = _mm512_mul_ps(inv, _mm512_fnmadd_ps(_mm512_mul_ps(vHalf, r2), inv2, vThreeHalves));
+            __m512 inv3 = _mm512_mul_ps(inv, _mm512_mul_ps(inv, inv));
+            inv3 = factorLanes<Kernel>(r2, inv3, terms);
+            if constexpr (Potential) {
+                const __mmask16 apart = _mm512_mask_cmp_ps_mask(lanes, r2, vEps2, _CMP_GT_OQ);
+                sp = _mm512_mask3_fmadd_ps(_mm512_maskz_loadu_ps(lanes, s.m + j),
+                                           potentialLanes<Kernel>(r2, inv, terms), sp, apart);
+            }
+            
+            const __mmask16 valid = _mm512_mask_cmp_ps_mask(lanes, r2, vZero, _CMP_GT_OQ);
+            __m512 a = _mm512_maskz_mul_ps(valid, _mm512_maskz_loadu_ps(lanes, s.m + j), inv3);
+            sx = _mm512_fmadd_ps(dx, a, sx);
+            sy = _mm512_fmadd_ps(dy, a, sy);
+        }
+        
+        alignas(64) float lanesX[16];
+        alignas(64) float lanesY[16];
+        alignas(64) float lanesP[16];
+        _mm512_store_ps(lanesX, sx);
+        _mm512_store_ps(lanesY, sy);
+        _mm512_store_ps(lanesP, sp);
+        float tx = 0.0f;
+        float ty = 0.0f;
+        float tp = 0.0f;
+        for (int l = 0; l < 16; ++l) {
+            tx += lanesX[l];
+            ty += lanesY[l];
+            tp += lanesP[l];
+        }
+        ax[k] += tx;
+        ay[k] += ty;
+        if constexpr (Potential) phi[k] -= tp;
+    }
+}
+#endif
+
+#if ASTRO_NEON
+template <typename Kernel>
+inline float32x4_t factorLanes(float32x4_t s, float32x4_t inv3, const KernelTerms<float>& terms) {
+    if constexpr (Kernel::COMPACT) {
+        static_assert(Kernel::DEGREE == 2, "the lane-wise inner form is quadratic");
+        const float32x4_t q = vmulq_f32(s, vdupq_n_f32(terms.invH2));
+        float32x4_t inner = vfmaq_f32(vdupq_n_f32(float(Kernel::C1)), q, vdupq_n_f32(float(Kernel::C2)));
+        inner = vmulq_f32(vfmaq_f32(vdupq_n_f32(float(Kernel::C0)), q, inner), vdupq_n_f32(terms.invH3));
+        return vbslq_f32(vcltq_f32(s, vdupq_n_f32(terms.h2)), inner, inv3);
+    } else {
+        (void)s, (void)terms;
+        return inv3;
+    }
+}
+
+template <typename Kernel>
+inline float32x4_t potentialLanes(float32x4_t s, float32x4_t inv1, const KernelTerms<float>& terms) {
+    if constexpr (Kernel::COMPACT) {
+        const float32x4_t q = vmulq_f32(s, vdupq_n_f32(terms.invH2));
+        float32x4_t inner = vfmaq_f32(vdupq_n_f32(float(Kernel::P2)), q, vdupq_n_f32(float(Kernel::P3)));
+        inner = vfmaq_f32(vdupq_n_f32(float(Kernel::P1)), q, inner);
+        inner = vmulq_f32(vfmaq_f32(vdupq_n_f32(float(Kernel::P0)), q, inner), vdupq_n_f32(terms.invH));
+        return vbslq_f32(vcltq_f32(s, vdupq_n_f32(terms.h2)), inner, inv1);
+    } else {
+        (void)s, (void)terms;
+        return inv1;
+    }
+}
+
+template <typename Kernel, bool Potential>
+void tileNeon(const SourceSpan& s, size_t jBegin, size_t jEnd,
+              const float* xi, const float* yi, size_t count, const KernelTerms<float>& terms,
+              float* ax, float* ay, float* phi) {
+    const float32x4_t vEps2 = vdupq_n_f32(terms.eps2);
+    const float32x4_t vZero = vdupq_n_f32(0.0f);
+    const size_t vecEnd = jBegin + (jEnd - jBegin) / 4 * 4;
+    
+    for (size_t k = 0; k < count; ++k) {
+        const float32x4_t vxi = vdupq_n_f32(xi[k]);
+        const float32x4_t vyi = vdupq_n_f32(yi[k]);
+        float32x4_t sx = vdupq_n_f32(0.0f);
+        float32x4_t sy = vdupq_n_f32(0.0f);
+        float32x4_t sp = vdupq_n_f32(0.0f);
+        
+        for (size_t j = jBegin; j < vecEnd; j += 4) {
+            float32x4_t dx = vsubq_f32(vld1q_f32(s.x + j), vxi);
+            float32x4_t dy = vsubq_f32(vld1q_f32(s.y + j), vyi);
+            float32x4_t r2 = vfmaq_f32(vfmaq_f32(vEps2, dy, dy), dx, dx);
+            
+            // The NEON estimate is only ~8 bits, so take two Newton steps
+            float32x4_t inv = vrsqrteq_f32(r2);
+            inv = vmulq_f32(inv, vrsqrtsq_f32(vmulq_f32(r2, inv), inv));
+            inv = vmulq_f32(inv, vrsqrtsq_f32(vmulq_f32(r2, inv), inv));
+            float32x4_t inv3 = vmulq_f32(inv, vmulq_f32(inv, inv));
+            inv3 = factorLanes<Kernel>(r2, inv3, terms);
+            if constexpr (Potential) {
+                float32x4_t p = vmulq_f32(vld1q_f32(s.m + j), potentialLanes<Kernel>(r2, inv, terms));
+                sp = vaddq_f32(sp, vbslq_f32(vcgtq_f32(r2, vEps2), p, vZero));
+            }
+            
+            float32x4_t a = vmulq_f32(vld1q_f32(s.m + j), inv3);
+            a = vbslq_f32(vcgtq_f32(r2, vZero), a, vZero);
+            sx = vfmaq_f32(sx, dx, a);
+            sy = vfmaq_f32(sy, dy, a);
+        }
+        
+        ax[k] += vaddvq_f32(sx);
+        ay[k] += vaddvq_f32(sy);
+        if constexpr (Potential) phi[k] -= vaddvq_f32(sp);
+    }
+    
+    if (vecEnd < jEnd) {
+        tileScalar<Kernel, Potential>(s, vecEnd, jEnd, xi, yi, count, terms, ax, ay, phi);
+    }
+}
+#endif
+#endif // ASTRO_PRECISION_DOUBLE
+
+template <typename Kernel, bool Potential>
+TileFunction tileFunctionFor(SimdLevel level) {
+    switch (level) {
+#if ASTRO_X86
+        case SimdLevel::Avx512: return tileAvx512<Kernel, Potential>;
+        case SimdLevel::Avx2:   return tileAvx2<Kernel, Potential>;
+#endif
+#if ASTRO_NEON
+        case SimdLevel::Neon:   return tileNeon<Kernel, Potential>;
+#endif
+        default:                return tileScalar<Kernel, Potential>;
+    }
+}
+
+TileFunction tileFunctionFor(SimdLevel level, SofteningKernel kernel, bool potential) {
+    return withSofteningKernel(kernel, [&](auto policy) {
+        using Kernel = decltype(policy);
+        return potential ? tileFunctionFor<Kernel, true>(level) : tileFunctionFor<Kernel, false>(level);
+    });
+}
+
+bool isSupported(SimdLevel level) {
+    if (level == SimdLevel::Scalar) return true;
+    SimdLevel best = detectSimdLevel();
+    if (level == SimdLevel::Neon) return best == SimdLevel::Neon;
+    if (best == SimdLevel::Neon) return false;
+    return static_cast<int>(level) <= static_cast<int>(best);
+}
+
+// Sums the tiles of sources onto count targets, and their potential onto phi
+// if tile computes one. In mixed builds every tile is summed in float on its
+// own and added into the double accumulators, so the rounding does not grow
+// with the number of sources.
+void accumulateTiled(TileFunction tile, const SourceSpan& sources, const ForceReal* x, const ForceReal* y,
+                     size_t count, const KernelTerms<ForceReal>& terms, Real* ax, Real* ay, Real* phi) {
+#ifdef ASTRO_PRECISION_MIXED
+    ForceReal tileAx[TARGET_BLOCK], tileAy[TARGET_BLOCK], tilePhi[TARGET_BLOCK];
+    for (size_t kBegin = 0; kBegin < count; kBegin += TARGET_BLOCK) {
+        const size_t n = std::min(TARGET_BLOCK, count - kBegin);
+        for (size_t jBegin = 0; jBegin < sources.count; jBegin += SOURCE_TILE) {
+            const size_t jEnd = std::min(sources.count, jBegin + SOURCE_TILE);
+            std::fill(tileAx, tileAx + n, ForceReal(0));
+            std::fill(tileAy, tileAy + n, ForceReal(0));
+            std::fill(tilePhi, tilePhi + n, ForceReal(0));
+            tile(sources, jBegin, jEnd, x + kBegin, y + kBegin, n, terms, tileAx, tileAy, tilePhi);
+            for (size_t k = 0; k < n; ++k) {
+                ax[kBegin + k] += tileAx[k];
+                ay[kBegin + k] += tileAy[k];
+                if (phi) phi[kBegin + k] += tilePhi[k];
+            }
+        }
+    }
+#else
+    for (size_t jBegin = 0; jBegin < sources.count; jBegin += SOURCE_TILE) {
+        const size_t jEnd = std::min(sources.count, jBegin + SOURCE_TILE);
+        tile(sources, jBegin, jEnd, x, y, count, terms, ax, ay, phi);
+    }
+#endif
+}
+
+void runTiled(TileFunction tile, const SourceSpan& sources, const TargetSpan& targets,
+              size_t begin, size_t end, const AccelerationSpan& out,
+              Real G, const Softening& softening) {
+    const KernelTerms<ForceReal> terms = softening.terms<ForceReal>();
+    ForceReal xi[TARGET_BLOCK], yi[TARGET_BLOCK];
+    Real ax[TARGET_BLOCK], ay[TARGET_BLOCK], phi[TARGET_BLOCK];
+    
+    for (size_t blockBegin = begin; blockBegin < end; blockBegin += TARGET_BLOCK) {
+        const size_t count = std::min(TARGET_BLOCK, end - blockBegin);
+        for (size_t k = 0; k < count; ++k) {
+            const size_t i = targets(blockBegin + k);
+            xi[k] = sources.x[i];
+            yi[k] = sources.y[i];
+            ax[k] = 0;
+            ay[k] = 0;
+            phi[k] = 0;
+        }
+        
+        accumulateTiled(tile, sources, xi, yi, count, terms, ax, ay, out.potential ? phi : nullptr);
+        
+        for (size_t k = 0; k < count; ++k) {
+            const size_t i = targets(blockBegin + k);
+            out.ax[i] = G * ax[k];
+            out.ay[i] = G * ay[k];
+            if (out.potential) out.potential[i] = G * phi[k];
+        }
+    }
+}
+
+} // namespace
+
+SimdLevel detectSimdLevel() {
+    static const SimdLevel level = [] {
+#if ASTRO_X86 && (defined(__GNUC__) || defined(__clang__))
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f")) return SimdLevel::Avx512;
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return SimdLevel::Avx2;
+        return SimdLevel::Scalar;
+#elif ASTRO_X86 && defined(_MSC_VER)
+        int info[4];
+        __cpuid(info, 0);
+        if (info[0] < 7) return SimdLevel::Scalar;
+        __cpuid(info, 1);
+        const bool fma = (info[2] & (1 << 12)) != 0;
+        const bool osxsave = (info[2] & (1 << 27)) != 0;
+        if (!osxsave) return SimdLevel::Scalar;
+        const unsigned long long xcr0 = _xgetbv(0);
+        __cpuidex(info, 7, 0);
+        const bool avx2 = (info[1] & (1 << 5)) != 0;
+        const bool avx512f = (info[1] & (1 << 16)) != 0;
+        if (avx512f && (xcr0 & 0xE6) == 0xE6) return SimdLevel::Avx512;
+        if (avx2 && fma && (xcr0 & 0x6) == 0x6) return SimdLevel::Avx2;
+        return SimdLevel::Scalar;
+#elif ASTRO_NEON
+        return SimdLevel::Neon;
+#else
+        return SimdLevel::Scalar;
+#endif
+    }();
+    return level;
+}
+
+const char* simdLevelName(SimdLevel level) {
+    switch (level) {
+        case SimdLevel::Avx512: return "AVX-512";
+        case SimdLevel::Avx2:   return "AVX2";
+        case SimdLevel::Neon:   return "NEON";
+        case SimdLevel::Scalar:
+        default:                return "Scalar";
+    }
+}
+
+void directAccelerations(const SourceSpan& sources, const TargetSpan& targets,
+                         size_t begin, size_t end, const AccelerationSpan& out,
+                         Real G, const Softening& softening) {
+    runTiled(tileFunctionFor(detectSimdLevel(), softening.kernel, out.potential != nullptr),
+             sources, targets, begin, end, out, G, softening);
+}
+
+void directAccelerations(SimdLevel level, const SourceSpan& sources, const TargetSpan& targets,
+                         size_t begin, size_t end, const AccelerationSpan& out,
+                         Real G, const Softening& softening) {
+    TileFunction tile = tileFunctionFor(isSupported(level) ? level : SimdLevel::Scalar, softening.kernel,
+                                        out.potential != nullptr);
+    runTiled(tile, sources, targets, begin, end, out, G, softening);
+}
+
+void accumulateAccelerations(const SourceSpan& sources, const ForceReal* x, const ForceReal* y, size_t count,
+                             const Softening& softening, Real* ax, Real* ay, Real* phi) {
+    accumulateTiled(tileFunctionFor(detectSimdLevel(), softening.kernel, phi != nullptr), sources, x, y, count,
+                    softening.terms<ForceReal>(), ax, ay, phi);
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include "ParticleStore.h"
+#include "Interaction.h"
+
+#include <cstddef>
+
+// Direct-sum gravity kernel: a_i = G * sum_j m_j f(r_ij) r_ij for the targets
+// [begin, end) of a TargetSpan, with every body as a source, where f is the
+// softening kernel (Interaction.h; (|r_ij|^2 + eps^2)^-1.5 for Plummer).
+//
+// The source loop is tiled so each tile of x, y and m stays in L1 while a
+// block of targets sweeps over it. The inner loop is vectorised with AVX2,
+// AVX-512 or NEON when the CPU supports it (selected once at runtime), using
+// a reciprocal square-root estimate refined by Newton-Raphson (an exact square
+// root in double builds). Pairs at zero separation (the self-interaction) are
+// masked out instead of branched on.
+//
+// Pairs are computed in ForceReal and summed into Real accelerations
+// (Precision.h); mixed builds keep float pairs at full SIMD width and add each
+// tile's float sum into double.
+
+enum class SimdLevel {
+    Scalar,
+    Neon,
+    Avx2,
+    Avx512
+};
+
+// Best instruction set available on this CPU
+SimdLevel detectSimdLevel();
+
+const char* simdLevelName(SimdLevel level);
+
+void directAccelerations(const SourceSpan& sources, const TargetSpan& targets,
+                         size_t begin, size_t end, const AccelerationSpan& out,
+                         Real G, const Softening& softening);
+
+// Same as above, but forces a specific code path (used to compare kernels).
+// Falls back to scalar if the level is not supported.
+void directAccelerations(SimdLevel level, const SourceSpan& sources, const TargetSpan& targets,
+                         size_t begin, size_t end, const AccelerationSpan& out,
+                         Real G, const Softening& softening);
+
+// Adds the acceleration from every body in sources, without the factor G, onto
+// count points at (x[k], y[k]), and their potential onto phi when it is given.
+// Used to evaluate tree interaction lists.
+void accumulateAccelerations(const SourceSpan& sources, const ForceReal* x, const ForceReal* y, size_t count,
+                             const Softening& softening, Real* ax, Real* ay, Real* phi = nullptr);
+
+// The bodies as the kernels read them: the arrays themselves when the state
+// and pair precisions agree, otherwise a converted copy kept in x, y and m
+inline SourceSpan sourceView(const BodySpan& bodies, ForceArray& x, ForceArray& y, ForceArray& m) {
+#ifdef ASTRO_PRECISION_MIXED
+    x.assign(bodies.x, bodies.x + bodies.count);
+    y.assign(bodies.y, bodies.y + bodies.count);
+    m.assign(bodies.m, bodies.m + bodies.count);
+    return SourceSpan{x.data(), y.data(), m.data(), bodies.count};
+#else
+    (void)x, (void)y, (void)m;
+    return bodies;
+#endif
+}
@@ -0,0 +1,731 @@
+#pragma once
+
+#include "SimulationCore.h"
+#include "Snapshot.h"
+#include "CommandLine.h"
+#include "Threading.h"
+
+// Only the C API is used; the deprecated C++ bindings warn under -Wextra
+#define OMPI_SKIP_MPICXX 1
+#define MPICH_SKIP_MPICXX 1
+#include <mpi.h>
+#include <nlohmann/json.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Domain-decomposed runs over MPI, for scenes that do not fit on one machine:
+//
+//   mpirun -n 16 astro_mpi --scenario cosmology.json --steps 1000 --checkpoint run.snap
+//
+// Every process runs a SimulationCore that holds only the bodies it owns.
+//
+// Ownership: the plane is cut along the Morton curve of the tree build
+// (Morton.h). Each process owns one contiguous run of keys. The cuts are
+// placed so every process carries the same share of the force time measured
+// since the last decomposition, so the domains follow the load as clusters
+// form. Decomposition runs every --domain-every steps.
+//
+// Forces: before every evaluation, each process walks a tree of its own
+// bodies against every other process's bounding box, with the Barnes-Hut
+// opening test. The cells that pass and the bodies of the leaves that do not
+// form the locally essential tree (LET) of that box, and are sent to the box's
+// owner. Each process then evaluates its bodies against its own bodies plus
+// the ghosts it received, with the scenario's force solver. Ghosts are
+// read-only point masses, rebuilt at every evaluation and never integrated.
+//
+// I/O: a JSON scenario or snapshot is loaded in equal id ranges, one per
+// process: each process generates or maps only its own bodies. Checkpoints
+// are ordinary snapshots, written collectively with MPI-IO, each process
+// writing its id range in place. A single process can resume them.
+//
+// Every force evaluation is collective, so the integrator must evaluate the
+// same number of times on every process; block time-stepping, which depends
+// on each process's bodies, is not supported.
+
+// MPI type of Real
+inline MPI_Datatype mpiReal() { return sizeof(Real) == sizeof(double) ? MPI_DOUBLE : MPI_FLOAT; }
+
+// A body as it travels between processes. Names follow the records in one
+// character block, nameBytes each.
+struct BodyRecord {
+    Real x, y, vx, vy, ax, ay, m;
+    PackedColor color;
+    uint32_t id;
+    uint32_t nameBytes;
+    uint8_t flags;  // SNAPSHOT_FIXED, SNAPSHOT_TRAIL
+};
+
+struct BodyBatch {
+    std::vector<BodyRecord> records;
+    std::string names;
+    
+    void clear() {
+        records.clear();
+        names.clear();
+    }
+    
+    void add(const ParticleStore& particles, size_t i) {
+        const ParticleInfo& meta = particles.info[i];
+        const uint8_t flags = (meta.fixed ? SNAPSHOT_FIXED : 0) | (meta.trail ? SNAPSHOT_TRAIL : 0);
+        records.push_back(BodyRecord{particles.x[i], particles.y[i], particles.vx[i], particles.vy[i],
+                                     particles.ax[i], particles.ay[i], particles.m[i], meta.color, meta.id,
+                                     static_cast<uint32_t>(meta.name.size()), flags});
+        names += meta.name;
+    }
+    
+    // Appends the batch's bodies to the store, ids and all
+    void appendTo(ParticleStore& particles) const {
+        const size_t first = particles.append(records.size());
+        size_t name = 0;
+        for (size_t k = 0; k < records.size(); ++k) {
+            const BodyRecord& r = records[k];
+            const size_t i = first + k;
+            particles.x[i] = r.x;
+            particles.y[i] = r.y;
+            particles.vx[i] = r.vx;
+            particles.vy[i] = r.vy;
+            particles.ax[i] = r.ax;
+            particles.ay[i] = r.ay;
+            particles.m[i] = r.m;
+            ParticleInfo& meta = particles.info[i];
+            meta.color = r.color;
+            meta.id = r.id;
+            meta.fixed = (r.flags & SNAPSHOT_FIXED) != 0;
+            meta.trail = (r.flags & SNAPSHOT_TRAIL) != 0;
+            meta.name.assign(names, name, r.nameBytes);
+            name += r.nameBytes;
+        }
+    }
+};
+
+// All-to-all exchange of bodies. The buffers are kept between calls.
+class BodyExchange {
+private:
+    MPI_Comm comm;
+    int ranks;
+    MPI_Datatype recordType;
+    std::vector<int> sendCounts, sendOffsets, recvCounts, recvOffsets;
+    std::vector<int> nameSendCounts, nameSendOffsets, nameRecvCounts, nameRecvOffsets;
+    BodyBatch sorted;
+    
+    static void offsetsOf(const std::vector<int>& counts, std::vector<int>& offsets) {
+        offsets.resize(counts.size());
+        int offset = 0;
+        for (size_t r = 0; r < counts.size(); ++r) {
+            offsets[r] = offset;
+            offset += counts[r];
+        }
+    }
+    
+public:
+    explicit BodyExchange(MPI_Comm comm) : comm(comm) {
+        MPI_Comm_size(comm, &ranks);
+        MPI_Type_contiguous(sizeof(BodyRecord), MPI_BYTE, &recordType);
+        MPI_Type_commit(&recordType);
+    }
+    
+    ~BodyExchange() { MPI_Type_free(&recordType); }
+    BodyExchange(const BodyExchange&) = delete;
+    BodyExchange& operator=(const BodyExchange&) = delete;
+    
+    // Sends record k of `out` to process dest[k] and returns what the others
+    // sent here, ordered by sender. Collective over the communicator.
+    void exchange(const BodyBatch& out, const std::vector<int>& dest, BodyBatch& in) {
+        sendCounts.assign(ranks, 0);
+        nameSendCounts.assign(ranks, 0);
+        for (size_t k = 0; k < out.records.size(); ++k) {
+            ++sendCounts[dest[k]];
+            nameSendCounts[dest[k]] += int(out.records[k].nameBytes);
+        }
+        offsetsOf(sendCounts, sendOffsets);
+        offsetsOf(nameSendCounts, nameSendOffsets);
+        
+        // Group the records and their names by destination
+        sorted.records.resize(out.records.size());
+        sorted.names.resize(out.names.size());
+        std::vector<int> next = sendOffsets, nextName = nameSendOffsets;
+        size_t name = 0;
+        for (size_t k = 0; k < out.records.size(); ++k) {
+            const BodyRecord& r = out.records[k];
+            sorted.records[next[dest[k]]++] = r;
+            sorted.names.replace(size_t(nextName[dest[k]]), r.nameBytes, out.names, name, r.nameBytes);
+            nextName[dest[k]] += int(r.nameBytes);
+            name += r.nameBytes;
+        }
+        
+        recvCounts.resize(ranks);
+        nameRecvCounts.resize(ranks);
+        MPI_Alltoall(sendCounts.data(), 1, MPI_INT, recvCounts.data(), 1, MPI_INT, comm);
+        MPI_Alltoall(nameSendCounts.data(), 1, MPI_INT, nameRecvCounts.data(), 1, MPI_INT, comm);
+        offsetsOf(recvCounts, recvOffsets);
+        offsetsOf(nameRecvCounts, nameRecvOffsets);
+        
+        in.records.resize(size_t(recvOffsets.back() + recvCounts.back()));
+        in.names.resize(size_t(nameRecvOffsets.back() + nameRecvCounts.back()));
+        MPI_Alltoallv(sorted.records.data(), sendCounts.data(), sendOffsets.data(), recordType,
+                      in.records.data(), recvCounts.data(), recvOffsets.data(), recordType, comm);
+        MPI_Alltoallv(sorted.names.data(), nameSendCounts.data(), nameSendOffsets.data(), MPI_CHAR,
+                      &in.names[0], nameRecvCounts.data(), nameRecvOffsets.data(), MPI_CHAR, comm);
+    }
+};
+
+// Wraps the force solver of one process: adds the locally essential trees
+// of the other processes' bodies as ghosts, then evaluates the local bodies
+// against local bodies and ghosts with the wrapped solver
+class DistributedForceSolver : public ForceSolver {
+private:
+    MPI_Comm comm;
+    int rank, ranks;
+    std::unique_ptr<ForceSolver> solver;
+    float theta;
+    
+    QuadTree localTree;  // Over this process's bodies, for the export walks
+    std::vector<Real> boxes;  // minX, minY, maxX, maxY of every process
+    std::vector<InteractionList> exports;  // LET for every other process
+    std::vector<int> sendCounts, sendOffsets, recvCounts, recvOffsets;
+    RealArray sendX, sendY, sendM;
+    RealArray x, y, m;  // Local bodies, then ghosts
+    std::vector<uint32_t> localTargets;
+    size_t ghosts = 0;
+    double computeMs = 0.0;  // Local work since takeComputeMs(), without waits
+    
+    using Clock = std::chrono::steady_clock;
+    static double msSince(Clock::time_point start) {
+        return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+    }
+    
+public:
+    DistributedForceSolver(MPI_Comm comm, std::unique_ptr<ForceSolver> solver, float theta)
+        : comm(comm), solver(std::move(solver)), theta(theta) {
+        MPI_Comm_rank(comm, &rank);
+        MPI_Comm_size(comm, &ranks);
+        boxes.resize(4 * size_t(ranks));
+        exports.resize(ranks);
+        sendCounts.resize(ranks);
+        recvCounts.resize(ranks);
+        sendOffsets.resize(ranks);
+        recvOffsets.resize(ranks);
+    }
+    
+    void computeAccelerations(const BodySpan& bodies, const TargetSpan& targets,
+                              const AccelerationSpan& out, Real G, const Softening& softening) override {
+        const size_t n = bodies.count;
+        auto start = Clock::now();
+        
+        // An empty box (min > max) receives nothing
+        Real box[4] = {1, 1, -1, -1};
+        if (n > 0) {
+            const BodyBounds local = bodyBounds(bodies);
+            box[0] = local.minX;
+            box[1] = local.minY;
+            box[2] = local.maxX;
+            box[3] = local.maxY;
+            localTree.update(bodies);
+        }
+        computeMs += msSince(start);
+        MPI_Allgather(box, 4, mpiReal(), boxes.data(), 4, mpiReal(), comm);
+        start = Clock::now();
+        
+        parallelFor(size_t(ranks), 1, [&](size_t begin, size_t end) {
+            for (size_t r = begin; r < end; ++r) {
+                exports[r].clear();
+                const Real* b = &boxes[4 * r];
+                if (int(r) == rank || n == 0 || b[0] > b[2]) continue;
+                localTree.buildInteractionList(ForceVector2(ForceReal(b[0]), ForceReal(b[1])),
+                                               ForceVector2(ForceReal(b[2]), ForceReal(b[3])),
+                                               exports[r], theta, softening);
+            }
+        });
+        size_t sent = 0;
+        for (int r = 0; r < ranks; ++r) {
+            sendOffsets[r] = int(sent);
+            sendCounts[r] = int(exports[r].count);
+            sent += exports[r].count;
+        }
+        sendX.resize(sent);
+        sendY.resize(sent);
+        sendM.resize(sent);
+        for (int r = 0; r < ranks; ++r) {
+            const InteractionList& list = exports[r];
+            std::copy(list.x.data(), list.x.data() + list.count, sendX.data() + sendOffsets[r]);
+            std::copy(list.y.data(), list.y.data() + list.count, sendY.data() + sendOffsets[r]);
+            std::copy(list.m.data(), list.m.data() + list.count, sendM.data() + sendOffsets[r]);
+        }
+        computeMs += msSince(start);
+        
+        MPI_Alltoall(sendCounts.data(), 1, MPI_INT, recvCounts.data(), 1, MPI_INT, comm);
+        size_t received = 0;
+        for (int r = 0; r < ranks; ++r) {
+            recvOffsets[r] = int(n + received);
+            received += size_t(recvCounts[r]);
+        }
+        if (received != ghosts) solver->reset();  // A different ghost set, so do not refit over it
+        ghosts = received;
+        x.resize(n + ghosts);
+        y.resize(n + ghosts);
+        m.resize(n + ghosts);
+        std::copy(bodies.x, bodies.x + n, x.data());
+        std::copy(bodies.y, bodies.y + n, y.data());
+        std::copy(bodies.m, bodies.m + n, m.data());
+        MPI_Alltoallv(sendX.data(), sendCounts.data(), sendOffsets.data(), mpiReal(),
+                      x.data(), recvCounts.data(), recvOffsets.data(), mpiReal(), comm);
+        MPI_Alltoallv(sendY.data(), sendCounts.data(), sendOffsets.data(), mpiReal(),
+                      y.data(), recvCounts.data(), recvOffsets.data(), mpiReal(), comm);
+        MPI_Alltoallv(sendM.data(), sendCounts.data(), sendOffsets.data(), mpiReal(),
+                      m.data(), recvCounts.data(), recvOffsets.data(), mpiReal(), comm);
+        
+        if (n == 0) return;
+        start = Clock::now();
+        TargetSpan local = targets;
+        if (targets.all()) {
+            if (localTargets.size() != n) {
+                localTargets.resize(n);
+                for (size_t i = 0; i < n; ++i) localTargets[i] = uint32_t(i);
+            }
+            local = TargetSpan{localTargets.data(), n};
+        }
+        solver->computeAccelerations(BodySpan{x.data(), y.data(), m.data(), n + ghosts}, local, out, G, softening);
+        computeMs += msSince(start);
+    }
+    
+    std::string name() const override {
+        return solver->name() + " on " + std::to_string(ranks) + " processes";
+    }
+    
+    const TreeStats* treeStats() const override { return solver->treeStats(); }
+    
+    bool providesPotential() const override { return solver->providesPotential(); }
+    
+    void reset() override {
+        solver->reset();
+        localTree.invalidate();
+    }
+    
+    // Ghosts received for the last evaluation
+    size_t ghostCount() const { return ghosts; }
+    
+    // Force time spent here since the last call, not counting time spent
+    // waiting on other processes
+    double takeComputeMs() {
+        const double ms = computeMs;
+        computeMs = 0.0;
+        return ms;
+    }
+};
+
+struct DistributedOptions {
+    std::string scenario;
+    uint64_t steps = 0;            // 0 = no step limit
+    double until = 0.0;            // 0 = no time limit
+    uint64_t outputEvery = 100;    // Steps between reports, 0 = only at the end
+    std::string checkpointPath;    // Snapshot rewritten at each checkpoint, optional
+    uint64_t checkpointEvery = 1000;  // Steps between checkpoints, 0 = only at the end
+    uint64_t domainEvery = 16;     // Steps between decompositions, 0 = only at the start
+    int threads = 0;               // Per process; 0 = ASTRO_THREADS or all hardware threads
+    bool pinThreads = defaultThreadPinning();
+};
+
+inline void printDistributedUsage(const char* program) {
+    std::cerr << "Usage: mpirun -n P " << program << " --scenario file (--steps N | --until T)"
+              << " [--output-every K] [--checkpoint file.snap] [--checkpoint-every K]"
+              << " [--domain-every K] [--threads N] [--pin-threads]" << std::endl;
+}
+
+inline bool parseDistributedOptions(int argc, char* argv[], DistributedOptions& options) {
+    int i = 1;
+    const auto invalid = [&](const char* option, const char* expected) {
+        std::cerr << "Invalid " << option << " \"" << argv[i] << "\" (" << expected << ")" << std::endl;
+        return false;
+    };
+    for (; i < argc; ++i) {
+        const std::string arg = argv[i];
+        const bool hasValue = i + 1 < argc;
+        if (arg == "--scenario" && hasValue) {
+            options.scenario = argv[++i];
+        } else if (arg == "--steps" && hasValue) {
+            if (!parseCount(argv[++i], options.steps)) return invalid("--steps", "a positive count such as 10000 or 10k");
+        } else if (arg == "--until" && hasValue) {
+            if (!parsePositive(argv[++i], options.until)) return invalid("--until", "a positive time");
+        } else if (arg == "--output-every" && hasValue) {
+            if (!parseWhole(argv[++i], options.outputEvery)) return invalid("--output-every", "a whole number of steps");
+        } else if (arg == "--checkpoint" && hasValue) {
+            options.checkpointPath = argv[++i];
+        } else if (arg == "--checkpoint-every" && hasValue) {
+            if (!parseWhole(argv[++i], options.checkpointEvery)) return invalid("--checkpoint-every", "a whole number of steps");
+        } else if (arg == "--domain-every" && hasValue) {
+            if (!parseWhole(argv[++i], options.domainEvery)) return invalid("--domain-every", "a whole number of steps");
+        } else if (arg == "--threads" && hasValue) {
+            options.threads = std::atoi(argv[++i]);
+        } else if (arg == "--pin-threads") {
+            options.pinThreads = true;
+        } else {
+            std::cerr << "Unknown or incomplete argument: " << arg << std::endl;
+            return false;
+        }
+    }
+    
+    // Every process would otherwise load the whole default scene
+    if (options.scenario.empty()) {
+        std::cerr << "A distributed run needs --scenario" << std::endl;
+        return false;
+    }
+    if (options.steps == 0 && options.until <= 0.0) {
+        std::cerr << "A distributed run needs --steps or --until" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+class DistributedRunner {
+private:
+    MPI_Comm comm;
+    int rank = 0, ranks = 1;
+    DistributedOptions options;
+    SimulationCore core;
+    DistributedForceSolver* solver = nullptr;  // Owned by core
+    BodyExchange exchange;
+    BodyBatch outgoing, incoming;
+    std::vector<int> dest;
+    std::vector<uint32_t> kept;
+    MortonSorter sorter;
+    std::vector<uint64_t> splitters;  // Process r owns keys [splitters[r - 1], splitters[r])
+    double imbalance = 1.0;  // Slowest process's force time over the mean, last interval
+    double referenceEnergy = std::numeric_limits<double>::quiet_NaN();  // Total energy of the first report
+    
+    bool finished() const {
+        if (options.steps > 0 && core.getStepCount() >= options.steps) return true;
+        return options.until > 0.0 && core.getTime() + 0.5 * core.getConstants().DT >= options.until;
+    }
+    
+    bool everywhere(bool ok) const {
+        int local = ok ? 1 : 0, all = 0;
+        MPI_Allreduce(&local, &all, 1, MPI_INT, MPI_MIN, comm);
+        return all == 1;
+    }
+    
+    uint64_t globalCount() const {
+        uint64_t local = core.getParticles().size(), total = 0;
+        MPI_Allreduce(&local, &total, 1, MPI_UINT64_T, MPI_SUM, comm);
+        return total;
+    }
+    
+    // Sends body i to process dest[i]
+    void migrate() {
+        ParticleStore& particles = core.getParticles();
+        outgoing.clear();
+        kept.clear();
+        std::vector<int> outgoingDest;
+        for (size_t i = 0; i < particles.size(); ++i) {
+            if (dest[i] == rank) {
+                kept.push_back(uint32_t(i));
+            } else {
+                outgoing.add(particles, i);
+                outgoingDest.push_back(dest[i]);
+            }
+        }
+        exchange.exchange(outgoing, outgoingDest, incoming);
+        particles.permute(kept);
+        incoming.appendTo(particles);
+        core.adoptParticles();
+    }
+    
+    // Cuts the Morton curve over all bodies into runs of equal measured cost
+    // and hands every body to the owner of its run
+    void decompose() {
+        ParticleStore& particles = core.getParticles();
+        const size_t n = particles.size();
+        
+        // Common square over every process's bodies
+        Real box[4] = {std::numeric_limits<Real>::max(), std::numeric_limits<Real>::max(),
+                       std::numeric_limits<Real>::max(), std::numeric_limits<Real>::max()};
+        if (n > 0) {
+            const BodyBounds local = bodyBounds(particles.bodies());
+            box[0] = local.minX;
+            box[1] = local.minY;
+            box[2] = -local.maxX;
+            box[3] = -local.maxY;
+        }
+        Real common[4];
+        MPI_Allreduce(box, common, 4, mpiReal(), MPI_MIN, comm);
+        const Real size = std::max(-common[2] - common[0], -common[3] - common[1]);
+        sorter.sort(particles.bodies(), common[0], common[1], size);
+        const std::vector<uint64_t>& keys = sorter.keys();
+        
+        // Every body here is charged an equal part of this process's force
+        // time; before any time is measured, bodies are counted instead
+        const double measured = solver->takeComputeMs();
+        double stats[2] = {measured, -measured}, extremes[2];
+        MPI_Allreduce(stats, extremes, 2, MPI_DOUBLE, MPI_MAX, comm);
+        double totalMs = 0.0;
+        MPI_Allreduce(&measured, &totalMs, 1, MPI_DOUBLE, MPI_SUM, comm);
+        const bool timed = -extremes[1] > 0.0;  // Every process measured something
+        imbalance = totalMs > 0.0 ? extremes[0] * ranks / totalMs : 1.0;
+        const double weight = n == 0 ? 0.0 : timed ? measured / n : 1.0;
+        double total = 0.0;
+        const double localWeight = weight * n;
+        MPI_Allreduce(&localWeight, &total, 1, MPI_DOUBLE, MPI_SUM, comm);
+        
+        // Bisection on the key of every cut at once: the smallest key with
+        // at least r / ranks of the total weight below it
+        const size_t cuts = size_t(ranks - 1);
+        std::vector<uint64_t> lo(cuts, 0), hi(cuts, uint64_t(1) << MortonSorter::KEY_BITS);
+        std::vector<double> below(cuts), globalBelow(cuts);
+        while (cuts > 0 && lo != hi) {
+            for (size_t c = 0; c < cuts; ++c) {
+                const uint64_t mid = lo[c] + (hi[c] - lo[c]) / 2;
+                below[c] = weight * double(std::lower_bound(keys.begin(), keys.end(), mid) - keys.begin());
+            }
+            MPI_Allreduce(below.data(), globalBelow.data(), int(cuts), MPI_DOUBLE, MPI_SUM, comm);
+            for (size_t c = 0; c < cuts; ++c) {
+                const uint64_t mid = lo[c] + (hi[c] - lo[c]) / 2;
+                if (globalBelow[c] >= total * double(c + 1) / ranks) {
+                    hi[c] = mid;
+                } else {
+                    lo[c] = mid + 1;
+                }
+            }
+        }
+        splitters = lo;
+        
+        dest.resize(n);
+        const std::vector<uint32_t>& order = sorter.order();
+        for (size_t k = 0; k < n; ++k) {
+            dest[order[k]] = int(std::upper_bound(splitters.begin(), splitters.end(), keys[k]) - splitters.begin());
+        }
+        migrate();
+    }
+    
+    // Writes a snapshot in the format of Snapshot.h: bodies go to the
+    // process that owns their id range, which writes its part of every
+    // array and table in place
+    bool writeCheckpoint(const std::string& path) {
+        const ParticleStore& particles = core.getParticles();
+        const uint64_t total = globalCount();
+        const LoadShare share{rank, ranks};
+        const uint64_t first = share.begin(total);
+        const uint64_t count = share.end(total) - first;
+        
+        outgoing.clear();
+        dest.resize(particles.size());
+        for (size_t i = 0; i < particles.size(); ++i) {
+            outgoing.add(particles, i);
+            dest[i] = int(((uint64_t(particles.info[i].id) + 1) * ranks - 1) / total);
+        }
+        exchange.exchange(outgoing, dest, incoming);
+        
+        // Into id order
+        std::vector<const BodyRecord*> byId(count);
+        std::vector<size_t> nameAt(count);
+        size_t name = 0;
+        for (const BodyRecord& r : incoming.records) {
+            byId[r.id - first] = &r;
+            nameAt[r.id - first] = name;
+            name += r.nameBytes;
+        }
+        std::vector<Real> columns[SNAPSHOT_ARRAYS];
+        for (auto& column : columns) column.resize(count);
+        std::vector<uint32_t> colors(count), nameEnds(count);
+        std::vector<uint8_t> flags(count);
+        std::string names;
+        uint64_t localNames = incoming.names.size(), namesBefore = 0, totalNames = 0;
+        MPI_Exscan(&localNames, &namesBefore, 1, MPI_UINT64_T, MPI_SUM, comm);
+        if (rank == 0) namesBefore = 0;  // Exscan leaves rank 0 undefined
+        MPI_Allreduce(&localNames, &totalNames, 1, MPI_UINT64_T, MPI_SUM, comm);
+        for (size_t k = 0; k < count; ++k) {
+            const BodyRecord& r = *byId[k];
+            columns[SNAPSHOT_X][k] = r.x;
+            columns[SNAPSHOT_Y][k] = r.y;
+            columns[SNAPSHOT_VX][k] = r.vx;
+            columns[SNAPSHOT_VY][k] = r.vy;
+            columns[SNAPSHOT_M][k] = r.m;
+            colors[k] = r.color;
+            flags[k] = r.flags;
+            names.append(incoming.names, nameAt[k], r.nameBytes);
+            nameEnds[k] = uint32_t(namesBefore + names.size());
+        }
+        
+        SnapshotHeader header = snapshotHeader(total, core.getTime(), core.getStepCount());
+        const nlohmann::json metadata = {{"name", core.getScenarioName()}, {"settings", core.settings()}};
+        const std::string json = metadata.dump();
+        const uint64_t jsonBytes = json.size();
+        const uint64_t colorsOffset = header.metadataOffset + sizeof(jsonBytes) + jsonBytes;
+        const uint64_t flagsOffset = colorsOffset + total * sizeof(uint32_t);
+        const uint64_t nameEndsOffset = flagsOffset + total;
+        const uint64_t namesOffset = nameEndsOffset + total * sizeof(uint32_t);
+        header.metadataBytes = namesOffset + totalNames - header.metadataOffset;
+        
+        const std::string partial = path + ".partial";
+        MPI_File file;
+        if (!everywhere(MPI_File_open(comm, partial.c_str(), MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL,
+                                      &file) == MPI_SUCCESS)) {
+            if (rank == 0) std::cerr << "Could not write checkpoint: " << partial << std::endl;
+            return false;
+        }
+        bool ok = MPI_File_set_size(file, 0) == MPI_SUCCESS;
+        auto put = [&](uint64_t offset, const void* data, size_t items, MPI_Datatype type) {
+            ok = MPI_File_write_at_all(file, MPI_Offset(offset), data, int(items), type, MPI_STATUS_IGNORE) ==
+                     MPI_SUCCESS && ok;
+        };
+        if (rank == 0) {
+            ok = MPI_File_write_at(file, 0, &header, sizeof(header), MPI_BYTE, MPI_STATUS_IGNORE) == MPI_SUCCESS &&
+                 MPI_File_write_at(file, MPI_Offset(header.metadataOffset), &jsonBytes, sizeof(jsonBytes), MPI_BYTE,
+                                   MPI_STATUS_IGNORE) == MPI_SUCCESS &&
+                 MPI_File_write_at(file, MPI_Offset(header.metadataOffset + sizeof(jsonBytes)), json.data(),
+                                   int(jsonBytes), MPI_CHAR, MPI_STATUS_IGNORE) == MPI_SUCCESS && ok;
+        }
+        for (int a = 0; a < SNAPSHOT_ARRAYS; ++a) {
+            put(header.arrayOffset[a] + first * sizeof(Real), columns[a].data(), count, mpiReal());
+        }
+        put(colorsOffset + first * sizeof(uint32_t), colors.data(), count, MPI_UINT32_T);
+        put(flagsOffset + first, flags.data(), count, MPI_UINT8_T);
+        put(nameEndsOffset + first * sizeof(uint32_t), nameEnds.data(), count, MPI_UINT32_T);
+        put(namesOffset + namesBefore, names.data(), names.size(), MPI_CHAR);
+        ok = MPI_File_close(&file) == MPI_SUCCESS && ok;
+        
+        // Renamed over the target once complete, as HeadlessRunner does
+        ok = everywhere(ok);
+        if (ok && rank == 0 && std::rename(partial.c_str(), path.c_str()) != 0) ok = false;
+        MPI_Bcast(&ok, 1, MPI_CXX_BOOL, 0, comm);
+        if (!ok && rank == 0) std::cerr << "Could not write checkpoint: " << path << std::endl;
+        return ok;
+    }
+    
+    // The energies of every process (Diagnostics.h) add up to those of the
+    // whole run: each pair potential is split between its two bodies, with
+    // the ghosts standing in for the bodies of other processes
+    void report(double wallMs, uint64_t stepsSinceReport) {
+        if (!core.diagnosticsCurrent()) core.measureDiagnostics();
+        const Diagnostics& local = core.getDiagnostics();
+        const double sums[2] = {local.kinetic, local.potential};
+        double total[2];
+        MPI_Allreduce(sums, total, 2, MPI_DOUBLE, MPI_SUM, comm);
+        Diagnostics diagnostics = local;
+        diagnostics.kinetic = total[0];
+        diagnostics.potential = total[1];
+        uint64_t ghosts = solver->ghostCount(), totalGhosts = 0;
+        MPI_Reduce(&ghosts, &totalGhosts, 1, MPI_UINT64_T, MPI_SUM, 0, comm);
+        if (diagnostics.hasPotential()) {
+            if (std::isnan(referenceEnergy)) referenceEnergy = diagnostics.energy();
+            diagnostics.energyDrift = (diagnostics.energy() - referenceEnergy) / std::abs(referenceEnergy);
+        }
+        if (rank != 0) return;
+        std::cout << "step " << core.getStepCount()
+                  << "  t " << std::fixed << std::setprecision(4) << core.getTime()
+                  << "  KE " << std::scientific << std::setprecision(4) << diagnostics.kinetic;
+        if (diagnostics.hasPotential()) {
+            std::cout << "  E " << diagnostics.energy() << "  dE " << std::setprecision(2) << diagnostics.energyDrift
+                      << "  Q " << std::fixed << std::setprecision(3) << diagnostics.virialRatio();
+        }
+        std::cout << "  " << std::fixed << std::setprecision(3)
+                  << (stepsSinceReport > 0 ? wallMs / stepsSinceReport : 0.0) << " ms/step"
+                  << "  imbalance " << std::setprecision(2) << imbalance
+                  << "  ghosts " << totalGhosts << std::endl;
+        std::cout.unsetf(std::ios::floatfield);
+    }
+    
+public:
+    DistributedRunner(MPI_Comm comm, const DistributedOptions& options)
+        : comm(comm), options(options), exchange(comm) {
+        MPI_Comm_rank(comm, &rank);
+        MPI_Comm_size(comm, &ranks);
+    }
+    
+    int run() {
+        if (!everywhere(core.loadScenario(options.scenario, LoadShare{rank, ranks}))) {
+            return 1;
+        }
+        if (core.getIntegratorType() == IntegratorType::BlockTimestep) {
+            if (rank == 0) std::cerr << "Distributed runs do not support block time-stepping" << std::endl;
+            return 1;
+        }
+        if (core.getConstants().GRAVITY_SOURCES != GravitySources::All) {
+            if (rank == 0) std::cerr << "Distributed runs do not support gravity_sources \"fixed\"" << std::endl;
+            return 1;
+        }
+        if (core.getConstants().COLLISIONS) {
+            if (rank == 0) std::cerr << "Distributed runs do not support collisions" << std::endl;
+            return 1;
+        }
+        core.wrapForceSolver([&](std::unique_ptr<ForceSolver> local) {
+            auto wrapped = std::make_unique<DistributedForceSolver>(comm, std::move(local), core.getConstants().THETA);
+            solver = wrapped.get();
+            return wrapped;
+        });
+        decompose();
+        
+        const uint64_t total = globalCount();
+        if (rank == 0) {
+            std::cout << "Distributed run: " << total << " particles on " << ranks << " processes x "
+                      << maxThreads() << " threads, " << core.getIntegrator().name() << ", "
+                      << core.getForceSolver().name() << std::endl;
+        }
+        
+        using Clock = std::chrono::steady_clock;
+        const auto start = Clock::now();
+        const uint64_t firstStep = core.getStepCount();
+        auto lastReport = start;
+        uint64_t stepsSinceReport = 0;
+        
+        report(0.0, 0);
+        while (!finished()) {
+            if (options.outputEvery > 0 && (core.getStepCount() + 1) % options.outputEvery == 0) {
+                core.requestDiagnostics();
+            }
+            core.step();
+            ++stepsSinceReport;
+            if (options.domainEvery > 0 && core.getStepCount() % options.domainEvery == 0) {
+                decompose();
+            }
+            if (options.outputEvery > 0 && core.getStepCount() % options.outputEvery == 0) {
+                report(std::chrono::duration<double, std::milli>(Clock::now() - lastReport).count(), stepsSinceReport);
+                lastReport = Clock::now();
+                stepsSinceReport = 0;
+            }
+            if (!options.checkpointPath.empty() && options.checkpointEvery > 0 &&
+                core.getStepCount() % options.checkpointEvery == 0 && !writeCheckpoint(options.checkpointPath)) {
+                return 1;
+            }
+        }
+        if (stepsSinceReport > 0) {
+            report(std::chrono::duration<double, std::milli>(Clock::now() - lastReport).count(), stepsSinceReport);
+        }
+        if (!options.checkpointPath.empty() && !writeCheckpoint(options.checkpointPath)) {
+            return 1;
+        }
+        
+        const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        const uint64_t stepsRun = core.getStepCount() - firstStep;
+        if (rank == 0) {
+            std::cout << "Finished " << stepsRun << " steps in " << std::fixed << std::setprecision(2)
+                      << seconds << " s (" << std::setprecision(1)
+                      << (seconds > 0.0 ? stepsRun / seconds : 0.0) << " steps/s)" << std::endl;
+        }
+        return 0;
+    }
+};
+
+// Entry point of astro_mpi, between MPI_Init_thread() and MPI_Finalize().
+// Only the first process writes to std::cout.
+inline int runDistributed(MPI_Comm comm, int argc, char* argv[]) {
+    int rank = 0;
+    MPI_Comm_rank(comm, &rank);
+    DistributedOptions options;
+    if (!parseDistributedOptions(argc, argv, options)) {
+        if (rank == 0) printDistributedUsage(argv[0]);
+        return 2;
+    }
+    if (rank != 0) std::cout.setstate(std::ios::badbit);
+    configureThreadPool(options.threads, options.pinThreads);
+    DistributedRunner runner(comm, options);
+    return runner.run();
+}
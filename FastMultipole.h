@@ -0,0 +1,529 @@
+#pragma once
+
+#include "ParticleStore.h"
+#include "BarnesHut.h"
+#include "DirectKernel.h"
+#include "Threading.h"
+#include "Profiler.h"
+
+#include <SFML/System/Vector2.hpp>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+
+// Fast multipole method on the Barnes-Hut QuadTree.
+//
+// The softened kernel K(R) = (|R|^2 + eps^2)^-1/2 is not harmonic in the
+// plane, so instead of complex 2D expansions this uses Cartesian Taylor
+// series (as in Dehnen's falcON) of total order p in (x, y):
+//
+//   multipole  M_n = sum_j m_j d_j^n / n!          d_j = x_j - z_A
+//   local      L_k = sum_n (-1)^|n| M_n D_(n+k)(R)  R = z_B - z_A, |n + k| <= p
+//   field      Phi(z_B + y) = sum_k y^k / k! L_k,   a = G grad Phi
+//
+// with D_n = d^n K the derivative tensor, and the potential -G Phi, which
+// the leaves add to that of their direct pairs when it is asked for.
+// Expansions are centred on each cell's centre of mass, so the dipole
+// vanishes. Two cells interact through their expansions (M2L) when
+// (r_A + r_B) < theta |z_A - z_B|, with r the largest distance of a body
+// from its cell centre; otherwise the source is opened further, and what is
+// left at the leaves is summed body by body on the SIMD kernel.
+//
+// A compact softening kernel (Interaction.h) is exactly Newtonian beyond its
+// support h, so its expansions are those of K with eps = 0, and two cells
+// are only accepted when every pair between them is at least h apart:
+// r_A + r_B + h < |z_A - z_B|.
+//
+// Interaction lists are built level by level: a cell's candidates are the
+// children of its parent's near cells, so every cell on a level can be
+// processed in parallel once the level above is done.
+class FastMultipoleCalculator {
+public:
+    static constexpr int MAX_ORDER = 8;
+    static constexpr int DEFAULT_ORDER = 4;
+    static constexpr float DEFAULT_THETA = 0.6f;
+    static constexpr uint32_t DEFAULT_LEAF_CAPACITY = 64;
+    
+private:
+    static constexpr int MAX_COEFFICIENTS = (MAX_ORDER + 1) * (MAX_ORDER + 2) / 2;
+    static constexpr uint32_t NO_PARENT = QuadTreeNode::NO_CHILD;
+    
+    int order = DEFAULT_ORDER;
+    int coefficientCount = (DEFAULT_ORDER + 1) * (DEFAULT_ORDER + 2) / 2;
+    float theta = DEFAULT_THETA;  // Opening angle of the cell-cell acceptance test
+    ForceReal support = 0;        // Softening support radius of the current evaluation
+    
+    QuadTree tree;
+    TreeStats stats;
+    
+    // Per node, indexed like QuadTree::getNodes()
+    std::vector<double> multipoles, locals;    // coefficientCount entries per node
+    std::vector<ForceReal> radii;              // Largest body distance from the centre of mass
+    std::vector<uint32_t> parents;
+    std::vector<std::vector<uint32_t>> nearLists;  // Cells still too close to use expansions
+    
+    // Non-empty nodes by level, level l at levelNodes[levelStarts[l] .. levelStarts[l + 1])
+    std::vector<uint32_t> levelNodes;
+    std::vector<size_t> levelStarts;
+    
+    struct LeafScratch {
+        InteractionList list;
+        RealArray ax, ay, phi;
+        std::vector<uint32_t> stack;
+    };
+    std::vector<LeafScratch> scratch;
+    std::vector<uint8_t> wanted;  // Requested targets, by sorted position
+    
+    // Every pair of multi-indices (n, k) with |n| + |k| <= p, as coefficient
+    // indices of n, k and n + k. M2M, M2L and L2L are all sums over these
+    // pairs, so each is a single pass over the table.
+    struct ShiftTerm {
+        uint8_t outer, inner, sum;
+    };
+    
+    // D_t += coefficient * (2x)^xPower * (2y)^yPower * g_g
+    struct DerivativeTerm {
+        double coefficient;
+        uint8_t target, xPower, yPower, g;
+    };
+    
+    std::vector<ShiftTerm> shiftTerms;
+    std::vector<DerivativeTerm> derivativeTerms;
+    size_t directPairLimit = 0;  // Body pairs that cost about as much as one M2L
+    
+    // Coefficient of the multi-index (a, b), ordered by total degree
+    static int index(int a, int b) {
+        const int n = a + b;
+        return n * (n + 1) / 2 + b;
+    }
+    
+    static double factorial(int n) {
+        double f = 1.0;
+        for (int k = 2; k <= n; ++k) f *= k;
+        return f;
+    }
+    
+    void buildTables() {
+        const int p = order;
+        
+        // Outer index first, so consecutive terms accumulate into different
+        // coefficients and do not wait on each other
+        shiftTerms.clear();
+        for (int n = 0; n <= p; ++n) {
+            for (int nb = 0; nb <= n; ++nb) {
+                for (int k = 0; n + k <= p; ++k) {
+                    for (int kb = 0; kb <= k; ++kb) {
+                        shiftTerms.push_back({uint8_t(index(n - nb, nb)), uint8_t(index(k - kb, kb)),
+                                              uint8_t(index(n - nb + k - kb, nb + kb))});
+                    }
+                }
+            }
+        }
+        
+        // d^a/dx^a h(x^2) = sum_i a! / (i! (a - 2i)!) (2x)^(a - 2i) h^(a - i)(x^2),
+        // applied along x and then y to h(s) = s^-1/2
+        derivativeTerms.clear();
+        for (int a = 0; a <= p; ++a) {
+            for (int b = 0; a + b <= p; ++b) {
+                for (int i = 0; 2 * i <= a; ++i) {
+                    for (int j = 0; 2 * j <= b; ++j) {
+                        const double cx = factorial(a) / (factorial(i) * factorial(a - 2 * i));
+                        const double cy = factorial(b) / (factorial(j) * factorial(b - 2 * j));
+                        derivativeTerms.push_back({cx * cy, uint8_t(index(a, b)), uint8_t(a - 2 * i),
+                                                   uint8_t(b - 2 * j), uint8_t(a + b - i - j)});
+                    }
+                }
+            }
+        }
+        
+        // One M2L is a pass over each table; a SIMD body pair costs roughly
+        // a quarter of one table term
+        directPairLimit = 4 * (shiftTerms.size() + derivativeTerms.size());
+    }
+    
+    // u^a / a! for a = 0 .. p
+    static void scaledPowers(double u, int p, double* out) {
+        out[0] = 1.0;
+        for (int a = 1; a <= p; ++a) {
+            out[a] = out[a - 1] * u / a;
+        }
+    }
+    
+    // t^n / n! for every multi-index n, the shift operator of M2M and L2L
+    void shiftCoefficients(double tx, double ty, double* T) const {
+        double px[MAX_ORDER + 1], py[MAX_ORDER + 1];
+        scaledPowers(tx, order, px);
+        scaledPowers(ty, order, py);
+        for (int a = 0; a <= order; ++a) {
+            for (int b = 0; a + b <= order; ++b) {
+                T[index(a, b)] = px[a] * py[b];
+            }
+        }
+    }
+    
+    // D_(a,b) = d^a/dx^a d^b/dy^b (x^2 + y^2 + eps^2)^-1/2 for a + b <= p
+    void derivatives(double x, double y, double eps2, double* D) const {
+        const int p = order;
+        const double s = x * x + y * y + eps2;
+        
+        // g_k = d^k/ds^k s^-1/2
+        double g[MAX_ORDER + 1];
+        g[0] = 1.0 / std::sqrt(s);
+        const double inv = 1.0 / s;
+        for (int k = 1; k <= p; ++k) {
+            g[k] = g[k - 1] * -(k - 0.5) * inv;
+        }
+        
+        double px[MAX_ORDER + 1], py[MAX_ORDER + 1];
+        px[0] = py[0] = 1.0;
+        for (int a = 1; a <= p; ++a) {
+            px[a] = px[a - 1] * 2.0 * x;
+            py[a] = py[a - 1] * 2.0 * y;
+        }
+        
+        std::fill(D, D + coefficientCount, 0.0);
+        for (const DerivativeTerm& t : derivativeTerms) {
+            D[t.target] += t.coefficient * px[t.xPower] * py[t.yPower] * g[t.g];
+        }
+    }
+    
+    bool wellSeparated(const std::vector<QuadTreeNode>& nodes, uint32_t a, uint32_t b) const {
+        const ForceVector2 r = nodes[a].centerOfMass - nodes[b].centerOfMass;
+        const ForceReal reach = radii[a] + radii[b];
+        const ForceReal d2 = r.x * r.x + r.y * r.y;
+        if (support > 0 && (reach + support) * (reach + support) >= d2) return false;
+        return reach * reach < theta * theta * d2;
+    }
+    
+    // Breadth-first lists of the non-empty nodes, and each node's parent
+    void collectLevels(const std::vector<QuadTreeNode>& nodes) {
+        parents.assign(nodes.size(), NO_PARENT);
+        levelNodes.clear();
+        levelStarts.clear();
+        levelNodes.push_back(0);
+        levelStarts.push_back(0);
+        
+        size_t begin = 0;
+        while (begin < levelNodes.size()) {
+            const size_t end = levelNodes.size();
+            levelStarts.push_back(end);
+            for (size_t k = begin; k < end; ++k) {
+                const uint32_t n = levelNodes[k];
+                if (nodes[n].isLeaf()) continue;
+                for (int q = 0; q < QuadTree::NUM_CHILDREN; ++q) {
+                    const uint32_t child = nodes[n].firstChild + q;
+                    if (nodes[child].count > 0) {
+                        parents[child] = n;
+                        levelNodes.push_back(child);
+                    }
+                }
+            }
+            begin = end;
+        }
+        // The loop leaves an empty last level behind
+        if (levelStarts.size() > 1 && levelStarts[levelStarts.size() - 2] == levelNodes.size()) {
+            levelStarts.pop_back();
+        }
+    }
+    
+    // Multipoles and radii, deepest level first (P2M at leaves, M2M above)
+    void upwardPass(const std::vector<QuadTreeNode>& nodes, const SourceSpan& sorted) {
+        const int p = order;
+        const int nc = coefficientCount;
+        
+        for (size_t level = levelStarts.size() - 1; level-- > 0;) {
+            const size_t begin = levelStarts[level];
+            const size_t end = levelStarts[level + 1];
+            
+            parallelFor(end - begin, 16, [&](size_t first, size_t last) {
+                for (size_t k = begin + first; k < begin + last; ++k) {
+                    const uint32_t n = levelNodes[k];
+                    const QuadTreeNode& node = nodes[n];
+                    double* M = multipoles.data() + size_t(n) * nc;
+                    std::fill(M, M + nc, 0.0);
+                    ForceReal radius = 0;
+                    
+                    if (node.isLeaf()) {
+                        double px[MAX_ORDER + 1], py[MAX_ORDER + 1];
+                        for (uint32_t j = node.begin; j < node.begin + node.count; ++j) {
+                            const double dx = sorted.x[j] - node.centerOfMass.x;
+                            const double dy = sorted.y[j] - node.centerOfMass.y;
+                            radius = std::max(radius, ForceReal(std::sqrt(dx * dx + dy * dy)));
+                            scaledPowers(dx, p, px);
+                            scaledPowers(dy, p, py);
+                            for (int a = 0; a <= p; ++a) {
+                                for (int b = 0; a + b <= p; ++b) {
+                                    M[index(a, b)] += sorted.m[j] * px[a] * py[b];
+                                }
+                            }
+                        }
+                    } else {
+                        double T[MAX_COEFFICIENTS];
+                        for (int q = 0; q < QuadTree::NUM_CHILDREN; ++q) {
+                            const uint32_t c = node.firstChild + q;
+                            if (nodes[c].count == 0) continue;
+                            
+                            const double tx = nodes[c].centerOfMass.x - node.centerOfMass.x;
+                            const double ty = nodes[c].centerOfMass.y - node.centerOfMass.y;
+                            radius = std::max(radius, ForceReal(std::sqrt(tx * tx + ty * ty)) + radii[c]);
+                            shiftCoefficients(tx, ty, T);
+                            
+                            // M_n += sum_(m <= n) Mc_m t^(n - m) / (n - m)!
+                            const double* Mc = multipoles.data() + size_t(c) * nc;
+                            for (const ShiftTerm& t : shiftTerms) {
+                                M[t.sum] += Mc[t.outer] * T[t.inner];
+                            }
+                        }
+                    }
+                    radii[n] = radius;
+                }
+            });
+        }
+    }
+    
+    // L_target += M2L(M_source)
+    void multipoleToLocal(const std::vector<QuadTreeNode>& nodes, uint32_t source, uint32_t target,
+                          double eps2) {
+        const int nc = coefficientCount;
+        const ForceVector2 R = nodes[target].centerOfMass - nodes[source].centerOfMass;
+        double D[MAX_COEFFICIENTS];
+        derivatives(R.x, R.y, eps2, D);
+        
+        // (-1)^|n| M_n, so the sum below is a plain product
+        const double* M = multipoles.data() + size_t(source) * nc;
+        double signedM[MAX_COEFFICIENTS];
+        for (int n = 0; n <= order; ++n) {
+            const double sign = (n & 1) ? -1.0 : 1.0;
+            for (int i = index(n, 0); i <= index(0, n); ++i) {
+                signedM[i] = sign * M[i];
+            }
+        }
+        
+        double* L = locals.data() + size_t(target) * nc;
+        for (const ShiftTerm& t : shiftTerms) {
+            L[t.inner] += signedM[t.outer] * D[t.sum];
+        }
+    }
+    
+    // L_child = L2L(L_parent): L_j = sum_(k >= j) t^(k - j) / (k - j)! Lp_k
+    void localToLocal(const std::vector<QuadTreeNode>& nodes, uint32_t parent, uint32_t child) {
+        const int nc = coefficientCount;
+        double T[MAX_COEFFICIENTS];
+        shiftCoefficients(nodes[child].centerOfMass.x - nodes[parent].centerOfMass.x,
+                          nodes[child].centerOfMass.y - nodes[parent].centerOfMass.y, T);
+        
+        const double* Lp = locals.data() + size_t(parent) * nc;
+        double* L = locals.data() + size_t(child) * nc;
+        for (const ShiftTerm& t : shiftTerms) {
+            L[t.inner] += T[t.outer] * Lp[t.sum];
+        }
+    }
+    
+    // grad Phi, and Phi itself, at a point offset (dx, dy) from the cell centre
+    void localToPoint(const double* L, double dx, double dy, double& gx, double& gy, double& phi) const {
+        const int p = order;
+        double px[MAX_ORDER + 1], py[MAX_ORDER + 1];
+        scaledPowers(dx, p, px);
+        scaledPowers(dy, p, py);
+        gx = 0.0;
+        gy = 0.0;
+        phi = 0.0;
+        for (int a = 0; a <= p; ++a) {
+            for (int b = 0; a + b <= p; ++b) {
+                const double l = L[index(a, b)];
+                if (a > 0) gx += px[a - 1] * py[b] * l;
+                if (b > 0) gy += px[a] * py[b - 1] * l;
+                phi += px[a] * py[b] * l;
+            }
+        }
+    }
+    
+    // Resolves a leaf's remaining near cells into expansions and bodies,
+    // then evaluates the leaf's bodies. Cells small enough that their body
+    // pairs are cheaper than an M2L are summed directly; a cell's bodies are
+    // contiguous in the sorted arrays, leaf or not.
+    void evaluateLeaf(const std::vector<QuadTreeNode>& nodes, const SourceSpan& sorted, uint32_t leaf,
+                      LeafScratch& local, bool all, const AccelerationSpan& out,
+                      Real G, const Softening& softening) {
+        const QuadTreeNode& node = nodes[leaf];
+        const double eps2 = softening.offset2();
+        
+        local.list.clear();
+        local.stack.assign(nearLists[leaf].begin(), nearLists[leaf].end());
+        while (!local.stack.empty()) {
+            const uint32_t a = local.stack.back();
+            local.stack.pop_back();
+            const bool direct = size_t(nodes[a].count) * node.count <= directPairLimit;
+            if (!direct && wellSeparated(nodes, a, leaf)) {
+                multipoleToLocal(nodes, a, leaf, eps2);
+            } else if (direct || nodes[a].isLeaf()) {
+                local.list.append(sorted.x + nodes[a].begin, sorted.y + nodes[a].begin,
+                                  sorted.m + nodes[a].begin, nodes[a].count);
+            } else {
+                for (int q = 0; q < QuadTree::NUM_CHILDREN; ++q) {
+                    if (nodes[nodes[a].firstChild + q].count > 0) {
+                        local.stack.push_back(nodes[a].firstChild + q);
+                    }
+                }
+            }
+        }
+        
+        if (!all) {
+            bool any = false;
+            for (uint32_t k = node.begin; k < node.begin + node.count && !any; ++k) {
+                any = wanted[k] != 0;
+            }
+            if (!any) return;
+        }
+        
+        local.ax.resize(std::max<size_t>(local.ax.size(), node.count));
+        local.ay.resize(local.ax.size());
+        std::fill(local.ax.begin(), local.ax.begin() + node.count, Real(0));
+        std::fill(local.ay.begin(), local.ay.begin() + node.count, Real(0));
+        Real* nearPhi = nullptr;
+        if (out.potential) {
+            local.phi.resize(local.ax.size());
+            std::fill(local.phi.begin(), local.phi.begin() + node.count, Real(0));
+            nearPhi = local.phi.data();
+        }
+        accumulateAccelerations(local.list.span(), sorted.x + node.begin, sorted.y + node.begin, node.count,
+                                softening, local.ax.data(), local.ay.data(), nearPhi);
+        
+        const double* L = locals.data() + size_t(leaf) * coefficientCount;
+        for (uint32_t m = 0; m < node.count; ++m) {
+            const uint32_t k = node.begin + m;
+            if (!all && !wanted[k]) continue;
+            double gx, gy, farPhi;
+            localToPoint(L, sorted.x[k] - node.centerOfMass.x, sorted.y[k] - node.centerOfMass.y, gx, gy, farPhi);
+            const uint32_t i = tree.bodyAt(k);
+            out.ax[i] = G * Real(local.ax[m] + gx);
+            out.ay[i] = G * Real(local.ay[m] + gy);
+            if (nearPhi) out.potential[i] = G * Real(nearPhi[m] - farPhi);
+        }
+    }
+    
+    // Locals and interaction lists, root level first
+    void downwardPass(const std::vector<QuadTreeNode>& nodes, const SourceSpan& sorted, bool all,
+                      const AccelerationSpan& out, Real G, const Softening& softening) {
+        const double eps2 = softening.offset2();
+        const int nc = coefficientCount;
+        
+        for (size_t level = 0; level + 1 < levelStarts.size(); ++level) {
+            const size_t begin = levelStarts[level];
+            const size_t end = levelStarts[level + 1];
+            
+            parallelFor(end - begin, 8, [&](size_t first, size_t last) {
+                LeafScratch& local = scratch[threadIndex()];
+                
+                for (size_t k = begin + first; k < begin + last; ++k) {
+                    const uint32_t n = levelNodes[k];
+                    const uint32_t parent = parents[n];
+                    std::fill(locals.begin() + size_t(n) * nc, locals.begin() + size_t(n + 1) * nc, 0.0);
+                    
+                    std::vector<uint32_t>& near = nearLists[n];
+                    near.clear();
+                    
+                    auto consider = [&](uint32_t a) {
+                        if (wellSeparated(nodes, a, n)) {
+                            multipoleToLocal(nodes, a, n, eps2);
+                        } else {
+                            near.push_back(a);
+                        }
+                    };
+                    
+                    if (parent == NO_PARENT) {
+                        near.push_back(n);
+                    } else {
+                        localToLocal(nodes, parent, n);
+                        for (uint32_t a : nearLists[parent]) {
+                            if (nodes[a].isLeaf()) {
+                                consider(a);
+                                continue;
+                            }
+                            for (int q = 0; q < QuadTree::NUM_CHILDREN; ++q) {
+                                const uint32_t c = nodes[a].firstChild + q;
+                                if (nodes[c].count > 0) {
+                                    consider(c);
+                                }
+                            }
+                        }
+                    }
+                    
+                    if (nodes[n].isLeaf()) {
+                        evaluateLeaf(nodes, sorted, n, local, all, out, G, softening);
+                    }
+                }
+            });
+        }
+    }
+    
+public:
+    FastMultipoleCalculator() {
+        tree.setLeafCapacity(DEFAULT_LEAF_CAPACITY);
+        buildTables();
+    }
+    
+    void setTheta(float t) { theta = t; }
+    void setLeafCapacity(uint32_t capacity) { tree.setLeafCapacity(capacity); }
+    void setRefitPolicy(uint32_t interval, float growth) { tree.setRefitPolicy(interval, growth); }
+    void invalidate() { tree.invalidate(); }
+    
+    void setOrder(int p) {
+        order = std::clamp(p, 1, MAX_ORDER);
+        coefficientCount = (order + 1) * (order + 2) / 2;
+        buildTables();
+    }
+    
+    int getOrder() const { return order; }
+    const TreeStats& getStats() const { return stats; }
+    
+    // Builds (or refits) the tree, computes the expansions from all bodies and
+    // evaluates the targets
+    void computeAccelerations(const BodySpan& particles, const TargetSpan& targets,
+                              const AccelerationSpan& out, Real G, const Softening& softening) {
+        if (particles.count == 0) return;
+        support = ForceReal(softening.support());
+        
+        auto buildStart = std::chrono::steady_clock::now();
+        tree.update(particles);
+        
+        const std::vector<QuadTreeNode>& nodes = tree.getNodes();
+        const SourceSpan sorted = tree.sortedBodies();
+        multipoles.resize(nodes.size() * coefficientCount);
+        locals.resize(nodes.size() * coefficientCount);
+        radii.resize(nodes.size());
+        if (nearLists.size() < nodes.size()) {
+            nearLists.resize(nodes.size());
+        }
+        collectLevels(nodes);
+        {
+            PROFILE_SCOPE(ProfilePhase::CenterOfMass);  // Multipole moments
+            upwardPass(nodes, sorted);
+        }
+        
+        stats.buildMs = std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - buildStart).count();
+        stats.nodeCount = nodes.size();
+        stats.groupCount = 0;
+        stats.refitsSinceBuild = tree.getRefitsSinceBuild();
+        stats.arenaBytes = tree.arenaBytes() +
+                           (multipoles.capacity() + locals.capacity()) * sizeof(double) +
+                           radii.capacity() * sizeof(ForceReal) + parents.capacity() * sizeof(uint32_t);
+        
+        const bool all = targets.all();
+        if (!all) {
+            wanted.assign(particles.count, 0);
+            for (size_t k = 0; k < targets.count; ++k) {
+                wanted[tree.rankOf(targets(k))] = 1;
+            }
+        }
+        if (scratch.size() < size_t(maxThreads())) {
+            scratch.resize(maxThreads());
+        }
+        
+        PROFILE_SCOPE(ProfilePhase::ForceWalk);
+        downwardPass(nodes, sorted, all, out, G, softening);
+    }
+};
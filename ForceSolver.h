@@ -0,0 +1,602 @@
+#pragma once
+
+#include "ParticleStore.h"
+#include "BarnesHut.h"
+#include "FastMultipole.h"
+#include "DirectKernel.h"
+#include "GpuKernels.h"
+#include "Profiler.h"
+#include "Threading.h"
+
+#include <SFML/System/Vector2.hpp>
+#include <vector>
+#include <memory>
+#include <string>
+#include <iostream>
+#include <algorithm>
+#include <cmath>
+#include <type_traits>
+
+// Available force solvers. Auto switches between direct summation and
+// Barnes-Hut depending on the particle count. Gpu needs a build with
+// -DASTRO_ENABLE_GPU=ON and falls back to Auto otherwise.
+enum class ForceSolverType {
+    Direct,
+    BarnesHut,
+    FastMultipole,
+    Gpu,
+    Auto
+};
+
+// Abstract force solver: writes the gravitational acceleration of the target
+// bodies (all of them for a default TargetSpan) into caller-owned buffers, so
+// a steady-state evaluation does not allocate. Every body acts as a source.
+class ForceSolver {
+public:
+    virtual ~ForceSolver() = default;
+    virtual void computeAccelerations(const BodySpan& bodies, const TargetSpan& targets,
+                                      const AccelerationSpan& out, Real G, const Softening& softening) = 0;
+    virtual std::string name() const = 0;
+    
+    // Build statistics of the tree used by the last evaluation, if any
+    virtual const TreeStats* treeStats() const { return nullptr; }
+    
+    // Whether an evaluation fills AccelerationSpan::potential when it is set
+    virtual bool providesPotential() const { return false; }
+    
+    // Drops state kept between evaluations, such as a tree waiting to be
+    // refit. Call it when the bodies have been reordered.
+    virtual void reset() {}
+};
+
+// O(N^2) direct summation on the SIMD kernel in DirectKernel.h. Targets are
+// split into chunks that run in parallel; each chunk walks the sources tile
+// by tile.
+class DirectForceSolver : public ForceSolver {
+private:
+    static constexpr size_t CHUNK_SIZE = 256;
+    
+    ForceArray sourceX, sourceY, sourceM;  // Bodies in the pair precision, mixed builds only
+    
+public:
+    void computeAccelerations(const BodySpan& bodies, const TargetSpan& targets,
+                              const AccelerationSpan& out, Real G, const Softening& softening) override {
+        PROFILE_SCOPE(ProfilePhase::ForceWalk);
+        const SourceSpan sources = sourceView(bodies, sourceX, sourceY, sourceM);
+        parallelFor(targets.size(bodies.count), CHUNK_SIZE, [&](size_t begin, size_t end) {
+            directAccelerations(sources, targets, begin, end, out, G, softening);
+        });
+    }
+    
+    std::string name() const override {
+        return std::string("Direct [") + simdLevelName(detectSimdLevel()) + "]";
+    }
+    
+    bool providesPotential() const override { return true; }
+};
+
+// O(N log N) tree code backed by BarnesHutForceCalculator
+class BarnesHutForceSolver : public ForceSolver {
+private:
+    BarnesHutForceCalculator calculator;
+    
+public:
+    explicit BarnesHutForceSolver(float theta = 0.5f,
+                                  uint32_t leafCapacity = QuadTree::DEFAULT_LEAF_CAPACITY,
+                                  uint32_t groupCapacity = QuadTree::DEFAULT_GROUP_CAPACITY) {
+        calculator.setTheta(theta);
+        calculator.setLeafCapacity(leafCapacity);
+        calculator.setGroupCapacity(groupCapacity);
+    }
+    
+    void computeAccelerations(const BodySpan& bodies, const TargetSpan& targets,
+                              const AccelerationSpan& out, Real G, const Softening& softening) override {
+        calculator.computeAccelerations(bodies, targets, out, G, softening);
+    }
+    
+    // Evaluations between full tree builds (0 = always rebuild), and the leaf
+    // area growth at which a refit tree is rebuilt early
+    void setRefitPolicy(uint32_t interval, float growth) { calculator.setRefitPolicy(interval, growth); }
+    
+    std::string name() const override { return "Barnes-Hut"; }
+    
+    bool providesPotential() const override { return true; }
+    
+    const TreeStats* treeStats() const override { return &calculator.getStats(); }
+    
+    void reset() override { calculator.invalidate(); }
+};
+
+// O(N) fast multipole method backed by FastMultipoleCalculator. Its theta
+// compares the summed cell radii with the cell separation, so it is not
+// interchangeable with the Barnes-Hut opening angle.
+class FastMultipoleForceSolver : public ForceSolver {
+private:
+    FastMultipoleCalculator calculator;
+    
+public:
+    explicit FastMultipoleForceSolver(int order = FastMultipoleCalculator::DEFAULT_ORDER,
+                                      float theta = FastMultipoleCalculator::DEFAULT_THETA) {
+        calculator.setOrder(order);
+        calculator.setTheta(theta);
+    }
+    
+    void computeAccelerations(const BodySpan& bodies, const TargetSpan& targets,
+                              const AccelerationSpan& out, Real G, const Softening& softening) override {
+        calculator.computeAccelerations(bodies, targets, out, G, softening);
+    }
+    
+    void setRefitPolicy(uint32_t interval, float growth) { calculator.setRefitPolicy(interval, growth); }
+    
+    std::string name() const override { return "FMM (p=" + std::to_string(calculator.getOrder()) + ")"; }
+    
+    bool providesPotential() const override { return true; }
+    
+    const TreeStats* treeStats() const override { return &calculator.getStats(); }
+    
+    void reset() override { calculator.invalidate(); }
+};
+
+#ifdef ASTRO_ENABLE_GPU
+// Forces on a CUDA device (GpuKernels.h): tiled direct summation below
+// treeThreshold bodies, a walk of the host-built QuadTree above it. The
+// integrators run on the host, so positions are uploaded and accelerations
+// downloaded once per evaluation; device buffers are reused between them.
+// The device computes in float whatever the build's precision.
+class GpuForceSolver : public ForceSolver {
+private:
+    GpuDevice device;
+    QuadTree tree;
+    TreeStats stats;
+    float theta;
+    size_t treeThreshold;
+    bool usingTree = false;
+    
+    std::vector<GpuTreeNode> deviceNodes;  // Staging copy of the tree for upload
+    std::vector<uint32_t> targetList;
+    AlignedFloatArray ax, ay;  // Accelerations in target order
+    AlignedFloatArray hostX, hostY, hostM;  // Bodies converted to float for upload
+    
+    template <typename T>
+    void uploadBodies(const T* x, const T* y, const T* m, size_t n) {
+        if constexpr (std::is_same_v<T, float>) {
+            device.uploadBodies(x, y, m, n);
+        } else {
+            hostX.assign(x, x + n);
+            hostY.assign(y, y + n);
+            hostM.assign(m, m + n);
+            device.uploadBodies(hostX.data(), hostY.data(), hostM.data(), n);
+        }
+    }
+    
+public:
+    explicit GpuForceSolver(float theta = 0.5f, size_t treeThreshold = GpuDevice::DEFAULT_TREE_THRESHOLD,
+                            uint32_t leafCapacity = QuadTree::DEFAULT_LEAF_CAPACITY)
+        : theta(theta), treeThreshold(treeThreshold) {
+        tree.setLeafCapacity(leafCapacity);
+    }
+    
+    void computeAccelerations(const BodySpan& bodies, const TargetSpan& targets,
+                              const AccelerationSpan& out, Real G, const Softening& softening) override {
+        const size_t n = bodies.count;
+        if (n == 0) return;
+        const size_t targetCount = targets.size(n);
+        usingTree = n >= treeThreshold;
+        PROFILE_SCOPE(ProfilePhase::ForceWalk);  // Transfers and kernels; the tree build is its own phase
+        
+        if (usingTree) {
+            auto buildStart = std::chrono::steady_clock::now();
+            tree.update(bodies);
+            
+            const std::vector<QuadTreeNode>& nodes = tree.getNodes();
+            deviceNodes.resize(nodes.size());
+            parallelFor(nodes.size(), PARALLEL_GRAIN, [&](size_t begin, size_t end) {
+                for (size_t k = begin; k < end; ++k) {
+                    const QuadTreeNode& node = nodes[k];
+                    deviceNodes[k] = GpuTreeNode{float(node.centerOfMass.x), float(node.centerOfMass.y),
+                                                 float(node.totalMass), float(node.boundary.halfSize * 2),
+                                                 node.firstChild, node.begin, node.count, float(node.reach())};
+                }
+            });
+            stats.buildMs = std::chrono::duration<double, std::milli>(
+                std::chrono::steady_clock::now() - buildStart).count();
+            stats.nodeCount = nodes.size();
+            stats.arenaBytes = tree.arenaBytes();
+            stats.refitsSinceBuild = tree.getRefitsSinceBuild();
+            
+            // The walk runs on the sorted bodies, so targets become sorted positions
+            const SourceSpan sorted = tree.sortedBodies();
+            uploadBodies(sorted.x, sorted.y, sorted.m, n);
+            device.uploadTree(deviceNodes.data(), deviceNodes.size());
+            if (targets.all()) {
+                device.uploadTargets(nullptr, n);
+            } else {
+                targetList.resize(targetCount);
+                for (size_t k = 0; k < targetCount; ++k) {
+                    targetList[k] = tree.rankOf(targets(k));
+                }
+                device.uploadTargets(targetList.data(), targetCount);
+            }
+            device.treeAccelerations(theta, float(G), softening);
+        } else {
+            uploadBodies(bodies.x, bodies.y, bodies.m, n);
+            device.uploadTargets(targets.index, targetCount);
+            device.directAccelerations(float(G), softening);
+        }
+        
+        ax.resize(std::max(ax.size(), targetCount));
+        ay.resize(ax.size());
+        device.downloadAccelerations(ax.data(), ay.data());
+        
+        const bool sortedOrder = usingTree && targets.all();
+        parallelFor(targetCount, PARALLEL_GRAIN, [&](size_t begin, size_t end) {
+            for (size_t k = begin; k < end; ++k) {
+                const size_t i = sortedOrder ? tree.bodyAt(k) : targets(k);
+                out.ax[i] = ax[k];
+                out.ay[i] = ay[k];
+            }
+        });
+    }
+    
+    void setRefitPolicy(uint32_t interval, float growth) { tree.setRefitPolicy(interval, growth); }
+    
+    std::string name() const override {
+        return std::string(usingTree ? "GPU tree [" : "GPU direct [") + GpuDevice::deviceName() + "]";
+    }
+    
+    const TreeStats* treeStats() const override { return usingTree ? &stats : nullptr; }
+    
+    void reset() override { tree.invalidate(); }
+};
+#endif
+
+// Picks direct summation for small systems and Barnes-Hut above a threshold.
+// Measured at theta = 0.5 on uniform discs (one core, AVX-512 direct kernel,
+// group walk), the tree is faster from ~600 bodies (1000: 0.35 ms direct vs
+// 0.23 ms tree; 4096: 5.3 ms vs 1.1 ms). The default sits a little above
+// that so small hand-built systems keep exact forces for a negligible cost.
+class AutoForceSolver : public ForceSolver {
+public:
+    static constexpr size_t DEFAULT_THRESHOLD = 1000;
+    
+private:
+    DirectForceSolver direct;
+    BarnesHutForceSolver barnesHut;
+    size_t threshold;
+    bool usingTree = false;
+    
+public:
+    explicit AutoForceSolver(float theta = 0.5f, size_t threshold = DEFAULT_THRESHOLD,
+                             uint32_t leafCapacity = QuadTree::DEFAULT_LEAF_CAPACITY,
+                             uint32_t groupCapacity = QuadTree::DEFAULT_GROUP_CAPACITY)
+        : barnesHut(theta, leafCapacity, groupCapacity), threshold(threshold) {}
+    
+    void computeAccelerations(const BodySpan& bodies, const TargetSpan& targets,
+                              const AccelerationSpan& out, Real G, const Softening& softening) override {
+        usingTree = bodies.count >= threshold;
+        if (usingTree) {
+            barnesHut.computeAccelerations(bodies, targets, out, G, softening);
+        } else {
+            direct.computeAccelerations(bodies, targets, out, G, softening);
+        }
+    }
+    
+    std::string name() const override {
+        return "Auto (" + (usingTree ? barnesHut.name() : direct.name()) + ")";
+    }
+    
+    void setRefitPolicy(uint32_t interval, float growth) { barnesHut.setRefitPolicy(interval, growth); }
+    
+    const TreeStats* treeStats() const override {
+        return usingTree ? barnesHut.treeStats() : nullptr;
+    }
+    
+    bool providesPotential() const override { return true; }
+    
+    void reset() override { barnesHut.reset(); }
+};
+
+// Forces from a few given bodies only (GravitySources::Fixed): every target
+// feels the sources set with setSources() and nothing else, summed on the
+// direct kernel in O(N F) for F sources, with no tree at all. The sources
+// themselves get no acceleration. SimulationCore picks the fixed bodies and
+// keeps the list in step with the store, so this is not a ForceSolverType.
+class FixedSourceForceSolver : public ForceSolver {
+private:
+    static constexpr size_t CHUNK_SIZE = 256;
+    
+    std::vector<uint32_t> sources;  // Store indices of the attracting bodies
+    std::vector<uint8_t> isSource;  // By store index
+    ForceArray sourceX, sourceY, sourceM;
+    
+public:
+    // The attracting bodies of a store holding count bodies
+    void setSources(std::vector<uint32_t> indices, size_t count) {
+        isSource.assign(count, 0);
+        for (uint32_t i : indices) {
+            isSource[i] = 1;
+        }
+        sources = std::move(indices);
+        sourceX.resize(sources.size());
+        sourceY.resize(sources.size());
+        sourceM.resize(sources.size());
+    }
+    
+    size_t sourceCount() const { return sources.size(); }
+    size_t bodyCount() const { return isSource.size(); }
+    
+    void computeAccelerations(const BodySpan& bodies, const TargetSpan& targets,
+                              const AccelerationSpan& out, Real G, const Softening& softening) override {
+        PROFILE_SCOPE(ProfilePhase::ForceWalk);
+        for (size_t k = 0; k < sources.size(); ++k) {
+            sourceX[k] = ForceReal(bodies.x[sources[k]]);
+            sourceY[k] = ForceReal(bodies.y[sources[k]]);
+            sourceM[k] = ForceReal(bodies.m[sources[k]]);
+        }
+        const SourceSpan span{sourceX.data(), sourceY.data(), sourceM.data(), sources.size()};
+        
+        parallelFor(targets.size(bodies.count), CHUNK_SIZE, [&](size_t begin, size_t end) {
+            ForceReal x[CHUNK_SIZE], y[CHUNK_SIZE];
+            Real ax[CHUNK_SIZE], ay[CHUNK_SIZE], phi[CHUNK_SIZE];
+            for (size_t blockBegin = begin; blockBegin < end; blockBegin += CHUNK_SIZE) {
+                const size_t count = std::min(CHUNK_SIZE, end - blockBegin);
+                for (size_t k = 0; k < count; ++k) {
+                    const size_t i = targets(blockBegin + k);
+                    x[k] = ForceReal(bodies.x[i]);
+                    y[k] = ForceReal(bodies.y[i]);
+                    ax[k] = 0;
+                    ay[k] = 0;
+                    phi[k] = 0;
+                }
+                accumulateAccelerations(span, x, y, count, softening, ax, ay, out.potential ? phi : nullptr);
+                for (size_t k = 0; k < count; ++k) {
+                    const size_t i = targets(blockBegin + k);
+                    const bool source = i < isSource.size() && isSource[i];
+                    out.ax[i] = source ? 0 : G * ax[k];
+                    out.ay[i] = source ? 0 : G * ay[k];
+                    if (out.potential) out.potential[i] = source ? 0 : G * phi[k];
+                }
+            }
+        });
+    }
+    
+    std::string name() const override {
+        return "Fixed sources (" + std::to_string(sources.size()) + ")";
+    }
+    
+    bool providesPotential() const override { return true; }
+};
+
+// Forces on a store that ends in massless tracers: bodies [0, massiveCount)
+// have mass and the rest have none. The massive bodies go to the wrapped
+// solver on their own, so tracers never enter its tree or its pair loops,
+// and the tracers feel the massive bodies only. Up to treeThreshold massive
+// bodies they are summed on the direct kernel in O(M T); above it a tree of
+// the massive bodies is walked once per group of GROUP_SIZE consecutive
+// tracers, which the Morton reorder keeps close together. SimulationCore
+// keeps the store split and the solver bound to the one the settings chose.
+class TracerForceSolver : public ForceSolver {
+public:
+    static constexpr size_t DEFAULT_TREE_THRESHOLD = 1024;
+    
+private:
+    static constexpr size_t GROUP_SIZE = 64;
+    
+    ForceSolver* massive = nullptr;
+    size_t massiveCount = 0;
+    float theta;
+    size_t treeThreshold;
+    
+    QuadTree tree;  // Massive bodies only
+    TreeStats stats;
+    std::vector<InteractionList> lists;  // Per thread
+    ForceArray sourceX, sourceY, sourceM;
+    std::vector<uint32_t> massiveTargets, tracerTargets;
+    
+public:
+    explicit TracerForceSolver(float theta = 0.5f, size_t treeThreshold = DEFAULT_TREE_THRESHOLD,
+                               uint32_t leafCapacity = QuadTree::DEFAULT_LEAF_CAPACITY)
+        : theta(theta), treeThreshold(treeThreshold) {
+        tree.setLeafCapacity(leafCapacity);
+    }
+    
+    void setRefitPolicy(uint32_t interval, float growth) { tree.setRefitPolicy(interval, growth); }
+    
+    // Evaluates the first count bodies of the store with solver
+    void bind(ForceSolver& solver, size_t count) {
+        massive = &solver;
+        massiveCount = count;
+    }
+    
+    size_t massiveBodies() const { return massiveCount; }
+    bool walksTree() const { return massiveCount >= treeThreshold; }
+    
+    void computeAccelerations(const BodySpan& bodies, const TargetSpan& targets,
+                              const AccelerationSpan& out, Real G, const Softening& softening) override {
+        const size_t n = bodies.count;
+        const size_t split = std::min(massiveCount, n);
+        const BodySpan sources{bodies.x, bodies.y, bodies.m, split};
+        
+        const bool all = targets.all();
+        if (!all) {
+            massiveTargets.clear();
+            tracerTargets.clear();
+            for (size_t k = 0; k < targets.count; ++k) {
+                const uint32_t i = uint32_t(targets(k));
+                (i < split ? massiveTargets : tracerTargets).push_back(i);
+            }
+        }
+        if (split > 0 && (all || !massiveTargets.empty())) {
+            massive->computeAccelerations(sources, all ? TargetSpan{}
+                                                       : TargetSpan{massiveTargets.data(), massiveTargets.size()},
+                                          out, G, softening);
+        }
+        
+        const size_t tracerCount = all ? n - split : tracerTargets.size();
+        auto tracerAt = [&](size_t k) { return all ? split + k : size_t(tracerTargets[k]); };
+        if (tracerCount == 0) return;
+        if (split == 0) {
+            for (size_t k = 0; k < tracerCount; ++k) {
+                out.ax[tracerAt(k)] = 0;
+                out.ay[tracerAt(k)] = 0;
+                if (out.potential) out.potential[tracerAt(k)] = 0;
+            }
+            return;
+        }
+        
+        const bool usingTree = walksTree();
+        SourceSpan direct;
+        if (usingTree) {
+            auto buildStart = std::chrono::steady_clock::now();
+            tree.update(sources);
+            stats.buildMs = std::chrono::duration<double, std::milli>(
+                std::chrono::steady_clock::now() - buildStart).count();
+            stats.nodeCount = tree.nodeCount();
+            stats.arenaBytes = tree.arenaBytes();
+            stats.refitsSinceBuild = tree.getRefitsSinceBuild();
+            stats.groupCount = tree.groupCount();
+        } else {
+            direct = sourceView(sources, sourceX, sourceY, sourceM);
+        }
+        if (lists.size() < size_t(maxThreads())) {
+            lists.resize(maxThreads());
+        }
+        
+        PROFILE_SCOPE(ProfilePhase::ForceWalk);
+        parallelFor(tracerCount, 4 * GROUP_SIZE, [&](size_t begin, size_t end) {
+            InteractionList& list = lists[threadIndex()];
+            ForceReal x[GROUP_SIZE], y[GROUP_SIZE];
+            Real ax[GROUP_SIZE], ay[GROUP_SIZE], phi[GROUP_SIZE];
+            Real* groupPhi = out.potential ? phi : nullptr;
+            for (size_t groupBegin = begin; groupBegin < end; groupBegin += GROUP_SIZE) {
+                const size_t count = std::min(GROUP_SIZE, end - groupBegin);
+                for (size_t k = 0; k < count; ++k) {
+                    const size_t i = tracerAt(groupBegin + k);
+                    x[k] = ForceReal(bodies.x[i]);
+                    y[k] = ForceReal(bodies.y[i]);
+                    ax[k] = 0;
+                    ay[k] = 0;
+                    phi[k] = 0;
+                }
+                if (usingTree) {
+                    ForceVector2 lo(x[0], y[0]);
+                    ForceVector2 hi = lo;
+                    for (size_t k = 1; k < count; ++k) {
+                        lo.x = std::min(lo.x, x[k]);
+                        lo.y = std::min(lo.y, y[k]);
+                        hi.x = std::max(hi.x, x[k]);
+                        hi.y = std::max(hi.y, y[k]);
+                    }
+                    tree.buildInteractionList(lo, hi, list, theta, softening);
+                    accumulateAccelerations(list.span(), x, y, count, softening, ax, ay, groupPhi);
+                } else {
+                    accumulateAccelerations(direct, x, y, count, softening, ax, ay, groupPhi);
+                }
+                for (size_t k = 0; k < count; ++k) {
+                    const size_t i = tracerAt(groupBegin + k);
+                    out.ax[i] = G * ax[k];
+                    out.ay[i] = G * ay[k];
+                    if (groupPhi) out.potential[i] = G * phi[k];
+                }
+            }
+        });
+    }
+    
+    std::string name() const override {
+        const std::string field = walksTree() ? "tree" : "direct";
+        return (massive ? massive->name() : std::string("None")) + " + tracers (" + field + ")";
+    }
+    
+    const TreeStats* treeStats() const override {
+        if (const TreeStats* own = massive ? massive->treeStats() : nullptr) return own;
+        return walksTree() ? &stats : nullptr;
+    }
+    
+    bool providesPotential() const override { return massive && massive->providesPotential(); }
+    
+    void reset() override {
+        tree.invalidate();
+        if (massive) massive->reset();
+    }
+};
+
+inline std::unique_ptr<ForceSolver> createForceSolver(ForceSolverType type, float theta,
+                                                     size_t autoThreshold,
+                                                     uint32_t leafCapacity = QuadTree::DEFAULT_LEAF_CAPACITY,
+                                                     uint32_t groupCapacity = QuadTree::DEFAULT_GROUP_CAPACITY,
+                                                     int fmmOrder = FastMultipoleCalculator::DEFAULT_ORDER,
+                                                     float fmmTheta = FastMultipoleCalculator::DEFAULT_THETA,
+                                                     uint32_t rebuildInterval = QuadTree::DEFAULT_REBUILD_INTERVAL,
+                                                     float refitGrowth = QuadTree::DEFAULT_REFIT_GROWTH,
+                                                     size_t gpuTreeThreshold = GpuDevice::DEFAULT_TREE_THRESHOLD) {
+    switch (type) {
+        case ForceSolverType::Direct:
+            return std::make_unique<DirectForceSolver>();
+        case ForceSolverType::BarnesHut: {
+            auto solver = std::make_unique<BarnesHutForceSolver>(theta, leafCapacity, groupCapacity);
+            solver->setRefitPolicy(rebuildInterval, refitGrowth);
+            return solver;
+        }
+        case ForceSolverType::FastMultipole: {
+            auto solver = std::make_unique<FastMultipoleForceSolver>(fmmOrder, fmmTheta);
+            solver->setRefitPolicy(rebuildInterval, refitGrowth);
+            return solver;
+        }
+        case ForceSolverType::Gpu:
+#ifdef ASTRO_ENABLE_GPU
+            if (GpuDevice::available()) {
+                auto solver = std::make_unique<GpuForceSolver>(theta, gpuTreeThreshold, leafCapacity);
+                solver->setRefitPolicy(rebuildInterval, refitGrowth);
+                return solver;
+            }
+            std::cerr << "No CUDA device found, using the auto force solver" << std::endl;
+#else
+            (void)gpuTreeThreshold;
+            std::cerr << "Built without ASTRO_ENABLE_GPU, using the auto force solver" << std::endl;
+#endif
+            [[fallthrough]];
+        case ForceSolverType::Auto:
+        default: {
+            auto solver = std::make_unique<AutoForceSolver>(theta, autoThreshold, leafCapacity, groupCapacity);
+            solver->setRefitPolicy(rebuildInterval, refitGrowth);
+            return solver;
+        }
+    }
+}
+
+// Parses the "force_solver" scenario setting; unknown names keep the fallback
+inline ForceSolverType parseForceSolverType(const std::string& name, ForceSolverType fallback) {
+    if (name == "direct") return ForceSolverType::Direct;
+    if (name == "barnes_hut" || name == "barnes-hut" || name == "tree") return ForceSolverType::BarnesHut;
+    if (name == "fmm" || name == "fast_multipole") return ForceSolverType::FastMultipole;
+    if (name == "gpu") return ForceSolverType::Gpu;
+    if (name == "auto") return ForceSolverType::Auto;
+    return fallback;
+}
+
+// Setting name of a solver type, as parseForceSolverType reads it back
+inline const char* forceSolverTypeName(ForceSolverType type) {
+    switch (type) {
+        case ForceSolverType::Direct:        return "direct";
+        case ForceSolverType::BarnesHut:     return "barnes_hut";
+        case ForceSolverType::FastMultipole: return "fmm";
+        case ForceSolverType::Gpu:           return "gpu";
+        case ForceSolverType::Auto:
+        default:                             return "auto";
+    }
+}
+
+inline ForceSolverType nextForceSolverType(ForceSolverType type) {
+    switch (type) {
+        case ForceSolverType::Direct:    return ForceSolverType::BarnesHut;
+        case ForceSolverType::BarnesHut: return ForceSolverType::FastMultipole;
+#ifdef ASTRO_ENABLE_GPU
+        case ForceSolverType::FastMultipole: return ForceSolverType::Gpu;
+        case ForceSolverType::Gpu: return ForceSolverType::Auto;
+#else
+        case ForceSolverType::FastMultipole: return ForceSolverType::Auto;
+#endif
+        case ForceSolverType::Auto:
+        default:                         return ForceSolverType::Direct;
+    }
+}
@@ -0,0 +1,233 @@
+#include "GpuKernels.h"
+
+#include <cuda_runtime.h>
+
+#include <stdexcept>
+#include <string>
+
+namespace {
+
+constexpr int BLOCK_SIZE = 256;                // Threads per block, and bodies per shared tile
+constexpr uint32_t NO_CHILD = 0xFFFFFFFFu;     // QuadTreeNode::NO_CHILD
+constexpr int MAX_STACK = 21 * 3 + 4 + 1;      // Same bound as the CPU walk (QuadTree::MAX_DEPTH = 21)
+
+void check(cudaError_t status, const char* what) {
+    if (status != cudaSuccess) {
+        throw std::runtime_error(std::string("CUDA ") + what + ": " + cudaGetErrorString(status));
+    }
+}
+
+// Device allocation that only grows
+template <typename T>
+struct DeviceArray {
+    T* data = nullptr;
+    size_t capacity = 0;
+    
+    ~DeviceArray() {
+        if (data) cudaFree(data);
+    }
+    
+    void reserve(size_t n) {
+        if (n <= capacity) return;
+        if (data) cudaFree(data);
+        data = nullptr;
+        check(cudaMalloc(&data, n * sizeof(T)), "cudaMalloc");
+        capacity = n;
+    }
+    
+    void upload(const T* host, size_t n) {
+        reserve(n);
+        if (n > 0) {
+            check(cudaMemcpy(data, host, n * sizeof(T), cudaMemcpyHostToDevice), "upload");
+        }
+    }
+};
+
+// One softened pair, without G, under the softening kernel (Interaction.h).
+// With zero softening the self-pair has r2 == 0 and is skipped rather than
+// turned into inf * 0.
+template <typename Kernel>
+__device__ inline void accumulate(float tx, float ty, float sx, float sy, float sm,
+                                  const KernelTerms<float>& terms, float& ax, float& ay) {
+    const float dx = sx - tx;
+    const float dy = sy - ty;
+    const float r2 = dx * dx + dy * dy + terms.eps2;
+    const float inv = r2 > 0.0f ? rsqrtf(r2) : 0.0f;
+    const float s = r2 > 0.0f ? sm * kernelFactor<Kernel>(r2, inv * inv * inv, terms) : 0.0f;
+    ax += dx * s;
+    ay += dy * s;
+}
+
+// One thread per target. The block loads BLOCK_SIZE sources at a time into
+// shared memory, so each source is read from global memory once per block
+// rather than once per target.
+template <typename Kernel>
+__global__ void directKernel(const float* __restrict__ x, const float* __restrict__ y,
+                             const float* __restrict__ m, uint32_t n,
+                             const uint32_t* __restrict__ targets, uint32_t targetCount,
+                             float G, KernelTerms<float> terms, float* __restrict__ ax, float* __restrict__ ay) {
+    __shared__ float tileX[BLOCK_SIZE];
+    __shared__ float tileY[BLOCK_SIZE];
+    __shared__ float tileM[BLOCK_SIZE];
+    
+    const uint32_t t = blockIdx.x * blockDim.x + threadIdx.x;
+    const bool active = t < targetCount;
+    const uint32_t i = active ? (targets ? targets[t] : t) : 0;
+    const float px = active ? x[i] : 0.0f;
+    const float py = active ? y[i] : 0.0f;
+    float sumX = 0.0f;
+    float sumY = 0.0f;
+    
+    // Every thread helps load every tile, active or not
+    for (uint32_t base = 0; base < n; base += BLOCK_SIZE) {
+        const uint32_t j = base + threadIdx.x;
+        tileX[threadIdx.x] = j < n ? x[j] : 0.0f;
+        tileY[threadIdx.x] = j < n ? y[j] : 0.0f;
+        tileM[threadIdx.x] = j < n ? m[j] : 0.0f;
+        __syncthreads();
+        
+        const uint32_t tile = min(uint32_t(BLOCK_SIZE), n - base);
+        #pragma unroll 8
+        for (uint32_t k = 0; k < tile; ++k) {
+            accumulate<Kernel>(px, py, tileX[k], tileY[k], tileM[k], terms, sumX, sumY);
+        }
+        __syncthreads();
+    }
+    
+    if (active) {
+        ax[t] = G * sumX;
+        ay[t] = G * sumY;
+    }
+}
+
+// One thread per target, walking the tree from the root with the CPU's
+// point opening test (s^2 < theta^2 (d^2 + eps^2), and under a compact
+// kernel d > h + reach). Targets are sorted positions, so neighbouring
+// threads take similar paths through the tree.
+template <typename Kernel>
+__global__ void treeKernel(const GpuTreeNode* __restrict__ nodes, const float* __restrict__ x,
+                           const float* __restrict__ y, const float* __restrict__ m,
+                           const uint32_t* __restrict__ targets, uint32_t targetCount,
+                           float theta2, float G, KernelTerms<float> terms,
+                           float* __restrict__ ax, float* __restrict__ ay) {
+    const uint32_t t = blockIdx.x * blockDim.x + threadIdx.x;
+    if (t >= targetCount) return;
+    
+    const uint32_t i = targets ? targets[t] : t;
+    const float px = x[i];
+    const float py = y[i];
+    float sumX = 0.0f;
+    float sumY = 0.0f;
+    const float support = Kernel::COMPACT ? sqrtf(terms.h2) : 0.0f;
+    
+    uint32_t stack[MAX_STACK];
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0) {
+        const GpuTreeNode node = nodes[stack[--top]];
+        if (node.mass == 0.0f) continue;
+        
+        const float dx = node.comX - px;
+        const float dy = node.comY - py;
+        const float r2 = dx * dx + dy * dy + terms.eps2;
+        bool accept = node.size * node.size < theta2 * r2;
+        if (Kernel::COMPACT && accept) {
+            const float opening = support + node.reach;
+            accept = opening * opening < r2;
+        }
+        if (accept) {
+            accumulate<Kernel>(px, py, node.comX, node.comY, node.mass, terms, sumX, sumY);
+        } else if (node.firstChild == NO_CHILD) {
+            for (uint32_t k = node.begin; k < node.begin + node.count; ++k) {
+                accumulate<Kernel>(px, py, x[k], y[k], m[k], terms, sumX, sumY);
+            }
+        } else {
+            for (int q = 3; q >= 0; --q) {
+                stack[top++] = node.firstChild + q;
+            }
+        }
+    }
+    
+    ax[t] = G * sumX;
+    ay[t] = G * sumY;
+}
+
+} // namespace
+
+struct GpuDevice::Buffers {
+    DeviceArray<float> x, y, m;
+    DeviceArray<float> ax, ay;
+    DeviceArray<uint32_t> targets;
+    DeviceArray<GpuTreeNode> nodes;
+    uint32_t bodyCount = 0;
+    uint32_t targetCount = 0;
+    bool allTargets = true;
+};
+
+bool GpuDevice::available() {
+    int count = 0;
+    return cudaGetDeviceCount(&count) == cudaSuccess && count > 0;
+}
+
+std::string GpuDevice::deviceName() {
+    cudaDeviceProp properties;
+    if (cudaGetDeviceProperties(&properties, 0) != cudaSuccess) return "none";
+    return properties.name;
+}
+
+GpuDevice::GpuDevice() : buffers(std::make_unique<Buffers>()) {}
+
+GpuDevice::~GpuDevice() = default;
+
+void GpuDevice::uploadBodies(const float* x, const float* y, const float* m, size_t count) {
+    buffers->x.upload(x, count);
+    buffers->y.upload(y, count);
+    buffers->m.upload(m, count);
+    buffers->bodyCount = uint32_t(count);
+}
+
+void GpuDevice::uploadTree(const GpuTreeNode* nodes, size_t count) {
+    buffers->nodes.upload(nodes, count);
+}
+
+void GpuDevice::uploadTargets(const uint32_t* targets, size_t count) {
+    buffers->allTargets = targets == nullptr;
+    if (targets) {
+        buffers->targets.upload(targets, count);
+    }
+    buffers->targetCount = uint32_t(count);
+    buffers->ax.reserve(count);
+    buffers->ay.reserve(count);
+}
+
+void GpuDevice::directAccelerations(float G, const Softening& softening) {
+    Buffers& b = *buffers;
+    if (b.targetCount == 0) return;
+    const uint32_t blocks = (b.targetCount + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    withSofteningKernel(softening.kernel, [&](auto policy) {
+        directKernel<decltype(policy)><<<blocks, BLOCK_SIZE>>>(
+            b.x.data, b.y.data, b.m.data, b.bodyCount, b.allTargets ? nullptr : b.targets.data,
+            b.targetCount, G, softening.terms<float>(), b.ax.data, b.ay.data);
+    });
+    check(cudaGetLastError(), "direct kernel launch");
+}
+
+void GpuDevice::treeAccelerations(float theta, float G, const Softening& softening) {
+    Buffers& b = *buffers;
+    if (b.targetCount == 0) return;
+    const uint32_t blocks = (b.targetCount + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    withSofteningKernel(softening.kernel, [&](auto policy) {
+        treeKernel<decltype(policy)><<<blocks, BLOCK_SIZE>>>(
+            b.nodes.data, b.x.data, b.y.data, b.m.data, b.allTargets ? nullptr : b.targets.data,
+            b.targetCount, theta * theta, G, softening.terms<float>(), b.ax.data, b.ay.data);
+    });
+    check(cudaGetLastError(), "tree kernel launch");
+}
+
+void GpuDevice::downloadAccelerations(float* ax, float* ay) {
+    Buffers& b = *buffers;
+    if (b.targetCount == 0) return;
+    // Synchronous copies, so this also waits for the kernel
+    check(cudaMemcpy(ax, b.ax.data, b.targetCount * sizeof(float), cudaMemcpyDeviceToHost), "download");
+    check(cudaMemcpy(ay, b.ay.data, b.targetCount * sizeof(float), cudaMemcpyDeviceToHost), "download");
+}
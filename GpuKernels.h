@@ -0,0 +1,67 @@
+#pragma once
+
+#include "Interaction.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+// CUDA force kernels (GpuKernels.cu), only built with -DASTRO_ENABLE_GPU=ON.
+// This header has no CUDA dependency so host code can include it freely.
+//
+// Two kernels share one set of device buffers:
+//   - direct: every thread owns a target and walks all sources in tiles that
+//     a thread block stages through shared memory, the GPU analogue of the
+//     SOURCE_TILE loop in DirectKernel.cpp
+//   - tree: every thread walks an uploaded copy of the host QuadTree for
+//     one body, with the same opening test as the CPU point walk
+//
+// Buffers grow to the largest size seen and are then reused, so a steady
+// state evaluation does not allocate on the device either.
+
+// QuadTreeNode reduced to what the walk reads, 32 bytes
+struct GpuTreeNode {
+    float comX, comY;
+    float mass;
+    float size;           // Edge length of the cell's square
+    uint32_t firstChild;  // QuadTreeNode::NO_CHILD for leaves
+    uint32_t begin, count;
+    float reach;          // QuadTreeNode::reach, for the compact-kernel opening test
+};
+
+class GpuDevice {
+public:
+    // Bodies from which GpuForceSolver walks a tree instead of summing
+    // directly. The direct kernel runs at full occupancy without divergence,
+    // so the tree only pays off once the N^2 pairs outweigh its divergent,
+    // memory-bound walk; this is a starting point to tune per device.
+    static constexpr size_t DEFAULT_TREE_THRESHOLD = 65536;
+    
+    // Whether a usable CUDA device is present, and its name
+    static bool available();
+    static std::string deviceName();
+    
+    GpuDevice();
+    ~GpuDevice();
+    GpuDevice(const GpuDevice&) = delete;
+    GpuDevice& operator=(const GpuDevice&) = delete;
+    
+    // Source bodies. For the tree kernel these are the tree's sorted bodies.
+    void uploadBodies(const float* x, const float* y, const float* m, size_t count);
+    void uploadTree(const GpuTreeNode* nodes, size_t count);
+    
+    // Target indices into the uploaded bodies; nullptr evaluates all bodies
+    void uploadTargets(const uint32_t* targets, size_t count);
+    
+    // Accelerations of the uploaded targets, in target order, on the device
+    void directAccelerations(float G, const Softening& softening);
+    void treeAccelerations(float theta, float G, const Softening& softening);
+    
+    // Copies the last result for the targets back to the host
+    void downloadAccelerations(float* ax, float* ay);
+    
+private:
+    struct Buffers;
+    std::unique_ptr<Buffers> buffers;
+};
@@ -0,0 +1,328 @@
+#pragma once
+
+#include "SimulationCore.h"
+#include "TrajectoryWriter.h"
+#include "CommandLine.h"
+#include "Profiler.h"
+#include "Threading.h"
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <string>
+
+// Batch runs without a window. Physics steps back to back with no frame
+// limit, and progress is reported every outputEvery steps:
+//
+//   astro_headless --scenario galaxy.json --steps 10000 --output-every 100 --output run.csv
+//
+// The run stops after --steps N steps or once the simulated time reaches
+// --until T, whichever comes first; at least one of the two is required.
+//
+// --checkpoint file writes a binary snapshot (Snapshot.h) every
+// --checkpoint-every K steps and at the end of the run. Passing the snapshot
+// back as --scenario resumes the run: the step count and time carry over,
+// so --steps and --until still count from the start of the original run.
+//
+// --trajectory file streams frames of selected fields and bodies every
+// --trajectory-every K steps to a chunked binary or HDF5 file, written on a
+// background thread (TrajectoryWriter.h).
+//
+// Every report and trajectory frame carries the conserved quantities of its
+// step (Diagnostics.h): the step before it asks the core to measure them,
+// which the leapfrog integrators do from their own last force evaluation.
+//
+// --profile prints the average and p99 time of every physics phase at the
+// end (Profiler.h); --profile-trace file.json writes every phase of the run
+// as a Chrome trace.
+//
+// --threads N sizes the thread pool (Threading.h) and --pin-threads pins its
+// workers to CPUs.
+struct HeadlessOptions {
+    std::string scenario;          // Empty runs the default scenario
+    uint64_t steps = 0;            // 0 = no step limit
+    double until = 0.0;            // 0 = no time limit
+    uint64_t outputEvery = 100;    // Steps between reports, 0 = only at the end
+    std::string outputPath;        // CSV of particle states at each report, optional
+    std::string checkpointPath;    // Snapshot rewritten at each checkpoint, optional
+    uint64_t checkpointEvery = 1000;  // Steps between checkpoints, 0 = only at the end
+    TrajectoryOptions trajectory;
+    bool profile = false;
+    std::string profileTrace;      // Chrome trace of the run, optional
+    int threads = 0;               // 0 = ASTRO_THREADS or all hardware threads
+    bool pinThreads = defaultThreadPinning();
+};
+
+inline void printHeadlessUsage(const char* program) {
+    std::cerr << "Usage: " << program << " [--headless] [--scenario file] (--steps N | --until T)"
+              << " [--output-every K] [--output file.csv]"
+              << " [--checkpoint file.snap] [--checkpoint-every K]"
+              << " [--trajectory file] [--trajectory-every K] [--trajectory-fields x,y,vx,vy,m|all]"
+              << " [--trajectory-bodies all|named|name,...] [--trajectory-chunk frames] [--trajectory-compress]"
+              << " [--profile] [--profile-trace trace.json] [--threads N] [--pin-threads]" << std::endl;
+}
+
+// Returns false, after reporting to std::cerr, if the arguments are invalid
+inline bool parseHeadlessOptions(int argc, char* argv[], HeadlessOptions& options) {
+    int i = 1;
+    const auto invalid = [&](const char* option, const char* expected) {
+        std::cerr << "Invalid " << option << " \"" << argv[i] << "\" (" << expected << ")" << std::endl;
+        return false;
+    };
+    for (; i < argc; ++i) {
+        const std::string arg = argv[i];
+        const bool hasValue = i + 1 < argc;
+        if (arg == "--headless") {
+            continue;
+        } else if (arg == "--scenario" && hasValue) {
+            options.scenario = argv[++i];
+        } else if (arg == "--steps" && hasValue) {
+            if (!parseCount(argv[++i], options.steps)) return invalid("--steps", "a positive count such as 10000 or 10k");
+        } else if (arg == "--until" && hasValue) {
+            if (!parsePositive(argv[++i], options.until)) return invalid("--until", "a positive time");
+        } else if (arg == "--output-every" && hasValue) {
+            if (!parseWhole(argv[++i], options.outputEvery)) return invalid("--output-every", "a whole number of steps");
+        } else if (arg == "--output" && hasValue) {
+            options.outputPath = argv[++i];
+        } else if (arg == "--checkpoint" && hasValue) {
+            options.checkpointPath = argv[++i];
+        } else if (arg == "--checkpoint-every" && hasValue) {
+            if (!parseWhole(argv[++i], options.checkpointEvery)) return invalid("--checkpoint-every", "a whole number of steps");
+        } else if (arg == "--trajectory" && hasValue) {
+            options.trajectory.path = argv[++i];
+        } else if (arg == "--trajectory-every" && hasValue) {
+            if (!parseWhole(argv[++i], options.trajectory.every)) return invalid("--trajectory-every", "a whole number of steps");
+        } else if (arg == "--trajectory-fields" && hasValue) {
+            options.trajectory.fields = argv[++i];
+        } else if (arg == "--trajectory-bodies" && hasValue) {
+            options.trajectory.bodies = argv[++i];
+        } else if (arg == "--trajectory-chunk" && hasValue) {
+            long frames = 0;
+            if (!parsePositive(argv[++i], frames) || frames > long(UINT32_MAX)) {
+                return invalid("--trajectory-chunk", "a positive number of frames");
+            }
+            options.trajectory.chunkFrames = static_cast<uint32_t>(frames);
+        } else if (arg == "--trajectory-compress") {
+            options.trajectory.compress = true;
+        } else if (arg == "--profile") {
+            options.profile = true;
+        } else if (arg == "--profile-trace" && hasValue) {
+            options.profileTrace = argv[++i];
+        } else if (arg == "--threads" && hasValue) {
+            options.threads = std::atoi(argv[++i]);
+        } else if (arg == "--pin-threads") {
+            options.pinThreads = true;
+        } else {
+            std::cerr << "Unknown or incomplete argument: " << arg << std::endl;
+            return false;
+        }
+    }
+    
+    if (options.trajectory.every == 0) options.trajectory.every = 1;
+    
+    // A batch job without an end would run until the scheduler kills it
+    if (options.steps == 0 && options.until <= 0.0) {
+        std::cerr << "A headless run needs --steps or --until" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+class HeadlessRunner {
+private:
+    static constexpr size_t PROFILE_WINDOW = size_t(1) << 16;  // Steps the --profile percentiles cover
+    
+    SimulationCore core;
+    HeadlessOptions options;
+    std::ofstream output;
+    TrajectoryWriter trajectory;
+    Profiler profiler{"physics"};
+    PhaseHistory history{PROFILE_WINDOW};
+    
+    bool finished() const {
+        if (options.steps > 0 && core.getStepCount() >= options.steps) return true;
+        // Half a step of slack so float round-off in the accumulated time
+        // does not add one step past T
+        return options.until > 0.0 && core.getTime() + 0.5 * core.getConstants().DT >= options.until;
+    }
+    
+    bool reportsAt(uint64_t step) const {
+        return options.outputEvery > 0 && step % options.outputEvery == 0;
+    }
+    
+    bool recordsAt(uint64_t step) const {
+        return trajectory.isOpen() && step % options.trajectory.every == 0;
+    }
+    
+    bool recordTrajectory() {
+        if (!recordsAt(core.getStepCount())) return true;
+        if (!core.diagnosticsCurrent()) core.measureDiagnostics();
+        if (trajectory.capture(core)) return true;
+        trajectory.close();  // Reports why
+        return false;
+    }
+    
+    // Written beside the target and renamed over it, so a job killed
+    // mid-write leaves the previous checkpoint intact
+    bool checkpoint() {
+        const std::string partial = options.checkpointPath + ".partial";
+        if (!core.saveSnapshot(partial)) return false;
+#ifdef _WIN32
+        std::remove(options.checkpointPath.c_str());  // rename does not replace an existing file here
+#endif
+        if (std::rename(partial.c_str(), options.checkpointPath.c_str()) != 0) {
+            std::cerr << "Could not write checkpoint: " << options.checkpointPath << std::endl;
+            return false;
+        }
+        return true;
+    }
+    
+    void printProfile() {
+        const ProfileSummary summary = history.summary();
+        std::cout << "Profile (ms per step, last " << summary[static_cast<size_t>(ProfilePhase::Integrate)].samples << " steps):" << std::endl;
+        std::cout << std::fixed << std::setprecision(3);
+        for (ProfilePhase phase : {ProfilePhase::TreeBuild, ProfilePhase::CenterOfMass,
+                                   ProfilePhase::ForceWalk, ProfilePhase::Integrate,
+                                   ProfilePhase::Collisions}) {
+            const PhaseSummary& stats = summary[static_cast<size_t>(phase)];
+            if (stats.samples == 0) continue;
+            std::cout << "  " << std::left << std::setw(16) << profilePhaseName(phase) << std::right
+                      << " avg " << std::setw(9) << stats.averageMs << "  p99 " << std::setw(9) << stats.p99Ms
+                      << std::endl;
+        }
+        std::cout.unsetf(std::ios::floatfield);
+    }
+    
+    void report(double wallMs, uint64_t stepsSinceReport) {
+        const ForceSolver& solver = core.getForceSolver();
+        if (!core.diagnosticsCurrent()) core.measureDiagnostics();
+        const Diagnostics& diagnostics = core.getDiagnostics();
+        std::cout << "step " << core.getStepCount()
+                  << "  t " << std::fixed << std::setprecision(4) << core.getTime()
+                  << "  KE " << std::scientific << std::setprecision(4) << diagnostics.kinetic;
+        if (diagnostics.hasPotential()) {
+            std::cout << "  E " << diagnostics.energy() << "  dE " << std::setprecision(2) << diagnostics.energyDrift
+                      << "  Q " << std::fixed << std::setprecision(3) << diagnostics.virialRatio();
+        }
+        std::cout << "  " << std::fixed << std::setprecision(3)
+                  << (stepsSinceReport > 0 ? wallMs / stepsSinceReport : 0.0) << " ms/step";
+        if (core.getConstants().COLLISIONS) {
+            std::cout << "  bodies " << core.getParticles().size() << "  merged " << core.getMergeCount();
+        }
+        std::cout << "  " << solver.name() << std::endl;
+        std::cout.unsetf(std::ios::floatfield);
+        
+        if (output.is_open()) {
+            const ParticleStore& particles = core.getParticles();
+            for (size_t i = 0; i < particles.size(); ++i) {
+                output << core.getStepCount() << ',' << core.getTime() << ',' << particles.info[i].id << ','
+                       << particles.info[i].serial << ','
+                       << particles.x[i] << ',' << particles.y[i] << ','
+                       << particles.vx[i] << ',' << particles.vy[i] << '\n';
+            }
+        }
+    }
+    
+public:
+    explicit HeadlessRunner(const HeadlessOptions& options) : options(options) {}
+    
+    int run() {
+        if (options.scenario.empty()) {
+            core.loadDefaultScenario();
+        } else if (!core.loadScenario(options.scenario)) {
+            return 1;
+        }
+        
+        if (!options.outputPath.empty()) {
+            output.open(options.outputPath);
+            if (!output.is_open()) {
+                std::cerr << "Could not open output file: " << options.outputPath << std::endl;
+                return 1;
+            }
+            output << std::setprecision(std::numeric_limits<Real>::max_digits10) << "step,time,id,serial,x,y,vx,vy\n";
+        }
+        if (!options.trajectory.path.empty() && !trajectory.open(options.trajectory, core)) {
+            return 1;
+        }
+        
+        std::cout << "Headless run: " << core.getParticles().size() << " particles, "
+                  << core.getIntegrator().name() << ", " << core.getForceSolver().name() << ", "
+                  << PRECISION_NAME << " precision" << std::endl;
+        
+        using Clock = std::chrono::steady_clock;
+        const auto start = Clock::now();
+        const uint64_t firstStep = core.getStepCount();  // Non-zero when resuming a checkpoint
+        auto lastReport = start;
+        uint64_t stepsSinceReport = 0;
+        
+        const bool profile = options.profile || !options.profileTrace.empty();
+        if (!options.profileTrace.empty()) profiler.startTrace();
+        activeProfiler = profile ? &profiler : nullptr;
+        
+        report(0.0, 0);
+        if (!recordTrajectory()) return 1;
+        while (!finished()) {
+            profiler.beginFrame();
+            const uint64_t next = core.getStepCount() + 1;
+            if (reportsAt(next) || recordsAt(next)) core.requestDiagnostics();
+            core.step();
+            if (profile) {
+                history.push(profiler.phaseMs, {ProfilePhase::TreeBuild, ProfilePhase::CenterOfMass,
+                                                ProfilePhase::ForceWalk, ProfilePhase::Integrate});
+                if (core.getConstants().COLLISIONS) {
+                    history.push(profiler.phaseMs, {ProfilePhase::Collisions});
+                }
+            }
+            ++stepsSinceReport;
+            if (!recordTrajectory()) return 1;
+            if (reportsAt(core.getStepCount())) {
+                report(std::chrono::duration<double, std::milli>(Clock::now() - lastReport).count(), stepsSinceReport);
+                lastReport = Clock::now();  // Leave the report's own I/O out of the next interval
+                stepsSinceReport = 0;
+            }
+            if (!options.checkpointPath.empty() && options.checkpointEvery > 0 &&
+                core.getStepCount() % options.checkpointEvery == 0 && !checkpoint()) {
+                return 1;
+            }
+        }
+        if (stepsSinceReport > 0) {
+            report(std::chrono::duration<double, std::milli>(Clock::now() - lastReport).count(), stepsSinceReport);
+        }
+        if (!options.checkpointPath.empty() && !checkpoint()) {
+            return 1;
+        }
+        if (!trajectory.close()) {
+            return 1;
+        }
+        activeProfiler = nullptr;
+        
+        const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        const uint64_t stepsRun = core.getStepCount() - firstStep;
+        std::cout << "Finished " << stepsRun << " steps in " << std::fixed << std::setprecision(2)
+                  << seconds << " s (" << std::setprecision(1)
+                  << (seconds > 0.0 ? stepsRun / seconds : 0.0) << " steps/s)" << std::endl;
+        if (options.profile) printProfile();
+        if (!options.profileTrace.empty() && !writeChromeTrace(options.profileTrace, {&profiler})) {
+            return 1;
+        }
+        return 0;
+    }
+};
+
+// Entry point shared by astro_headless and the --headless flag of the
+// interactive build
+inline int runHeadless(int argc, char* argv[]) {
+    HeadlessOptions options;
+    if (!parseHeadlessOptions(argc, argv, options)) {
+        printHeadlessUsage(argv[0]);
+        return 2;
+    }
+    configureThreadPool(options.threads, options.pinThreads);
+    HeadlessRunner runner(options);
+    return runner.run();
+}
@@ -0,0 +1,495 @@
+#pragma once
+
+#include "ParticleStore.h"
+#include "Threading.h"
+
+#include <SFML/System/Vector2.hpp>
+#include <vector>
+#include <functional>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+// Fills the accelerations of the target bodies (positions and masses in, a out).
+// Every body in the BodySpan acts as a source.
+using AccelerationFunction = std::function<void(const BodySpan&, const TargetSpan&, const AccelerationSpan&)>;
+
+enum class IntegratorType {
+    RungeKutta4,
+    Leapfrog,
+    VelocityVerlet,
+    BlockTimestep
+};
+
+// Abstract Integrator class
+class Integrator {
+public:
+    virtual ~Integrator() = default;
+    virtual void integrate(ParticleStore& particles,
+                         const AccelerationFunction& accelFunc,
+                         Real dt) = 0;
+    
+    // Drops any state carried between steps (call after particles are replaced)
+    virtual void reset() {}
+    
+    // Follows ParticleStore::permute(order) for any per-body state kept
+    // between steps
+    virtual void permute(const std::vector<uint32_t>& order) { (void)order; }
+    
+    // Follows a change of the particle set that moved every body's ax/ay with
+    // it, such as bodies passed between processes (Distributed.h); the store
+    // now holds count bodies. State that cannot follow is dropped.
+    virtual void adopt(size_t count) {
+        (void)count;
+        reset();
+    }
+    
+    // Whether the last evaluation of a step is a full one at the store's
+    // final positions, so its potential is that of the state the step ends in
+    virtual bool endsOnFullEvaluation() const { return false; }
+    
+    virtual std::string name() const = 0;
+};
+
+// Stage buffers kept alive across steps. resize() only touches the heap when
+// the particle count grows past the previous capacity, so a steady-state step
+// performs no allocations.
+struct IntegratorWorkspace {
+    RealArray x, y;      // Stage positions
+    RealArray vx, vy;    // Stage velocities
+    RealArray ax, ay;    // Stage accelerations
+    RealArray dx, dy;    // Weighted sum of stage velocities
+    RealArray dvx, dvy;  // Weighted sum of stage accelerations
+    
+    void resize(size_t n) {
+        for (auto* a : {&x, &y, &vx, &vy, &ax, &ay, &dx, &dy, &dvx, &dvy}) {
+            a->resize(n);
+        }
+    }
+};
+
+// Runge-Kutta 4th order integrator
+class RungeKuttaIntegrator : public Integrator {
+private:
+    IntegratorWorkspace workspace;
+    
+    // Adds weight * (v, a) of the stage just evaluated to the running sums and,
+    // if another stage follows, moves the stage state to (x0 + v*h, v0 + a*h)
+    void accumulateStage(const ParticleStore& particles, Real weight, Real h, bool advance) {
+        auto& ws = workspace;
+        parallelFor(particles.size(), PARALLEL_GRAIN, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                ws.dx[i] += weight * ws.vx[i];
+                ws.dy[i] += weight * ws.vy[i];
+                ws.dvx[i] += weight * ws.ax[i];
+                ws.dvy[i] += weight * ws.ay[i];
+                
+                if (advance) {
+                    ws.x[i] = particles.x[i] + ws.vx[i] * h;
+                    ws.y[i] = particles.y[i] + ws.vy[i] * h;
+                    ws.vx[i] = particles.vx[i] + ws.ax[i] * h;
+                    ws.vy[i] = particles.vy[i] + ws.ay[i] * h;
+                }
+            }
+        });
+    }
+    
+public:
+    void integrate(ParticleStore& particles,
+                  const AccelerationFunction& accelFunc,
+                  Real dt) override {
+        const size_t n = particles.size();
+        auto& ws = workspace;
+        ws.resize(n);
+        
+        parallelFor(n, PARALLEL_GRAIN, [&](size_t begin, size_t end) {
+            std::fill(ws.dx.begin() + begin, ws.dx.begin() + end, 0.0f);
+            std::fill(ws.dy.begin() + begin, ws.dy.begin() + end, 0.0f);
+            std::fill(ws.dvx.begin() + begin, ws.dvx.begin() + end, 0.0f);
+            std::fill(ws.dvy.begin() + begin, ws.dvy.begin() + end, 0.0f);
+            std::copy(particles.vx.begin() + begin, particles.vx.begin() + end, ws.vx.begin() + begin);
+            std::copy(particles.vy.begin() + begin, particles.vy.begin() + end, ws.vy.begin() + begin);
+        });
+        
+        const BodySpan stage{ws.x.data(), ws.y.data(), particles.m.data(), n};
+        const AccelerationSpan stageAcc{ws.ax.data(), ws.ay.data(), n};
+        
+        // k1 at the initial state, then k2..k4 at the intermediate states
+        accelFunc(particles.bodies(), TargetSpan{}, stageAcc);
+        accumulateStage(particles, 1.0f, dt * 0.5f, true);
+        accelFunc(stage, TargetSpan{}, stageAcc);
+        accumulateStage(particles, 2.0f, dt * 0.5f, true);
+        accelFunc(stage, TargetSpan{}, stageAcc);
+        accumulateStage(particles, 2.0f, dt, true);
+        accelFunc(stage, TargetSpan{}, stageAcc);
+        accumulateStage(particles, 1.0f, 0.0f, false);
+        
+        // Update particles
+        parallelFor(n, PARALLEL_GRAIN, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                if (!particles.info[i].fixed) {
+                    particles.x[i] += ws.dx[i] / 6.0f * dt;
+                    particles.y[i] += ws.dy[i] / 6.0f * dt;
+                    particles.vx[i] += ws.dvx[i] / 6.0f * dt;
+                    particles.vy[i] += ws.dvy[i] / 6.0f * dt;
+                    particles.ax[i] = ws.dvx[i] / 6.0f;
+                    particles.ay[i] = ws.dvy[i] / 6.0f;
+                }
+            }
+        });
+    }
+    
+    std::string name() const override { return "RK4"; }
+};
+
+// Base for the symplectic integrators: they reuse the accelerations left in
+// ParticleStore::ax/ay by the previous step, so each step costs one force
+// evaluation. The first step after a reset (or a change in particle count)
+// evaluates them once up front.
+class CachedAccelerationIntegrator : public Integrator {
+private:
+    bool primed = false;
+    size_t primedCount = 0;
+    
+protected:
+    void ensureAccelerations(ParticleStore& particles, const AccelerationFunction& accelFunc) {
+        if (!primed || primedCount != particles.size()) {
+            accelFunc(particles.bodies(), TargetSpan{}, particles.accelerations());
+            primed = true;
+            primedCount = particles.size();
+        }
+    }
+    
+public:
+    void reset() override { primed = false; }
+    
+    // The cached accelerations travel in the store, so they stay valid
+    void adopt(size_t count) override {
+        if (primed) primedCount = count;
+    }
+    
+    // The closing kick only changes velocities
+    bool endsOnFullEvaluation() const override { return true; }
+};
+
+// Kick-drift-kick leapfrog
+class LeapfrogIntegrator : public CachedAccelerationIntegrator {
+public:
+    void integrate(ParticleStore& particles,
+                  const AccelerationFunction& accelFunc,
+                  Real dt) override {
+        ensureAccelerations(particles, accelFunc);
+        
+        const size_t n = particles.size();
+        const Real halfDt = dt * 0.5f;
+        
+        // Half kick, full drift
+        parallelFor(n, PARALLEL_GRAIN, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                if (!particles.info[i].fixed) {
+                    particles.vx[i] += particles.ax[i] * halfDt;
+                    particles.vy[i] += particles.ay[i] * halfDt;
+                    particles.x[i] += particles.vx[i] * dt;
+                    particles.y[i] += particles.vy[i] * dt;
+                }
+            }
+        });
+        
+        accelFunc(particles.bodies(), TargetSpan{}, particles.accelerations());
+        
+        // Closing half kick with the new accelerations
+        parallelFor(n, PARALLEL_GRAIN, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                if (!particles.info[i].fixed) {
+                    particles.vx[i] += particles.ax[i] * halfDt;
+                    particles.vy[i] += particles.ay[i] * halfDt;
+                }
+            }
+        });
+    }
+    
+    std::string name() const override { return "Leapfrog"; }
+};
+
+// Velocity Verlet: x += v dt + a dt^2 / 2, then v += (a_old + a_new) dt / 2
+class VelocityVerletIntegrator : public CachedAccelerationIntegrator {
+private:
+    RealArray oldAx, oldAy;
+    
+public:
+    void integrate(ParticleStore& particles,
+                  const AccelerationFunction& accelFunc,
+                  Real dt) override {
+        ensureAccelerations(particles, accelFunc);
+        
+        const size_t n = particles.size();
+        const Real halfDt2 = 0.5f * dt * dt;
+        oldAx.resize(n);
+        oldAy.resize(n);
+        
+        parallelFor(n, PARALLEL_GRAIN, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                oldAx[i] = particles.ax[i];
+                oldAy[i] = particles.ay[i];
+                if (!particles.info[i].fixed) {
+                    particles.x[i] += particles.vx[i] * dt + particles.ax[i] * halfDt2;
+                    particles.y[i] += particles.vy[i] * dt + particles.ay[i] * halfDt2;
+                }
+            }
+        });
+        
+        accelFunc(particles.bodies(), TargetSpan{}, particles.accelerations());
+        
+        parallelFor(n, PARALLEL_GRAIN, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                if (!particles.info[i].fixed) {
+                    particles.vx[i] += (oldAx[i] + particles.ax[i]) * 0.5f * dt;
+                    particles.vy[i] += (oldAy[i] + particles.ay[i]) * 0.5f * dt;
+                }
+            }
+        });
+    }
+    
+    std::string name() const override { return "Velocity Verlet"; }
+};
+
+// Hierarchical power-of-two block time-stepping on top of kick-drift-kick
+// leapfrog. The step passed to integrate() (capped at maxDt) is rung 0; a body
+// on rung r is kicked every dt / 2^r, down to the finest rung allowed by minDt.
+// Every body drifts to each substep boundary, but accelerations are evaluated
+// only for the bodies whose step ends there. Rungs are chosen from the
+// acceleration and the jerk estimated between successive evaluations.
+class BlockTimestepIntegrator : public Integrator {
+public:
+    static constexpr int MAX_RUNGS = 20;
+    
+private:
+    Real minDt;
+    Real maxDt;
+    Real softening;
+    Real eta;  // Accuracy parameter of the step criterion
+    
+    std::vector<uint8_t> rungs, rungScratch;
+    RealArray previousAx, previousAy;
+    std::vector<uint32_t> active;
+    
+    // Next step boundary and deepest rung seen by the opening kick
+    struct TickScan {
+        uint32_t next;
+        int deepest;
+        
+        static TickScan combine(const TickScan& a, const TickScan& b) {
+            return TickScan{std::min(a.next, b.next), std::max(a.deepest, b.deepest)};
+        }
+    };
+    
+    bool primed = false;
+    size_t primedCount = 0;
+    size_t lastEvaluations = 0;
+    int lastDeepestRung = 0;
+    
+    // dt_i = min(sqrt(2 eta eps / |a|), eta |a| / |jerk|). With zero softening
+    // the first term would be 0 and pin every body to the deepest rung, so it
+    // is dropped and the jerk term alone sets the step.
+    Real desiredStep(Real ax, Real ay, Real jerk) const {
+        Real a = std::sqrt(ax * ax + ay * ay);
+        Real step = maxDt;
+        if (a > 0.0f) {
+            if (softening > 0.0f) {
+                step = std::min(step, std::sqrt(2.0f * eta * softening / a));
+            }
+            if (jerk > 0.0f) {
+                step = std::min(step, eta * a / jerk);
+            }
+        }
+        return step;
+    }
+    
+    // Shallowest rung whose step does not exceed the desired one
+    static int rungFor(Real desired, Real blockDt, int deepest) {
+        int rung = 0;
+        Real h = blockDt;
+        while (rung < deepest && h > desired) {
+            h *= 0.5f;
+            ++rung;
+        }
+        return rung;
+    }
+    
+    static int deepestAllowedRung(Real blockDt, Real minDt) {
+        int rung = 0;
+        while (rung < MAX_RUNGS && blockDt / Real(1u << (rung + 1)) >= minDt) {
+            ++rung;
+        }
+        return rung;
+    }
+    
+    void prime(ParticleStore& particles, const AccelerationFunction& accelFunc, Real blockDt, int deepest) {
+        const size_t n = particles.size();
+        rungs.assign(n, 0);
+        previousAx.resize(n);
+        previousAy.resize(n);
+        active.reserve(n);
+        
+        accelFunc(particles.bodies(), TargetSpan{}, particles.accelerations());
+        for (size_t i = 0; i < n; ++i) {
+            if (!particles.info[i].fixed) {
+                rungs[i] = uint8_t(rungFor(desiredStep(particles.ax[i], particles.ay[i], 0.0f), blockDt, deepest));
+            }
+        }
+        
+        primed = true;
+        primedCount = n;
+    }
+    
+public:
+    BlockTimestepIntegrator(Real minDt, Real maxDt, Real softening, Real eta = Real(0.025))
+        : minDt(minDt), maxDt(maxDt), softening(softening), eta(eta) {}
+    
+    void integrate(ParticleStore& particles,
+                  const AccelerationFunction& accelFunc,
+                  Real dt) override {
+        const size_t n = particles.size();
+        const int blocks = std::max(1, int(std::ceil(dt / maxDt)));
+        const Real blockDt = dt / blocks;
+        const int deepest = deepestAllowedRung(blockDt, minDt);
+        const uint32_t ticks = 1u << deepest;
+        const Real tickDt = blockDt / ticks;
+        
+        if (!primed || primedCount != n) {
+            prime(particles, accelFunc, blockDt, deepest);
+        }
+        
+        lastEvaluations = 0;
+        lastDeepestRung = 0;
+        
+        for (int block = 0; block < blocks; ++block) {
+            uint32_t tick = 0;
+            while (tick < ticks) {
+                // Opening half kick for bodies starting a step, and the next
+                // tick at which any rung finishes its step
+                const TickScan scan = parallelReduce(n, PARALLEL_GRAIN, TickScan{ticks, 0},
+                    [&](size_t begin, size_t end) {
+                        TickScan chunk{ticks, 0};
+                        for (size_t i = begin; i < end; ++i) {
+                            const int rung = std::min<int>(rungs[i], deepest);
+                            const uint32_t stride = ticks >> rung;
+                            if (!particles.info[i].fixed && tick % stride == 0) {
+                                const Real halfStep = 0.5f * blockDt / Real(1u << rung);
+                                particles.vx[i] += particles.ax[i] * halfStep;
+                                particles.vy[i] += particles.ay[i] * halfStep;
+                            }
+                            chunk.next = std::min(chunk.next, (tick / stride + 1) * stride);
+                            chunk.deepest = std::max(chunk.deepest, rung);
+                        }
+                        return chunk;
+                    }, TickScan::combine);
+                const uint32_t next = scan.next;
+                lastDeepestRung = std::max(lastDeepestRung, scan.deepest);
+                
+                // Drift everything to the next step boundary
+                const Real driftDt = (next - tick) * tickDt;
+                parallelFor(n, PARALLEL_GRAIN, [&](size_t begin, size_t end) {
+                    for (size_t i = begin; i < end; ++i) {
+                        if (!particles.info[i].fixed) {
+                            particles.x[i] += particles.vx[i] * driftDt;
+                            particles.y[i] += particles.vy[i] * driftDt;
+                        }
+                    }
+                });
+                tick = next;
+                
+                // Bodies whose step ends at this tick
+                active.clear();
+                for (size_t i = 0; i < n; ++i) {
+                    if (!particles.info[i].fixed && tick % (ticks >> std::min<int>(rungs[i], deepest)) == 0) {
+                        active.push_back(uint32_t(i));
+                        previousAx[i] = particles.ax[i];
+                        previousAy[i] = particles.ay[i];
+                    }
+                }
+                if (active.empty()) continue;
+                
+                accelFunc(particles.bodies(), TargetSpan{active.data(), active.size()}, particles.accelerations());
+                lastEvaluations += active.size();
+                
+                // Closing half kick, then pick the next rung. Moving to a
+                // larger step is only allowed where that step's boundary lines
+                // up with the current tick.
+                parallelFor(active.size(), PARALLEL_GRAIN, [&](size_t begin, size_t end) {
+                    for (size_t k = begin; k < end; ++k) {
+                        const uint32_t i = active[k];
+                        const int rung = std::min<int>(rungs[i], deepest);
+                        const Real step = blockDt / Real(1u << rung);
+                        particles.vx[i] += particles.ax[i] * 0.5f * step;
+                        particles.vy[i] += particles.ay[i] * 0.5f * step;
+                        
+                        const Real jx = (particles.ax[i] - previousAx[i]) / step;
+                        const Real jy = (particles.ay[i] - previousAy[i]) / step;
+                        const Real jerk = std::sqrt(jx * jx + jy * jy);
+                        int newRung = rungFor(desiredStep(particles.ax[i], particles.ay[i], jerk), blockDt, deepest);
+                        while (newRung < rung && tick % (ticks >> newRung) != 0) {
+                            ++newRung;
+                        }
+                        rungs[i] = uint8_t(newRung);
+                    }
+                });
+            }
+        }
+    }
+    
+    void reset() override { primed = false; }
+    
+    void permute(const std::vector<uint32_t>& order) override {
+        if (!primed || rungs.size() != order.size()) return;
+        rungScratch.resize(rungs.size());
+        for (size_t i = 0; i < order.size(); ++i) {
+            rungScratch[i] = rungs[order[i]];
+        }
+        rungs.swap(rungScratch);
+    }
+    
+    // Target accelerations evaluated during the last integrate() call
+    size_t evaluationsLastStep() const { return lastEvaluations; }
+    int deepestRungLastStep() const { return lastDeepestRung; }
+    
+    std::string name() const override { return "Block Leapfrog"; }
+};
+
+// minDt, maxDt and softening are only used by the block time-stepping scheme
+inline std::unique_ptr<Integrator> createIntegrator(IntegratorType type, Real minDt, Real maxDt,
+                                                    Real softening) {
+    switch (type) {
+        case IntegratorType::BlockTimestep:
+            return std::make_unique<BlockTimestepIntegrator>(minDt, maxDt, softening);
+        case IntegratorType::Leapfrog:
+            return std::make_unique<LeapfrogIntegrator>();
+        case IntegratorType::VelocityVerlet:
+            return std::make_unique<VelocityVerletIntegrator>();
+        case IntegratorType::RungeKutta4:
+        default:
+            return std::make_unique<RungeKuttaIntegrator>();
+    }
+}
+
+// Parses the "integrator" scenario setting; unknown names keep the fallback
+inline IntegratorType parseIntegratorType(const std::string& name, IntegratorType fallback) {
+    if (name == "rk4" || name == "runge_kutta") return IntegratorType::RungeKutta4;
+    if (name == "leapfrog" || name == "kdk") return IntegratorType::Leapfrog;
+    if (name == "verlet" || name == "velocity_verlet") return IntegratorType::VelocityVerlet;
+    if (name == "block" || name == "block_leapfrog") return IntegratorType::BlockTimestep;
+    return fallback;
+}
+
+// Setting name of an integrator type, as parseIntegratorType reads it back
+inline const char* integratorTypeName(IntegratorType type) {
+    switch (type) {
+        case IntegratorType::Leapfrog:       return "leapfrog";
+        case IntegratorType::VelocityVerlet: return "verlet";
+        case IntegratorType::BlockTimestep:  return "block";
+        case IntegratorType::RungeKutta4:
+        default:                             return "rk4";
+    }
+}
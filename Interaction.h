@@ -0,0 +1,173 @@
+#pragma once
+
+#include <cmath>
+#include <string>
+
+// Interaction policies: the force law every solver applies to a pair, and
+// which bodies act as sources.
+//
+// A softening kernel turns the squared separation s = r^2 + offset into the
+// factor f with a = G m f(s) r. Each kernel is a policy type; the force
+// kernels (DirectKernel.cpp, GpuKernels.cu) are templates over it, so the
+// choice is made once per evaluation and every pair is inlined code. The
+// tree solvers take the same kernel for their leaf bodies and cells, and
+// their acceptance tests use its offset and support, so no solver can apply
+// a different law from another.
+//
+//   plummer   f = (r^2 + eps^2)^-3/2, softened at every distance
+//   compact   density proportional to (1 - r^2/h^2)^2 inside h = eps
+//             (Dehnen 2001); f is a polynomial in r^2 inside h and exactly
+//             Newtonian beyond, with a continuous force and slope at h
+//
+// The potential of a pair, phi = -G m p(s), comes from the same s: p is
+// s^-1/2 for Plummer and for a compact kernel beyond h, and the integral of
+// f inside it.
+//
+// This header has no other project dependency so the CUDA sources can
+// include it.
+
+#if defined(__CUDACC__)
+#define ASTRO_HOST_DEVICE __host__ __device__
+#else
+#define ASTRO_HOST_DEVICE
+#endif
+
+enum class SofteningKernel {
+    Plummer,
+    Compact
+};
+
+// Which bodies attract. Fixed: only bodies marked "fixed" are sources, as an
+// external potential for test-particle runs; fixed bodies get no
+// acceleration of their own.
+enum class GravitySources {
+    All,
+    Fixed
+};
+
+// The per-evaluation constants of a kernel in the precision it runs in
+template <typename T>
+struct KernelTerms {
+    T eps2 = 0;   // Offset added to every r^2
+    T h2 = 0;     // Squared support radius, below which the inner form applies
+    T invH = 0;
+    T invH2 = 0;
+    T invH3 = 0;
+};
+
+struct PlummerKernel {
+    static constexpr SofteningKernel KIND = SofteningKernel::Plummer;
+    static constexpr bool COMPACT = false;
+};
+
+// f = (C0 + C1 q + C2 q^2) / h^3 with q = r^2 / h^2 inside the support,
+// and p = (P0 + P1 q + P2 q^2 + P3 q^3) / h, which meets 1/r at h
+struct CompactKernel {
+    static constexpr SofteningKernel KIND = SofteningKernel::Compact;
+    static constexpr bool COMPACT = true;
+    static constexpr int DEGREE = 2;
+    static constexpr double C0 = 35.0 / 8.0;
+    static constexpr double C1 = -21.0 / 4.0;
+    static constexpr double C2 = 15.0 / 8.0;
+    static constexpr double P0 = 35.0 / 16.0;
+    static constexpr double P1 = -35.0 / 16.0;
+    static constexpr double P2 = 21.0 / 16.0;
+    static constexpr double P3 = -5.0 / 16.0;
+    
+    template <typename T>
+    ASTRO_HOST_DEVICE static T inner(T q) { return T(C0) + q * (T(C1) + q * T(C2)); }
+    
+    template <typename T>
+    ASTRO_HOST_DEVICE static T innerPotential(T q) { return T(P0) + q * (T(P1) + q * (T(P2) + q * T(P3))); }
+};
+
+// f(s) for s = r^2 + eps2 > 0, given inv3 = s^-3/2 from the caller's own
+// square root. The SIMD kernels compute the same blend lane-wise.
+template <typename Kernel, typename T>
+ASTRO_HOST_DEVICE inline T kernelFactor(T s, T inv3, const KernelTerms<T>& k) {
+    if constexpr (Kernel::COMPACT) {
+        if (s < k.h2) return Kernel::inner(s * k.invH2) * k.invH3;
+    }
+    return inv3;
+}
+
+// p(s), given inv1 = s^-1/2
+template <typename Kernel, typename T>
+ASTRO_HOST_DEVICE inline T kernelPotential(T s, T inv1, const KernelTerms<T>& k) {
+    if constexpr (Kernel::COMPACT) {
+        if (s < k.h2) return Kernel::innerPotential(s * k.invH2) * k.invH;
+    }
+    return inv1;
+}
+
+// Calls f(Kernel()) with the policy type of a runtime kernel choice
+template <typename F>
+inline decltype(auto) withSofteningKernel(SofteningKernel kernel, F&& f) {
+    switch (kernel) {
+        case SofteningKernel::Compact: return f(CompactKernel());
+        case SofteningKernel::Plummer:
+        default:                       return f(PlummerKernel());
+    }
+}
+
+// The softening of a run: a kernel and its length eps
+struct Softening {
+    SofteningKernel kernel = SofteningKernel::Plummer;
+    double length = 0.0;
+    
+    // Added to every r^2: eps^2 for Plummer, nothing for compact kernels
+    double offset2() const { return kernel == SofteningKernel::Plummer ? length * length : 0.0; }
+    
+    // Radius beyond which the force is exactly Newtonian (0 for none)
+    double support() const { return kernel == SofteningKernel::Plummer ? 0.0 : length; }
+    
+    template <typename T>
+    KernelTerms<T> terms() const {
+        KernelTerms<T> k;
+        k.eps2 = T(offset2());
+        const double h = support();
+        if (h > 0.0) {
+            k.h2 = T(h * h);
+            k.invH = T(1.0 / h);
+            k.invH2 = T(1.0 / (h * h));
+            k.invH3 = T(1.0 / (h * h * h));
+        }
+        return k;
+    }
+    
+    // f for a plain separation r^2, for code outside the force loops
+    double factor(double r2) const {
+        const KernelTerms<double> k = terms<double>();
+        const double s = r2 + k.eps2;
+        if (!(s > 0.0)) return 0.0;
+        return withSofteningKernel(kernel, [&](auto policy) {
+            return kernelFactor<decltype(policy)>(s, 1.0 / (s * std::sqrt(s)), k);
+        });
+    }
+};
+
+// Parses the "softening_kernel" scenario setting; unknown names keep the fallback
+inline SofteningKernel parseSofteningKernel(const std::string& name, SofteningKernel fallback) {
+    if (name == "plummer") return SofteningKernel::Plummer;
+    if (name == "compact") return SofteningKernel::Compact;
+    return fallback;
+}
+
+inline const char* softeningKernelName(SofteningKernel kernel) {
+    switch (kernel) {
+        case SofteningKernel::Compact: return "compact";
+        case SofteningKernel::Plummer:
+        default:                       return "plummer";
+    }
+}
+
+// Parses the "gravity_sources" scenario setting; unknown names keep the fallback
+inline GravitySources parseGravitySources(const std::string& name, GravitySources fallback) {
+    if (name == "all") return GravitySources::All;
+    if (name == "fixed") return GravitySources::Fixed;
+    return fallback;
+}
+
+inline const char* gravitySourcesName(GravitySources sources) {
+    return sources == GravitySources::Fixed ? "fixed" : "all";
+}
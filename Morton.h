@@ -0,0 +1,187 @@
+#pragma once
+
+#include "ParticleStore.h"
+#include "Threading.h"
+
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+
+// Bounding box of a non-empty set of bodies
+struct BodyBounds {
+    Real minX, minY, maxX, maxY;
+    
+    static BodyBounds combine(const BodyBounds& a, const BodyBounds& b) {
+        return BodyBounds{std::min(a.minX, b.minX), std::min(a.minY, b.minY),
+                          std::max(a.maxX, b.maxX), std::max(a.maxY, b.maxY)};
+    }
+};
+
+inline BodyBounds bodyBounds(const BodySpan& bodies) {
+    const BodyBounds first{bodies.x[0], bodies.y[0], bodies.x[0], bodies.y[0]};
+    return parallelReduce(bodies.count, PARALLEL_GRAIN, first, [&](size_t begin, size_t end) {
+        BodyBounds box = first;
+        for (size_t i = begin; i < end; ++i) {
+            box.minX = std::min(box.minX, bodies.x[i]);
+            box.minY = std::min(box.minY, bodies.y[i]);
+            box.maxX = std::max(box.maxX, bodies.x[i]);
+            box.maxY = std::max(box.maxY, bodies.y[i]);
+        }
+        return box;
+    }, BodyBounds::combine);
+}
+
+// 2D Morton (Z-order) keys: the bits of the quantised x and y coordinates are
+// interleaved, so sorting by key walks the plane quadrant by quadrant. The two
+// bits at level L (counted from the root) select the child cell as
+// (y >= cy) << 1 | (x >= cx), which is the child order used by QuadTree.
+//
+// Sorts bodies by Morton key with a parallel LSD radix sort. The buffers are
+// kept between calls, so repeated sorts of a similar count do not allocate.
+class MortonSorter {
+public:
+    static constexpr int BITS = 21;  // Bits per axis, i.e. tree levels a key can resolve
+    static constexpr int KEY_BITS = 2 * BITS;
+    
+private:
+    static constexpr int RADIX_BITS = 11;
+    static constexpr uint32_t RADIX = 1u << RADIX_BITS;
+    static constexpr int PASSES = (KEY_BITS + RADIX_BITS - 1) / RADIX_BITS;
+    static constexpr size_t MIN_BLOCK_KEYS = 16384;  // Smaller sorts run in one block
+    
+    std::vector<uint64_t> keyBuffer, keyScratch;
+    std::vector<uint32_t> orderBuffer, orderScratch;
+    std::vector<uint32_t> histograms;  // One RADIX-sized histogram per block
+    
+    static uint64_t spreadBits(uint32_t v) {
+        uint64_t x = v;
+        x = (x | (x << 16)) & 0x0000FFFF0000FFFFull;
+        x = (x | (x << 8)) & 0x00FF00FF00FF00FFull;
+        x = (x | (x << 4)) & 0x0F0F0F0F0F0F0F0Full;
+        x = (x | (x << 2)) & 0x3333333333333333ull;
+        x = (x | (x << 1)) & 0x5555555555555555ull;
+        return x;
+    }
+    
+    static uint32_t compactBits(uint64_t x) {
+        x &= 0x5555555555555555ull;
+        x = (x | (x >> 1)) & 0x3333333333333333ull;
+        x = (x | (x >> 2)) & 0x0F0F0F0F0F0F0F0Full;
+        x = (x | (x >> 4)) & 0x00FF00FF00FF00FFull;
+        x = (x | (x >> 8)) & 0x0000FFFF0000FFFFull;
+        x = (x | (x >> 16)) & 0x00000000FFFFFFFFull;
+        return uint32_t(x);
+    }
+    
+    void radixSort(size_t n) {
+        uint64_t* keys = keyBuffer.data();
+        uint64_t* keysOut = keyScratch.data();
+        uint32_t* order = orderBuffer.data();
+        uint32_t* orderOut = orderScratch.data();
+        
+        // A fixed split into blocks, rather than one per running thread,
+        // keeps the passes independent of how the pool schedules them
+        const size_t blocks = std::clamp<size_t>(n / MIN_BLOCK_KEYS, 1, size_t(maxThreads()));
+        histograms.resize(blocks * RADIX);
+        
+        for (int pass = 0; pass < PASSES; ++pass) {
+            const int shift = pass * RADIX_BITS;
+            
+            parallelFor(blocks, 1, [&](size_t first, size_t last) {
+                for (size_t b = first; b < last; ++b) {
+                    uint32_t* histogram = histograms.data() + b * RADIX;
+                    std::fill(histogram, histogram + RADIX, 0u);
+                    for (size_t i = n * b / blocks; i < n * (b + 1) / blocks; ++i) {
+                        ++histogram[(keys[i] >> shift) & (RADIX - 1)];
+                    }
+                }
+            });
+            
+            // Exclusive prefix sum in (digit, block) order keeps the sort stable
+            uint32_t sum = 0;
+            for (uint32_t d = 0; d < RADIX; ++d) {
+                for (size_t b = 0; b < blocks; ++b) {
+                    uint32_t& slot = histograms[b * RADIX + d];
+                    const uint32_t c = slot;
+                    slot = sum;
+                    sum += c;
+                }
+            }
+            
+            parallelFor(blocks, 1, [&](size_t first, size_t last) {
+                for (size_t b = first; b < last; ++b) {
+                    uint32_t* histogram = histograms.data() + b * RADIX;
+                    for (size_t i = n * b / blocks; i < n * (b + 1) / blocks; ++i) {
+                        const uint32_t slot = histogram[(keys[i] >> shift) & (RADIX - 1)]++;
+                        keysOut[slot] = keys[i];
+                        orderOut[slot] = order[i];
+                    }
+                }
+            });
+            
+            std::swap(keys, keysOut);
+            std::swap(order, orderOut);
+        }
+        
+        // An odd pass count leaves the result in the scratch buffers
+        if (keys != keyBuffer.data()) {
+            keyBuffer.swap(keyScratch);
+            orderBuffer.swap(orderScratch);
+        }
+    }
+    
+public:
+    // Sorts the bodies inside the square [originX, originX + size) x
+    // [originY, originY + size). Bodies outside are clamped to its edge.
+    void sort(const BodySpan& bodies, Real originX, Real originY, Real size) {
+        const size_t n = bodies.count;
+        keyBuffer.resize(n);
+        keyScratch.resize(n);
+        orderBuffer.resize(n);
+        orderScratch.resize(n);
+        
+        const double cells = double(1u << BITS);
+        const double scale = size > 0 ? cells / size : 0.0;
+        const double maxCell = cells - 1.0;
+        
+        parallelFor(n, PARALLEL_GRAIN, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                const double cx = std::clamp((bodies.x[i] - originX) * scale, 0.0, maxCell);
+                const double cy = std::clamp((bodies.y[i] - originY) * scale, 0.0, maxCell);
+                keyBuffer[i] = encode(uint32_t(cx), uint32_t(cy));
+                orderBuffer[i] = uint32_t(i);
+            }
+        });
+        
+        radixSort(n);
+    }
+    
+    // Same, over the bounding square of the bodies
+    void sort(const BodySpan& bodies) {
+        if (bodies.count == 0) {
+            sort(bodies, 0, 0, 0);
+            return;
+        }
+        const BodyBounds box = bodyBounds(bodies);
+        sort(bodies, box.minX, box.minY, std::max(box.maxX - box.minX, box.maxY - box.minY));
+    }
+    
+    // Sorted keys, and the body index each one belongs to
+    const std::vector<uint64_t>& keys() const { return keyBuffer; }
+    const std::vector<uint32_t>& order() const { return orderBuffer; }
+    
+    // Key of the finest cell (cx, cy), and back
+    static uint64_t encode(uint32_t cx, uint32_t cy) { return spreadBits(cx) | (spreadBits(cy) << 1); }
+    static uint32_t cellX(uint64_t key) { return compactBits(key); }
+    static uint32_t cellY(uint64_t key) { return compactBits(key >> 1); }
+    
+    // Child cell (0-3) of a key at the given tree level
+    static uint32_t digit(uint64_t key, int level) {
+        return uint32_t(key >> (2 * (BITS - 1 - level))) & 3u;
+    }
+    
+    size_t bytes() const {
+        return (keyBuffer.capacity() + keyScratch.capacity()) * sizeof(uint64_t) +
+               (orderBuffer.capacity() + orderScratch.capacity() + histograms.capacity()) * sizeof(uint32_t);
+    }
+};
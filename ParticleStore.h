@@ -0,0 +1,294 @@
+#pragma once
+
+#include "Precision.h"
+
+#include <SFML/System/Vector2.hpp>
+#include <vector>
+#include <algorithm>
+#include <array>
+#include <functional>
+#include <string>
+#include <new>
+#include <cstddef>
+#include <cstdint>
+
+// Allocator handing out cache-line aligned storage so the hot arrays can be
+// streamed with aligned vector loads
+template <typename T, std::size_t Alignment = 64>
+struct AlignedAllocator {
+    using value_type = T;
+    
+    template <typename U>
+    struct rebind { using other = AlignedAllocator<U, Alignment>; };
+    
+    AlignedAllocator() noexcept = default;
+    template <typename U>
+    AlignedAllocator(const AlignedAllocator<U, Alignment>&) noexcept {}
+    
+    T* allocate(std::size_t n) {
+        return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(Alignment)));
+    }
+    
+    void deallocate(T* p, std::size_t) noexcept {
+        ::operator delete(p, std::align_val_t(Alignment));
+    }
+    
+    template <typename U>
+    bool operator==(const AlignedAllocator<U, Alignment>&) const noexcept { return true; }
+    template <typename U>
+    bool operator!=(const AlignedAllocator<U, Alignment>&) const noexcept { return false; }
+};
+
+using AlignedFloatArray = std::vector<float, AlignedAllocator<float>>;
+using RealArray = std::vector<Real, AlignedAllocator<Real>>;        // Particle state
+using ForceArray = std::vector<ForceReal, AlignedAllocator<ForceReal>>;  // Kernel inputs
+
+// Non-owning view of position and mass arrays
+template <typename T>
+struct PointSpan {
+    const T* x = nullptr;
+    const T* y = nullptr;
+    const T* m = nullptr;
+    size_t count = 0;
+    
+    sf::Vector2<T> position(size_t i) const { return sf::Vector2<T>(x[i], y[i]); }
+};
+
+// The bodies a force evaluation reads, in the state precision
+using BodySpan = PointSpan<Real>;
+// Sources as the kernels read them, in the pair precision. The same type
+// as BodySpan unless the build is mixed.
+using SourceSpan = PointSpan<ForceReal>;
+
+// Non-owning view of the acceleration arrays a force evaluation writes. When
+// potential is set, solvers that provide one also write each target's G*phi.
+struct AccelerationSpan {
+    Real* ax = nullptr;
+    Real* ay = nullptr;
+    size_t count = 0;
+    Real* potential = nullptr;
+};
+
+// Indices of the bodies whose accelerations are wanted. A default-constructed
+// span selects every body.
+struct TargetSpan {
+    const uint32_t* index = nullptr;
+    size_t count = 0;
+    
+    bool all() const { return index == nullptr; }
+    size_t size(size_t bodyCount) const { return all() ? bodyCount : count; }
+    size_t operator()(size_t k) const { return all() ? k : index[k]; }
+};
+
+// Particle colour packed as 0xRRGGBBAA, the layout of sf::Color::toInteger().
+// The store keeps colours as plain integers so the physics code does not need
+// SFML's graphics module; the renderer converts with sf::Color(packed).
+using PackedColor = uint32_t;
+constexpr PackedColor COLOR_WHITE = 0xFFFFFFFFu;
+
+constexpr PackedColor packColor(uint32_t r, uint32_t g, uint32_t b, uint32_t a = 255) {
+    return (r & 0xFFu) << 24 | (g & 0xFFu) << 16 | (b & 0xFFu) << 8 | (a & 0xFFu);
+}
+
+// Cold per-particle data, indexed by the same ID as the hot arrays
+struct ParticleInfo {
+    PackedColor color = COLOR_WHITE;
+    std::string name;
+    bool fixed = false;  // For fixed bodies like black holes
+    bool trail = true;   // Whether the renderer records a trail for it
+    uint32_t id = 0;     // Insertion order, unchanged when the store is reordered
+    uint64_t serial = 0;  // Unique to the body within its store; unlike id, never handed on
+};
+
+// Structure-of-arrays particle storage. The force loops only touch x, y and m,
+// so they stream through contiguous scalars instead of dragging colors and
+// names through the cache.
+class ParticleStore {
+public:
+    // Hot arrays
+    RealArray x, y;
+    RealArray vx, vy;
+    RealArray ax, ay;
+    RealArray m;
+    
+    // Cold metadata
+    std::vector<ParticleInfo> info;
+    
+    size_t size() const { return m.size(); }
+    bool empty() const { return m.empty(); }
+    
+    size_t add(Vector2r pos, Vector2r vel, Real mass, PackedColor color = COLOR_WHITE,
+               const std::string& name = "", bool fixed = false) {
+        x.push_back(pos.x);
+        y.push_back(pos.y);
+        vx.push_back(vel.x);
+        vy.push_back(vel.y);
+        ax.push_back(0);
+        ay.push_back(0);
+        m.push_back(mass);
+        
+        ParticleInfo meta;
+        meta.color = color;
+        meta.name = name;
+        meta.fixed = fixed;
+        meta.id = static_cast<uint32_t>(info.size());
+        meta.serial = nextSerial++;
+        info.push_back(std::move(meta));
+        
+        return size() - 1;
+    }
+    
+    // Replaces every particle with the given arrays, copied as they are.
+    // Metadata starts at its defaults, with ids in array order.
+    template <typename T>
+    void assign(size_t n, const T* px, const T* py, const T* pvx, const T* pvy, const T* pm) {
+        x.assign(px, px + n);
+        y.assign(py, py + n);
+        vx.assign(pvx, pvx + n);
+        vy.assign(pvy, pvy + n);
+        m.assign(pm, pm + n);
+        ax.assign(n, 0);
+        ay.assign(n, 0);
+        info.assign(n, ParticleInfo());
+        for (size_t i = 0; i < n; ++i) {
+            info[i].id = static_cast<uint32_t>(i);
+            info[i].serial = nextSerial++;
+        }
+    }
+    
+    // Adds n particles with zeroed state for bulk generators that fill the
+    // hot arrays in place. The store must be in insertion order; returns the
+    // slot of the first new particle.
+    size_t append(size_t n, PackedColor color = COLOR_WHITE, bool trail = true) {
+        const size_t first = size();
+        for (auto* a : hotArrays()) {
+            a->resize(first + n, 0);
+        }
+        ParticleInfo meta;
+        meta.color = color;
+        meta.trail = trail;
+        info.resize(first + n, meta);
+        for (size_t i = first; i < first + n; ++i) {
+            info[i].id = static_cast<uint32_t>(i);
+            info[i].serial = nextSerial++;
+        }
+        return first;
+    }
+    
+    void reserve(size_t n) {
+        for (auto* a : hotArrays()) {
+            a->reserve(n);
+        }
+        info.reserve(n);
+    }
+    
+    // Keeps the first n particles in insertion order
+    void truncate(size_t n) {
+        if (n >= size()) return;
+        restoreInsertionOrder();
+        for (auto* a : hotArrays()) {
+            a->resize(n);
+        }
+        info.resize(n);
+    }
+    
+    void clear() {
+        for (auto* a : hotArrays()) {
+            a->clear();
+        }
+        info.clear();
+    }
+    
+    // Reorders every particle so that new slot i holds old particle order[i].
+    // An order shorter than the store drops the particles it leaves out.
+    void permute(const std::vector<uint32_t>& order) {
+        const size_t n = order.size();
+        for (auto* a : hotArrays()) {
+            scratch.resize(n);
+            for (size_t i = 0; i < n; ++i) {
+                scratch[i] = (*a)[order[i]];
+            }
+            a->swap(scratch);
+        }
+        
+        infoScratch.resize(n);
+        for (size_t i = 0; i < n; ++i) {
+            std::swap(infoScratch[i], info[order[i]]);
+        }
+        info.swap(infoScratch);
+    }
+    
+    // Removes the particles at the given slots (each at most once) by moving
+    // the last particle into every freed slot. Ids stay 0..size()-1: the
+    // survivors with the highest ids take over the ids of the removed ones,
+    // keeping their serials, so an id whose serial changed names another body.
+    void removeSwapAndPop(std::vector<uint32_t> slots) {
+        const size_t oldSize = size();
+        std::vector<uint8_t> freedId(oldSize, 0);
+        for (uint32_t i : slots) {
+            freedId[info[i].id] = 1;
+        }
+        
+        // Descending, so the last particle is never one still to be removed
+        std::sort(slots.begin(), slots.end(), std::greater<uint32_t>());
+        for (uint32_t i : slots) {
+            const size_t last = size() - 1;
+            if (i != last) {
+                for (auto* a : hotArrays()) {
+                    (*a)[i] = (*a)[last];
+                }
+                info[i] = std::move(info[last]);
+            }
+            for (auto* a : hotArrays()) {
+                a->pop_back();
+            }
+            info.pop_back();
+        }
+        
+        const size_t n = size();
+        std::vector<uint32_t> holes;
+        for (uint32_t id = 0; id < n; ++id) {
+            if (freedId[id]) holes.push_back(id);
+        }
+        std::vector<uint32_t> movers;  // Slots of survivors whose id is now out of range
+        for (uint32_t i = 0; i < n; ++i) {
+            if (info[i].id >= n) movers.push_back(i);
+        }
+        std::sort(movers.begin(), movers.end(), [&](uint32_t a, uint32_t b) { return info[a].id < info[b].id; });
+        for (size_t k = 0; k < movers.size(); ++k) {
+            info[movers[k]].id = holes[k];
+        }
+    }
+    
+    void restoreInsertionOrder() {
+        const size_t n = size();
+        orderScratch.resize(n);
+        for (size_t i = 0; i < n; ++i) {
+            orderScratch[info[i].id] = static_cast<uint32_t>(i);
+        }
+        permute(orderScratch);
+    }
+    
+    BodySpan bodies() const { return BodySpan{x.data(), y.data(), m.data(), size()}; }
+    AccelerationSpan accelerations() { return AccelerationSpan{ax.data(), ay.data(), size()}; }
+    
+    Vector2r position(size_t i) const { return Vector2r(x[i], y[i]); }
+    Vector2r velocity(size_t i) const { return Vector2r(vx[i], vy[i]); }
+    
+    Real kineticEnergy(size_t i) const {
+        Real v2 = vx[i] * vx[i] + vy[i] * vy[i];
+        return Real(0.5) * m[i] * v2;
+    }
+    
+private:
+    uint64_t nextSerial = 0;  // Not reset by clear(), so serials are never reused
+    
+    // Reorder buffers
+    RealArray scratch;
+    std::vector<ParticleInfo> infoScratch;
+    std::vector<uint32_t> orderScratch;
+    
+    std::array<RealArray*, 7> hotArrays() {
+        return {&x, &y, &vx, &vy, &ax, &ay, &m};
+    }
+};
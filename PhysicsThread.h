@@ -0,0 +1,363 @@
+#pragma once
+
+#include "SimulationCore.h"
+#include "BarnesHut.h"
+#include "TripleBuffer.h"
+#include "Profiler.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// One cell of the view tree: a QuadTree cell copied to float for the
+// renderer, with the aggregate its level-of-detail splat draws. Bodies
+// weigh their mass, or 1 when they have none, so cells of massless tracers
+// still show.
+struct ViewNode {
+    float centerX = 0, centerY = 0, halfSize = 0;  // Square covering the cell's bodies
+    float comX = 0, comY = 0;                      // Weighted centre of its bodies
+    float weight = 0;
+    float maxMass = 0;                             // Heaviest body, which sets the splat's size
+    PackedColor color = COLOR_WHITE;               // Weighted mean colour
+    uint32_t firstChild = QuadTreeNode::NO_CHILD;  // As in QuadTreeNode; begin and count
+    uint32_t begin = 0;                            // index FrameSnapshot::viewBodies
+    uint32_t count = 0;
+    
+    bool isLeaf() const { return firstChild == QuadTreeNode::NO_CHILD; }
+};
+
+// Particle state handed from the physics thread to the renderer. The arrays
+// are indexed by ParticleInfo::id rather than by store slot, so consecutive
+// snapshots line up for interpolation even after a Morton reorder. The state
+// is converted to float here, the precision the renderer draws in, whatever
+// the build's Real.
+struct FrameSnapshot {
+    std::vector<float> x, y;
+    std::vector<float> vx, vy;
+    std::vector<float> m;
+    std::vector<PackedColor> color;
+    std::vector<uint8_t> trail;  // ParticleInfo::trail
+    std::vector<uint64_t> serial;  // ParticleInfo::serial; a change means the id was handed to another body
+    
+    // Cells of the view tree in QuadTree order (root first, children after
+    // their parent) and the ids of their bodies in the leaves' order; empty
+    // unless the front end asked for it with PhysicsThread::setViewTree()
+    std::vector<ViewNode> viewNodes;
+    std::vector<uint32_t> viewBodies;
+    
+    uint64_t generation = 0;  // SimulationCore::getGeneration()
+    uint64_t step = 0;
+    double time = 0.0;
+    double kineticEnergy = 0.0;
+    bool hasDiagnostics = false;  // Whether diagnostics holds a measurement of this run
+    Diagnostics diagnostics;      // The last one, usually a few steps old
+    size_t trailLength = 0;
+    uint32_t trailInterval = 1;
+    double stepMs = 0.0;      // Wall time of the last physics step
+    std::string solverName;
+    bool hasTree = false;
+    TreeStats tree;
+    bool profiled = false;    // Whether profile holds the physics phases
+    ProfileSummary profile;
+    std::chrono::steady_clock::time_point published;
+    
+    size_t size() const { return m.size(); }
+    
+    void capture(const SimulationCore& core) {
+        const ParticleStore& particles = core.getParticles();
+        const size_t n = particles.size();
+        for (auto* a : {&x, &y, &vx, &vy, &m}) {
+            a->resize(n);
+        }
+        color.resize(n);
+        trail.resize(n);
+        serial.resize(n);
+        for (size_t i = 0; i < n; ++i) {
+            const uint32_t id = particles.info[i].id;
+            x[id] = float(particles.x[i]);
+            y[id] = float(particles.y[i]);
+            vx[id] = float(particles.vx[i]);
+            vy[id] = float(particles.vy[i]);
+            m[id] = float(particles.m[i]);
+            color[id] = particles.info[i].color;
+            trail[id] = particles.info[i].trail;
+            serial[id] = particles.info[i].serial;
+        }
+        
+        generation = core.getGeneration();
+        step = core.getStepCount();
+        time = core.getTime();
+        kineticEnergy = core.totalKineticEnergy();
+        hasDiagnostics = core.hasDiagnostics();
+        if (hasDiagnostics) diagnostics = core.getDiagnostics();
+        trailLength = core.getConstants().TRAIL_LENGTH;
+        trailInterval = core.getConstants().TRAIL_INTERVAL;
+        
+        const ForceSolver& solver = core.getForceSolver();
+        solverName = solver.name();
+        const TreeStats* stats = solver.treeStats();
+        hasTree = stats != nullptr;
+        if (stats) tree = *stats;
+    }
+    
+    // Copies tree, built over particles, into viewNodes and viewBodies
+    void captureViewTree(const QuadTree& tree, const ParticleStore& particles) {
+        const std::vector<QuadTreeNode>& nodes = tree.getNodes();
+        viewBodies.resize(particles.size());
+        viewNodes.resize(nodes.size());
+        
+        // Weighted sums of a cell's bodies or children
+        struct Aggregate {
+            double weight = 0.0, momentX = 0.0, momentY = 0.0;
+            double red = 0.0, green = 0.0, blue = 0.0;
+            float maxMass = 0.0f;
+            
+            void add(double w, double px, double py, PackedColor c) {
+                weight += w;
+                momentX += w * px;
+                momentY += w * py;
+                red += w * (c >> 24 & 0xFFu);
+                green += w * (c >> 16 & 0xFFu);
+                blue += w * (c >> 8 & 0xFFu);
+            }
+            
+            void store(ViewNode& view) const {
+                view.weight = float(weight);
+                view.maxMass = maxMass;
+                if (weight > 0.0) {
+                    view.comX = float(momentX / weight);
+                    view.comY = float(momentY / weight);
+                    view.color = packColor(uint32_t(red / weight + 0.5), uint32_t(green / weight + 0.5),
+                                           uint32_t(blue / weight + 0.5));
+                } else {
+                    view.comX = view.centerX;
+                    view.comY = view.centerY;
+                }
+            }
+        };
+        
+        // Every cell's square and range, and the leaves' aggregates, read
+        // from the bodies in the tree's order
+        parallelFor(nodes.size(), 64, [&](size_t first, size_t last) {
+            for (size_t n = first; n < last; ++n) {
+                const QuadTreeNode& node = nodes[n];
+                ViewNode& view = viewNodes[n];
+                view.centerX = float(node.boundary.center.x);
+                view.centerY = float(node.boundary.center.y);
+                view.halfSize = float(node.boundary.halfSize);
+                view.firstChild = node.firstChild;
+                view.begin = node.begin;
+                view.count = node.count;
+                if (!node.isLeaf()) continue;
+                
+                Aggregate sums;
+                for (uint32_t k = node.begin; k < node.begin + node.count; ++k) {
+                    const uint32_t i = tree.bodyAt(k);
+                    const ForceVector2 position = tree.sortedPosition(k);
+                    const float mass = float(particles.m[i]);
+                    sums.add(mass > 0.0f ? mass : 1.0f, position.x, position.y, particles.info[i].color);
+                    sums.maxMass = std::max(sums.maxMass, mass);
+                    viewBodies[k] = particles.info[i].id;
+                }
+                sums.store(view);
+            }
+        });
+        
+        // Then the cells above them, children before parents
+        for (size_t n = nodes.size(); n-- > 0;) {
+            ViewNode& view = viewNodes[n];
+            if (view.isLeaf()) continue;
+            Aggregate sums;
+            for (int q = 0; q < QuadTree::NUM_CHILDREN; ++q) {
+                const ViewNode& child = viewNodes[view.firstChild + q];
+                if (child.count == 0) continue;
+                sums.add(child.weight, child.comX, child.comY, child.color);
+                sums.maxMass = std::max(sums.maxMass, child.maxMass);
+            }
+            sums.store(view);
+        }
+    }
+    
+    void clearViewTree() {
+        viewNodes.clear();
+        viewBodies.clear();
+    }
+};
+
+// Work the front end wants done on the simulation, run by the physics thread
+// between steps
+using SimulationCommand = std::function<void(SimulationCore&)>;
+
+// Input events arrive a few per second at most, so a mutex is cheap here;
+// the physics thread takes all pending commands in one swap.
+class CommandQueue {
+private:
+    std::mutex mutex;
+    std::vector<SimulationCommand> pending;
+    
+public:
+    void push(SimulationCommand command) {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending.push_back(std::move(command));
+    }
+    
+    // Replaces out with every pending command, in submission order
+    void drain(std::vector<SimulationCommand>& out) {
+        out.clear();
+        std::lock_guard<std::mutex> lock(mutex);
+        out.swap(pending);
+    }
+};
+
+// Steps a SimulationCore on its own thread at PHYSICS_RATE steps per second
+// and publishes a FrameSnapshot after every step, so a slow frame does not
+// hold up physics and a slow step does not hold up the window. Once started,
+// the core must only be touched through submit().
+class PhysicsThread {
+private:
+    static constexpr double IDLE_RATE = 60.0;  // Command polling rate while paused and unthrottled
+    
+    SimulationCore& core;
+    TripleBuffer<FrameSnapshot> snapshots;
+    CommandQueue commands;
+    std::vector<SimulationCommand> running;
+    std::atomic<bool> stopRequested{false};
+    std::atomic<bool> paused{false};
+    double lastStepMs = 0.0;
+    std::thread thread;
+    
+    // Physics phases of every step while profiling is on, and of the whole
+    // run while tracing
+    std::atomic<bool> profiling{false};
+    Profiler profiler{"physics"};
+    PhaseHistory history;
+    bool profilingActive = false;
+    
+    // Kept apart from the solver's tree, which may not exist or may be a
+    // step behind, and refit between builds like it. Its leaves index store
+    // slots, so a reload or reorder forces a rebuild.
+    std::atomic<bool> viewTreeWanted{false};
+    QuadTree viewTree;
+    uint64_t viewTreeGeneration = 0;
+    uint64_t viewTreeReorders = 0;
+    
+    void publish() {
+        FrameSnapshot& snapshot = snapshots.write();
+        snapshot.capture(core);
+        const ParticleStore& particles = core.getParticles();
+        if (viewTreeWanted.load(std::memory_order_relaxed) && particles.size() > 0) {
+            if (core.getGeneration() != viewTreeGeneration || core.getReorderCount() != viewTreeReorders) {
+                viewTree.invalidate();
+                viewTreeGeneration = core.getGeneration();
+                viewTreeReorders = core.getReorderCount();
+            }
+            viewTree.update(particles.bodies());
+            snapshot.captureViewTree(viewTree, particles);
+        } else {
+            snapshot.clearViewTree();
+        }
+        snapshot.stepMs = lastStepMs;
+        snapshot.profiled = profilingActive;
+        if (profilingActive) snapshot.profile = history.summary();
+        snapshot.published = std::chrono::steady_clock::now();
+        snapshots.publish();
+    }
+    
+    void loop() {
+        using Clock = std::chrono::steady_clock;
+        auto next = Clock::now();
+        publish();
+        while (!stopRequested.load(std::memory_order_relaxed)) {
+            commands.drain(running);
+            for (auto& command : running) {
+                command(core);
+            }
+            bool changed = !running.empty();
+            
+            const bool isPaused = paused.load(std::memory_order_relaxed);
+            const bool profile = profiling.load(std::memory_order_relaxed) || profiler.isTracing();
+            if (profile != profilingActive) {
+                history.clear();
+                profilingActive = profile;
+                changed = true;
+            }
+            activeProfiler = profile ? &profiler : nullptr;
+            if (!isPaused) {
+                profiler.beginFrame();
+                const auto start = Clock::now();
+                core.step();
+                lastStepMs = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+                if (profile) {
+                    history.push(profiler.phaseMs, {ProfilePhase::TreeBuild, ProfilePhase::CenterOfMass,
+                                                    ProfilePhase::ForceWalk, ProfilePhase::Integrate});
+                    if (core.getConstants().COLLISIONS) {
+                        history.push(profiler.phaseMs, {ProfilePhase::Collisions});
+                    }
+                }
+                changed = true;
+            }
+            if (changed) {
+                publish();
+            }
+            
+            double rate = core.getConstants().PHYSICS_RATE;
+            if (isPaused && rate <= 0.0) rate = IDLE_RATE;
+            if (rate > 0.0) {
+                next += std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0 / rate));
+                const auto now = Clock::now();
+                if (next < now) {
+                    next = now;  // Behind: carry on at the rate instead of catching up in a burst
+                } else {
+                    std::this_thread::sleep_until(next);
+                }
+            }
+        }
+    }
+    
+public:
+    explicit PhysicsThread(SimulationCore& core) : core(core) {}
+    ~PhysicsThread() { stop(); }
+    PhysicsThread(const PhysicsThread&) = delete;
+    PhysicsThread& operator=(const PhysicsThread&) = delete;
+    
+    void start() {
+        if (thread.joinable()) return;
+        stopRequested = false;
+        thread = std::thread(&PhysicsThread::loop, this);
+    }
+    
+    void stop() {
+        if (!thread.joinable()) return;
+        stopRequested = true;
+        thread.join();
+    }
+    
+    void submit(SimulationCommand command) { commands.push(std::move(command)); }
+    
+    void setPaused(bool value) { paused = value; }
+    bool isPaused() const { return paused; }
+    
+    // Times the physics phases of every step into FrameSnapshot::profile
+    void setProfiling(bool value) { profiling = value; }
+    
+    // Publishes a view tree with every snapshot, for culling and
+    // level-of-detail drawing
+    void setViewTree(bool value) { viewTreeWanted = value; }
+    
+    // Records every physics phase until the thread stops. Call before
+    // start(); read the trace with traceProfiler() after stop().
+    void startTrace() {
+        if (!thread.joinable()) profiler.startTrace();
+    }
+    const Profiler& traceProfiler() const { return profiler; }
+    
+    // Render side: switches to the newest snapshot if one was published
+    // since the last call, and returns whether it did
+    bool acquireSnapshot() { return snapshots.acquire(); }
+    const FrameSnapshot& snapshot() const { return snapshots.read(); }
+};
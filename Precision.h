@@ -0,0 +1,34 @@
+#pragma once
+
+#include <SFML/System/Vector2.hpp>
+
+// Scalar types of the physics core, fixed at compile time by ASTRO_PRECISION
+// (-DASTRO_PRECISION=float|double|mixed):
+//
+//   float    everything in float (the default)
+//   double   everything in double
+//   mixed    positions, velocities and accumulated accelerations in double;
+//            the pairwise interaction in float, so the SIMD kernels keep
+//            their full width
+//
+// Real is the type of the particle state and of every sum over it;
+// ForceReal is the type the force kernels and tree walks compute a pair in.
+// Rendering, trajectories and the GPU backend stay in float and convert
+// where the data leaves the physics core.
+
+#if defined(ASTRO_PRECISION_DOUBLE)
+using Real = double;
+using ForceReal = double;
+constexpr const char* PRECISION_NAME = "double";
+#elif defined(ASTRO_PRECISION_MIXED)
+using Real = double;
+using ForceReal = float;
+constexpr const char* PRECISION_NAME = "mixed";
+#else
+using Real = float;
+using ForceReal = float;
+constexpr const char* PRECISION_NAME = "float";
+#endif
+
+using Vector2r = sf::Vector2<Real>;
+using ForceVector2 = sf::Vector2<ForceReal>;
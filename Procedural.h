@@ -0,0 +1,242 @@
+#pragma once
+
+#include "ParticleStore.h"
+#include "Interaction.h"
+#include "Threading.h"
+
+#include <nlohmann/json.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+
+// Populations generated at load time from the "procedural_particles" block of
+// a scenario, so large scenes need not list every body. Each entry makes
+// `count` bodies of one "type":
+//
+//   disk      rotating disk between inner_radius and outer_radius, uniform
+//             in area, on near-circular orbits around its centre
+//   plummer   Plummer sphere of scale_radius, projected on the plane, with
+//             isotropic velocities from its distribution function
+//   uniform   cloud uniform over a circle of radius, at rest
+//
+// Bodies are written straight into the particle store in parallel. Every body
+// draws from its own random stream keyed on the seed and its index, so a
+// scenario produces the same bodies whatever the thread count.
+
+constexpr uint64_t DEFAULT_PROCEDURAL_SEED = 1;
+constexpr double PROCEDURAL_PI = 3.14159265358979323846;
+
+enum class PopulationType { Disk, Plummer, Uniform };
+
+// SplitMix64 keyed on (seed, index)
+class BodyRandom {
+private:
+    uint64_t state;
+    
+public:
+    BodyRandom(uint64_t seed, uint64_t index) : state(seed ^ (index + 1) * 0x9E3779B97F4A7C15ull) { next(); }
+    
+    uint64_t next() {
+        uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        return z ^ (z >> 31);
+    }
+    
+    // In [0, 1)
+    double uniform() { return (next() >> 11) * 0x1.0p-53; }
+    double uniform(double lo, double hi) { return lo + (hi - lo) * uniform(); }
+    
+    // Standard normal (Box-Muller)
+    double normal() {
+        const double u = 1.0 - uniform();  // (0, 1], keeps log finite
+        return std::sqrt(-2.0 * std::log(u)) * std::cos(2.0 * PROCEDURAL_PI * uniform());
+    }
+};
+
+// Settings of the scenario the populations are generated for
+struct ProceduralContext {
+    Real G = 1;
+    Softening softening;
+    uint64_t seed = DEFAULT_PROCEDURAL_SEED;  // Scenario "seed"
+};
+
+// Speed of a circular orbit of radius r around mass M under the softened
+// force the solvers apply, v^2 = G M r^2 f(r^2)
+inline double circularSpeed(double G, double M, double r, const Softening& softening) {
+    return std::sqrt(G * M * r * r * softening.factor(r * r));
+}
+
+// Random direction in 3D projected on the plane, scaled by length
+inline void projectIsotropic(BodyRandom& rng, double length, double& px, double& py) {
+    const double cosTheta = rng.uniform(-1.0, 1.0);
+    const double sinTheta = std::sqrt(1.0 - cosTheta * cosTheta);
+    const double phi = 2.0 * PROCEDURAL_PI * rng.uniform();
+    px = length * sinTheta * std::cos(phi);
+    py = length * sinTheta * std::sin(phi);
+}
+
+inline uint64_t populationSeed(uint64_t scenarioSeed, uint64_t index) {
+    return BodyRandom(scenarioSeed, index).next();
+}
+
+// Number of bodies a "procedural_particles" entry makes
+inline size_t populationCount(const nlohmann::json& block) {
+    return block.value("count", size_t(0));
+}
+
+// Appends the population described by `block` to the store, after the
+// explicit bodies a "center_ref" may name, and returns the number of bodies
+// added. `index` is the entry's position in the list; it keeps entries
+// without their own "seed" on separate streams. Only bodies [from, to) of the
+// population are made, the same as in a full run, so processes that share a
+// run (Distributed.h) can each generate their own part. Throws
+// std::runtime_error for an invalid entry.
+inline size_t generatePopulation(ParticleStore& particles, const nlohmann::json& block,
+                                 const ProceduralContext& context, uint64_t index,
+                                 size_t from = 0, size_t to = SIZE_MAX) {
+    const std::string typeName = block.value("type", "disk");
+    PopulationType type;
+    if (typeName == "disk") {
+        type = PopulationType::Disk;
+    } else if (typeName == "plummer") {
+        type = PopulationType::Plummer;
+    } else if (typeName == "uniform") {
+        type = PopulationType::Uniform;
+    } else {
+        throw std::runtime_error("procedural_particles: unknown type \"" + typeName + "\"");
+    }
+    const size_t count = populationCount(block);
+    to = std::min(to, count);
+    
+    // Centre, bulk velocity and (for disks) central mass from a named body
+    // or from the entry itself
+    double cx = 0.0, cy = 0.0, cvx = 0.0, cvy = 0.0, centralMass = 0.0;
+    if (block.contains("center_ref")) {
+        const std::string ref = block["center_ref"];
+        size_t i = 0;
+        while (i < particles.size() && particles.info[i].name != ref) ++i;
+        if (i == particles.size()) {
+            throw std::runtime_error("procedural_particles: no body named \"" + ref + "\"");
+        }
+        cx = particles.x[i];
+        cy = particles.y[i];
+        cvx = particles.vx[i];
+        cvy = particles.vy[i];
+        centralMass = particles.m[i];
+    } else {
+        if (block.contains("center")) {
+            cx = block["center"][0];
+            cy = block["center"][1];
+        }
+        if (block.contains("velocity")) {
+            cvx = block["velocity"][0];
+            cvy = block["velocity"][1];
+        }
+    }
+    centralMass = block.value("central_mass", centralMass);
+    
+    double massLo = 1.0, massHi = 1.0;
+    if (block.contains("mass_range")) {
+        massLo = block["mass_range"][0];
+        massHi = block["mass_range"][1];
+    } else if (block.contains("mass")) {
+        massLo = massHi = block["mass"].get<double>();
+    }
+    if (block.value("tracer", false)) massLo = massHi = 0.0;
+    const double totalMass = 0.5 * (massLo + massHi) * count;  // Expected
+    
+    PackedColor color = COLOR_WHITE;
+    if (block.contains("color")) {
+        color = packColor(block["color"][0], block["color"][1], block["color"][2]);
+    }
+    
+    // The simulation is planar; the out-of-plane dispersion older scenarios
+    // give as random_z_velocity is applied in the plane instead
+    const double dispersion = block.value("velocity_dispersion", block.value("random_z_velocity", 0.0));
+    const double velocityFactor = block.value("orbital_velocity_factor", block.value("velocity_factor", 1.0));
+    const double spin = block.value("clockwise", false) ? -1.0 : 1.0;
+    
+    const double innerRadius = block.value("inner_radius", 0.0);
+    const double outerRadius = block.value("outer_radius", 100.0);
+    const double scaleRadius = block.value("scale_radius", 50.0);
+    const double maxRadius = block.value("max_radius", 10.0 * scaleRadius);
+    const double cloudRadius = block.value("radius", 100.0);
+    if (outerRadius <= innerRadius || scaleRadius <= 0.0 || maxRadius <= 0.0 || cloudRadius <= 0.0) {
+        throw std::runtime_error("procedural_particles: invalid radii in a \"" + typeName + "\" entry");
+    }
+    
+    const uint64_t seed = block.value("seed", populationSeed(context.seed, index));
+    const double G = context.G;
+    const Softening softening = context.softening;
+    
+    if (from >= to) return 0;
+    
+    // Generated bodies record no trail unless asked to: a trail per body of
+    // a million-body disk would dwarf the simulation itself
+    const size_t first = particles.append(to - from, color, block.value("trail", false));
+    Real* x = particles.x.data() + first;
+    Real* y = particles.y.data() + first;
+    Real* vx = particles.vx.data() + first;
+    Real* vy = particles.vy.data() + first;
+    Real* m = particles.m.data() + first;
+    
+    parallelFor(to - from, PARALLEL_GRAIN, [&](size_t begin, size_t end) {
+        for (size_t k = begin; k < end; ++k) {
+            BodyRandom rng(seed, static_cast<uint64_t>(from + k));
+            double px = 0.0, py = 0.0, pvx = 0.0, pvy = 0.0;
+            
+            if (type == PopulationType::Disk) {
+                const double r2Inner = innerRadius * innerRadius;
+                const double r2Outer = outerRadius * outerRadius;
+                const double r = std::sqrt(rng.uniform(r2Inner, r2Outer));
+                const double angle = 2.0 * PROCEDURAL_PI * rng.uniform();
+                px = r * std::cos(angle);
+                py = r * std::sin(angle);
+                
+                // Central body plus the share of the disk inside r
+                const double enclosed = centralMass + totalMass * (r * r - r2Inner) / (r2Outer - r2Inner);
+                const double speed = velocityFactor * circularSpeed(G, enclosed, r, softening);
+                pvx = -spin * speed * std::sin(angle);
+                pvy = spin * speed * std::cos(angle);
+            } else if (type == PopulationType::Plummer) {
+                // Radius from the inverted cumulative mass, truncated at maxRadius
+                double r;
+                do {
+                    const double u = 1.0 - rng.uniform();
+                    r = scaleRadius / std::sqrt(std::pow(u, -2.0 / 3.0) - 1.0);
+                } while (r > maxRadius);
+                projectIsotropic(rng, r, px, py);
+                
+                // Speed as a fraction q of the escape speed, from g(q) = q^2 (1 - q^2)^3.5
+                // by rejection (Aarseth, Henon and Wielen 1974)
+                double q, g;
+                do {
+                    q = rng.uniform();
+                    g = 0.1 * rng.uniform();
+                } while (g > q * q * std::pow(1.0 - q * q, 3.5));
+                const double escape = std::sqrt(2.0 * G * totalMass) * std::pow(r * r + scaleRadius * scaleRadius, -0.25);
+                projectIsotropic(rng, velocityFactor * q * escape, pvx, pvy);
+            } else {
+                const double r = cloudRadius * std::sqrt(rng.uniform());
+                const double angle = 2.0 * PROCEDURAL_PI * rng.uniform();
+                px = r * std::cos(angle);
+                py = r * std::sin(angle);
+            }
+            
+            if (dispersion > 0.0) {
+                pvx += dispersion * rng.normal();
+                pvy += dispersion * rng.normal();
+            }
+            
+            x[k] = static_cast<Real>(cx + px);
+            y[k] = static_cast<Real>(cy + py);
+            vx[k] = static_cast<Real>(cvx + pvx);
+            vy[k] = static_cast<Real>(cvy + pvy);
+            m[k] = static_cast<Real>(rng.uniform(massLo, massHi));
+        }
+    });
+    return to - from;
+}
@@ -0,0 +1,262 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <initializer_list>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Per-phase timing of the hot path. Code marks a phase with
+//
+//   PROFILE_SCOPE(ProfilePhase::ForceWalk);
+//
+// which times the rest of the enclosing block on the calling thread when that
+// thread has a Profiler installed (activeProfiler) and costs a thread-local
+// load and a branch when it has not. Scopes nest: a phase's time excludes the
+// phases opened inside it, so the phases of a frame add up to the frame.
+// Scopes only count on the thread that installed the profiler, so they wrap
+// parallel regions rather than sit inside them. Building with
+// ASTRO_DISABLE_PROFILING (-DASTRO_ENABLE_PROFILING=OFF) removes them.
+//
+// A Profiler can also keep every scope as a trace event, written by
+// writeChromeTrace() in the Chrome trace format that chrome://tracing and
+// ui.perfetto.dev open.
+
+enum class ProfilePhase : uint8_t {
+    Events,
+    TreeBuild,
+    CenterOfMass,
+    ForceWalk,
+    Integrate,
+    Collisions,
+    Trails,
+    Upload,
+    Draw,
+    Count
+};
+
+constexpr size_t PROFILE_PHASES = static_cast<size_t>(ProfilePhase::Count);
+
+inline const char* profilePhaseName(ProfilePhase phase) {
+    switch (phase) {
+        case ProfilePhase::Events: return "events";
+        case ProfilePhase::TreeBuild: return "tree build";
+        case ProfilePhase::CenterOfMass: return "center of mass";
+        case ProfilePhase::ForceWalk: return "force walk";
+        case ProfilePhase::Integrate: return "integrate";
+        case ProfilePhase::Collisions: return "collisions";
+        case ProfilePhase::Trails: return "trails";
+        case ProfilePhase::Upload: return "vertex upload";
+        case ProfilePhase::Draw: return "draw";
+        default: return "unknown";
+    }
+}
+
+using ProfileClock = std::chrono::steady_clock;
+
+// Common time origin of every trace, fixed by the first call
+inline ProfileClock::time_point profileEpoch() {
+    static const ProfileClock::time_point epoch = ProfileClock::now();
+    return epoch;
+}
+
+struct TraceEvent {
+    ProfilePhase phase;
+    double startUs;     // Since profileEpoch()
+    double durationUs;  // Inclusive of nested phases
+};
+
+class ProfileScope;
+
+// Phase times of one thread. Owned by the thread's loop, which installs it
+// as activeProfiler and calls beginFrame() at the start of every frame or step.
+class Profiler {
+public:
+    static constexpr size_t DEFAULT_MAX_TRACE_EVENTS = size_t(1) << 22;  // ~100 MB of events
+    
+    std::array<double, PROFILE_PHASES> phaseMs{};  // Exclusive times since beginFrame()
+    std::vector<TraceEvent> trace;
+    std::string threadName;
+    uint64_t droppedEvents = 0;  // Past maxTraceEvents
+    
+    explicit Profiler(std::string threadName = "main") : threadName(std::move(threadName)) {}
+    
+    void beginFrame() { phaseMs.fill(0.0); }
+    
+    // Keeps every scope from now on, up to maxEvents of them
+    void startTrace(size_t maxEvents = DEFAULT_MAX_TRACE_EVENTS) {
+        profileEpoch();
+        trace.clear();
+        trace.reserve(std::min<size_t>(maxEvents, 1 << 16));
+        maxTraceEvents = maxEvents;
+        tracing = true;
+    }
+    bool isTracing() const { return tracing; }
+    
+private:
+    friend class ProfileScope;
+    
+    ProfileScope* top = nullptr;  // Innermost open scope
+    bool tracing = false;
+    size_t maxTraceEvents = 0;
+    
+    void record(ProfilePhase phase, ProfileClock::time_point start, double ms) {
+        if (trace.size() >= maxTraceEvents) {
+            ++droppedEvents;
+            return;
+        }
+        const double startUs = std::chrono::duration<double, std::micro>(start - profileEpoch()).count();
+        trace.push_back(TraceEvent{phase, startUs, ms * 1000.0});
+    }
+};
+
+// Profiler of the calling thread; null when it is not profiling
+inline thread_local Profiler* activeProfiler = nullptr;
+
+class ProfileScope {
+private:
+    Profiler* profiler;
+    ProfileScope* parent = nullptr;
+    ProfilePhase phase;
+    ProfileClock::time_point start;
+    double childMs = 0.0;
+    
+public:
+    explicit ProfileScope(ProfilePhase phase) : profiler(activeProfiler), phase(phase) {
+        if (!profiler) return;
+        parent = profiler->top;
+        profiler->top = this;
+        start = ProfileClock::now();
+    }
+    
+    ~ProfileScope() {
+        if (!profiler) return;
+        const double ms = std::chrono::duration<double, std::milli>(ProfileClock::now() - start).count();
+        profiler->phaseMs[static_cast<size_t>(phase)] += ms - childMs;
+        if (parent) parent->childMs += ms;
+        profiler->top = parent;
+        if (profiler->tracing) profiler->record(phase, start, ms);
+    }
+    
+    ProfileScope(const ProfileScope&) = delete;
+    ProfileScope& operator=(const ProfileScope&) = delete;
+};
+
+#ifdef ASTRO_DISABLE_PROFILING
+#define PROFILE_SCOPE(phase)
+#else
+#define PROFILE_CONCAT_INNER(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_INNER(a, b)
+#define PROFILE_SCOPE(phase) ProfileScope PROFILE_CONCAT(profileScope, __LINE__)(phase)
+#endif
+
+struct PhaseSummary {
+    float averageMs = 0.0f;
+    float p99Ms = 0.0f;
+    size_t samples = 0;
+};
+
+using ProfileSummary = std::array<PhaseSummary, PROFILE_PHASES>;
+
+// The last `window` samples of every phase, for rolling averages and
+// percentiles. Phases fill at their own rate: physics phases once per step,
+// render phases once per frame.
+class PhaseHistory {
+private:
+    struct Ring {
+        std::vector<float> values;
+        size_t next = 0;
+    };
+    
+    std::array<Ring, PROFILE_PHASES> rings;
+    size_t window;
+    std::vector<float> sorted;  // Scratch for the percentiles
+    
+public:
+    static constexpr size_t DEFAULT_WINDOW = 240;  // 4 s at 60 Hz
+    
+    explicit PhaseHistory(size_t window = DEFAULT_WINDOW) : window(std::max<size_t>(window, 1)) {}
+    
+    void push(ProfilePhase phase, double ms) {
+        Ring& ring = rings[static_cast<size_t>(phase)];
+        if (ring.values.size() < window) {
+            ring.values.push_back(static_cast<float>(ms));
+        } else {
+            ring.values[ring.next] = static_cast<float>(ms);
+            ring.next = (ring.next + 1) % window;
+        }
+    }
+    
+    // Pushes phaseMs of the given phases
+    void push(const std::array<double, PROFILE_PHASES>& phaseMs, std::initializer_list<ProfilePhase> phases) {
+        for (ProfilePhase phase : phases) {
+            push(phase, phaseMs[static_cast<size_t>(phase)]);
+        }
+    }
+    
+    void clear() {
+        for (Ring& ring : rings) {
+            ring.values.clear();
+            ring.next = 0;
+        }
+    }
+    
+    ProfileSummary summary() {
+        ProfileSummary result;
+        for (size_t p = 0; p < PROFILE_PHASES; ++p) {
+            const std::vector<float>& values = rings[p].values;
+            if (values.empty()) continue;
+            double sum = 0.0;
+            for (float v : values) sum += v;
+            sorted.assign(values.begin(), values.end());
+            const size_t rank = std::min(sorted.size() - 1, static_cast<size_t>(0.99 * sorted.size()));
+            std::nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+            result[p].averageMs = static_cast<float>(sum / values.size());
+            result[p].p99Ms = sorted[rank];
+            result[p].samples = values.size();
+        }
+        return result;
+    }
+};
+
+// Writes the trace events of the given profilers, one track per profiler,
+// as a Chrome trace. Returns false, after reporting to std::cerr, on failure.
+inline bool writeChromeTrace(const std::string& path, const std::vector<const Profiler*>& profilers) {
+    std::ofstream file(path);
+    if (!file.is_open()) {
+        std::cerr << "Could not open trace file: " << path << std::endl;
+        return false;
+    }
+    
+    file << std::fixed << std::setprecision(3) << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    bool first = true;
+    size_t events = 0;
+    for (size_t t = 0; t < profilers.size(); ++t) {
+        const Profiler& profiler = *profilers[t];
+        file << (first ? "" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << t + 1
+             << ",\"args\":{\"name\":\"" << profiler.threadName << "\"}}";
+        first = false;
+        for (const TraceEvent& event : profiler.trace) {
+            file << ",\n{\"name\":\"" << profilePhaseName(event.phase) << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << t + 1
+                 << ",\"ts\":" << event.startUs << ",\"dur\":" << event.durationUs << '}';
+        }
+        events += profiler.trace.size();
+        if (profiler.droppedEvents > 0) {
+            std::cerr << "Trace of " << profiler.threadName << " is missing " << profiler.droppedEvents
+                      << " events past its limit" << std::endl;
+        }
+    }
+    file << "\n]}\n";
+    
+    if (!file) {
+        std::cerr << "Could not write trace file: " << path << std::endl;
+        return false;
+    }
+    std::cout << "Wrote " << events << " trace events to " << path << std::endl;
+    return true;
+}
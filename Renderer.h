@@ -0,0 +1,407 @@
+#pragma once
+
+#include "PhysicsThread.h"
+#include "TrailStore.h"
+#include "Profiler.h"
+
+#include <SFML/Graphics.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// Position of a body a fraction alpha of a step from the previous snapshot
+// to the current one, by id. Bodies the previous snapshot does not share,
+// including ids a merge handed to another body, are drawn where the
+// current one has them.
+struct FrameInterpolation {
+    const FrameSnapshot* previous = nullptr;
+    const FrameSnapshot* current = nullptr;
+    float alpha = 1.0f;
+    size_t blended = 0;  // Ids below this are in both snapshots
+    
+    sf::Vector2f operator()(size_t id) const {
+        const sf::Vector2f to(current->x[id], current->y[id]);
+        if (id >= blended || previous->serial[id] != current->serial[id]) return to;
+        const sf::Vector2f from(previous->x[id], previous->y[id]);
+        return from + (to - from) * alpha;
+    }
+};
+
+// The world rectangle a view shows and its size in pixels
+struct ViewRegion {
+    float left = 0, top = 0, width = 0, height = 0;
+    unsigned columns = 1, rows = 1;
+    
+    static ViewRegion of(const sf::View& view, sf::Vector2u pixels) {
+        ViewRegion region;
+        region.left = view.getCenter().x - view.getSize().x * 0.5f;
+        region.top = view.getCenter().y - view.getSize().y * 0.5f;
+        region.width = view.getSize().x;
+        region.height = view.getSize().y;
+        region.columns = std::max(1u, pixels.x);
+        region.rows = std::max(1u, pixels.y);
+        return region;
+    }
+    
+    // World size of the larger side of a pixel
+    float pixelSize() const { return std::max(width / columns, height / rows); }
+    
+    // Whether the box lo..hi, grown by margin on every side, shows at all
+    bool overlaps(sf::Vector2f lo, sf::Vector2f hi, float margin = 0.0f) const {
+        return hi.x + margin >= left && lo.x - margin <= left + width &&
+               hi.y + margin >= top && lo.y - margin <= top + height;
+    }
+    
+    bool contains(sf::Vector2f point, float margin = 0.0f) const { return overlaps(point, point, margin); }
+};
+
+// Walks the snapshot's view tree over the bodies a region shows. A cell
+// out of view is skipped whole; a cell narrower than cellPixels pixels is
+// handed to onCell(node) as one aggregate; otherwise the walk descends to
+// the leaves, whose bodies in view go to onBody(id, position). margin grows
+// every test by the largest distance a body draws beyond its position.
+template <typename OnBody, typename OnCell>
+inline void walkViewTree(const FrameSnapshot& frame, const FrameInterpolation& at, const ViewRegion& region,
+                         float cellPixels, float margin, std::vector<uint32_t>& stack,
+                         OnBody&& onBody, OnCell&& onCell) {
+    if (frame.viewNodes.empty()) return;
+    const float aggregate = cellPixels * region.pixelSize();
+    stack.assign(1, 0);
+    while (!stack.empty()) {
+        const ViewNode& node = frame.viewNodes[stack.back()];
+        stack.pop_back();
+        const sf::Vector2f half(node.halfSize, node.halfSize);
+        const sf::Vector2f center(node.centerX, node.centerY);
+        if (node.count == 0 || !region.overlaps(center - half, center + half, margin)) continue;
+        
+        if (node.count > 1 && 2 * node.halfSize < aggregate) {
+            onCell(node);
+        } else if (node.isLeaf()) {
+            for (uint32_t k = node.begin; k < node.begin + node.count; ++k) {
+                const uint32_t id = frame.viewBodies[k];
+                const sf::Vector2f position = at(id);
+                if (region.contains(position, margin)) onBody(id, position);
+            }
+        } else {
+            for (uint32_t q = 0; q < uint32_t(QuadTree::NUM_CHILDREN); ++q) {
+                stack.push_back(node.firstChild + q);
+            }
+        }
+    }
+}
+
+// Vertices rebuilt every frame and drawn with a single call. Where the driver
+// supports it they go up in one upload to a streaming sf::VertexBuffer that
+// is kept across frames and only reallocated when it has to grow; otherwise
+// they are drawn straight from the staging array. Profiles count the draw
+// call as Draw and the rest, vertex building included, as Upload.
+class VertexBatch {
+private:
+    sf::PrimitiveType primitive;
+    std::vector<sf::Vertex> vertices;
+    sf::VertexBuffer buffer;
+    bool useBuffer;
+    
+public:
+    explicit VertexBatch(sf::PrimitiveType primitive)
+        : primitive(primitive), buffer(primitive, sf::VertexBuffer::Stream),
+          useBuffer(sf::VertexBuffer::isAvailable()) {}
+    
+    void clear() { vertices.clear(); }
+    void reserve(size_t n) { vertices.reserve(n); }
+    void append(const sf::Vertex& vertex) { vertices.push_back(vertex); }
+    
+    void draw(sf::RenderTarget& target, const sf::RenderStates& states = sf::RenderStates()) {
+        if (vertices.empty()) return;
+        if (useBuffer && buffer.getVertexCount() < vertices.size()) {
+            // Doubling keeps a slowly growing body count from reallocating every frame
+            useBuffer = buffer.create(std::max(vertices.size(), 2 * buffer.getVertexCount()));
+        }
+        if (useBuffer && buffer.update(vertices.data(), vertices.size(), 0)) {
+            PROFILE_SCOPE(ProfilePhase::Draw);
+            target.draw(buffer, 0, vertices.size(), states);
+        } else {
+            PROFILE_SCOPE(ProfilePhase::Draw);
+            target.draw(vertices.data(), vertices.size(), primitive, states);
+        }
+    }
+};
+
+// Surface density of the bodies in view, accumulated in float per screen
+// pixel and shown tone-mapped through one texture: each body, or each cell
+// of the view tree narrower than a pixel, adds its weight and colour to the
+// pixel it falls in, so the cost follows the pixel count rather than the
+// body count. Brightness is logarithmic over DENSITY_RANGE below the
+// densest pixel; colour is the weighted mean of what landed there.
+class DensityMap {
+private:
+    static constexpr float DENSITY_RANGE = 1000.0f;
+    
+    ViewRegion region;
+    std::vector<float> weight, red, green, blue;
+    std::vector<sf::Uint8> pixels;  // RGBA
+    sf::Texture texture;
+    
+public:
+    // Clears the accumulation for a frame of region
+    void begin(const ViewRegion& view) {
+        const size_t count = size_t(view.columns) * view.rows;
+        if (texture.getSize() != sf::Vector2u(view.columns, view.rows)) {
+            texture.create(view.columns, view.rows);
+            pixels.assign(4 * count, 0);
+        }
+        region = view;
+        for (auto* a : {&weight, &red, &green, &blue}) {
+            a->assign(count, 0.0f);
+        }
+    }
+    
+    void deposit(sf::Vector2f position, float w, PackedColor color) {
+        const float column = (position.x - region.left) / region.width * region.columns;
+        const float row = (position.y - region.top) / region.height * region.rows;
+        if (!(column >= 0.0f && row >= 0.0f && column < region.columns && row < region.rows)) return;
+        const size_t p = size_t(row) * region.columns + size_t(column);
+        weight[p] += w;
+        red[p] += w * (color >> 24 & 0xFFu);
+        green[p] += w * (color >> 16 & 0xFFu);
+        blue[p] += w * (color >> 8 & 0xFFu);
+    }
+    
+    // Tone-maps the accumulation and adds it to target over the whole window
+    void draw(sf::RenderTarget& target) {
+        const float densest = *std::max_element(weight.begin(), weight.end());
+        if (!(densest > 0.0f)) return;
+        const float scale = DENSITY_RANGE / densest;
+        const float norm = 1.0f / std::log1p(DENSITY_RANGE);
+        for (size_t p = 0; p < weight.size(); ++p) {
+            sf::Uint8* rgba = &pixels[4 * p];
+            if (weight[p] <= 0.0f) {
+                rgba[0] = rgba[1] = rgba[2] = rgba[3] = 0;
+                continue;
+            }
+            const float brightness = std::log1p(weight[p] * scale) * norm / weight[p];
+            rgba[0] = static_cast<sf::Uint8>(std::min(255.0f, red[p] * brightness));
+            rgba[1] = static_cast<sf::Uint8>(std::min(255.0f, green[p] * brightness));
+            rgba[2] = static_cast<sf::Uint8>(std::min(255.0f, blue[p] * brightness));
+            rgba[3] = 255;
+        }
+        texture.update(pixels.data());
+        
+        const sf::View saved = target.getView();
+        target.setView(sf::View(sf::FloatRect(0, 0, float(region.columns), float(region.rows))));
+        {
+            PROFILE_SCOPE(ProfilePhase::Draw);
+            target.draw(sf::Sprite(texture), sf::BlendAdd);
+        }
+        target.setView(saved);
+    }
+};
+
+// Draws a frame's trails, bodies and velocity vectors in three draw calls
+// whatever the body count: trails as one line list, every body (and the glow
+// behind the massive ones) as a textured quad of a shared disc texture, and
+// the velocity vectors as a second line list. Only what falls in the view
+// region is drawn. With a view tree, cells narrower than LOD_PIXELS pixels are
+// drawn as one disc at their centre of mass, sized for their heaviest body
+// and tinted with their mean colour, so the vertex count is bounded by the
+// screen rather than by the bodies.
+class ParticleRenderer {
+public:
+    // Cells narrower than this many pixels are merged. Two keeps every
+    // merged cell well inside the smallest disc at the default zoom while
+    // cutting the drawn count several-fold against one, since a leaf just
+    // over a pixel wide still holds up to leaf capacity bodies.
+    static constexpr float LOD_PIXELS = 2.0f;
+    
+    // What the last drawBodies() or drawDensity() drew
+    struct Counts {
+        size_t bodies = 0;
+        size_t cells = 0;  // Merged cells, each drawn as one
+    };
+    
+private:
+    static constexpr unsigned DISC_SIZE = 64;  // Disc texture edge in pixels
+    static constexpr float MIN_RADIUS = 1.0f;   // Smallest bodyRadius(), which massless tracers get
+    static constexpr float MAX_RADIUS = 20.0f;  // Largest bodyRadius()
+    
+    // A disc queued for the body batch
+    struct Splat {
+        sf::Vector2f center;
+        float radius;
+        sf::Color color;
+        bool glow;
+    };
+    
+    sf::Texture disc;
+    VertexBatch trailBatch{sf::Lines};
+    VertexBatch bodyBatch{sf::Triangles};
+    VertexBatch velocityBatch{sf::Lines};
+    DensityMap density;
+    std::vector<Splat> splats;
+    std::vector<uint32_t> walkStack;
+    Counts counts;
+    
+    // White disc with an antialiased edge; vertex colours tint it
+    void createDiscTexture() {
+        sf::Image image;
+        image.create(DISC_SIZE, DISC_SIZE, sf::Color::Transparent);
+        const float radius = DISC_SIZE * 0.5f;
+        for (unsigned py = 0; py < DISC_SIZE; ++py) {
+            for (unsigned px = 0; px < DISC_SIZE; ++px) {
+                const float dx = px + 0.5f - radius;
+                const float dy = py + 0.5f - radius;
+                const float coverage = std::clamp(radius - std::sqrt(dx * dx + dy * dy), 0.0f, 1.0f);
+                image.setPixel(px, py, sf::Color(255, 255, 255, static_cast<sf::Uint8>(255 * coverage)));
+            }
+        }
+        disc.loadFromImage(image);
+        disc.setSmooth(true);
+    }
+    
+    // Two triangles covering the square of half-width r around center
+    void appendDisc(sf::Vector2f center, float r, sf::Color color) {
+        const float t = static_cast<float>(DISC_SIZE);
+        const sf::Vertex topLeft(center + sf::Vector2f(-r, -r), color, sf::Vector2f(0, 0));
+        const sf::Vertex topRight(center + sf::Vector2f(r, -r), color, sf::Vector2f(t, 0));
+        const sf::Vertex bottomRight(center + sf::Vector2f(r, r), color, sf::Vector2f(t, t));
+        const sf::Vertex bottomLeft(center + sf::Vector2f(-r, r), color, sf::Vector2f(0, t));
+        bodyBatch.append(topLeft);
+        bodyBatch.append(topRight);
+        bodyBatch.append(bottomRight);
+        bodyBatch.append(topLeft);
+        bodyBatch.append(bottomRight);
+        bodyBatch.append(bottomLeft);
+    }
+    
+    // log10 of a tiny or zero mass would make the radius negative or -inf
+    static float bodyRadius(float mass) { return std::clamp(5.0f + std::log10(mass), MIN_RADIUS, MAX_RADIUS); }
+    static bool hasGlow(float mass) { return mass > 1000; }
+    static float bodyWeight(float mass) { return mass > 0.0f ? mass : 1.0f; }  // As ViewNode::weight
+    
+    void addSplat(sf::Vector2f center, float mass, PackedColor color) {
+        splats.push_back(Splat{center, bodyRadius(mass), sf::Color(color), hasGlow(mass)});
+    }
+    
+public:
+    ParticleRenderer() { createDiscTexture(); }
+    
+    const Counts& lastCounts() const { return counts; }
+    
+    // Trails fade from transparent at the oldest point to half opacity at
+    // the newest; alpha is set per vertex while the rings are read in place,
+    // and segments out of view are left out
+    void drawTrails(sf::RenderTarget& target, const TrailStore& trails, const FrameSnapshot& frame,
+                    const ViewRegion& view) {
+        PROFILE_SCOPE(ProfilePhase::Upload);
+        trailBatch.clear();
+        for (size_t k = 0; k < trails.particleCount() && k < frame.size(); ++k) {
+            const size_t count = trails.size(k);
+            if (count < 2) continue;
+            const float length = static_cast<float>(count);
+            sf::Color color(frame.color[k]);
+            size_t age = 0;
+            sf::Vertex last;
+            trails.forEachPoint(k, [&](sf::Vector2f point) {
+                color.a = static_cast<sf::Uint8>(255 * (age / length) * 0.5f);
+                const sf::Vertex vertex(point, color);
+                if (age++ > 0) {
+                    const sf::Vector2f lo(std::min(last.position.x, point.x), std::min(last.position.y, point.y));
+                    const sf::Vector2f hi(std::max(last.position.x, point.x), std::max(last.position.y, point.y));
+                    if (view.overlaps(lo, hi)) {
+                        trailBatch.append(last);
+                        trailBatch.append(vertex);
+                    }
+                }
+                last = vertex;
+            });
+        }
+        trailBatch.draw(target);
+    }
+    
+    // Bodies in view, merged into cells of the frame's view tree when
+    // levelOfDetail is set and the frame has one
+    void drawBodies(sf::RenderTarget& target, const FrameSnapshot& frame, const FrameInterpolation& at,
+                    const ViewRegion& view, bool levelOfDetail) {
+        PROFILE_SCOPE(ProfilePhase::Upload);
+        splats.clear();
+        counts = Counts{};
+        const float margin = 2 * MAX_RADIUS;  // A glow's reach
+        if (levelOfDetail && !frame.viewNodes.empty()) {
+            walkViewTree(frame, at, view, LOD_PIXELS, margin, walkStack,
+                         [&](uint32_t id, sf::Vector2f position) {
+                             addSplat(position, frame.m[id], frame.color[id]);
+                             ++counts.bodies;
+                         },
+                         [&](const ViewNode& node) {
+                             addSplat(sf::Vector2f(node.comX, node.comY), node.maxMass, node.color);
+                             ++counts.cells;
+                         });
+        } else {
+            for (size_t i = 0; i < frame.size(); ++i) {
+                const sf::Vector2f position = at(i);
+                if (view.contains(position, margin)) addSplat(position, frame.m[i], frame.color[i]);
+            }
+            counts.bodies = splats.size();
+        }
+        
+        bodyBatch.clear();
+        bodyBatch.reserve(6 * splats.size());
+        
+        // Glows first so that no glow covers a body
+        for (const Splat& splat : splats) {
+            if (splat.glow) {
+                sf::Color glow(splat.color);
+                glow.a = 50;
+                appendDisc(splat.center, 2 * splat.radius, glow);
+            }
+        }
+        for (const Splat& splat : splats) {
+            appendDisc(splat.center, splat.radius, splat.color);
+        }
+        bodyBatch.draw(target, sf::RenderStates(&disc));
+    }
+    
+    // The bodies in view as a density map, from the view tree's sub-pixel
+    // cells when the frame has one and from every body otherwise
+    void drawDensity(sf::RenderTarget& target, const FrameSnapshot& frame, const FrameInterpolation& at,
+                     const ViewRegion& view) {
+        PROFILE_SCOPE(ProfilePhase::Upload);
+        counts = Counts{};
+        density.begin(view);
+        if (!frame.viewNodes.empty()) {
+            walkViewTree(frame, at, view, 1.0f, 0.0f, walkStack,
+                         [&](uint32_t id, sf::Vector2f position) {
+                             density.deposit(position, bodyWeight(frame.m[id]), frame.color[id]);
+                             ++counts.bodies;
+                         },
+                         [&](const ViewNode& node) {
+                             density.deposit(sf::Vector2f(node.comX, node.comY), node.weight, node.color);
+                             ++counts.cells;
+                         });
+        } else {
+            for (size_t i = 0; i < frame.size(); ++i) {
+                density.deposit(at(i), bodyWeight(frame.m[i]), frame.color[i]);
+            }
+            counts.bodies = frame.size();
+        }
+        density.draw(target);
+    }
+    
+    void drawVelocities(sf::RenderTarget& target, const FrameSnapshot& frame, const FrameInterpolation& at,
+                        const ViewRegion& view) {
+        PROFILE_SCOPE(ProfilePhase::Upload);
+        velocityBatch.clear();
+        velocityBatch.reserve(2 * frame.size());
+        for (size_t i = 0; i < frame.size(); ++i) {
+            const sf::Vector2f position = at(i);
+            const sf::Vector2f tip = position + sf::Vector2f(frame.vx[i], frame.vy[i]) * 0.5f;
+            const sf::Vector2f lo(std::min(position.x, tip.x), std::min(position.y, tip.y));
+            const sf::Vector2f hi(std::max(position.x, tip.x), std::max(position.y, tip.y));
+            if (!view.overlaps(lo, hi)) continue;
+            velocityBatch.append(sf::Vertex(position, sf::Color::White));
+            velocityBatch.append(sf::Vertex(tip, sf::Color(255, 255, 255, 100)));
+        }
+        velocityBatch.draw(target);
+    }
+};
@@ -0,0 +1,682 @@
+#pragma once
+
+#include "ParticleStore.h"
+#include "Collisions.h"
+#include "Diagnostics.h"
+#include "ForceSolver.h"
+#include "Integrator.h"
+#include "Morton.h"
+#include "Procedural.h"
+#include "Profiler.h"
+#include "Snapshot.h"
+
+#include <SFML/System/Vector2.hpp>
+#include <nlohmann/json.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <numeric>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+// Constants
+struct SimulationConstants {
+    Real G = Real(6.67430e-2);    // Gravitational constant (scaled for visualization)
+    Real DT = Real(0.01);         // Time step
+    Real SOFTENING = 1;           // Softening parameter
+    SofteningKernel SOFTENING_KERNEL = SofteningKernel::Plummer;  // Force law inside the softening
+    GravitySources GRAVITY_SOURCES = GravitySources::All;         // Which bodies attract
+    Real MIN_DT = Real(0.0001);   // Minimum time step for adaptive stepping
+    Real MAX_DT = Real(0.1);      // Maximum time step
+    size_t TRAIL_LENGTH = 100;    // Number of trail points
+    uint32_t TRAIL_INTERVAL = 1;  // Steps between trail points
+    bool ADAPTIVE_TIMESTEP = false;
+    float THETA = 0.5f;           // Barnes-Hut opening angle
+    size_t AUTO_SOLVER_THRESHOLD = AutoForceSolver::DEFAULT_THRESHOLD;  // Tree above this many bodies
+    uint32_t LEAF_CAPACITY = QuadTree::DEFAULT_LEAF_CAPACITY;    // Bodies per Barnes-Hut leaf
+    uint32_t GROUP_CAPACITY = QuadTree::DEFAULT_GROUP_CAPACITY;  // Bodies sharing one tree walk
+    int FMM_ORDER = FastMultipoleCalculator::DEFAULT_ORDER;    // Expansion order of the FMM solver
+    float FMM_THETA = FastMultipoleCalculator::DEFAULT_THETA;  // FMM cell acceptance parameter
+    uint32_t TREE_REBUILD_INTERVAL = QuadTree::DEFAULT_REBUILD_INTERVAL;  // Tree refits between builds
+    float TREE_REFIT_GROWTH = QuadTree::DEFAULT_REFIT_GROWTH;  // Leaf area growth that forces a build
+    size_t GPU_TREE_THRESHOLD = GpuDevice::DEFAULT_TREE_THRESHOLD;  // GPU solver walks a tree above this
+    size_t TRACER_TREE_THRESHOLD = TracerForceSolver::DEFAULT_TREE_THRESHOLD;  // Tracers walk a tree from this many massive bodies
+    int REORDER_INTERVAL = 16;    // Steps between Morton reorders while a tree is used (0 = never)
+    float PHYSICS_RATE = 60.0f;   // Steps per wall-clock second in the window (0 = as fast as possible)
+    bool COLLISIONS = false;      // Merge bodies that touch after every step
+    Real COLLISION_RADIUS = 1;    // Radius of a body of unit mass; radii grow as sqrt(m)
+    uint32_t DIAGNOSTICS_INTERVAL = 100;  // Steps between conserved-quantity measurements (0 = on request only)
+    
+    Softening softening() const { return Softening{SOFTENING_KERNEL, double(SOFTENING)}; }
+};
+
+// Part of a scenario one process loads when several share a run
+// (Distributed.h): the bodies whose ids fall in range `part` of `parts`
+// equal, contiguous id ranges. The default share is every body.
+struct LoadShare {
+    int part = 0;
+    int parts = 1;
+    
+    uint64_t begin(uint64_t total) const { return total * part / parts; }
+    uint64_t end(uint64_t total) const { return total * (part + 1) / parts; }
+};
+
+// Physics state of a run: particles, integrator, force solver and the
+// settings a scenario file can change. It has no window or graphics
+// dependency, so the interactive front end and the headless batch runner
+// (Headless.h) step the same code.
+class SimulationCore {
+private:
+    ParticleStore particles;
+    std::unique_ptr<Integrator> integrator;
+    IntegratorType integratorType = IntegratorType::RungeKutta4;
+    std::unique_ptr<ForceSolver> forceSolver;
+    ForceSolverType forceSolverType = ForceSolverType::Auto;
+    SimulationConstants constants;
+    
+    // Used instead of forceSolver when only fixed bodies attract; its list
+    // of fixed bodies is refreshed whenever the store has changed
+    FixedSourceForceSolver fixedSources;
+    bool fixedSourcesStale = true;
+    
+    // Massless tracers are kept behind the massive bodies and evaluated by
+    // tracers, which wraps forceSolver; partitionedSize is the store size
+    // the split was made for. A wrapped solver sees every tracer instead.
+    TracerForceSolver tracers;
+    size_t partitionedSize = 0;
+    bool splitTracers = true;
+    std::vector<uint32_t> storeOrder;
+    
+    CollisionStage collisions;
+    
+    // Conserved quantities (Diagnostics.h) of the last measured step. phi is
+    // the potential the last evaluation of that step filled in, or that of an
+    // extra evaluation into the scratch accelerations.
+    Diagnostics diagnostics;
+    bool diagnosticsMeasured = false;
+    bool diagnosticsRequested = false;
+    double referenceEnergy = std::numeric_limits<double>::quiet_NaN();  // E0 of the current generation
+    RealArray phi, scratchAx, scratchAy;
+    std::vector<DiagnosticSums> diagnosticPartials;
+    
+    // Spatial ordering of the particle store
+    MortonSorter spatialOrder;
+    int stepsSinceReorder = 0;
+    uint64_t reorderCount = 0;  // Bumped whenever the store's slots are permuted in place
+    
+    double simulatedTime = 0.0;
+    uint64_t stepCount = 0;
+    uint64_t generation = 0;  // Bumped whenever the particles are replaced
+    std::string scenarioName = "Default";
+    
+    // Sorts the store along a Z-curve so bodies that are near each other in
+    // space are near each other in memory during the tree build and walk
+    void reorderParticles() {
+        spatialOrder.sort(particles.bodies());
+        storeOrder = spatialOrder.order();
+        const size_t massiveCount = splitTracers ? partitionMassive(storeOrder) : storeOrder.size();
+        particles.permute(storeOrder);
+        integrator->permute(storeOrder);
+        ++reorderCount;
+        tracers.reset();  // And forceSolver with it
+        stepsSinceReorder = 0;
+        fixedSourcesStale = true;
+        bindTracers(massiveCount);
+    }
+    
+    // Moves the bodies with mass to the front of order, each part keeping
+    // its order, and returns how many there are
+    size_t partitionMassive(std::vector<uint32_t>& order) const {
+        const auto end = std::stable_partition(order.begin(), order.end(),
+                                               [&](uint32_t i) { return particles.m[i] != 0; });
+        return size_t(end - order.begin());
+    }
+    
+    void bindTracers(size_t massiveCount) {
+        tracers.bind(*forceSolver, massiveCount);
+        partitionedSize = particles.size();
+    }
+    
+    // Splits the store into massive bodies and tracers where it is not split
+    // already, without the cost of a spatial sort
+    void partitionTracers() {
+        storeOrder.resize(particles.size());
+        std::iota(storeOrder.begin(), storeOrder.end(), 0u);
+        const size_t massiveCount = partitionMassive(storeOrder);
+        if (!std::is_sorted(storeOrder.begin(), storeOrder.end())) {
+            particles.permute(storeOrder);
+            integrator->permute(storeOrder);
+            ++reorderCount;
+            tracers.reset();
+            fixedSourcesStale = true;
+        }
+        bindTracers(massiveCount);
+    }
+    
+    void updateFixedSources() {
+        std::vector<uint32_t> fixed;
+        for (size_t i = 0; i < particles.size(); ++i) {
+            if (particles.info[i].fixed) fixed.push_back(uint32_t(i));
+        }
+        fixedSources.setSources(std::move(fixed), particles.size());
+        fixedSourcesStale = false;
+    }
+    
+    bool measuresNextStep() const {
+        const uint32_t interval = constants.DIAGNOSTICS_INTERVAL;
+        return diagnosticsRequested || (interval > 0 && (stepCount + 1) % interval == 0);
+    }
+    
+    // Measures the current state. phiFilled says phi already holds the
+    // potential of every body at the current positions; otherwise one is
+    // evaluated here if the solver can give it.
+    void measure(bool phiFilled) {
+        ForceSolver& solver = activeSolver();
+        const bool withPotential = solver.providesPotential();
+        if (withPotential && !phiFilled) {
+            const size_t n = particles.size();
+            phi.resize(n);
+            scratchAx.resize(n);
+            scratchAy.resize(n);
+            solver.computeAccelerations(particles.bodies(), TargetSpan{},
+                                        AccelerationSpan{scratchAx.data(), scratchAy.data(), n, phi.data()},
+                                        constants.G, constants.softening());
+        }
+        
+        const double weight = constants.GRAVITY_SOURCES == GravitySources::Fixed ? 1.0 : 0.5;
+        const DiagnosticSums sums = sumDiagnostics(particles, withPotential ? phi.data() : nullptr, weight,
+                                                   diagnosticPartials);
+        diagnostics = Diagnostics();
+        diagnostics.step = stepCount;
+        diagnostics.time = simulatedTime;
+        diagnostics.kinetic = sums.kinetic;
+        diagnostics.momentumX = sums.momentumX;
+        diagnostics.momentumY = sums.momentumY;
+        diagnostics.angularMomentum = sums.angularMomentum;
+        if (withPotential) {
+            diagnostics.potential = sums.potential;
+            if (std::isnan(referenceEnergy)) referenceEnergy = diagnostics.energy();
+            if (referenceEnergy != 0.0) {
+                diagnostics.energyDrift = (diagnostics.energy() - referenceEnergy) / std::abs(referenceEnergy);
+            }
+        }
+        diagnosticsMeasured = true;
+        diagnosticsRequested = false;
+    }
+    
+    ForceSolver& activeSolver() {
+        if (constants.GRAVITY_SOURCES == GravitySources::Fixed) return fixedSources;
+        if (tracers.massiveBodies() < partitionedSize) return tracers;
+        return *forceSolver;
+    }
+    
+    // "all", "named" (bodies with a name) or a list of body names
+    void selectTrails(const nlohmann::json& selection) {
+        if (selection.is_array()) {
+            std::unordered_set<std::string> names;
+            for (const auto& name : selection) {
+                names.insert(name.get<std::string>());
+            }
+            for (auto& meta : particles.info) {
+                meta.trail = names.count(meta.name) > 0;
+            }
+            return;
+        }
+        
+        const std::string mode = selection.get<std::string>();
+        if (mode != "all" && mode != "named") {
+            std::cerr << "Unknown trail_bodies \"" << mode << "\", recording all trails" << std::endl;
+        }
+        for (auto& meta : particles.info) {
+            meta.trail = mode != "named" || !meta.name.empty();
+        }
+    }
+    
+    // Applies the "settings" object of a scenario or snapshot; missing keys
+    // keep their current values
+    void applySettings(const nlohmann::json& settings) {
+        constants.G = settings.value("gravitational_constant", constants.G);
+        constants.DT = settings.value("time_step", constants.DT);
+        constants.SOFTENING = settings.value("softening", constants.SOFTENING);
+        if (settings.contains("softening_kernel")) {
+            constants.SOFTENING_KERNEL = parseSofteningKernel(settings["softening_kernel"], constants.SOFTENING_KERNEL);
+        }
+        if (settings.contains("gravity_sources")) {
+            constants.GRAVITY_SOURCES = parseGravitySources(settings["gravity_sources"], constants.GRAVITY_SOURCES);
+        }
+        constants.TRAIL_LENGTH = settings.value("trail_length", constants.TRAIL_LENGTH);
+        constants.TRAIL_INTERVAL = std::max(1u, settings.value("trail_interval", constants.TRAIL_INTERVAL));
+        if (settings.contains("trail_bodies")) {
+            selectTrails(settings["trail_bodies"]);
+        }
+        constants.ADAPTIVE_TIMESTEP = settings.value("adaptive_timestep", constants.ADAPTIVE_TIMESTEP);
+        constants.MIN_DT = settings.value("min_dt", constants.MIN_DT);
+        constants.MAX_DT = settings.value("max_dt", constants.MAX_DT);
+        constants.THETA = settings.value("theta", constants.THETA);
+        constants.AUTO_SOLVER_THRESHOLD = settings.value("auto_solver_threshold", constants.AUTO_SOLVER_THRESHOLD);
+        constants.LEAF_CAPACITY = settings.value("leaf_capacity", constants.LEAF_CAPACITY);
+        constants.GROUP_CAPACITY = settings.value("group_capacity", constants.GROUP_CAPACITY);
+        constants.FMM_ORDER = settings.value("fmm_order", constants.FMM_ORDER);
+        constants.FMM_THETA = settings.value("fmm_theta", constants.FMM_THETA);
+        constants.TREE_REBUILD_INTERVAL = settings.value("tree_rebuild_interval", constants.TREE_REBUILD_INTERVAL);
+        constants.TREE_REFIT_GROWTH = settings.value("tree_refit_growth", constants.TREE_REFIT_GROWTH);
+        constants.GPU_TREE_THRESHOLD = settings.value("gpu_tree_threshold", constants.GPU_TREE_THRESHOLD);
+        constants.TRACER_TREE_THRESHOLD = settings.value("tracer_tree_threshold", constants.TRACER_TREE_THRESHOLD);
+        constants.REORDER_INTERVAL = settings.value("reorder_interval", constants.REORDER_INTERVAL);
+        constants.PHYSICS_RATE = settings.value("physics_rate", constants.PHYSICS_RATE);
+        constants.COLLISIONS = settings.value("collisions", constants.COLLISIONS);
+        constants.COLLISION_RADIUS = settings.value("collision_radius", constants.COLLISION_RADIUS);
+        constants.DIAGNOSTICS_INTERVAL = settings.value("diagnostics_interval", constants.DIAGNOSTICS_INTERVAL);
+        
+        if (settings.contains("force_solver")) {
+            forceSolverType = parseForceSolverType(settings["force_solver"], forceSolverType);
+        }
+        selectForceSolver(forceSolverType);
+        
+        IntegratorType type = IntegratorType::RungeKutta4;
+        if (settings.contains("integrator")) {
+            type = parseIntegratorType(settings["integrator"], type);
+        }
+        
+        // Adaptive stepping runs the hierarchical block scheme
+        if (constants.ADAPTIVE_TIMESTEP) {
+            type = IntegratorType::BlockTimestep;
+        }
+        selectIntegrator(type);
+    }
+    
+    void readJsonScenario(const std::string& filename, const LoadShare& share) {
+        std::ifstream file(filename);
+        nlohmann::json j;
+        file >> j;
+        
+        particles.clear();
+        
+        // Load particles
+        for (const auto& p : j["particles"]) {
+            Vector2r pos(p["position"][0], p["position"][1]);
+            Vector2r vel(p["velocity"][0], p["velocity"][1]);
+            // A tracer is a massless test particle, whatever mass it lists
+            Real mass = p.value("tracer", false) ? Real(0) : p["mass"].get<Real>();
+            PackedColor color = packColor(p["color"][0], p["color"][1], p["color"][2]);
+            std::string name = p.value("name", "");
+            bool fixed = p.value("fixed", false);
+            
+            particles.add(pos, vel, mass, color, name, fixed);
+        }
+        
+        // Ids run through the explicit bodies, then each population in turn
+        const size_t explicitCount = particles.size();
+        uint64_t total = explicitCount;
+        if (j.contains("procedural_particles")) {
+            for (const auto& population : j["procedural_particles"]) {
+                total += populationCount(population);
+            }
+        }
+        const uint64_t first = share.begin(total);
+        const uint64_t last = share.end(total);
+        
+        // Generated populations, after the explicit bodies they may be
+        // centred on and with the G and softening they are set up for
+        if (j.contains("procedural_particles")) {
+            const nlohmann::json settings = j.value("settings", nlohmann::json::object());
+            ProceduralContext context;
+            context.G = settings.value("gravitational_constant", constants.G);
+            context.softening.length = settings.value("softening", double(constants.SOFTENING));
+            context.softening.kernel = parseSofteningKernel(settings.value("softening_kernel", ""),
+                                                            constants.SOFTENING_KERNEL);
+            context.seed = j.value("seed", DEFAULT_PROCEDURAL_SEED);
+            uint64_t index = 0;
+            uint64_t offset = explicitCount;
+            for (const auto& population : j["procedural_particles"]) {
+                const uint64_t count = populationCount(population);
+                const uint64_t from = std::clamp(first, offset, offset + count) - offset;
+                const uint64_t to = std::clamp(last, offset, offset + count) - offset;
+                const size_t slot = particles.size();
+                generatePopulation(particles, population, context, index++, from, to);
+                for (size_t i = slot; i < particles.size(); ++i) {
+                    particles.info[i].id = static_cast<uint32_t>(offset + from + (i - slot));
+                }
+                offset += count;
+            }
+        }
+        
+        // Explicit bodies outside the share were only kept for center_ref
+        if (first > 0 || last < explicitCount) {
+            std::vector<uint32_t> kept;
+            for (size_t i = 0; i < particles.size(); ++i) {
+                if (particles.info[i].id >= first && particles.info[i].id < last) kept.push_back(uint32_t(i));
+            }
+            particles.permute(kept);
+        }
+        
+        // Load settings if present
+        if (j.contains("settings")) {
+            applySettings(j["settings"]);
+        }
+        
+        integrator->reset();
+        restartClock();
+        scenarioName = j.value("name", "Unknown");
+        
+        std::cout << "Loaded scenario: " << scenarioName << std::endl;
+    }
+    
+    // Snapshots also carry the time and step count, so a checkpoint resumes
+    // where it was written. Integrator history is not saved; schemes that
+    // carry accelerations between steps start afresh.
+    void readSnapshot(const std::string& filename, const LoadShare& share) {
+        SnapshotReader reader(filename);
+        nlohmann::json metadata = nlohmann::json::object();
+        if (reader.hasMetadata() && !reader.metadataJson().empty()) {
+            metadata = nlohmann::json::parse(reader.metadataJson());
+        }
+        
+        reader.load(particles, share.begin(reader.count()), share.end(reader.count()));
+        if (metadata.contains("settings")) {
+            applySettings(metadata["settings"]);
+        }
+        
+        integrator->reset();
+        restartClock();
+        simulatedTime = reader.time();
+        stepCount = reader.step();
+        scenarioName = metadata.value("name", "Unknown");
+        
+        std::cout << "Loaded snapshot: " << scenarioName << " (" << reader.count() << " bodies, step "
+                  << stepCount << ")" << std::endl;
+    }
+    
+    // Inverse of selectTrails(). Unnamed bodies cannot be listed by name, so
+    // a selection that picks some of them out comes back as "all".
+    nlohmann::json trailSelection() const {
+        bool all = true, named = true;
+        nlohmann::json names = nlohmann::json::array();
+        for (const auto& meta : particles.info) {
+            all = all && meta.trail;
+            named = named && meta.trail == !meta.name.empty();
+            if (meta.trail && !meta.name.empty()) names.push_back(meta.name);
+        }
+        if (all) return "all";
+        if (named) return "named";
+        for (const auto& meta : particles.info) {
+            if (meta.trail && meta.name.empty()) return "all";
+        }
+        return names;
+    }
+    
+    void restartClock() {
+        ++generation;
+        simulatedTime = 0.0;
+        stepCount = 0;
+        stepsSinceReorder = 0;
+        fixedSourcesStale = true;
+        diagnosticsMeasured = false;
+        diagnosticsRequested = false;
+        referenceEnergy = std::numeric_limits<double>::quiet_NaN();
+        if (splitTracers) partitionTracers();
+        if (constants.GRAVITY_SOURCES == GravitySources::Fixed) updateFixedSources();  // So name() counts them
+    }
+    
+public:
+    SimulationCore() {
+        selectIntegrator(integratorType);
+        selectForceSolver(forceSolverType);
+    }
+    
+    void selectIntegrator(IntegratorType type) {
+        integratorType = type;
+        integrator = createIntegrator(type, constants.MIN_DT, constants.MAX_DT, constants.SOFTENING);
+    }
+    
+    void selectForceSolver(ForceSolverType type) {
+        forceSolverType = type;
+        forceSolver = createForceSolver(type, constants.THETA, constants.AUTO_SOLVER_THRESHOLD,
+                                        constants.LEAF_CAPACITY, constants.GROUP_CAPACITY,
+                                        constants.FMM_ORDER, constants.FMM_THETA,
+                                        constants.TREE_REBUILD_INTERVAL, constants.TREE_REFIT_GROWTH,
+                                        constants.GPU_TREE_THRESHOLD);
+        const size_t massiveCount = tracers.massiveBodies();
+        tracers = TracerForceSolver(constants.THETA, constants.TRACER_TREE_THRESHOLD, constants.LEAF_CAPACITY);
+        tracers.setRefitPolicy(constants.TREE_REBUILD_INTERVAL, constants.TREE_REFIT_GROWTH);
+        tracers.bind(*forceSolver, massiveCount);
+    }
+    
+    // Replaces the force solver with wrap(solver), which takes ownership of
+    // the one the settings selected, e.g. to add the bodies other processes
+    // hold (Distributed.h). Loading a scenario selects a plain solver again.
+    template <typename Wrap>
+    void wrapForceSolver(Wrap wrap) {
+        forceSolver = wrap(std::move(forceSolver));
+        splitTracers = false;
+        bindTracers(particles.size());
+    }
+    
+    // Call after bodies were added to or removed from getParticles() with
+    // their accelerations, ids and metadata in place
+    void adoptParticles() {
+        integrator->adopt(particles.size());
+        reorderParticles();
+    }
+    
+    // Advances every particle by one time step
+    void step() {
+        PROFILE_SCOPE(ProfilePhase::Integrate);  // What the force evaluations leave
+        if (splitTracers && partitionedSize != particles.size()) {
+            partitionTracers();
+        }
+        if (constants.GRAVITY_SOURCES == GravitySources::Fixed &&
+            (fixedSourcesStale || fixedSources.bodyCount() != particles.size())) {
+            updateFixedSources();
+        }
+        // What the force callback reads, captured as one reference so the
+        // std::function the integrator takes stores it without allocating
+        struct StepForces {
+            SimulationCore& core;
+            ForceSolver& solver;
+            Softening softening;
+            bool sharePotential;
+            bool phiFilled;
+        };
+        ForceSolver& solver = activeSolver();
+        
+        // On a measured step, full evaluations at the store's positions also
+        // fill phi; the last one is at the positions the step ends on when
+        // the integrator says so
+        const bool measured = measuresNextStep();
+        StepForces forces{*this, solver, constants.softening(),
+                          measured && integrator->endsOnFullEvaluation() && solver.providesPotential(), false};
+        if (forces.sharePotential) phi.resize(particles.size());
+        integrator->integrate(particles,
+            [&forces](const BodySpan& b, const TargetSpan& t, const AccelerationSpan& a) {
+                SimulationCore& core = forces.core;
+                AccelerationSpan out = a;
+                if (forces.sharePotential && t.all() && b.x == core.particles.x.data()) {
+                    out.potential = core.phi.data();
+                    forces.phiFilled = true;
+                }
+                forces.solver.computeAccelerations(b, t, out, core.constants.G, forces.softening);
+            },
+            constants.DT);
+        
+        if (constants.COLLISIONS) {
+            PROFILE_SCOPE(ProfilePhase::Collisions);
+            if (collisions.resolve(particles, constants.COLLISION_RADIUS) > 0) {
+                adoptParticles();
+                forces.phiFilled = false;
+            }
+        }
+        
+        simulatedTime += constants.DT;
+        ++stepCount;
+        if (measured) measure(forces.phiFilled);
+        
+        if (activeSolver().treeStats() && constants.REORDER_INTERVAL > 0 &&
+            ++stepsSinceReorder >= constants.REORDER_INTERVAL) {
+            PROFILE_SCOPE(ProfilePhase::TreeBuild);  // A Morton sort of the store
+            reorderParticles();
+        }
+    }
+    
+    // Makes the next step() measure the conserved quantities whatever the
+    // diagnostics interval
+    void requestDiagnostics() { diagnosticsRequested = true; }
+    
+    // Measures the conserved quantities now, at the cost of one force
+    // evaluation if the solver gives a potential
+    void measureDiagnostics() { measure(false); }
+    
+    // Whether getDiagnostics() describes the current state
+    bool diagnosticsCurrent() const { return diagnosticsMeasured && diagnostics.step == stepCount; }
+    
+    void loadDefaultScenario() {
+        particles.clear();
+        integrator->reset();
+        restartClock();
+        scenarioName = "Default";
+        particles.add(Vector2r(400, 300), Vector2r(0, 0), 5000.0f, packColor(255, 255, 0), "Sun");
+        particles.add(Vector2r(400, 200), Vector2r(50, 0), 10.0f, packColor(0, 255, 255), "Planet 1");
+        particles.add(Vector2r(550, 300), Vector2r(0, 35), 20.0f, packColor(255, 0, 0), "Planet 2");
+        particles.add(Vector2r(400, 450), Vector2r(-30, 0), 15.0f, packColor(0, 255, 0), "Planet 3");
+    }
+    
+    // The settings applySettings() reads, for writing scenarios and snapshots
+    nlohmann::json settings() const {
+        return {
+            {"gravitational_constant", constants.G},
+            {"time_step", constants.DT},
+            {"softening", constants.SOFTENING},
+            {"softening_kernel", softeningKernelName(constants.SOFTENING_KERNEL)},
+            {"gravity_sources", gravitySourcesName(constants.GRAVITY_SOURCES)},
+            {"trail_length", constants.TRAIL_LENGTH},
+            {"trail_interval", constants.TRAIL_INTERVAL},
+            {"adaptive_timestep", constants.ADAPTIVE_TIMESTEP},
+            {"min_dt", constants.MIN_DT},
+            {"max_dt", constants.MAX_DT},
+            {"theta", constants.THETA},
+            {"auto_solver_threshold", constants.AUTO_SOLVER_THRESHOLD},
+            {"leaf_capacity", constants.LEAF_CAPACITY},
+            {"group_capacity", constants.GROUP_CAPACITY},
+            {"fmm_order", constants.FMM_ORDER},
+            {"fmm_theta", constants.FMM_THETA},
+            {"tree_rebuild_interval", constants.TREE_REBUILD_INTERVAL},
+            {"tree_refit_growth", constants.TREE_REFIT_GROWTH},
+            {"gpu_tree_threshold", constants.GPU_TREE_THRESHOLD},
+            {"tracer_tree_threshold", constants.TRACER_TREE_THRESHOLD},
+            {"reorder_interval", constants.REORDER_INTERVAL},
+            {"physics_rate", constants.PHYSICS_RATE},
+            {"collisions", constants.COLLISIONS},
+            {"collision_radius", constants.COLLISION_RADIUS},
+            {"diagnostics_interval", constants.DIAGNOSTICS_INTERVAL},
+            {"force_solver", forceSolverTypeName(forceSolverType)},
+            {"integrator", integratorTypeName(integratorType)}
+        };
+    }
+    
+    // Replaces the particles and settings with a JSON scenario or a binary
+    // snapshot (Snapshot.h), told apart by the file's first bytes, keeping
+    // only the bodies of the given share. Returns false and reports to
+    // std::cerr if the file cannot be read.
+    bool loadScenario(const std::string& filename, const LoadShare& share = LoadShare()) {
+        if (!std::ifstream(filename).is_open()) {
+            std::cerr << "Could not open scenario file: " << filename << std::endl;
+            return false;
+        }
+        try {
+            if (isSnapshotFile(filename)) {
+                readSnapshot(filename, share);
+            } else {
+                readJsonScenario(filename, share);
+            }
+            return true;
+        } catch (const std::exception& e) {
+            std::cerr << "Error loading scenario: " << e.what() << std::endl;
+            return false;
+        }
+    }
+    
+    // Writes the current state as a binary snapshot. Returns false and
+    // reports to std::cerr on failure.
+    bool saveSnapshot(const std::string& filename) const {
+        try {
+            const nlohmann::json metadata = {{"name", scenarioName}, {"settings", settings()}};
+            writeSnapshot(filename, particles, simulatedTime, stepCount, metadata.dump());
+            return true;
+        } catch (const std::exception& e) {
+            std::cerr << "Error saving snapshot: " << e.what() << std::endl;
+            return false;
+        }
+    }
+    
+    // Writes the current state as a JSON scenario, bodies in insertion order
+    bool saveScenario(const std::string& filename) const {
+        std::ofstream file(filename);
+        if (!file.is_open()) {
+            std::cerr << "Could not write scenario file: " << filename << std::endl;
+            return false;
+        }
+        
+        std::vector<size_t> slotOf(particles.size());
+        for (size_t i = 0; i < particles.size(); ++i) {
+            slotOf[particles.info[i].id] = i;
+        }
+        nlohmann::json bodies = nlohmann::json::array();
+        for (size_t i : slotOf) {
+            const ParticleInfo& meta = particles.info[i];
+            nlohmann::json p = {
+                {"position", {particles.x[i], particles.y[i]}},
+                {"velocity", {particles.vx[i], particles.vy[i]}},
+                {"mass", particles.m[i]},
+                {"color", {meta.color >> 24, (meta.color >> 16) & 0xFF, (meta.color >> 8) & 0xFF}}
+            };
+            if (!meta.name.empty()) p["name"] = meta.name;
+            if (meta.fixed) p["fixed"] = true;
+            bodies.push_back(std::move(p));
+        }
+        
+        nlohmann::json scenarioSettings = settings();
+        scenarioSettings["trail_bodies"] = trailSelection();
+        const nlohmann::json scenario = {{"name", scenarioName}, {"particles", bodies}, {"settings", scenarioSettings}};
+        file << scenario.dump(2) << std::endl;
+        return file.good();
+    }
+    
+    Real totalKineticEnergy() const {
+        Real totalKE = 0;
+        for (size_t i = 0; i < particles.size(); ++i) {
+            totalKE += particles.kineticEnergy(i);
+        }
+        return totalKE;
+    }
+    
+    ParticleStore& getParticles() { return particles; }
+    const ParticleStore& getParticles() const { return particles; }
+    const SimulationConstants& getConstants() const { return constants; }
+    ForceSolverType getForceSolverType() const { return forceSolverType; }
+    IntegratorType getIntegratorType() const { return integratorType; }
+    const std::string& getScenarioName() const { return scenarioName; }
+    const ForceSolver& getForceSolver() const {
+        if (constants.GRAVITY_SOURCES == GravitySources::Fixed) return fixedSources;
+        if (tracers.massiveBodies() < partitionedSize) return tracers;
+        return *forceSolver;
+    }
+    const Integrator& getIntegrator() const { return *integrator; }
+    
+    double getTime() const { return simulatedTime; }
+    uint64_t getStepCount() const { return stepCount; }
+    uint64_t getGeneration() const { return generation; }
+    
+    // Changes whenever the slots of the bodies change without their count
+    // changing too, so structures indexed by slot know to rebuild
+    uint64_t getReorderCount() const { return reorderCount; }
+    uint64_t getMergeCount() const { return collisions.mergeCount(); }
+    
+    // The last measurement, if there has been one since the particles were loaded
+    bool hasDiagnostics() const { return diagnosticsMeasured; }
+    const Diagnostics& getDiagnostics() const { return diagnostics; }
+};
@@ -0,0 +1,381 @@
+#pragma once
+
+#include "ParticleStore.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Binary snapshot of a simulation, for large initial conditions and for
+// checkpoints. Layout, little-endian throughout:
+//
+//   SnapshotHeader                 128 bytes
+//   x, y, vx, vy, m                one array each of count floats or doubles
+//                                  (scalarBytes), every array 64-byte aligned
+//   metadata (optional)            64-byte aligned:
+//     uint64 jsonBytes, char json[jsonBytes]
+//                                  {"name": ..., "settings": {...}}, with the
+//                                  same settings keys as a JSON scenario
+//     uint32 color[count]          PackedColor
+//     uint8  flags[count]          SNAPSHOT_FIXED, SNAPSHOT_TRAIL
+//     uint32 nameEnd[count]        end of each name in the name block
+//     char   names[]               names back to back, not terminated
+//
+// Bodies are stored in ParticleInfo::id order. The arrays load with one copy
+// each straight out of a memory mapping, with no parsing.
+//
+// Snapshots hold the state in the precision of the build that wrote them
+// (Precision.h) and load into either, converting. Version 2 added
+// scalarBytes; version 1 files, which left it zero, are float. Float
+// snapshots are still written as version 1 so older builds keep reading them.
+
+constexpr char SNAPSHOT_MAGIC[8] = {'A', 'S', 'T', 'R', 'O', 'S', 'N', 'P'};
+constexpr uint32_t SNAPSHOT_VERSION = 2;
+constexpr uint32_t SNAPSHOT_BYTE_ORDER = 0x01020304u;
+constexpr size_t SNAPSHOT_ALIGNMENT = 64;
+
+enum SnapshotArray { SNAPSHOT_X, SNAPSHOT_Y, SNAPSHOT_VX, SNAPSHOT_VY, SNAPSHOT_M, SNAPSHOT_ARRAYS };
+
+enum SnapshotFlags : uint8_t {
+    SNAPSHOT_FIXED = 1 << 0,
+    SNAPSHOT_TRAIL = 1 << 1
+};
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;                  // SNAPSHOT_BYTE_ORDER as the writer saw it
+    uint64_t count;
+    uint64_t step;
+    double time;
+    uint64_t arrayOffset[SNAPSHOT_ARRAYS];
+    uint64_t metadataOffset;             // 0 without metadata
+    uint64_t metadataBytes;
+    uint32_t scalarBytes;                // Size of one array entry, 4 or 8 (0 in version 1)
+    uint32_t padding;
+    uint64_t reserved[3];
+};
+static_assert(sizeof(SnapshotHeader) == 128, "snapshot header layout changed");
+
+// Read-only mapping of a whole file. Throws std::runtime_error if the file
+// cannot be opened or mapped.
+class MappedFile {
+private:
+    const uint8_t* bytes = nullptr;
+    size_t length = 0;
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#endif
+
+public:
+    explicit MappedFile(const std::string& path) {
+#ifdef _WIN32
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                           FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        LARGE_INTEGER size;
+        if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &size)) {
+            close();
+            throw std::runtime_error("cannot open " + path);
+        }
+        length = static_cast<size_t>(size.QuadPart);
+        if (length == 0) return;
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        bytes = mapping ? static_cast<const uint8_t*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0)) : nullptr;
+#else
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        struct stat info;
+        if (fd < 0 || fstat(fd, &info) != 0) {
+            if (fd >= 0) ::close(fd);
+            throw std::runtime_error("cannot open " + path);
+        }
+        length = static_cast<size_t>(info.st_size);
+        if (length == 0) {
+            ::close(fd);
+            return;
+        }
+        void* view = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);  // The mapping keeps the file alive
+        if (view != MAP_FAILED) {
+            bytes = static_cast<const uint8_t*>(view);
+            madvise(view, length, MADV_SEQUENTIAL);
+        }
+#endif
+        if (!bytes) {
+            close();
+            throw std::runtime_error("cannot map " + path);
+        }
+    }
+    
+    ~MappedFile() { close(); }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    
+    const uint8_t* data() const { return bytes; }
+    size_t size() const { return length; }
+    
+private:
+    void close() {
+#ifdef _WIN32
+        if (bytes) UnmapViewOfFile(bytes);
+        if (mapping) CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+        mapping = nullptr;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (bytes) munmap(const_cast<uint8_t*>(bytes), length);
+#endif
+        bytes = nullptr;
+    }
+};
+
+// Whether a file starts with the snapshot magic, so callers can tell
+// snapshots from JSON scenarios whatever their extension
+inline bool isSnapshotFile(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    char magic[sizeof(SNAPSHOT_MAGIC)] = {};
+    return file.read(magic, sizeof(magic)) && std::memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic)) == 0;
+}
+
+// Validated view of a mapped snapshot. The accessors point into the mapping,
+// which lives as long as the reader. Throws std::runtime_error on files that
+// are not snapshots, come from a newer version or are truncated.
+class SnapshotReader {
+private:
+    MappedFile file;
+    SnapshotHeader header;
+    std::string json;
+    // The metadata tables follow the variable-length JSON, so they are not
+    // aligned and are read with memcpy
+    const uint8_t* colors = nullptr;
+    const uint8_t* flagBytes = nullptr;
+    const uint8_t* nameEnds = nullptr;
+    const char* nameBlock = nullptr;
+    size_t nameBlockBytes = 0;
+    
+    template <typename T>
+    void assignRange(ParticleStore& particles, size_t begin, size_t n) const {
+        particles.assign(n, array<T>(SNAPSHOT_X) + begin, array<T>(SNAPSHOT_Y) + begin,
+                         array<T>(SNAPSHOT_VX) + begin, array<T>(SNAPSHOT_VY) + begin,
+                         array<T>(SNAPSHOT_M) + begin);
+    }
+    
+    // Bounds check of [offset, offset + bytes) against the file
+    const uint8_t* at(uint64_t offset, uint64_t bytes, const char* what) const {
+        if (offset > file.size() || bytes > file.size() - offset) {
+            throw std::runtime_error(std::string("snapshot truncated in ") + what);
+        }
+        return file.data() + offset;
+    }
+    
+    static uint32_t load32(const uint8_t* table, size_t i) {
+        uint32_t value;
+        std::memcpy(&value, table + i * sizeof(uint32_t), sizeof(value));
+        return value;
+    }
+    
+public:
+    explicit SnapshotReader(const std::string& path) : file(path) {
+        std::memcpy(&header, at(0, sizeof(header), "header"), sizeof(header));
+        if (std::memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0) {
+            throw std::runtime_error("not a snapshot file");
+        }
+        if (header.byteOrder != SNAPSHOT_BYTE_ORDER) {
+            throw std::runtime_error("snapshot was written with a different byte order");
+        }
+        if (header.version > SNAPSHOT_VERSION) {
+            throw std::runtime_error("snapshot version " + std::to_string(header.version) +
+                                     " is newer than this build reads");
+        }
+        if (header.count > UINT32_MAX) {
+            throw std::runtime_error("snapshot has more bodies than particle ids can address");
+        }
+        if (header.version < 2) {
+            header.scalarBytes = sizeof(float);
+        }
+        if (header.scalarBytes != sizeof(float) && header.scalarBytes != sizeof(double)) {
+            throw std::runtime_error("snapshot has unknown scalar size " + std::to_string(header.scalarBytes));
+        }
+        const uint64_t count = header.count;
+        for (int a = 0; a < SNAPSHOT_ARRAYS; ++a) {
+            at(header.arrayOffset[a], count * header.scalarBytes, "body arrays");
+            if (header.arrayOffset[a] % header.scalarBytes != 0) {
+                throw std::runtime_error("snapshot body arrays are misaligned");
+            }
+        }
+        
+        if (header.metadataOffset == 0) return;
+        uint64_t offset = header.metadataOffset;
+        uint64_t jsonBytes;
+        std::memcpy(&jsonBytes, at(offset, sizeof(jsonBytes), "metadata"), sizeof(jsonBytes));
+        offset += sizeof(jsonBytes);
+        json.assign(reinterpret_cast<const char*>(at(offset, jsonBytes, "metadata")), jsonBytes);
+        offset += jsonBytes;
+        colors = at(offset, count * sizeof(uint32_t), "colors");
+        offset += count * sizeof(uint32_t);
+        flagBytes = at(offset, count, "flags");
+        offset += count;
+        nameEnds = at(offset, count * sizeof(uint32_t), "names");
+        offset += count * sizeof(uint32_t);
+        nameBlockBytes = count > 0 ? load32(nameEnds, count - 1) : 0;
+        nameBlock = reinterpret_cast<const char*>(at(offset, nameBlockBytes, "names"));
+    }
+    
+    size_t count() const { return static_cast<size_t>(header.count); }
+    uint64_t step() const { return header.step; }
+    double time() const { return header.time; }
+    size_t scalarBytes() const { return header.scalarBytes; }
+    
+    // T must match scalarBytes()
+    template <typename T>
+    const T* array(SnapshotArray a) const {
+        return reinterpret_cast<const T*>(file.data() + header.arrayOffset[a]);
+    }
+    
+    bool hasMetadata() const { return colors != nullptr; }
+    const std::string& metadataJson() const { return json; }
+    PackedColor color(size_t i) const { return load32(colors, i); }
+    uint8_t flags(size_t i) const { return flagBytes[i]; }
+    
+    std::string name(size_t i) const {
+        const uint32_t begin = i > 0 ? load32(nameEnds, i - 1) : 0;
+        const uint32_t end = load32(nameEnds, i);
+        if (begin > end || end > nameBlockBytes) throw std::runtime_error("snapshot name table is corrupt");
+        return std::string(nameBlock + begin, end - begin);
+    }
+    
+    // Replaces the store's bodies with the snapshot's, in id order
+    void load(ParticleStore& particles) const { load(particles, 0, count()); }
+    
+    // Same with the bodies [begin, end) only, keeping their ids. Only the
+    // pages of that range are read, so processes sharing a run each map the
+    // file and load their own part.
+    void load(ParticleStore& particles, size_t begin, size_t end) const {
+        end = std::min(end, count());
+        begin = std::min(begin, end);
+        const size_t n = end - begin;
+        if (scalarBytes() == sizeof(float)) {
+            assignRange<float>(particles, begin, n);
+        } else {
+            assignRange<double>(particles, begin, n);
+        }
+        for (size_t i = 0; i < n; ++i) {
+            ParticleInfo& meta = particles.info[i];
+            meta.id = static_cast<uint32_t>(begin + i);
+            if (!hasMetadata()) continue;
+            meta.color = color(begin + i);
+            meta.fixed = (flags(begin + i) & SNAPSHOT_FIXED) != 0;
+            meta.trail = (flags(begin + i) & SNAPSHOT_TRAIL) != 0;
+            meta.name = name(begin + i);
+        }
+    }
+};
+
+inline uint64_t snapshotAlign(uint64_t offset) {
+    return (offset + SNAPSHOT_ALIGNMENT - 1) / SNAPSHOT_ALIGNMENT * SNAPSHOT_ALIGNMENT;
+}
+
+// Header of a snapshot of count bodies in the build's precision, with the
+// array and metadata offsets laid out; metadataBytes is left for the writer
+// to fill in
+inline SnapshotHeader snapshotHeader(uint64_t count, double time, uint64_t step) {
+    SnapshotHeader header = {};
+    std::memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    header.version = sizeof(Real) == sizeof(float) ? 1 : SNAPSHOT_VERSION;
+    header.byteOrder = SNAPSHOT_BYTE_ORDER;
+    header.count = count;
+    header.step = step;
+    header.time = time;
+    header.scalarBytes = sizeof(Real);
+    uint64_t offset = sizeof(SnapshotHeader);
+    for (int a = 0; a < SNAPSHOT_ARRAYS; ++a) {
+        offset = snapshotAlign(offset);
+        header.arrayOffset[a] = offset;
+        offset += count * sizeof(Real);
+    }
+    header.metadataOffset = snapshotAlign(offset);
+    return header;
+}
+
+// Writes a snapshot of the store, in id order, with the given metadata JSON.
+// Throws std::runtime_error if the file cannot be written.
+inline void writeSnapshot(const std::string& path, const ParticleStore& particles, double time, uint64_t step,
+                          const std::string& metadataJson) {
+    const size_t count = particles.size();
+    SnapshotHeader header = snapshotHeader(count, time, step);
+    
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if (!file) throw std::runtime_error("cannot write " + path);
+    uint64_t written = 0;
+    auto put = [&](const void* data, size_t bytes) {
+        file.write(static_cast<const char*>(data), static_cast<std::streamsize>(bytes));
+        written += bytes;
+    };
+    auto padTo = [&](uint64_t target) {
+        static const char zeros[SNAPSHOT_ALIGNMENT] = {};
+        put(zeros, static_cast<size_t>(target - written));
+    };
+    
+    put(&header, sizeof(header));
+    
+    // Slot -> id gather, one array at a time
+    std::vector<Real> gathered(count);
+    auto putById = [&](const RealArray& values) {
+        for (size_t i = 0; i < count; ++i) {
+            gathered[particles.info[i].id] = values[i];
+        }
+        put(gathered.data(), count * sizeof(Real));
+    };
+    const RealArray* arrays[SNAPSHOT_ARRAYS] = {&particles.x, &particles.y, &particles.vx,
+                                                &particles.vy, &particles.m};
+    for (int a = 0; a < SNAPSHOT_ARRAYS; ++a) {
+        padTo(header.arrayOffset[a]);
+        putById(*arrays[a]);
+    }
+    
+    padTo(header.metadataOffset);
+    std::vector<const ParticleInfo*> byId(count);
+    for (const ParticleInfo& meta : particles.info) {
+        byId[meta.id] = &meta;
+    }
+    const uint64_t jsonBytes = metadataJson.size();
+    put(&jsonBytes, sizeof(jsonBytes));
+    put(metadataJson.data(), metadataJson.size());
+    for (const ParticleInfo* meta : byId) {
+        put(&meta->color, sizeof(uint32_t));
+    }
+    for (const ParticleInfo* meta : byId) {
+        const uint8_t flags = (meta->fixed ? SNAPSHOT_FIXED : 0) | (meta->trail ? SNAPSHOT_TRAIL : 0);
+        put(&flags, 1);
+    }
+    uint32_t nameEnd = 0;
+    for (const ParticleInfo* meta : byId) {
+        nameEnd += static_cast<uint32_t>(meta->name.size());
+        put(&nameEnd, sizeof(nameEnd));
+    }
+    for (const ParticleInfo* meta : byId) {
+        put(meta->name.data(), meta->name.size());
+    }
+    
+    header.metadataBytes = written - header.metadataOffset;
+    file.seekp(0);
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    if (!file.flush()) throw std::runtime_error("cannot write " + path);
+}
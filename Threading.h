@@ -0,0 +1,371 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#endif
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// One persistent work-stealing pool runs every parallel loop of the
+// simulation: tree build, force walks, integrator updates and generators.
+//
+//   parallelFor(count, grain, [&](size_t begin, size_t end) { ... });
+//
+// splits [0, count) into chunks of grain items and runs body(begin, end) on
+// each, on the calling thread and the pool's workers. Every thread starts on
+// a contiguous run of chunks, taken from the front; one that runs dry steals
+// the back half of another's run, so chunks of uneven cost even out without a
+// shared counter. parallelForRanges() runs chunks with explicit bounds,
+// typically from balanceRanges() over per-item costs measured last step.
+//
+// Loops no larger than one chunk, and loops started from inside a chunk, run
+// inline on the calling thread. One loop runs on the pool at a time; another
+// thread starting one waits for it. Bodies must not throw.
+//
+// The pool has ASTRO_THREADS threads (default: all hardware threads),
+// counting the caller, and ASTRO_PIN_THREADS=1 pins worker k to CPU k; the
+// front ends set both with --threads and --pin-threads through
+// configureThreadPool().
+
+// Items per chunk for cheap per-body loops such as integrator updates
+constexpr size_t PARALLEL_GRAIN = 4096;
+
+inline void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+    _mm_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#else
+    std::this_thread::yield();
+#endif
+}
+
+inline int defaultThreadCount() {
+    if (const char* value = std::getenv("ASTRO_THREADS")) {
+        const int threads = std::atoi(value);
+        if (threads > 0) return threads;
+    }
+    return std::max(1, int(std::thread::hardware_concurrency()));
+}
+
+inline bool defaultThreadPinning() {
+    const char* value = std::getenv("ASTRO_PIN_THREADS");
+    return value && std::atoi(value) != 0;
+}
+
+class ThreadPool {
+public:
+    static constexpr int SPIN_ROUNDS = 1 << 14;  // Pauses (well under a millisecond) before an idle worker sleeps
+    
+private:
+    // Chunk run [lo, hi) of one thread, packed as hi << 32 | lo so owner and
+    // thieves claim chunks with a single compare-and-swap
+    struct alignas(64) Slot {
+        std::atomic<uint64_t> range{0};
+    };
+    
+    static uint64_t pack(uint64_t lo, uint64_t hi) { return hi << 32 | lo; }
+    static uint32_t low(uint64_t r) { return uint32_t(r); }
+    static uint32_t high(uint64_t r) { return uint32_t(r >> 32); }
+    
+    struct Job {
+        void (*invoke)(void* body, size_t begin, size_t end) = nullptr;
+        void* body = nullptr;
+        const size_t* bounds = nullptr;  // chunks + 1 bounds, or null for uniform chunks
+        size_t grain = 1;
+        size_t count = 0;
+    };
+    
+    inline static thread_local int currentIndex = 0;
+    inline static thread_local bool inChunk = false;
+    
+    inline static std::unique_ptr<ThreadPool> sharedOwner;
+    inline static std::atomic<ThreadPool*> sharedPool{nullptr};  // Lock-free read of sharedOwner
+    inline static std::mutex sharedMutex;
+    
+    int threads;
+    std::vector<Slot> slots;
+    std::vector<std::thread> workers;
+    Job job;
+    std::atomic<size_t> remaining{0};  // Chunks not yet finished
+    std::atomic<uint64_t> jobId{0};
+    std::atomic<bool> active{false};
+    std::atomic<int> busy{0};          // Workers inside the current job
+    std::atomic<int> sleepers{0};
+    std::atomic<bool> stopping{false};
+    std::mutex submitMutex;
+    std::mutex sleepMutex;
+    std::condition_variable wake;
+    
+    void runChunk(size_t c) {
+        const size_t begin = job.bounds ? job.bounds[c] : c * job.grain;
+        const size_t end = job.bounds ? job.bounds[c + 1] : std::min(job.count, begin + job.grain);
+        job.invoke(job.body, begin, end);
+        remaining.fetch_sub(1, std::memory_order_release);
+    }
+    
+    bool takeOwn(int self, size_t& chunk) {
+        std::atomic<uint64_t>& range = slots[self].range;
+        uint64_t r = range.load(std::memory_order_acquire);
+        while (low(r) < high(r)) {
+            if (range.compare_exchange_weak(r, pack(low(r) + 1, high(r)), std::memory_order_acq_rel)) {
+                chunk = low(r);
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    // Moves the back half of another thread's run into our (empty) slot
+    bool steal(int self) {
+        for (int k = 1; k < threads; ++k) {
+            std::atomic<uint64_t>& victim = slots[(self + k) % threads].range;
+            uint64_t r = victim.load(std::memory_order_acquire);
+            while (low(r) < high(r)) {
+                const uint32_t split = high(r) - (high(r) - low(r) + 1) / 2;
+                if (victim.compare_exchange_weak(r, pack(low(r), split), std::memory_order_acq_rel)) {
+                    slots[self].range.store(pack(split, high(r)), std::memory_order_release);
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+    
+    void work(int self) {
+        currentIndex = self;
+        inChunk = true;
+        size_t chunk;
+        do {
+            while (takeOwn(self, chunk)) {
+                runChunk(chunk);
+            }
+        } while (steal(self));
+        inChunk = false;
+    }
+    
+    void workerLoop(int self) {
+        uint64_t seen = 0;
+        while (true) {
+            // Back-to-back loops are common within a step, so spin a little
+            // before going to sleep
+            int spins = 0;
+            while (jobId.load(std::memory_order_acquire) == seen && !stopping.load(std::memory_order_relaxed)) {
+                if (++spins < SPIN_ROUNDS) {
+                    cpuRelax();
+                    continue;
+                }
+                std::unique_lock<std::mutex> lock(sleepMutex);
+                sleepers.fetch_add(1);
+                wake.wait(lock, [&] { return jobId.load() != seen || stopping.load(); });
+                sleepers.fetch_sub(1);
+            }
+            if (stopping.load()) return;
+            seen = jobId.load(std::memory_order_acquire);
+            
+            // busy and active form a handshake with run(): either the caller
+            // sees this worker busy and waits, or this worker sees the job over
+            busy.fetch_add(1);
+            if (active.load()) work(self);
+            busy.fetch_sub(1);
+        }
+    }
+    
+    static void pinCurrentThread(int cpu) {
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu % CPU_SETSIZE, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+        (void)cpu;
+#endif
+    }
+    
+public:
+    ThreadPool(int threadCount, bool pin) : threads(std::max(1, threadCount)), slots(threads) {
+        const int cpus = std::max(1, int(std::thread::hardware_concurrency()));
+        for (int k = 1; k < threads; ++k) {
+            workers.emplace_back([this, k, pin, cpus] {
+                if (pin) pinCurrentThread(k % cpus);
+                workerLoop(k);
+            });
+        }
+    }
+    
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+    }
+    
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+    
+    int size() const { return threads; }
+    
+    // The pool every parallel loop runs on, created on first use
+    static ThreadPool& shared() {
+        ThreadPool* pool = sharedPool.load(std::memory_order_acquire);
+        if (!pool) {
+            std::lock_guard<std::mutex> lock(sharedMutex);
+            if (!sharedOwner) {
+                sharedOwner = std::make_unique<ThreadPool>(defaultThreadCount(), defaultThreadPinning());
+                sharedPool.store(sharedOwner.get(), std::memory_order_release);
+            }
+            pool = sharedOwner.get();
+        }
+        return *pool;
+    }
+    
+    static void configure(int threadCount, bool pin) {
+        std::lock_guard<std::mutex> lock(sharedMutex);
+        sharedPool.store(nullptr);
+        sharedOwner = std::make_unique<ThreadPool>(threadCount, pin);
+        sharedPool.store(sharedOwner.get(), std::memory_order_release);
+    }
+    
+    static int threadIndex() { return currentIndex; }
+    static bool insideChunk() { return inChunk; }
+    
+    // Runs body(begin, end) on `chunks` chunks: [bounds[c], bounds[c+1]) when
+    // bounds is given, [c * grain, min((c + 1) * grain, count)) otherwise
+    template <typename Body>
+    void run(size_t chunks, const size_t* bounds, size_t grain, size_t count, Body& body) {
+        std::lock_guard<std::mutex> lock(submitMutex);
+        job.invoke = [](void* b, size_t begin, size_t end) { (*static_cast<Body*>(b))(begin, end); };
+        job.body = &body;
+        job.bounds = bounds;
+        job.grain = grain;
+        job.count = count;
+        for (int k = 0; k < threads; ++k) {
+            slots[k].range.store(pack(chunks * k / threads, chunks * (k + 1) / threads), std::memory_order_relaxed);
+        }
+        remaining.store(chunks, std::memory_order_relaxed);
+        active.store(true);
+        jobId.fetch_add(1);
+        if (sleepers.load() > 0) {
+            { std::lock_guard<std::mutex> wakeLock(sleepMutex); }
+            wake.notify_all();
+        }
+        
+        const int callerIndex = currentIndex;
+        work(0);
+        currentIndex = callerIndex;
+        while (remaining.load(std::memory_order_acquire) > 0) {
+            cpuRelax();
+        }
+        active.store(false);
+        while (busy.load() > 0) {
+            cpuRelax();
+        }
+    }
+};
+
+// Replaces the shared pool; threads <= 0 picks the default count. Call it
+// before any parallel work starts, e.g. while parsing the command line.
+inline void configureThreadPool(int threads, bool pin) {
+    ThreadPool::configure(threads > 0 ? threads : defaultThreadCount(), pin);
+}
+
+inline ThreadPool& threadPool() { return ThreadPool::shared(); }
+
+// Threads a parallel loop started here would use
+inline int maxThreads() { return threadPool().size(); }
+
+// Index of the calling thread in the running loop, 0..maxThreads()-1, for
+// per-thread scratch buffers; 0 outside a loop
+inline int threadIndex() { return ThreadPool::threadIndex(); }
+
+template <typename Body>
+void parallelFor(size_t count, size_t grain, Body&& body) {
+    grain = std::max<size_t>(grain, 1);
+    if (count == 0) return;
+    if (count <= grain || ThreadPool::insideChunk() || maxThreads() == 1) {
+        body(size_t(0), count);
+        return;
+    }
+    threadPool().run((count + grain - 1) / grain, nullptr, grain, count, body);
+}
+
+// Chunks [bounds[c], bounds[c + 1]) for c < bounds.size() - 1
+template <typename Body>
+void parallelForRanges(const std::vector<size_t>& bounds, Body&& body) {
+    if (bounds.size() < 2) return;
+    const size_t chunks = bounds.size() - 1;
+    if (chunks == 1 || ThreadPool::insideChunk() || maxThreads() == 1) {
+        body(bounds.front(), bounds.back());
+        return;
+    }
+    threadPool().run(chunks, bounds.data(), 0, bounds.back(), body);
+}
+
+// Splits [0, count) into at most `chunks` ranges of about equal total
+// cost(i), written to bounds as parallelForRanges() takes them
+template <typename Cost>
+void balanceRanges(size_t count, size_t chunks, Cost&& cost, std::vector<size_t>& bounds) {
+    bounds.assign(1, 0);
+    if (count == 0) return;
+    chunks = std::clamp<size_t>(chunks, 1, count);
+    double total = 0.0;
+    for (size_t i = 0; i < count; ++i) {
+        total += cost(i);
+    }
+    if (total <= 0.0) {
+        for (size_t c = 1; c <= chunks; ++c) {
+            bounds.push_back(count * c / chunks);
+        }
+        return;
+    }
+    double running = 0.0;
+    for (size_t i = 0; i + 1 < count && bounds.size() < chunks; ++i) {
+        running += cost(i);
+        if (running >= total * bounds.size() / chunks) {
+            bounds.push_back(i + 1);
+        }
+    }
+    bounds.push_back(count);
+}
+
+// Folds body(begin, end) over the chunks of [0, count) with combine, which
+// must be associative and commutative (min, max, integer sums): chunk
+// results are combined in no fixed order
+template <typename T, typename Body, typename Combine>
+T parallelReduce(size_t count, size_t grain, T identity, Body&& body, Combine&& combine) {
+    struct alignas(64) Partial {
+        T value;
+    };
+    // Kept per calling thread and instantiation so steady-state calls do not
+    // allocate; the workers reach it through the reference
+    static thread_local std::vector<Partial> scratch;
+    std::vector<Partial>& partials = scratch;
+    partials.assign(maxThreads(), Partial{identity});
+    parallelFor(count, grain, [&](size_t begin, size_t end) {
+        T& partial = partials[threadIndex()].value;
+        partial = combine(partial, body(begin, end));
+    });
+    T result = identity;
+    for (const Partial& partial : partials) {
+        result = combine(result, partial.value);
+    }
+    return result;
+}
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <SFML/System/Vector2.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Trail points of every particle in one arena. Each recording particle owns a
+// fixed-capacity ring of `capacity` points in the arena, so recording a
+// point overwrites the oldest one in place instead of growing and shrinking
+// a container per particle. Particles that do not record own no ring at all,
+// which keeps the arena small when only a few bodies are traced.
+//
+// Particles are identified by ParticleInfo::id.
+class TrailStore {
+private:
+    static constexpr uint32_t NO_SLOT = 0xFFFFFFFFu;
+    
+    size_t capacity = 0;                // Points per ring
+    std::vector<sf::Vector2f> arena;    // Ring of slot s at [s * capacity, (s + 1) * capacity)
+    std::vector<uint32_t> slots;        // Ring of each particle, NO_SLOT if it does not record
+    std::vector<uint32_t> heads;        // Oldest point of each ring
+    std::vector<uint32_t> counts;       // Points held by each ring
+    std::vector<uint32_t> freeSlots;    // Rings released by particles that stopped recording
+    
+    uint32_t allocate() {
+        if (!freeSlots.empty()) {
+            const uint32_t slot = freeSlots.back();
+            freeSlots.pop_back();
+            heads[slot] = 0;
+            counts[slot] = 0;
+            return slot;
+        }
+        const uint32_t slot = static_cast<uint32_t>(heads.size());
+        heads.push_back(0);
+        counts.push_back(0);
+        arena.resize(arena.size() + capacity);
+        return slot;
+    }
+    
+    void release(uint32_t slot) { freeSlots.push_back(slot); }
+    
+public:
+    void clear() {
+        arena.clear();
+        slots.clear();
+        heads.clear();
+        counts.clear();
+        freeSlots.clear();
+    }
+    
+    // Brings the rings in line with the particles: recording[id] tells which
+    // particles keep a trail, and particles past the end of it are dropped.
+    // A new capacity discards every trail.
+    void sync(const std::vector<uint8_t>& recording, size_t newCapacity) {
+        if (newCapacity != capacity) {
+            clear();
+            capacity = newCapacity;
+        }
+        for (size_t id = recording.size(); id < slots.size(); ++id) {
+            if (slots[id] != NO_SLOT) release(slots[id]);
+        }
+        slots.resize(recording.size(), NO_SLOT);
+        if (capacity == 0) return;
+        
+        for (size_t id = 0; id < recording.size(); ++id) {
+            if (recording[id] && slots[id] == NO_SLOT) {
+                slots[id] = allocate();
+            } else if (!recording[id] && slots[id] != NO_SLOT) {
+                release(slots[id]);
+                slots[id] = NO_SLOT;
+            }
+        }
+    }
+    
+    // Appends a point to a particle's trail, dropping the oldest one once
+    // the ring is full. Particles without a ring are ignored.
+    void record(size_t id, sf::Vector2f point) {
+        if (id >= slots.size() || slots[id] == NO_SLOT) return;
+        const uint32_t slot = slots[id];
+        sf::Vector2f* ring = arena.data() + slot * capacity;
+        if (counts[slot] < capacity) {
+            ring[(heads[slot] + counts[slot]) % capacity] = point;
+            ++counts[slot];
+        } else {
+            ring[heads[slot]] = point;
+            heads[slot] = static_cast<uint32_t>((heads[slot] + 1) % capacity);
+        }
+    }
+    
+    // Empties a particle's trail, keeping its ring
+    void restart(size_t id) {
+        if (id >= slots.size() || slots[id] == NO_SLOT) return;
+        heads[slots[id]] = 0;
+        counts[slots[id]] = 0;
+    }
+    
+    size_t particleCount() const { return slots.size(); }
+    
+    size_t size(size_t id) const {
+        return id < slots.size() && slots[id] != NO_SLOT ? counts[slots[id]] : 0;
+    }
+    
+    // Calls f(point) for a particle's trail from oldest to newest, reading
+    // the ring in place as its two contiguous runs
+    template <typename F>
+    void forEachPoint(size_t id, F&& f) const {
+        const size_t count = size(id);
+        if (count == 0) return;
+        const uint32_t slot = slots[id];
+        const sf::Vector2f* ring = arena.data() + slot * capacity;
+        const size_t head = heads[slot];
+        const size_t firstRun = count < capacity - head ? count : capacity - head;
+        for (size_t k = 0; k < firstRun; ++k) {
+            f(ring[head + k]);
+        }
+        for (size_t k = 0; k < count - firstRun; ++k) {
+            f(ring[k]);
+        }
+    }
+};
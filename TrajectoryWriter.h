@@ -0,0 +1,681 @@
+#pragma once
+
+#include "SimulationCore.h"
+#include "Snapshot.h"
+#include "CommandLine.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#ifdef USE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef USE_HDF5
+#include <hdf5.h>
+#endif
+
+// Trajectory output for long batch runs. Selected fields of selected bodies
+// are captured every few steps into chunks of frames, and full chunks are
+// handed to a background thread that compresses and writes them, so the
+// integrator only pays for copying the values. The queue between the two is
+// bounded: if the disk cannot keep up, the simulation waits for it instead
+// of buffering without limit.
+//
+// Two formats: the native chunked binary format below, and HDF5 (.h5 or
+// .hdf5 files, with -DASTRO_ENABLE_HDF5=ON).
+//
+// Native format, little-endian:
+//
+//   TrajectoryHeader               32 bytes
+//   uint32 id[bodyCount]           ParticleInfo::id of each column's body
+//                                  when the file was opened
+//   uint32 nameEnd[bodyCount]      end of each name in the name block
+//   char   names[]                 names back to back, not terminated
+//   chunks until the end of the file, each:
+//     TrajectoryChunkHeader        24 bytes
+//     payload[storedBytes]         rawBytes once inflated:
+//       uint64 step[frames]
+//       double time[frames]
+//       double diagnostics[frames][8]  TRAJECTORY_DIAGNOSTIC_NAMES, NaN where
+//                                      not measured (version 2 on)
+//       float  values[frames][field][bodyCount], fields in mask order
+//
+// A compressed payload is byte-shuffled before deflating (all first bytes of
+// the floats, then all second bytes, ...), which lets deflate find the
+// slowly varying exponent bytes. Shuffling covers the whole raw payload.
+//
+// A column follows its body by ParticleInfo::serial, not by id, because a
+// merge hands ids on to other bodies. Once a body has been merged away its
+// column holds NaN.
+
+constexpr char TRAJECTORY_MAGIC[8] = {'A', 'S', 'T', 'R', 'O', 'T', 'R', 'J'};
+constexpr uint32_t TRAJECTORY_VERSION = 2;
+
+// The conserved quantities of each frame (Diagnostics.h), in record order
+constexpr int TRAJECTORY_DIAGNOSTICS = 8;
+constexpr const char* TRAJECTORY_DIAGNOSTIC_NAMES[TRAJECTORY_DIAGNOSTICS] = {
+    "kinetic_energy", "potential_energy", "energy", "energy_drift",
+    "momentum_x", "momentum_y", "angular_momentum", "virial_ratio"
+};
+
+// Field bits follow the snapshot array order
+constexpr uint32_t TRAJECTORY_ALL_FIELDS = (1u << SNAPSHOT_ARRAYS) - 1;
+constexpr const char* TRAJECTORY_FIELD_NAMES[SNAPSHOT_ARRAYS] = {"x", "y", "vx", "vy", "m"};
+
+enum TrajectoryCompression : uint32_t {
+    TRAJECTORY_RAW = 0,
+    TRAJECTORY_SHUFFLE_DEFLATE = 1
+};
+
+struct TrajectoryHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t fields;       // Bit a set for SnapshotArray a
+    uint32_t bodyCount;
+    uint32_t reserved;
+    uint64_t interval;     // Steps between frames
+};
+static_assert(sizeof(TrajectoryHeader) == 32, "trajectory header layout changed");
+
+struct TrajectoryChunkHeader {
+    uint32_t frames;
+    uint32_t compression;  // TrajectoryCompression
+    uint64_t rawBytes;
+    uint64_t storedBytes;
+};
+static_assert(sizeof(TrajectoryChunkHeader) == 24, "trajectory chunk header layout changed");
+
+struct TrajectoryOptions {
+    std::string path;                  // Empty disables trajectory output
+    uint64_t every = 100;              // Steps between frames
+    std::string fields = "x,y";        // Comma-separated field names or "all"
+    std::string bodies = "all";        // "all", "named" or comma-separated body names
+    uint32_t chunkFrames = 64;         // Frames per chunk
+    bool compress = false;
+};
+
+// What every chunk of a file holds
+struct TrajectoryLayout {
+    uint32_t fields = 0;
+    uint64_t interval = 1;
+    std::vector<uint32_t> ids;         // Column -> ParticleInfo::id at open()
+    std::vector<std::string> names;
+    uint32_t chunkFrames = 1;
+    bool compress = false;
+    
+    int fieldCount() const {
+        int count = 0;
+        for (int a = 0; a < SNAPSHOT_ARRAYS; ++a) {
+            count += (fields >> a) & 1;
+        }
+        return count;
+    }
+};
+
+// Frames captured between two hand-overs to the writer thread
+struct TrajectoryChunk {
+    uint32_t frames = 0;
+    std::vector<uint64_t> steps;
+    std::vector<double> times;
+    std::vector<double> diagnostics;   // [frame][TRAJECTORY_DIAGNOSTICS]
+    std::vector<float> values;         // [frame][field][column]
+};
+
+// Destination of a trajectory. begin() runs once before the first chunk and
+// finish() once after the last; write() and finish() run on the writer
+// thread. All three throw std::runtime_error when the output fails.
+class TrajectorySink {
+public:
+    virtual ~TrajectorySink() = default;
+    virtual void begin(const TrajectoryLayout& layout) = 0;
+    virtual void write(const TrajectoryChunk& chunk) = 0;
+    virtual void finish() = 0;
+    virtual uint64_t bytesWritten() const = 0;
+};
+
+class BinaryTrajectorySink : public TrajectorySink {
+private:
+    std::string path;
+    std::ofstream file;
+    size_t columns = 0;
+    int fieldCount = 0;
+    bool compress = false;
+    uint64_t written = 0;
+    std::vector<uint8_t> raw, shuffled, packed;  // Reused from chunk to chunk
+    
+    void put(const void* data, size_t bytes) {
+        file.write(static_cast<const char*>(data), static_cast<std::streamsize>(bytes));
+        if (!file) throw std::runtime_error("could not write " + path);
+        written += bytes;
+    }
+    
+    template <typename T>
+    void append(const std::vector<T>& values, size_t count) {
+        const size_t offset = raw.size();
+        raw.resize(offset + count * sizeof(T));
+        std::memcpy(raw.data() + offset, values.data(), count * sizeof(T));
+    }
+    
+public:
+    explicit BinaryTrajectorySink(const std::string& path) : path(path) {}
+    
+    void begin(const TrajectoryLayout& layout) override {
+        file.open(path, std::ios::binary | std::ios::trunc);
+        if (!file.is_open()) throw std::runtime_error("could not open " + path);
+        columns = layout.ids.size();
+        fieldCount = layout.fieldCount();
+        compress = layout.compress;
+        
+        TrajectoryHeader header{};
+        std::memcpy(header.magic, TRAJECTORY_MAGIC, sizeof(TRAJECTORY_MAGIC));
+        header.version = TRAJECTORY_VERSION;
+        header.fields = layout.fields;
+        header.bodyCount = static_cast<uint32_t>(columns);
+        header.interval = layout.interval;
+        put(&header, sizeof(header));
+        put(layout.ids.data(), columns * sizeof(uint32_t));
+        
+        std::vector<uint32_t> nameEnds;
+        std::string names;
+        for (const std::string& name : layout.names) {
+            names += name;
+            nameEnds.push_back(static_cast<uint32_t>(names.size()));
+        }
+        put(nameEnds.data(), nameEnds.size() * sizeof(uint32_t));
+        put(names.data(), names.size());
+    }
+    
+    void write(const TrajectoryChunk& chunk) override {
+        raw.clear();
+        append(chunk.steps, chunk.frames);
+        append(chunk.times, chunk.frames);
+        append(chunk.diagnostics, size_t(chunk.frames) * TRAJECTORY_DIAGNOSTICS);
+        append(chunk.values, size_t(chunk.frames) * fieldCount * columns);
+        
+        TrajectoryChunkHeader header{chunk.frames, TRAJECTORY_RAW, raw.size(), raw.size()};
+        const uint8_t* payload = raw.data();
+#ifdef USE_ZLIB
+        if (compress) {
+            // Shuffle at float width; the 8-byte step, time and diagnostics
+            // prefix only compresses a little worse for it
+            const size_t lanes = sizeof(float);
+            const size_t words = raw.size() / lanes;
+            shuffled.resize(raw.size());
+            for (size_t w = 0; w < words; ++w) {
+                for (size_t b = 0; b < lanes; ++b) {
+                    shuffled[b * words + w] = raw[w * lanes + b];
+                }
+            }
+            uLongf packedBytes = compressBound(static_cast<uLong>(raw.size()));
+            packed.resize(packedBytes);
+            // Level 1: most of the gain of deflate at a fraction of the time
+            if (compress2(packed.data(), &packedBytes, shuffled.data(), static_cast<uLong>(raw.size()), 1) != Z_OK) {
+                throw std::runtime_error("could not compress trajectory chunk");
+            }
+            header.compression = TRAJECTORY_SHUFFLE_DEFLATE;
+            header.storedBytes = packedBytes;
+            payload = packed.data();
+        }
+#endif
+        put(&header, sizeof(header));
+        put(payload, header.storedBytes);
+    }
+    
+    void finish() override {
+        file.flush();
+        if (!file) throw std::runtime_error("could not write " + path);
+        file.close();
+    }
+    
+    uint64_t bytesWritten() const override { return written; }
+};
+
+#ifdef USE_HDF5
+// One dataset per field, frames x bodies, grown by a chunk at a time; "step"
+// and "time" hold the frame times, one 1-D dataset per diagnostic its value
+// at each frame, and "id" and "name" the columns. The HDF5 chunk is the
+// trajectory chunk, so every append writes whole chunks.
+class Hdf5TrajectorySink : public TrajectorySink {
+private:
+    std::string path;
+    hid_t file = -1;
+    hid_t stepSet = -1, timeSet = -1;
+    std::vector<hid_t> diagnosticSets, fieldSets;
+    hsize_t columns = 0;
+    hsize_t frames = 0;
+    std::vector<float> rows;  // One field of a chunk, reused from chunk to chunk
+    std::vector<double> series;  // One diagnostic of a chunk
+    
+    static void check(herr_t status, const char* what) {
+        if (status < 0) throw std::runtime_error(std::string("HDF5: could not ") + what);
+    }
+    
+    static hid_t checkId(hid_t id, const char* what) {
+        if (id < 0) throw std::runtime_error(std::string("HDF5: could not ") + what);
+        return id;
+    }
+    
+    // Extendible dataset of `rank` dimensions, the first unlimited
+    hid_t createSeries(const char* name, hid_t type, int rank, hsize_t chunkFrames, bool compress) {
+        const hsize_t dims[2] = {0, columns};
+        const hsize_t maxDims[2] = {H5S_UNLIMITED, columns};
+        const hsize_t chunk[2] = {chunkFrames, columns};
+        const hid_t space = checkId(H5Screate_simple(rank, dims, maxDims), "create a dataspace");
+        const hid_t properties = checkId(H5Pcreate(H5P_DATASET_CREATE), "create dataset properties");
+        H5Pset_chunk(properties, rank, chunk);
+        if (compress) {
+            H5Pset_shuffle(properties);
+            H5Pset_deflate(properties, 1);
+        }
+        const hid_t set = H5Dcreate2(file, name, type, space, H5P_DEFAULT, properties, H5P_DEFAULT);
+        H5Pclose(properties);
+        H5Sclose(space);
+        return checkId(set, "create a dataset");
+    }
+    
+    void appendRows(hid_t set, hid_t type, int rank, hsize_t rows, const void* data) {
+        const hsize_t size[2] = {frames + rows, columns};
+        check(H5Dset_extent(set, size), "extend a dataset");
+        const hsize_t start[2] = {frames, 0};
+        const hsize_t count[2] = {rows, columns};
+        const hid_t fileSpace = checkId(H5Dget_space(set), "get a dataspace");
+        H5Sselect_hyperslab(fileSpace, H5S_SELECT_SET, start, nullptr, count, nullptr);
+        const hid_t memorySpace = checkId(H5Screate_simple(rank, count, nullptr), "create a dataspace");
+        const herr_t status = H5Dwrite(set, type, memorySpace, fileSpace, H5P_DEFAULT, data);
+        H5Sclose(memorySpace);
+        H5Sclose(fileSpace);
+        check(status, "write a dataset");
+    }
+    
+    void close() {
+        for (hid_t set : fieldSets) H5Dclose(set);
+        for (hid_t set : diagnosticSets) H5Dclose(set);
+        fieldSets.clear();
+        diagnosticSets.clear();
+        if (stepSet >= 0) H5Dclose(stepSet);
+        if (timeSet >= 0) H5Dclose(timeSet);
+        if (file >= 0) H5Fclose(file);
+        stepSet = timeSet = file = -1;
+    }
+    
+public:
+    explicit Hdf5TrajectorySink(const std::string& path) : path(path) {}
+    ~Hdf5TrajectorySink() override { close(); }
+    
+    void begin(const TrajectoryLayout& layout) override {
+        file = checkId(H5Fcreate(path.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT), "create the file");
+        columns = layout.ids.size();
+        
+        const hsize_t idDims[1] = {columns};
+        const hid_t idSpace = checkId(H5Screate_simple(1, idDims, nullptr), "create a dataspace");
+        const hid_t idSet = checkId(H5Dcreate2(file, "id", H5T_NATIVE_UINT32, idSpace,
+                                                H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT), "create a dataset");
+        check(H5Dwrite(idSet, H5T_NATIVE_UINT32, H5S_ALL, H5S_ALL, H5P_DEFAULT, layout.ids.data()), "write ids");
+        H5Dclose(idSet);
+        
+        std::vector<const char*> names;
+        for (const std::string& name : layout.names) names.push_back(name.c_str());
+        const hid_t text = H5Tcopy(H5T_C_S1);
+        H5Tset_size(text, H5T_VARIABLE);
+        const hid_t nameSet = checkId(H5Dcreate2(file, "name", text, idSpace,
+                                                  H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT), "create a dataset");
+        check(H5Dwrite(nameSet, text, H5S_ALL, H5S_ALL, H5P_DEFAULT, names.data()), "write names");
+        H5Dclose(nameSet);
+        H5Tclose(text);
+        H5Sclose(idSpace);
+        
+        stepSet = createSeries("step", H5T_NATIVE_UINT64, 1, layout.chunkFrames, false);
+        timeSet = createSeries("time", H5T_NATIVE_DOUBLE, 1, layout.chunkFrames, false);
+        for (const char* name : TRAJECTORY_DIAGNOSTIC_NAMES) {
+            diagnosticSets.push_back(createSeries(name, H5T_NATIVE_DOUBLE, 1, layout.chunkFrames, false));
+        }
+        for (int a = 0; a < SNAPSHOT_ARRAYS; ++a) {
+            if (layout.fields & (1u << a)) {
+                fieldSets.push_back(createSeries(TRAJECTORY_FIELD_NAMES[a], H5T_NATIVE_FLOAT, 2,
+                                                 layout.chunkFrames, layout.compress));
+            }
+        }
+    }
+    
+    void write(const TrajectoryChunk& chunk) override {
+        appendRows(stepSet, H5T_NATIVE_UINT64, 1, chunk.frames, chunk.steps.data());
+        appendRows(timeSet, H5T_NATIVE_DOUBLE, 1, chunk.frames, chunk.times.data());
+        series.resize(chunk.frames);
+        for (int d = 0; d < TRAJECTORY_DIAGNOSTICS; ++d) {
+            for (uint32_t k = 0; k < chunk.frames; ++k) {
+                series[k] = chunk.diagnostics[size_t(k) * TRAJECTORY_DIAGNOSTICS + d];
+            }
+            appendRows(diagnosticSets[d], H5T_NATIVE_DOUBLE, 1, chunk.frames, series.data());
+        }
+        
+        // The chunk interleaves fields per frame; each dataset wants its
+        // own field's rows, so gather them
+        rows.resize(chunk.frames * columns);
+        const size_t fieldCount = fieldSets.size();
+        for (size_t f = 0; f < fieldCount; ++f) {
+            for (uint32_t k = 0; k < chunk.frames; ++k) {
+                std::memcpy(rows.data() + k * columns, chunk.values.data() + (k * fieldCount + f) * columns,
+                            columns * sizeof(float));
+            }
+            appendRows(fieldSets[f], H5T_NATIVE_FLOAT, 2, chunk.frames, rows.data());
+        }
+        frames += chunk.frames;
+    }
+    
+    void finish() override {
+        check(H5Fflush(file, H5F_SCOPE_GLOBAL), "flush the file");
+        close();
+    }
+    
+    uint64_t bytesWritten() const override { return 0; }
+};
+#endif
+
+inline bool hasSuffix(const std::string& text, const std::string& suffix) {
+    return text.size() >= suffix.size() && text.compare(text.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+// HDF5 for .h5 and .hdf5 paths, falling back to the native format (with a
+// warning) in builds without HDF5
+inline std::unique_ptr<TrajectorySink> createTrajectorySink(const std::string& path) {
+    if (hasSuffix(path, ".h5") || hasSuffix(path, ".hdf5")) {
+#ifdef USE_HDF5
+        return std::make_unique<Hdf5TrajectorySink>(path);
+#else
+        std::cerr << "Built without HDF5 (-DASTRO_ENABLE_HDF5=ON), writing " << path
+                  << " in the native trajectory format" << std::endl;
+#endif
+    }
+    return std::make_unique<BinaryTrajectorySink>(path);
+}
+
+// Returns false, after reporting to std::cerr, for an unknown field name
+inline bool parseTrajectoryFields(const std::string& list, uint32_t& fields) {
+    if (list == "all") {
+        fields = TRAJECTORY_ALL_FIELDS;
+        return true;
+    }
+    fields = 0;
+    for (const std::string& item : splitList(list)) {
+        int a = 0;
+        while (a < SNAPSHOT_ARRAYS && item != TRAJECTORY_FIELD_NAMES[a]) ++a;
+        if (a == SNAPSHOT_ARRAYS) {
+            std::cerr << "Unknown trajectory field \"" << item << "\" (x, y, vx, vy, m or all)" << std::endl;
+            return false;
+        }
+        fields |= 1u << a;
+    }
+    if (fields == 0) {
+        std::cerr << "No trajectory fields selected" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Captures frames on the simulation thread and writes them on its own
+// thread. Frame, chunk and queue buffers are allocated up front and recycled,
+// so a steady run allocates nothing per frame.
+class TrajectoryWriter {
+public:
+    static constexpr size_t DEFAULT_QUEUE_CHUNKS = 8;  // Full chunks waiting for the disk before capture blocks
+    
+private:
+    std::unique_ptr<TrajectorySink> sink;
+    TrajectoryLayout layout;
+    std::vector<int32_t> columnOf;     // ParticleInfo::serial - serialBase -> column, -1 if not recorded
+    uint64_t serialBase = 0;           // Lowest serial at open(); later bodies have higher ones
+    size_t queueChunks = DEFAULT_QUEUE_CHUNKS;
+    TrajectoryChunk filling;
+    
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<TrajectoryChunk> queue;
+    std::vector<TrajectoryChunk> spare;
+    bool closing = false;
+    std::string error;                 // First sink failure, ends the run
+    std::thread thread;
+    
+    uint64_t framesCaptured = 0;
+    uint64_t chunksWritten = 0;
+    uint64_t stalls = 0;               // Captures that had to wait for the writer
+    double stallMs = 0.0;
+    
+    void prepare(TrajectoryChunk& chunk) const {
+        chunk.frames = 0;
+        chunk.steps.resize(layout.chunkFrames);
+        chunk.times.resize(layout.chunkFrames);
+        chunk.diagnostics.resize(size_t(layout.chunkFrames) * TRAJECTORY_DIAGNOSTICS);
+        chunk.values.resize(size_t(layout.chunkFrames) * layout.fieldCount() * layout.ids.size());
+    }
+    
+    void loop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            changed.wait(lock, [this] { return !queue.empty() || closing; });
+            if (queue.empty()) break;
+            TrajectoryChunk chunk = std::move(queue.front());
+            queue.pop_front();
+            
+            if (error.empty()) {
+                lock.unlock();
+                std::string failure;
+                try {
+                    sink->write(chunk);
+                } catch (const std::exception& e) {
+                    failure = e.what();
+                }
+                lock.lock();
+                if (!failure.empty() && error.empty()) error = failure;
+                ++chunksWritten;
+            }
+            spare.push_back(std::move(chunk));
+            changed.notify_all();
+        }
+        
+        if (error.empty()) {
+            lock.unlock();
+            std::string failure;
+            try {
+                sink->finish();
+            } catch (const std::exception& e) {
+                failure = e.what();
+            }
+            lock.lock();
+            if (!failure.empty()) error = failure;
+        }
+    }
+    
+    // Queues the filled chunk, waiting while the queue is full. Returns
+    // false if the writer has failed.
+    bool submit() {
+        using Clock = std::chrono::steady_clock;
+        std::unique_lock<std::mutex> lock(mutex);
+        if (queue.size() >= queueChunks && error.empty()) {
+            const auto start = Clock::now();
+            changed.wait(lock, [this] { return queue.size() < queueChunks || !error.empty(); });
+            ++stalls;
+            stallMs += std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+        }
+        if (!error.empty()) {
+            filling.frames = 0;
+            return false;
+        }
+        
+        queue.push_back(std::move(filling));
+        changed.notify_all();
+        if (spare.empty()) {
+            filling = TrajectoryChunk();
+        } else {
+            filling = std::move(spare.back());
+            spare.pop_back();
+        }
+        lock.unlock();
+        prepare(filling);
+        return true;
+    }
+    
+public:
+    TrajectoryWriter() = default;
+    ~TrajectoryWriter() { close(); }
+    TrajectoryWriter(const TrajectoryWriter&) = delete;
+    TrajectoryWriter& operator=(const TrajectoryWriter&) = delete;
+    
+    // Picks the fields and bodies to record from the core's current
+    // particles and starts the writer thread. Returns false, after reporting
+    // to std::cerr, if the options are invalid.
+    bool open(const TrajectoryOptions& options, const SimulationCore& core,
+              size_t maxQueuedChunks = DEFAULT_QUEUE_CHUNKS) {
+        if (!parseTrajectoryFields(options.fields, layout.fields)) return false;
+        layout.interval = options.every > 0 ? options.every : 1;
+        layout.chunkFrames = options.chunkFrames > 0 ? options.chunkFrames : 1;
+        layout.compress = options.compress;
+        queueChunks = maxQueuedChunks > 0 ? maxQueuedChunks : 1;
+#ifndef USE_ZLIB
+        if (layout.compress && !(hasSuffix(options.path, ".h5") || hasSuffix(options.path, ".hdf5"))) {
+            std::cerr << "Built without zlib, writing the trajectory uncompressed" << std::endl;
+            layout.compress = false;
+        }
+#endif
+        
+        // Columns in ParticleInfo::id order
+        const ParticleStore& particles = core.getParticles();
+        std::vector<const ParticleInfo*> byId(particles.size());
+        for (const ParticleInfo& meta : particles.info) {
+            byId[meta.id] = &meta;
+        }
+        const std::vector<std::string> wanted =
+            options.bodies == "all" || options.bodies == "named" ? std::vector<std::string>() : splitList(options.bodies);
+        std::unordered_map<std::string, bool> found;
+        for (const std::string& name : wanted) found[name] = false;
+        
+        // Serials only grow, so the bodies present now span a short range
+        uint64_t serialEnd = 0;
+        serialBase = std::numeric_limits<uint64_t>::max();
+        for (const ParticleInfo& meta : particles.info) {
+            serialBase = std::min(serialBase, meta.serial);
+            serialEnd = std::max(serialEnd, meta.serial + 1);
+        }
+        columnOf.assign(particles.empty() ? 0 : size_t(serialEnd - serialBase), -1);
+        for (const ParticleInfo* meta : byId) {
+            bool selected = options.bodies == "all";
+            if (options.bodies == "named") {
+                selected = !meta->name.empty();
+            } else if (!wanted.empty()) {
+                auto match = found.find(meta->name);
+                selected = match != found.end();
+                if (selected) match->second = true;
+            }
+            if (!selected) continue;
+            columnOf[meta->serial - serialBase] = static_cast<int32_t>(layout.ids.size());
+            layout.ids.push_back(meta->id);
+            layout.names.push_back(meta->name);
+        }
+        for (const auto& entry : found) {
+            if (!entry.second) std::cerr << "Trajectory body \"" << entry.first << "\" not found" << std::endl;
+        }
+        if (layout.ids.empty()) {
+            std::cerr << "No bodies selected for the trajectory" << std::endl;
+            return false;
+        }
+        
+        // Opened here rather than on the writer thread so that a bad path
+        // fails the run before the first step
+        sink = createTrajectorySink(options.path);
+        try {
+            sink->begin(layout);
+        } catch (const std::exception& e) {
+            std::cerr << "Trajectory output failed: " << e.what() << std::endl;
+            return false;
+        }
+        for (size_t c = 0; c < queueChunks + 1; ++c) {
+            spare.emplace_back();
+            prepare(spare.back());
+        }
+        prepare(filling);
+        thread = std::thread(&TrajectoryWriter::loop, this);
+        return true;
+    }
+    
+    bool isOpen() const { return thread.joinable(); }
+    
+    // Records the core's current state as a frame, with its diagnostics if
+    // they were measured at this step. Returns false if the writer has
+    // failed; the reason is reported by close().
+    bool capture(const SimulationCore& core) {
+        const ParticleStore& particles = core.getParticles();
+        const RealArray* arrays[SNAPSHOT_ARRAYS] = {
+            &particles.x, &particles.y, &particles.vx, &particles.vy, &particles.m
+        };
+        const size_t columns = layout.ids.size();
+        const uint32_t frame = filling.frames;
+        filling.steps[frame] = core.getStepCount();
+        filling.times[frame] = core.getTime();
+        
+        double* record = filling.diagnostics.data() + size_t(frame) * TRAJECTORY_DIAGNOSTICS;
+        std::fill(record, record + TRAJECTORY_DIAGNOSTICS, std::numeric_limits<double>::quiet_NaN());
+        if (core.diagnosticsCurrent()) {
+            const Diagnostics& d = core.getDiagnostics();
+            const double values[TRAJECTORY_DIAGNOSTICS] = {
+                d.kinetic, d.potential, d.energy(), d.energyDrift,
+                d.momentumX, d.momentumY, d.angularMomentum, d.virialRatio()
+            };
+            std::copy(values, values + TRAJECTORY_DIAGNOSTICS, record);
+        }
+        
+        // Bodies merged away since open() leave their columns at NaN
+        float* row = filling.values.data() + size_t(frame) * layout.fieldCount() * columns;
+        std::fill(row, row + size_t(layout.fieldCount()) * columns, std::numeric_limits<float>::quiet_NaN());
+        for (int a = 0; a < SNAPSHOT_ARRAYS; ++a) {
+            if (!(layout.fields & (1u << a))) continue;
+            const RealArray& values = *arrays[a];
+            for (size_t i = 0; i < particles.size(); ++i) {
+                const uint64_t offset = particles.info[i].serial - serialBase;
+                if (offset < columnOf.size() && columnOf[offset] >= 0) row[columnOf[offset]] = float(values[i]);
+            }
+            row += columns;
+        }
+        ++framesCaptured;
+        
+        if (++filling.frames == layout.chunkFrames) return submit();
+        return true;
+    }
+    
+    // Writes any partial chunk, waits for the writer to finish and reports
+    // the totals. Returns false, after reporting to std::cerr, if any
+    // write failed.
+    bool close() {
+        if (!thread.joinable()) return true;
+        if (filling.frames > 0) submit();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closing = true;
+        }
+        changed.notify_all();
+        thread.join();
+        
+        if (!error.empty()) {
+            std::cerr << "Trajectory output failed: " << error << std::endl;
+            return false;
+        }
+        std::cout << "Trajectory: " << framesCaptured << " frames of " << layout.ids.size() << " bodies in "
+                  << chunksWritten << " chunks";
+        if (sink->bytesWritten() > 0) std::cout << ", " << sink->bytesWritten() << " bytes";
+        std::cout << ", capture waited for the writer " << stalls << " times (" << stallMs << " ms)" << std::endl;
+        return true;
+    }
+};
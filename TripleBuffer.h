@@ -0,0 +1,43 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+// Single-producer, single-consumer triple buffer. The producer fills write()
+// and publishes it; the consumer picks up the newest published buffer with
+// acquire() and reads it until its next acquire. Neither side ever waits for
+// the other: a producer that outruns the consumer overwrites the unread
+// buffer, and a consumer that falls behind skips straight to the newest one.
+template <typename T>
+class TripleBuffer {
+private:
+    static constexpr uint8_t INDEX_MASK = 0x3;
+    static constexpr uint8_t FRESH = 0x4;  // The shared slot holds an unread buffer
+    
+    std::array<T, 3> buffers;
+    
+    // Each buffer is owned by exactly one of the producer, the consumer or
+    // the shared slot; publish and acquire swap ownership with the slot
+    alignas(64) std::atomic<uint8_t> shared{1};
+    alignas(64) uint8_t writeIndex = 0;
+    alignas(64) uint8_t readIndex = 2;
+    
+public:
+    // Producer side
+    T& write() { return buffers[writeIndex]; }
+    
+    void publish() {
+        writeIndex = shared.exchange(uint8_t(writeIndex | FRESH), std::memory_order_acq_rel) & INDEX_MASK;
+    }
+    
+    // Consumer side. Returns false, keeping the current buffer, if nothing
+    // was published since the last acquire.
+    bool acquire() {
+        if (!(shared.load(std::memory_order_relaxed) & FRESH)) return false;
+        readIndex = shared.exchange(readIndex, std::memory_order_acq_rel) & INDEX_MASK;
+        return true;
+    }
+    
+    const T& read() const { return buffers[readIndex]; }
+};
@@ -0,0 +1,78 @@
+// Accuracy versus time of the approximate force solvers
+//
+// Times a full force evaluation with Barnes-Hut over a range of opening
+// angles and with the fast multipole method over a range of expansion orders
+// and acceptance parameters, and reports each configuration's rms error
+// against direct summation on a sample of bodies. Comparing rows of similar
+// error shows which solver is cheaper for a given accuracy.
+//
+// Usage: astro_accuracy_bench [particles] [repetitions]
+
+#include "BenchCommon.h"
+
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+namespace {
+
+void printRow(const std::string& solver, const std::string& setting, double ms, double error) {
+    std::cout << std::left << std::setw(12) << solver << std::setw(18) << setting << std::right
+              << std::fixed << std::setprecision(2) << std::setw(10) << ms
+              << std::scientific << std::setw(12) << error << "\n";
+    std::cout.unsetf(std::ios::floatfield);
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    long arguments[2] = {65536, 3};
+    bool valid = argc <= 3;
+    for (int i = 1; i < argc && valid; ++i) {
+        valid = parsePositive(argv[i], arguments[i - 1]);
+    }
+    if (!valid) {
+        std::cerr << "Usage: " << argv[0] << " [particles] [repetitions], both positive" << std::endl;
+        return 2;
+    }
+    const size_t count = static_cast<size_t>(arguments[0]);
+    const int repetitions = static_cast<int>(arguments[1]);
+    const Real G = 1;
+    const Softening softening{SofteningKernel::Plummer, 1};
+    
+    ParticleStore particles;
+    makeMixedBodies(particles, count);
+    const BodySpan bodies = particles.bodies();
+    ForceReference ref;
+    ref.compute(bodies, G, softening);
+    
+    std::cout << "Accuracy benchmark: " << count << " bodies, " << repetitions << " repetitions\n\n";
+    std::cout << std::left << std::setw(12) << "solver" << std::setw(18) << "setting" << std::right
+              << std::setw(10) << "ms" << std::setw(12) << "rms error" << "\n";
+    
+    RealArray ax(count), ay(count);
+    const AccelerationSpan out{ax.data(), ay.data(), count};
+    
+    for (float theta : {0.2f, 0.3f, 0.5f, 0.7f, 0.9f}) {
+        BarnesHutForceSolver solver(theta);
+        solver.setRefitPolicy(0, QuadTree::DEFAULT_REFIT_GROWTH);  // Time full builds
+        const double ms = bestOf(repetitions, [&] { solver.computeAccelerations(bodies, TargetSpan{}, out, G, softening); });
+        std::ostringstream setting;
+        setting << "theta " << theta;
+        printRow("barnes_hut", setting.str(), ms, ref.error(ax.data(), ay.data()).rms);
+    }
+    
+    for (float theta : {0.4f, 0.6f, 0.8f}) {
+        for (int order = 1; order <= FastMultipoleCalculator::MAX_ORDER; ++order) {
+            FastMultipoleForceSolver solver(order, theta);
+            solver.setRefitPolicy(0, QuadTree::DEFAULT_REFIT_GROWTH);
+            const double ms = bestOf(repetitions, [&] { solver.computeAccelerations(bodies, TargetSpan{}, out, G, softening); });
+            std::ostringstream setting;
+            setting << "p " << order << ", theta " << theta;
+            printRow("fmm", setting.str(), ms, ref.error(ax.data(), ay.data()).rms);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,346 @@
+// Benchmark suite for the force solvers, the tree build and the integrators
+//
+// Builds seeded, reproducible scenarios (a uniform cloud, a Plummer sphere
+// and two colliding disks) at each requested size and times, separately:
+//
+//   tree       QuadTree build from scratch
+//   direct     direct summation (sampled and extrapolated above --direct-limit)
+//   barnes_hut full Barnes-Hut evaluation at each --thetas value
+//   fmm        fast multipole evaluation at the default order
+//   step       one step of each integrator with Barnes-Hut forces
+//
+// Force rows carry the rms and worst relative error against direct summation
+// on a fixed sample of bodies. Every row is the fastest of --repetitions runs
+// after a warm-up. Results print as a table and can be written as JSON and
+// CSV for tracking regressions across builds and machines.
+//
+// Usage: astro_bench [--sizes 1k,10k,100k] [--scenarios uniform,plummer,collision]
+//                    [--thetas 0.3,0.5,0.7] [--repetitions 3] [--seed 1]
+//                    [--direct-limit 20000] [--json file] [--csv file]
+//                    [--threads N] [--pin-threads] [--softening-kernel plummer|compact]
+
+#include "BenchCommon.h"
+#include "Integrator.h"
+#include "Procedural.h"
+#include "Threading.h"
+
+#include <nlohmann/json.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+constexpr Real G = 1;
+constexpr Real SOFTENING = 1;
+constexpr Real DT = Real(0.01);
+
+struct Options {
+    std::vector<size_t> sizes = {1000, 10000, 100000};
+    std::vector<std::string> scenarios = {"uniform", "plummer", "collision"};
+    std::vector<float> thetas = {0.3f, 0.5f, 0.7f};
+    int repetitions = 3;
+    uint64_t seed = 1;
+    size_t directLimit = 20000;  // Larger sizes time direct summation on a sample
+    std::string jsonPath;
+    std::string csvPath;
+    int threads = 0;  // 0 = ASTRO_THREADS or all hardware threads
+    bool pinThreads = defaultThreadPinning();
+    Softening softening{SofteningKernel::Plummer, SOFTENING};
+};
+
+struct Result {
+    std::string scenario;
+    size_t count = 0;
+    std::string benchmark;
+    std::string setting;
+    double ms = 0.0;
+    double rmsError = -1.0;  // Negative where it does not apply
+    double maxError = -1.0;
+};
+
+bool parseOptions(int argc, char* argv[], Options& options) {
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        const bool hasValue = i + 1 < argc;
+        if (arg == "--sizes" && hasValue) {
+            options.sizes.clear();
+            for (const std::string& item : splitList(argv[++i])) {
+                uint64_t count = 0;
+                if (!parseCount(item.c_str(), count)) {
+                    std::cerr << "Invalid size \"" << item << "\" (a positive count such as 1000, 10k or 1M)" << std::endl;
+                    return false;
+                }
+                options.sizes.push_back(static_cast<size_t>(count));
+            }
+        } else if (arg == "--scenarios" && hasValue) {
+            options.scenarios = splitList(argv[++i]);
+        } else if (arg == "--thetas" && hasValue) {
+            options.thetas.clear();
+            for (const std::string& item : splitList(argv[++i])) {
+                double theta = 0.0;
+                if (!parsePositive(item.c_str(), theta)) {
+                    std::cerr << "Invalid theta \"" << item << "\" (a positive number)" << std::endl;
+                    return false;
+                }
+                options.thetas.push_back(static_cast<float>(theta));
+            }
+        } else if (arg == "--repetitions" && hasValue) {
+            long repetitions = 0;
+            if (!parsePositive(argv[++i], repetitions)) {
+                std::cerr << "Invalid repetitions \"" << argv[i] << "\" (a positive whole number)" << std::endl;
+                return false;
+            }
+            options.repetitions = static_cast<int>(repetitions);
+        } else if (arg == "--seed" && hasValue) {
+            if (!parseWhole(argv[++i], options.seed)) {
+                std::cerr << "Invalid seed \"" << argv[i] << "\" (a whole number)" << std::endl;
+                return false;
+            }
+        } else if (arg == "--direct-limit" && hasValue) {
+            uint64_t limit = 0;
+            if (!parseCount(argv[++i], limit)) {
+                std::cerr << "Invalid direct limit \"" << argv[i] << "\" (a positive count such as 20000 or 20k)" << std::endl;
+                return false;
+            }
+            options.directLimit = static_cast<size_t>(limit);
+        } else if (arg == "--json" && hasValue) {
+            options.jsonPath = argv[++i];
+        } else if (arg == "--csv" && hasValue) {
+            options.csvPath = argv[++i];
+        } else if (arg == "--threads" && hasValue) {
+            options.threads = std::atoi(argv[++i]);
+        } else if (arg == "--pin-threads") {
+            options.pinThreads = true;
+        } else if (arg == "--softening-kernel" && hasValue) {
+            const std::string name = argv[++i];
+            options.softening.kernel = parseSofteningKernel(name, options.softening.kernel);
+            if (softeningKernelName(options.softening.kernel) != name) {
+                std::cerr << "Unknown softening kernel \"" << name << "\" (plummer or compact)" << std::endl;
+                return false;
+            }
+        } else {
+            std::cerr << "Unknown or incomplete argument: " << arg << std::endl;
+            return false;
+        }
+    }
+    if (options.sizes.empty() || options.scenarios.empty() || options.thetas.empty()) {
+        std::cerr << "--sizes, --scenarios and --thetas each need at least one item" << std::endl;
+        return false;
+    }
+    for (const std::string& name : options.scenarios) {
+        if (name != "uniform" && name != "plummer" && name != "collision") {
+            std::cerr << "Unknown scenario \"" << name << "\" (uniform, plummer or collision)" << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// The scenarios are procedural_particles entries, so they match what a
+// scenario file with the same entries and seed loads
+void makeScenario(ParticleStore& particles, const std::string& name, size_t count, uint64_t seed,
+                  const Softening& softening) {
+    ProceduralContext context;
+    context.G = G;
+    context.softening = softening;
+    context.seed = seed;
+    
+    particles.clear();
+    if (name == "uniform") {
+        generatePopulation(particles, {{"type", "uniform"}, {"count", count}, {"radius", 1000.0}}, context, 0);
+    } else if (name == "plummer") {
+        generatePopulation(particles, {{"type", "plummer"}, {"count", count}, {"scale_radius", 100.0}}, context, 0);
+    } else {
+        // Two disks of count / 2 bodies each (cores included) falling together
+        const size_t half = count / 2;
+        const Real coreMass = static_cast<Real>(half);
+        particles.add(Vector2r(-600, 0), Vector2r(0, -5), coreMass, COLOR_WHITE, "Core A");
+        particles.add(Vector2r(600, 0), Vector2r(0, 5), coreMass, COLOR_WHITE, "Core B");
+        generatePopulation(particles, {{"type", "disk"}, {"center_ref", "Core A"}, {"count", half - 1},
+                                       {"inner_radius", 20.0}, {"outer_radius", 400.0}}, context, 0);
+        generatePopulation(particles, {{"type", "disk"}, {"center_ref", "Core B"}, {"count", count - half - 1},
+                                       {"inner_radius", 20.0}, {"outer_radius", 300.0},
+                                       {"clockwise", true}}, context, 1);
+    }
+    sortBodiesMorton(particles);
+}
+
+void printHeader() {
+    std::cout << std::left << std::setw(11) << "scenario" << std::right << std::setw(9) << "bodies"
+              << "  " << std::left << std::setw(12) << "benchmark" << std::setw(28) << "setting" << std::right
+              << std::setw(11) << "ms" << std::setw(12) << "rms error" << std::setw(12) << "max error" << "\n";
+}
+
+void printRow(const Result& r) {
+    std::cout << std::left << std::setw(11) << r.scenario << std::right << std::setw(9) << r.count
+              << "  " << std::left << std::setw(12) << r.benchmark << std::setw(28) << r.setting << std::right
+              << std::fixed << std::setprecision(3) << std::setw(11) << r.ms << std::scientific << std::setprecision(2);
+    if (r.rmsError >= 0.0) {
+        std::cout << std::setw(12) << r.rmsError << std::setw(12) << r.maxError;
+    }
+    std::cout << "\n";
+    std::cout.unsetf(std::ios::floatfield);
+}
+
+void benchmarkScenario(const Options& options, const std::string& scenario, size_t count,
+                       std::vector<Result>& results) {
+    ParticleStore particles;
+    const Softening& softening = options.softening;
+    makeScenario(particles, scenario, count, options.seed, softening);
+    const BodySpan bodies = particles.bodies();
+    RealArray ax(count), ay(count);
+    const AccelerationSpan out{ax.data(), ay.data(), count};
+    const int reps = options.repetitions;
+    
+    ForceReference ref;
+    ref.compute(bodies, G, softening);
+    
+    auto record = [&](const std::string& benchmark, const std::string& setting, double ms, bool withError) {
+        Result r{scenario, count, benchmark, setting, ms};
+        if (withError) {
+            const ForceError error = ref.error(ax.data(), ay.data());
+            r.rmsError = error.rms;
+            r.maxError = error.worst;
+        }
+        printRow(r);
+        results.push_back(r);
+    };
+    
+    {
+        QuadTree tree;
+        const double ms = bestOf(reps, [&] { tree.build(bodies, QuadTree::rootBounds(bodies)); });
+        std::ostringstream setting;
+        setting << "leaf " << tree.getLeafCapacity() << ", " << tree.nodeCount() << " nodes";
+        record("tree", setting.str(), ms, false);
+    }
+    
+    {
+        DirectForceSolver direct;
+        if (count <= options.directLimit) {
+            const double ms = bestOf(reps, [&] { direct.computeAccelerations(bodies, TargetSpan{}, out, G, softening); });
+            record("direct", "all targets", ms, true);
+        } else {
+            // O(N^2) is out of reach here: time the sample and scale up
+            const TargetSpan targets{ref.sample.data(), ref.sample.size()};
+            const double ms = bestOf(reps, [&] { direct.computeAccelerations(bodies, targets, out, G, softening); });
+            std::ostringstream setting;
+            setting << ref.sample.size() << " targets, scaled";
+            record("direct", setting.str(), ms * count / ref.sample.size(), false);
+        }
+    }
+    
+    for (float theta : options.thetas) {
+        BarnesHutForceSolver solver(theta);
+        solver.setRefitPolicy(0, QuadTree::DEFAULT_REFIT_GROWTH);  // Time full builds
+        const double ms = bestOf(reps, [&] { solver.computeAccelerations(bodies, TargetSpan{}, out, G, softening); });
+        std::ostringstream setting;
+        setting << "theta " << theta;
+        record("barnes_hut", setting.str(), ms, true);
+    }
+    
+    {
+        FastMultipoleForceSolver solver;
+        solver.setRefitPolicy(0, QuadTree::DEFAULT_REFIT_GROWTH);
+        const double ms = bestOf(reps, [&] { solver.computeAccelerations(bodies, TargetSpan{}, out, G, softening); });
+        std::ostringstream setting;
+        setting << "p " << FastMultipoleCalculator::DEFAULT_ORDER << ", theta " << FastMultipoleCalculator::DEFAULT_THETA;
+        record("fmm", setting.str(), ms, true);
+    }
+    
+    // Steps as the simulation takes them, tree refits included; each
+    // integrator starts from the same state
+    for (IntegratorType type : {IntegratorType::RungeKutta4, IntegratorType::Leapfrog,
+                                IntegratorType::VelocityVerlet, IntegratorType::BlockTimestep}) {
+        ParticleStore state = particles;
+        auto integrator = createIntegrator(type, 0.1f * DT, DT, SOFTENING);
+        BarnesHutForceSolver solver;
+        const AccelerationFunction forces = [&](const BodySpan& b, const TargetSpan& t, const AccelerationSpan& a) {
+            solver.computeAccelerations(b, t, a, G, softening);
+        };
+        const double ms = bestOf(reps, [&] { integrator->integrate(state, forces, DT); });
+        record("step", integrator->name() + ", barnes_hut", ms, false);
+    }
+}
+
+bool writeJson(const std::string& path, const Options& options, const std::vector<Result>& results) {
+    nlohmann::json rows = nlohmann::json::array();
+    for (const Result& r : results) {
+        nlohmann::json row = {{"scenario", r.scenario}, {"bodies", r.count}, {"benchmark", r.benchmark},
+                              {"setting", r.setting}, {"ms", r.ms}};
+        row["rms_error"] = r.rmsError >= 0.0 ? nlohmann::json(r.rmsError) : nlohmann::json();
+        row["max_error"] = r.maxError >= 0.0 ? nlohmann::json(r.maxError) : nlohmann::json();
+        rows.push_back(row);
+    }
+    const nlohmann::json document = {
+        {"threads", maxThreads()},
+        {"precision", PRECISION_NAME},
+        {"softening_kernel", softeningKernelName(options.softening.kernel)},
+        {"seed", options.seed},
+        {"repetitions", options.repetitions},
+        {"results", rows}
+    };
+    std::ofstream file(path);
+    if (!file.is_open()) {
+        std::cerr << "Could not write " << path << std::endl;
+        return false;
+    }
+    file << document.dump(2) << std::endl;
+    return file.good();
+}
+
+bool writeCsv(const std::string& path, const std::vector<Result>& results) {
+    std::ofstream file(path);
+    if (!file.is_open()) {
+        std::cerr << "Could not write " << path << std::endl;
+        return false;
+    }
+    file << std::setprecision(9) << "scenario,bodies,benchmark,setting,ms,rms_error,max_error\n";
+    for (const Result& r : results) {
+        file << r.scenario << ',' << r.count << ',' << r.benchmark << ",\"" << r.setting << "\"," << r.ms << ',';
+        if (r.rmsError >= 0.0) file << r.rmsError << ',' << r.maxError;
+        else file << ',';
+        file << '\n';
+    }
+    return file.good();
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    Options options;
+    if (!parseOptions(argc, argv, options)) {
+        std::cerr << "Usage: " << argv[0] << " [--sizes 1k,10k,100k] [--scenarios uniform,plummer,collision]"
+                  << " [--thetas 0.3,0.5,0.7] [--repetitions N] [--seed S] [--direct-limit N]"
+                  << " [--json file] [--csv file] [--threads N] [--pin-threads]"
+                  << " [--softening-kernel plummer|compact]" << std::endl;
+        return 2;
+    }
+    configureThreadPool(options.threads, options.pinThreads);
+    
+    std::cout << "Benchmark: " << maxThreads() << " threads, " << PRECISION_NAME << " precision, "
+              << softeningKernelName(options.softening.kernel) << " softening, seed "
+              << options.seed << ", best of " << options.repetitions << "\n\n";
+    printHeader();
+    
+    std::vector<Result> results;
+    for (const std::string& scenario : options.scenarios) {
+        for (size_t count : options.sizes) {
+            if (count < 4) continue;
+            benchmarkScenario(options, scenario, count, results);
+        }
+    }
+    
+    bool ok = true;
+    if (!options.jsonPath.empty()) ok = writeJson(options.jsonPath, options, results) && ok;
+    if (!options.csvPath.empty()) ok = writeCsv(options.csvPath, results) && ok;
+    return ok ? 0 : 1;
+}
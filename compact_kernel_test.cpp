@@ -0,0 +1,70 @@
+// Barnes-Hut accuracy under a compact softening kernel
+//
+// Compares Barnes-Hut accelerations with direct summation on a uniform
+// cloud whose compact-kernel support spans a large part of it. Most cells
+// then hold bodies within the support of the target, and the walk must open
+// them: accepted as a monopole, a cell would get the inner polynomial at its
+// centre-of-mass distance rather than the sum over its bodies. Fails if the
+// rms or worst relative error of the group walk or of the single-point walk
+// exceeds its limit.
+//
+// Usage: astro_compact_kernel_test [particles] [softening]
+
+#include "BenchCommon.h"
+
+#include <iostream>
+#include <random>
+
+namespace {
+
+constexpr float THETA = 0.7f;
+// With the defaults, accepting cells within the support gives an rms error
+// near 1e-2 and a worst of 6e-2 to 1.3e-1; opening them, 5e-3 and 1e-2
+constexpr double MAX_RMS_ERROR = 8e-3;
+constexpr double MAX_WORST_ERROR = 3e-2;
+
+// Error of the group walk, or with sampleOnly of the single-point walk,
+// which the solver takes for a sparse set of targets
+ForceError barnesHutError(const BodySpan& bodies, const Softening& softening, bool sampleOnly) {
+    const Real G = 1;
+    ForceReference ref;
+    ref.compute(bodies, G, softening);
+    
+    RealArray ax(bodies.count), ay(bodies.count);
+    const TargetSpan targets = sampleOnly ? TargetSpan{ref.sample.data(), ref.sample.size()} : TargetSpan{};
+    BarnesHutForceSolver solver(THETA);
+    solver.computeAccelerations(bodies, targets, AccelerationSpan{ax.data(), ay.data(), bodies.count},
+                                G, softening);
+    return ref.error(ax.data(), ay.data());
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    long count = 20000;
+    double length = 400.0;
+    if (argc > 3 || (argc > 1 && !parsePositive(argv[1], count)) || (argc > 2 && !parsePositive(argv[2], length))) {
+        std::cerr << "Usage: " << argv[0] << " [particles] [softening], both positive" << std::endl;
+        return 2;
+    }
+    
+    ParticleStore particles;
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<float> uniform(0.0f, 1000.0f);
+    for (long i = 0; i < count; ++i) {
+        particles.add(Vector2r(uniform(rng), uniform(rng)), Vector2r(0, 0), 1);
+    }
+    sortBodiesMorton(particles);
+    const BodySpan bodies = particles.bodies();
+    const Softening softening{SofteningKernel::Compact, length};
+    
+    int failures = 0;
+    for (bool sampleOnly : {false, true}) {
+        const ForceError e = barnesHutError(bodies, softening, sampleOnly);
+        const bool pass = e.rms <= MAX_RMS_ERROR && e.worst <= MAX_WORST_ERROR;
+        std::cout << (sampleOnly ? "Point walk" : "Group walk") << ": rms error " << e.rms << ", worst "
+                  << e.worst << (pass ? "" : " (too large)") << std::endl;
+        if (!pass) ++failures;
+    }
+    return failures == 0 ? 0 : 1;
+}
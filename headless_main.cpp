@@ -0,0 +1,8 @@
+// Batch entry point with no window and no SFML graphics dependency, for
+// cluster nodes without X11 or OpenGL. See Headless.h for the options.
+
+#include "Headless.h"
+
+int main(int argc, char* argv[]) {
+    return runHeadless(argc, argv);
+}
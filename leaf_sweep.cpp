@@ -0,0 +1,94 @@
+// Barnes-Hut leaf and group capacity sweep
+//
+// Times a full force evaluation (tree build + walk) for a range of leaf and
+// walk-group capacities and reports the fastest pair on this machine,
+// together with the error against direct summation on a sample of bodies.
+//
+// Usage: astro_leaf_sweep [particles] [theta] [repetitions]
+
+#include "BenchCommon.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+int main(int argc, char* argv[]) {
+    long countArgument = 65536;
+    double thetaArgument = 0.5;
+    long repetitionsArgument = 5;
+    const bool valid = argc <= 4 && (argc <= 1 || parsePositive(argv[1], countArgument))
+                       && (argc <= 2 || parsePositive(argv[2], thetaArgument))
+                       && (argc <= 3 || parsePositive(argv[3], repetitionsArgument));
+    if (!valid) {
+        std::cerr << "Usage: " << argv[0] << " [particles] [theta] [repetitions], all positive" << std::endl;
+        return 2;
+    }
+    const size_t count = static_cast<size_t>(countArgument);
+    const float theta = static_cast<float>(thetaArgument);
+    const int repetitions = static_cast<int>(repetitionsArgument);
+    const Real G = 1;
+    const Softening softening{SofteningKernel::Plummer, 1};
+    
+    ParticleStore particles;
+    makeMixedBodies(particles, count);
+    const BodySpan bodies = particles.bodies();
+    ForceReference ref;
+    ref.compute(bodies, G, softening);
+    
+    std::cout << "Leaf/group capacity sweep: " << count << " bodies, theta " << theta << ", "
+              << repetitions << " repetitions\n\n";
+    std::cout << std::setw(6) << "leaf" << std::setw(7) << "group" << std::setw(9) << "nodes"
+              << std::setw(8) << "groups" << std::setw(11) << "build ms" << std::setw(11) << "total ms"
+              << std::setw(12) << "rms error" << "\n";
+    
+    uint32_t bestLeaf = 0;
+    uint32_t bestGroup = 0;
+    double bestMs = 0.0;
+    RealArray ax(count), ay(count);
+    const AccelerationSpan out{ax.data(), ay.data(), count};
+    
+    for (uint32_t leaf : {1u, 4u, 8u, 16u, 32u, 64u, 128u}) {
+    for (uint32_t group : {32u, 64u, 128u, 256u}) {
+        if (group < leaf) continue;
+        
+        BarnesHutForceSolver solver(theta, leaf, group);
+        solver.setRefitPolicy(0, QuadTree::DEFAULT_REFIT_GROWTH);  // Time full builds
+        solver.computeAccelerations(bodies, TargetSpan{}, out, G, softening);  // Warm up buffers
+        
+        // Fastest repetition, which is the least disturbed by other load
+        double buildMs = 0.0;
+        double totalMs = 0.0;
+        for (int r = 0; r < repetitions; ++r) {
+            auto start = std::chrono::steady_clock::now();
+            solver.computeAccelerations(bodies, TargetSpan{}, out, G, softening);
+            const double ms = std::chrono::duration<double, std::milli>(
+                std::chrono::steady_clock::now() - start).count();
+            if (r == 0 || ms < totalMs) {
+                totalMs = ms;
+                buildMs = solver.treeStats()->buildMs;
+            }
+        }
+        
+        const TreeStats& stats = *solver.treeStats();
+        std::cout << std::setw(6) << leaf << std::setw(7) << group << std::setw(9) << stats.nodeCount
+                  << std::setw(8) << stats.groupCount << std::fixed << std::setprecision(2)
+                  << std::setw(11) << buildMs << std::setw(11) << totalMs
+                  << std::scientific << std::setw(12) << ref.error(ax.data(), ay.data()).rms << "\n";
+        std::cout.unsetf(std::ios::floatfield);
+        
+        if (bestLeaf == 0 || totalMs < bestMs) {
+            bestLeaf = leaf;
+            bestGroup = group;
+            bestMs = totalMs;
+        }
+    }
+    }
+    
+    std::cout << "\nBest: leaf " << bestLeaf << ", group " << bestGroup << " (" << std::fixed
+              << std::setprecision(2) << bestMs << " ms per evaluation)\n";
+    std::cout << "Set \"leaf_capacity\": " << bestLeaf << " and \"group_capacity\": " << bestGroup
+              << " in the scenario settings to use them.\n";
+    return 0;
+}
@@ -1,144 +1,21 @@
+#include "SimulationCore.h"
+#include "PhysicsThread.h"
+#include "Renderer.h"
+#include "TrailStore.h"
+#include "Headless.h"
+#include "Profiler.h"
+#include "Threading.h"
+
 #include <SFML/Graphics.hpp>
-#include <nlohmann/json.hpp>
 #include <vector>
 #include <cmath>
+#include <cstdlib>
 #include <iostream>
-#include <fstream>
-#include <memory>
-#include <deque>
 #include <algorithm>
-#include <execution>
 #include <chrono>
 #include <iomanip>
 #include <sstream>
-
-using json = nlohmann::json;
-
-// Constants
-struct SimulationConstants {
-    float G = 6.67430e-2f;        // Gravitational constant (scaled for visualization)
-    float DT = 0.01f;             // Time step
-    float SOFTENING = 1.0f;       // Softening parameter
-    float MIN_DT = 0.0001f;       // Minimum time step for adaptive stepping
-    float MAX_DT = 0.1f;          // Maximum time step
-    float TRAIL_LENGTH = 100;     // Number of trail points
-    bool ADAPTIVE_TIMESTEP = false;
-};
-
-// Particle class with enhanced features
-class Particle {
-public:
-    sf::Vector2f position;
-    sf::Vector2f velocity;
-    sf::Vector2f acceleration;
-    float mass;
-    sf::Color color;
-    std::string name;
-    std::deque<sf::Vector2f> trail;
-    bool fixed = false;  // For fixed bodies like black holes
-    
-    Particle(sf::Vector2f pos, sf::Vector2f vel, float m, sf::Color c = sf::Color::White, const std::string& n = "")
-        : position(pos), velocity(vel), acceleration(0, 0), mass(m), color(c), name(n) {}
-    
-    void updateTrail(size_t maxLength) {
-        trail.push_back(position);
-        if (trail.size() > maxLength) {
-            trail.pop_front();
-        }
-    }
-    
-    float kineticEnergy() const {
-        float v2 = velocity.x * velocity.x + velocity.y * velocity.y;
-        return 0.5f * mass * v2;
-    }
-};
-
-// Abstract Integrator class
-class Integrator {
-public:
-    virtual ~Integrator() = default;
-    virtual void integrate(std::vector<Particle>& particles, 
-                         const std::function<std::vector<sf::Vector2f>(const std::vector<Particle>&)>& forceFunc,
-                         float dt) = 0;
-};
-
-// Runge-Kutta 4th order integrator
-class RungeKuttaIntegrator : public Integrator {
-private:
-    struct State {
-        std::vector<sf::Vector2f> positions;
-        std::vector<sf::Vector2f> velocities;
-    };
-    
-    struct Derivative {
-        std::vector<sf::Vector2f> dpos;  // velocity
-        std::vector<sf::Vector2f> dvel;  // acceleration
-    };
-    
-    Derivative evaluate(const State& initial, float dt, const Derivative& d,
-                       const std::function<std::vector<sf::Vector2f>(const std::vector<Particle>&)>& forceFunc,
-                       const std::vector<Particle>& particles) {
-        State state;
-        state.positions.resize(initial.positions.size());
-        state.velocities.resize(initial.velocities.size());
-        
-        // Create temporary particles for force calculation
-        std::vector<Particle> tempParticles = particles;
-        
-        for (size_t i = 0; i < initial.positions.size(); ++i) {
-            state.positions[i] = initial.positions[i] + d.dpos[i] * dt;
-            state.velocities[i] = initial.velocities[i] + d.dvel[i] * dt;
-            tempParticles[i].position = state.positions[i];
-            tempParticles[i].velocity = state.velocities[i];
-        }
-        
-        Derivative output;
-        output.dpos = state.velocities;
-        
-        // Calculate accelerations
-        auto forces = forceFunc(tempParticles);
-        output.dvel.resize(forces.size());
-        for (size_t i = 0; i < forces.size(); ++i) {
-            output.dvel[i] = forces[i] / tempParticles[i].mass;
-        }
-        
-        return output;
-    }
-    
-public:
-    void integrate(std::vector<Particle>& particles,
-                  const std::function<std::vector<sf::Vector2f>(const std::vector<Particle>&)>& forceFunc,
-                  float dt) override {
-        State initial;
-        for (const auto& p : particles) {
-            initial.positions.push_back(p.position);
-            initial.velocities.push_back(p.velocity);
-        }
-        
-        Derivative k1, k2, k3, k4;
-        
-        // Zero derivative for k1
-        k1.dpos.resize(particles.size(), sf::Vector2f(0, 0));
-        k1.dvel.resize(particles.size(), sf::Vector2f(0, 0));
-        
-        k1 = evaluate(initial, 0.0f, k1, forceFunc, particles);
-        k2 = evaluate(initial, dt * 0.5f, k1, forceFunc, particles);
-        k3 = evaluate(initial, dt * 0.5f, k2, forceFunc, particles);
-        k4 = evaluate(initial, dt, k3, forceFunc, particles);
-        
-        // Update particles
-        for (size_t i = 0; i < particles.size(); ++i) {
-            if (!particles[i].fixed) {
-                sf::Vector2f dxdt = (k1.dpos[i] + 2.0f * k2.dpos[i] + 2.0f * k3.dpos[i] + k4.dpos[i]) / 6.0f;
-                sf::Vector2f dvdt = (k1.dvel[i] + 2.0f * k2.dvel[i] + 2.0f * k3.dvel[i] + k4.dvel[i]) / 6.0f;
-                
-                particles[i].position += dxdt * dt;
-                particles[i].velocity += dvdt * dt;
-                particles[i].acceleration = dvdt;
-            }
-        }
-    }
-};
+#include <string>
 
 // HUD for displaying simulation information
 class HUD {
@@ -148,6 +25,9 @@ private:
     sf::Text particleCountText;
     sf::Text energyText;
     sf::Text zoomText;
+    sf::Text solverText;
+    sf::Text treeText;
+    sf::Text profileText;
     bool visible = true;
     
 public:
@@ -178,9 +58,28 @@ public:
         zoomText.setCharacterSize(14);
         zoomText.setFillColor(sf::Color::White);
         zoomText.setPosition(10, 70);
+        
+        solverText.setFont(font);
+        solverText.setCharacterSize(14);
+        solverText.setFillColor(sf::Color::White);
+        solverText.setPosition(10, 90);
+        
+        treeText.setFont(font);
+        treeText.setCharacterSize(14);
+        treeText.setFillColor(sf::Color::White);
+        treeText.setPosition(10, 110);
+        
+        profileText.setFont(font);
+        profileText.setCharacterSize(12);
+        profileText.setFillColor(sf::Color(180, 255, 180));
+        profileText.setPosition(10, 140);
     }
     
-    void update(float fps, size_t particleCount, float totalEnergy, float zoom) {
+    // diagnostics is the last conserved-quantity measurement, if any
+    // drawn is what the renderer put on screen last frame
+    void update(float fps, size_t particleCount, double kineticEnergy, const Diagnostics* diagnostics,
+                float zoom, const ParticleRenderer::Counts& drawn, const std::string& solver, double stepMs,
+                const TreeStats* tree) {
         if (!visible) return;
         
         std::stringstream ss;
@@ -192,12 +91,51 @@ public:
         particleCountText.setString(ss.str());
         
         ss.str("");
-        ss << "Total KE: " << std::scientific << std::setprecision(2) << totalEnergy;
+        ss << std::scientific << std::setprecision(2);
+        if (diagnostics && diagnostics->hasPotential()) {
+            ss << "Energy: " << diagnostics->energy() << ", drift " << diagnostics->energyDrift
+               << ", virial " << std::fixed << diagnostics->virialRatio();
+        } else {
+            ss << "Kinetic energy: " << kineticEnergy;
+        }
         energyText.setString(ss.str());
         
         ss.str("");
-        ss << "Zoom: " << std::fixed << std::setprecision(2) << zoom << "x";
+        ss << "Zoom: " << std::fixed << std::setprecision(2) << zoom << "x, drawn " << drawn.bodies << " bodies";
+        if (drawn.cells > 0) ss << " + " << drawn.cells << " merged cells";
         zoomText.setString(ss.str());
+        
+        ss.str("");
+        ss << "Solver: " << solver << ", " << std::fixed << std::setprecision(2) << stepMs << " ms/step";
+        solverText.setString(ss.str());
+        
+        ss.str("");
+        if (tree) {
+            ss << "Tree: " << tree->nodeCount << " nodes, " << tree->bytesPerNode << " B/node, "
+               << std::fixed << std::setprecision(2) << tree->buildMs
+               << (tree->refitsSinceBuild > 0 ? " ms refit, " : " ms build, ")
+               << std::setprecision(1) << tree->arenaBytes / (1024.0 * 1024.0) << " MB arena";
+        }
+        treeText.setString(ss.str());
+    }
+    
+    // Rolling average and p99 of every phase with samples; empty hides the overlay
+    void updateProfile(const ProfileSummary* physics, const ProfileSummary* render) {
+        if (!visible) return;
+        
+        std::stringstream ss;
+        if (physics || render) {
+            ss << std::fixed << std::setprecision(3);
+            for (size_t p = 0; p < PROFILE_PHASES; ++p) {
+                const PhaseSummary* phase = nullptr;
+                if (physics && (*physics)[p].samples > 0) phase = &(*physics)[p];
+                if (render && (*render)[p].samples > 0) phase = &(*render)[p];
+                if (!phase) continue;
+                ss << profilePhaseName(static_cast<ProfilePhase>(p)) << ": " << phase->averageMs
+                   << " ms avg, " << phase->p99Ms << " ms p99\n";
+            }
+        }
+        profileText.setString(ss.str());
     }
     
     void draw(sf::RenderWindow& window) {
@@ -206,18 +144,27 @@ public:
         window.draw(particleCountText);
         window.draw(energyText);
         window.draw(zoomText);
+        window.draw(solverText);
+        window.draw(treeText);
+        window.draw(profileText);
     }
 };
 
 // Enhanced N-Body Simulation
 class NBodySimulation {
 private:
-    std::vector<Particle> particles;
+    SimulationCore core;  // Owned by the physics thread once run() starts
+    PhysicsThread physics{core};
     sf::RenderWindow window;
-    std::unique_ptr<Integrator> integrator;
-    SimulationConstants constants;
+    ParticleRenderer renderer;  // After the window, whose context creates its texture
     HUD hud;
     
+    // The two newest snapshots; frames are drawn between them
+    FrameSnapshot previous, current;
+    FrameInterpolation interpolation{&previous, &current};
+    TrailStore trails;
+    uint64_t lastTrailStep = 0;
+    
     // Camera controls
     sf::View camera;
     float zoomLevel = 1.0f;
@@ -226,46 +173,24 @@ private:
     sf::Vector2i lastMousePos;
     
     // Simulation state
-    bool isPaused = false;
     bool showTrails = true;
     bool showVelocityVectors = false;
+    bool levelOfDetail = true;  // Cull and merge through the snapshots' view tree
+    bool showDensity = false;   // Density map in place of the body discs
     
     // Performance tracking
     sf::Clock fpsClock;
     float frameTime = 0.0f;
     
-    // Force calculation
-    std::vector<sf::Vector2f> computeForces(const std::vector<Particle>& particles) {
-        std::vector<sf::Vector2f> forces(particles.size(), sf::Vector2f(0, 0));
-        
-        // Parallel force calculation for better performance
-        std::for_each(std::execution::par_unseq, 
-                     forces.begin(), forces.end(),
-                     [&](sf::Vector2f& force) {
-            size_t i = &force - &forces[0];
-            for (size_t j = 0; j < particles.size(); ++j) {
-                if (i != j) {
-                    sf::Vector2f r = particles[j].position - particles[i].position;
-                    float r2 = r.x * r.x + r.y * r.y + constants.SOFTENING * constants.SOFTENING;
-                    float r3 = r2 * std::sqrt(r2);
-                    float F = constants.G * particles[i].mass * particles[j].mass / r3;
-                    forces[i] += r * F;
-                }
-            }
-        });
-        
-        return forces;
-    }
-    
-    float calculateTotalEnergy() {
-        float totalKE = 0.0f;
-        for (const auto& p : particles) {
-            totalKE += p.kineticEnergy();
-        }
-        return totalKE;
-    }
+    // Per-phase profile: render phases here, physics phases on the physics
+    // thread. The overlay toggles profiling; a trace keeps it on for the run.
+    bool showProfile = false;
+    Profiler profiler{"render"};
+    PhaseHistory history;
+    std::string tracePath;
     
     void handleEvents() {
+        PROFILE_SCOPE(ProfilePhase::Events);
         sf::Event event;
         while (window.pollEvent(event)) {
             if (event.type == sf::Event::Closed) {
@@ -276,8 +201,10 @@ private:
                     sf::Vector2f worldPos = window.mapPixelToCoords(
                         sf::Vector2i(event.mouseButton.x, event.mouseButton.y), camera);
                     
-                    particles.emplace_back(worldPos, sf::Vector2f(0, 0), 10.0f, 
-                                         sf::Color(rand() % 156 + 100, rand() % 156 + 100, rand() % 156 + 100));
+                    const PackedColor color = packColor(rand() % 156 + 100, rand() % 156 + 100, rand() % 156 + 100);
+                    physics.submit([worldPos, color](SimulationCore& sim) {
+                        sim.getParticles().add(Vector2r(worldPos), Vector2r(0, 0), 10, color);
+                    });
                 } else if (event.mouseButton.button == sf::Mouse::Middle) {
                     isPanning = true;
                     lastMousePos = sf::Mouse::getPosition(window);
@@ -314,12 +241,10 @@ private:
     void handleKeyPress(sf::Keyboard::Key key) {
         switch (key) {
             case sf::Keyboard::Space:
-                if (particles.size() > 1) {
-                    particles.erase(particles.begin() + 1, particles.end());
-                }
+                physics.submit([](SimulationCore& sim) { sim.getParticles().truncate(1); });
                 break;
             case sf::Keyboard::P:
-                isPaused = !isPaused;
+                physics.setPaused(!physics.isPaused());
                 break;
             case sf::Keyboard::T:
                 showTrails = !showTrails;
@@ -327,176 +252,227 @@ private:
             case sf::Keyboard::V:
                 showVelocityVectors = !showVelocityVectors;
                 break;
+            case sf::Keyboard::L:
+                levelOfDetail = !levelOfDetail;
+                physics.setViewTree(wantsViewTree());
+                break;
+            case sf::Keyboard::D:
+                showDensity = !showDensity;
+                physics.setViewTree(wantsViewTree());
+                break;
+            case sf::Keyboard::F3:
+                setProfiling(!showProfile);
+                break;
+            case sf::Keyboard::B:
+                physics.submit([](SimulationCore& sim) {
+                    sim.selectForceSolver(nextForceSolverType(sim.getForceSolverType()));
+                    std::cout << "Force solver: " << sim.getForceSolver().name() << std::endl;
+                });
+                break;
             case sf::Keyboard::R:
-                loadDefaultScenario();
+                physics.submit([](SimulationCore& sim) { sim.loadDefaultScenario(); });
                 break;
             case sf::Keyboard::Num1:
-                loadScenarioFromFile("scenarios/solar_system.json");
+                physics.submit([](SimulationCore& sim) { sim.loadScenario("scenarios/solar_system.json"); });
                 break;
             default:
                 break;
         }
     }
     
+    bool wantsViewTree() const { return levelOfDetail || showDensity; }
+    
     void updateCamera() {
         camera.setSize(800.0f * zoomLevel, 600.0f * zoomLevel);
         camera.setCenter(400.0f + cameraOffset.x, 300.0f + cameraOffset.y);
         window.setView(camera);
     }
     
-    void loadDefaultScenario() {
-        particles.clear();
-        particles.emplace_back(sf::Vector2f(400, 300), sf::Vector2f(0, 0), 5000.0f, sf::Color::Yellow, "Sun");
-        particles.emplace_back(sf::Vector2f(400, 200), sf::Vector2f(50, 0), 10.0f, sf::Color::Cyan, "Planet 1");
-        particles.emplace_back(sf::Vector2f(550, 300), sf::Vector2f(0, 35), 20.0f, sf::Color::Red, "Planet 2");
-        particles.emplace_back(sf::Vector2f(400, 450), sf::Vector2f(-30, 0), 15.0f, sf::Color::Green, "Planet 3");
+    void receiveSnapshot(const FrameSnapshot& snapshot) {
+        std::swap(previous, current);
+        current = snapshot;  // Copies into the capacity the old snapshot held
+        
+        PROFILE_SCOPE(ProfilePhase::Trails);
+        if (current.generation != previous.generation) {
+            trails.clear();
+            lastTrailStep = 0;
+        } else {
+            // An id a merge handed to another body starts its trail over
+            const size_t shared = std::min(previous.size(), current.size());
+            for (size_t i = 0; i < shared; ++i) {
+                if (previous.serial[i] != current.serial[i]) trails.restart(i);
+            }
+        }
+        trails.sync(current.trail, current.trailLength);
+        
+        // At most one trail point per trail_interval physics steps, taken
+        // from the snapshots that reach the screen
+        if (showTrails && current.step >= lastTrailStep + current.trailInterval) {
+            lastTrailStep = current.step;
+            for (size_t i = 0; i < current.size(); ++i) {
+                trails.record(i, sf::Vector2f(current.x[i], current.y[i]));
+            }
+        }
+    }
+    
+    // Bodies are drawn a fraction of a step between the previous and the
+    // current snapshot, so motion stays smooth when the display and physics
+    // rates differ. Drawing trails one step behind physics is the price.
+    // Only the fraction is set here; positions are blended as they are
+    // drawn, so bodies out of view cost nothing.
+    void interpolatePositions() {
+        interpolation.alpha = 1.0f;
+        if (current.generation == previous.generation && current.published > previous.published) {
+            using Seconds = std::chrono::duration<float>;
+            const float interval = Seconds(current.published - previous.published).count();
+            const float elapsed = Seconds(std::chrono::steady_clock::now() - current.published).count();
+            interpolation.alpha = std::clamp(elapsed / interval, 0.0f, 1.0f);
+        }
+        interpolation.blended = current.generation == previous.generation
+                                    ? std::min(previous.size(), current.size()) : 0;
     }
     
 public:
     NBodySimulation() : window(sf::VideoMode(800, 600), "AstroDynamics Engine v2.0") {
         window.setFramerateLimit(60);
-        integrator = std::make_unique<RungeKuttaIntegrator>();
         
         camera = window.getDefaultView();
         updateCamera();
+        physics.setViewTree(wantsViewTree());
         
-        loadDefaultScenario();
+        core.loadDefaultScenario();
     }
     
     void loadScenarioFromFile(const std::string& filename) {
-        try {
-            std::ifstream file(filename);
-            if (!file.is_open()) {
-                std::cerr << "Could not open scenario file: " << filename << std::endl;
-                return;
-            }
-            
-            json j;
-            file >> j;
-            
-            particles.clear();
-            
-            // Load particles
-            for (const auto& p : j["particles"]) {
-                sf::Vector2f pos(p["position"][0], p["position"][1]);
-                sf::Vector2f vel(p["velocity"][0], p["velocity"][1]);
-                float mass = p["mass"];
-                sf::Color color(p["color"][0], p["color"][1], p["color"][2]);
-                std::string name = p.value("name", "");
-                
-                particles.emplace_back(pos, vel, mass, color, name);
-                
-                if (p.contains("fixed")) {
-                    particles.back().fixed = p["fixed"];
-                }
-            }
-            
-            // Load settings if present
-            if (j.contains("settings")) {
-                const auto& settings = j["settings"];
-                constants.G = settings.value("gravitational_constant", constants.G);
-                constants.DT = settings.value("time_step", constants.DT);
-                constants.SOFTENING = settings.value("softening", constants.SOFTENING);
-            }
-            
-            std::cout << "Loaded scenario: " << j.value("name", "Unknown") << std::endl;
-            
-        } catch (const std::exception& e) {
-            std::cerr << "Error loading scenario: " << e.what() << std::endl;
-        }
+        physics.submit([filename](SimulationCore& sim) { sim.loadScenario(filename); });
+    }
+    
+    // Shows the profile overlay and times every frame and step while on
+    void setProfiling(bool value) {
+        showProfile = value;
+        physics.setProfiling(value);
+        history.clear();
+    }
+    
+    // Records a trace of the whole run, written to path when the window closes
+    void traceTo(const std::string& path) {
+        tracePath = path;
+        profiler.startTrace();
+        physics.startTrace();
     }
     
     void run() {
+        physics.start();
         while (window.isOpen()) {
             frameTime = fpsClock.restart().asSeconds();
             float fps = 1.0f / frameTime;
             
+            const bool profile = showProfile || profiler.isTracing();
+            activeProfiler = profile ? &profiler : nullptr;
+            profiler.beginFrame();
+            
             handleEvents();
             
-            if (!isPaused) {
-                // Update physics
-                integrator->integrate(particles, 
-                    [this](const std::vector<Particle>& p) { return computeForces(p); },
-                    constants.DT);
-                
-                // Update trails
-                if (showTrails) {
-                    for (auto& p : particles) {
-                        p.updateTrail(constants.TRAIL_LENGTH);
-                    }
-                }
+            // Pick up the newest physics state, if any, without waiting
+            if (physics.acquireSnapshot()) {
+                receiveSnapshot(physics.snapshot());
             }
+            interpolatePositions();
             
             // Update HUD
-            hud.update(fps, particles.size(), calculateTotalEnergy(), zoomLevel);
+            hud.update(fps, current.size(), current.kineticEnergy, current.hasDiagnostics ? &current.diagnostics : nullptr,
+                       zoomLevel, renderer.lastCounts(), current.solverName, current.stepMs,
+                       current.hasTree ? &current.tree : nullptr);
+            if (showProfile) {
+                const ProfileSummary render = history.summary();
+                hud.updateProfile(current.profiled ? &current.profile : nullptr, &render);
+            } else {
+                hud.updateProfile(nullptr, nullptr);
+            }
             
             // Render
             window.clear(sf::Color::Black);
             
-            // Draw trails
+            // Draw trails, bodies and velocity vectors, one batch each, for
+            // the part of the world the camera shows
+            const ViewRegion view = ViewRegion::of(camera, window.getSize());
             if (showTrails) {
-                for (const auto& p : particles) {
-                    if (!p.trail.empty()) {
-                        sf::VertexArray trail(sf::LineStrip, p.trail.size());
-                        for (size_t i = 0; i < p.trail.size(); ++i) {
-                            trail[i].position = p.trail[i];
-                            sf::Color trailColor = p.color;
-                            trailColor.a = static_cast<sf::Uint8>(255 * (i / float(p.trail.size())) * 0.5f);
-                            trail[i].color = trailColor;
-                        }
-                        window.draw(trail);
-                    }
-                }
+                renderer.drawTrails(window, trails, current, view);
             }
-            
-            // Draw particles
-            for (const auto& p : particles) {
-                float radius = std::min(5.0f + std::log10(p.mass), 20.0f);
-                sf::CircleShape shape(radius);
-                shape.setPosition(p.position - sf::Vector2f(radius, radius));
-                shape.setFillColor(p.color);
-                
-                // Add glow effect for massive objects
-                if (p.mass > 1000) {
-                    sf::CircleShape glow(radius * 2);
-                    glow.setPosition(p.position - sf::Vector2f(radius * 2, radius * 2));
-                    sf::Color glowColor = p.color;
-                    glowColor.a = 50;
-                    glow.setFillColor(glowColor);
-                    window.draw(glow);
-                }
-                
-                window.draw(shape);
-                
-                // Draw velocity vectors
-                if (showVelocityVectors) {
-                    sf::VertexArray velocityLine(sf::Lines, 2);
-                    velocityLine[0].position = p.position;
-                    velocityLine[0].color = sf::Color::White;
-                    velocityLine[1].position = p.position + p.velocity * 0.5f;
-                    velocityLine[1].color = sf::Color(255, 255, 255, 100);
-                    window.draw(velocityLine);
-                }
+            if (showDensity) {
+                renderer.drawDensity(window, current, interpolation, view);
+            } else {
+                renderer.drawBodies(window, current, interpolation, view, levelOfDetail);
+            }
+            if (showVelocityVectors) {
+                renderer.drawVelocities(window, current, interpolation, view);
             }
             
             // Draw HUD with default view
             window.setView(window.getDefaultView());
-            hud.draw(window);
+            {
+                PROFILE_SCOPE(ProfilePhase::Draw);
+                hud.draw(window);
+            }
             window.setView(camera);
             
+            // The frame limit waits in display(), so it is left out
+            if (profile) {
+                history.push(profiler.phaseMs, {ProfilePhase::Events, ProfilePhase::Trails,
+                                                ProfilePhase::Upload, ProfilePhase::Draw});
+            }
             window.display();
         }
+        activeProfiler = nullptr;
+        physics.stop();
+        
+        if (!tracePath.empty()) {
+            writeChromeTrace(tracePath, {&profiler, &physics.traceProfiler()});
+        }
     }
 };
 
 int main(int argc, char* argv[]) {
-    NBodySimulation sim;
+    // Batch runs skip the window entirely
+    for (int i = 1; i < argc; ++i) {
+        if (std::string(argv[i]) == "--headless") {
+            return runHeadless(argc, argv);
+        }
+    }
     
-    // Load scenario from command line if provided
-    if (argc > 2 && std::string(argv[1]) == "--scenario") {
-        sim.loadScenarioFromFile(argv[2]);
+    std::string scenario;
+    std::string tracePath;
+    bool profile = false;
+    int threads = 0;
+    bool pinThreads = defaultThreadPinning();
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        const bool hasValue = i + 1 < argc;
+        if (arg == "--scenario" && hasValue) {
+            scenario = argv[++i];
+        } else if (arg == "--profile") {
+            profile = true;
+        } else if (arg == "--profile-trace" && hasValue) {
+            tracePath = argv[++i];
+        } else if (arg == "--threads" && hasValue) {
+            threads = std::atoi(argv[++i]);
+        } else if (arg == "--pin-threads") {
+            pinThreads = true;
+        } else {
+            std::cerr << "Unknown or incomplete argument: " << arg << std::endl;
+            std::cerr << "Usage: " << argv[0] << " [--scenario file] [--profile] [--profile-trace trace.json]"
+                      << " [--threads N] [--pin-threads] | --headless ..." << std::endl;
+            return 2;
+        }
     }
     
+    // The pool is sized before the simulation first uses it
+    configureThreadPool(threads, pinThreads);
+    NBodySimulation sim;
+    if (!scenario.empty()) sim.loadScenarioFromFile(scenario);
+    if (profile) sim.setProfiling(true);
+    if (!tracePath.empty()) sim.traceTo(tracePath);
+    
     sim.run();
     return 0;
 }
@@ -0,0 +1,13 @@
+// Domain-decomposed batch runs over MPI. See Distributed.h for the options.
+
+#include "Distributed.h"
+
+int main(int argc, char* argv[]) {
+    // Only the thread that called main talks to MPI; the pool's workers
+    // never do
+    int provided = 0;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+    const int status = runDistributed(MPI_COMM_WORLD, argc, argv);
+    MPI_Finalize();
+    return status;
+}
@@ -0,0 +1,107 @@
+// Steady-state RK4 allocation test
+//
+// Counts every heap allocation made through operator new, on any thread,
+// while SimulationCore takes RK4 steps after warm-up steps have grown the
+// workspace, the solver buffers and the thread pool to size. Fails if a
+// steady-state step allocates, for the direct and the Barnes-Hut solver.
+//
+// Usage: astro_rk4_allocation_test [particles] [steps]
+
+#include "SimulationCore.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <random>
+
+#if defined(_WIN32)
+#include <malloc.h>
+#endif
+
+namespace {
+
+std::atomic<uint64_t> allocations{0};
+
+// Every block is allocated aligned, so one release function fits all of them
+void* countedAllocation(std::size_t size, std::size_t alignment) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    alignment = std::max(alignment, alignof(std::max_align_t));
+    if (size == 0) size = 1;
+#if defined(_WIN32)
+    void* p = _aligned_malloc(size, alignment);
+#else
+    void* p = nullptr;
+    if (posix_memalign(&p, alignment, size) != 0) p = nullptr;
+#endif
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+void release(void* p) {
+#if defined(_WIN32)
+    _aligned_free(p);
+#else
+    std::free(p);
+#endif
+}
+
+// Counts the allocations of steps steady-state steps of sim with solver.
+// The warm-up and the counted steps each span a tree rebuild, a Morton
+// reorder and a diagnostics measurement.
+uint64_t countSteadyStateAllocations(SimulationCore& sim, ForceSolverType solver, int steps) {
+    constexpr int WARMUP_STEPS = 40;
+    sim.selectForceSolver(solver);
+    sim.requestDiagnostics();
+    for (int s = 0; s < WARMUP_STEPS; ++s) {
+        sim.step();
+    }
+    const uint64_t before = allocations.load();
+    for (int s = 0; s < steps; ++s) {
+        if (s == steps / 2) sim.requestDiagnostics();
+        sim.step();
+    }
+    return allocations.load() - before;
+}
+
+}  // namespace
+
+void* operator new(std::size_t size) { return countedAllocation(size, 0); }
+void* operator new[](std::size_t size) { return countedAllocation(size, 0); }
+void* operator new(std::size_t size, std::align_val_t align) { return countedAllocation(size, std::size_t(align)); }
+void* operator new[](std::size_t size, std::align_val_t align) { return countedAllocation(size, std::size_t(align)); }
+void operator delete(void* p) noexcept { release(p); }
+void operator delete[](void* p) noexcept { release(p); }
+void operator delete(void* p, std::size_t) noexcept { release(p); }
+void operator delete[](void* p, std::size_t) noexcept { release(p); }
+void operator delete(void* p, std::align_val_t) noexcept { release(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { release(p); }
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept { release(p); }
+void operator delete[](void* p, std::size_t, std::align_val_t) noexcept { release(p); }
+
+int main(int argc, char* argv[]) {
+    const size_t count = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 2000;
+    const int steps = argc > 2 ? std::atoi(argv[2]) : 40;
+    
+    SimulationCore sim;
+    sim.selectIntegrator(IntegratorType::RungeKutta4);
+    ParticleStore& particles = sim.getParticles();
+    particles.clear();
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<float> uniform(0.0f, 1000.0f);
+    for (size_t i = 0; i < count; ++i) {
+        particles.add(Vector2r(uniform(rng), uniform(rng)), Vector2r(0, 0), 1);
+    }
+    sim.adoptParticles();
+    
+    int failures = 0;
+    for (ForceSolverType solver : {ForceSolverType::Direct, ForceSolverType::BarnesHut}) {
+        const uint64_t n = countSteadyStateAllocations(sim, solver, steps);
+        std::cout << sim.getForceSolver().name() << ": " << n << " allocations in " << steps << " RK4 steps"
+                  << std::endl;
+        if (n != 0) ++failures;
+    }
+    return failures == 0 ? 0 : 1;
+}
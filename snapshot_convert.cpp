@@ -0,0 +1,40 @@
+// Converts between JSON scenarios and binary snapshots (Snapshot.h):
+//
+//   astro_convert galaxy.json galaxy.snap
+//   astro_convert checkpoint.snap checkpoint.json
+//
+// The input format is detected from the file itself; the output is JSON when
+// its name ends in .json and a snapshot otherwise.
+
+#include "SimulationCore.h"
+
+#include <iostream>
+#include <string>
+
+namespace {
+
+bool endsWith(const std::string& text, const std::string& suffix) {
+    return text.size() >= suffix.size() && text.compare(text.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+}
+
+int main(int argc, char* argv[]) {
+    if (argc != 3) {
+        std::cerr << "Usage: " << argv[0] << " <input.json|input.snap> <output.json|output.snap>" << std::endl;
+        return 2;
+    }
+    
+    SimulationCore core;
+    if (!core.loadScenario(argv[1])) {
+        return 1;
+    }
+    
+    const std::string output = argv[2];
+    const bool saved = endsWith(output, ".json") ? core.saveScenario(output) : core.saveSnapshot(output);
+    if (!saved) {
+        return 1;
+    }
+    std::cout << "Wrote " << core.getParticles().size() << " bodies to " << output << std::endl;
+    return 0;
+}